@@ -2,6 +2,158 @@
 #include "base64/cdecode.h"
 #include "base64/cencode.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define BASE64_HAVE_SSSE3
+#endif
+
+#define BASE64_STREAM_CHUNK_SIZE 16384
+
+// Value of each base64 character, 255 for everything else.
+static const unsigned char base64_decode_table[256] = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 255, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
+// Decodes whole quads of plain base64 characters, i.e. without padding or
+// whitespace, 4 characters to 3 bytes at a time. Stops at the first quad
+// that has anything else in it and leaves it to the libb64 state machine.
+// Returns the number of decoded bytes, *consumed_ptr is set to the number
+// of characters used.
+static size_t base64_decode_quads(const unsigned char *input, size_t input_length, unsigned char *output,
+                                  size_t *consumed_ptr) {
+    const unsigned char *in = input;
+    unsigned char *out = output;
+    while (input_length - (size_t) (in - input) >= 4) {
+        unsigned int a = base64_decode_table[in[0]];
+        unsigned int b = base64_decode_table[in[1]];
+        unsigned int c = base64_decode_table[in[2]];
+        unsigned int d = base64_decode_table[in[3]];
+        if ((a | b | c | d) > 63) {
+            break;
+        }
+        unsigned int v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = (unsigned char) (v >> 16);
+        out[1] = (unsigned char) (v >> 8);
+        out[2] = (unsigned char) v;
+        in += 4;
+        out += 3;
+    }
+    *consumed_ptr = (size_t) (in - input);
+    return (size_t) (out - output);
+}
+
+#ifdef BASE64_HAVE_SSSE3
+// Same as base64_decode_quads, but 16 characters to 12 bytes at a time
+// with SSSE3, see http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html
+// Each store writes 16 bytes, so it only runs while there are at least
+// 32 characters left, which leaves enough room in the output.
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const unsigned char *input, size_t input_length, unsigned char *output,
+                                  size_t *consumed_ptr) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i merge_ab = _mm_set1_epi32(0x01400140);
+    const __m128i merge_abc = _mm_set1_epi32(0x00011000);
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    const unsigned char *in = input;
+    unsigned char *out = output;
+    while (input_length - (size_t) (in - input) >= 32) {
+        __m128i str = _mm_loadu_si128((const __m128i *) in);
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+            break;
+        }
+        __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+        str = _mm_maddubs_epi16(str, merge_ab);
+        str = _mm_madd_epi16(str, merge_abc);
+        str = _mm_shuffle_epi8(str, shuffle);
+        _mm_storeu_si128((__m128i *) out, str);
+        in += 16;
+        out += 12;
+    }
+    *consumed_ptr = (size_t) (in - input);
+    return (size_t) (out - output);
+}
+#endif
+
+typedef size_t (base64_decode_kernel)(const unsigned char *input, size_t input_length, unsigned char *output,
+                                      size_t *consumed_ptr);
+
+static base64_decode_kernel *base64_get_decode_kernel(void) {
+#ifdef BASE64_HAVE_SSSE3
+    static int has_ssse3 = -1;
+    if (has_ssse3 < 0) {
+        __builtin_cpu_init();
+        has_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    if (has_ssse3) {
+        return base64_decode_ssse3;
+    }
+#endif
+    return NULL;
+}
+
+// Drop-in replacement for base64_decode_block. The fast kernels take the
+// runs of plain base64 characters, and libb64 takes care of whitespace,
+// padding and invalid characters in between.
+static size_t base64_decode_block_fast(const char *code_in, size_t length_in, char *plaintext_out,
+                                       base64_decodestate *state_in) {
+    const unsigned char *in = (const unsigned char *) code_in;
+    unsigned char *out = (unsigned char *) plaintext_out;
+    base64_decode_kernel *kernel = base64_get_decode_kernel();
+    size_t consumed;
+
+    while (length_in > 0) {
+        if (state_in->step == step_a) {
+            if (kernel != NULL) {
+                out += kernel(in, length_in, out, &consumed);
+                in += consumed;
+                length_in -= consumed;
+            }
+            out += base64_decode_quads(in, length_in, out, &consumed);
+            in += consumed;
+            length_in -= consumed;
+            if (length_in == 0) {
+                break;
+            }
+        }
+        // Feed libb64 one character at a time until it is back at a quad
+        // boundary, so that the fast path can take over again.
+        do {
+            out += base64_decode_block((const char *) in, 1, out, state_in);
+            in++;
+            length_in--;
+        } while (length_in > 0 && state_in->step != step_a);
+    }
+    return (size_t) (out - (unsigned char *) plaintext_out);
+}
+
 int base64_encode(const char *input, Tcl_Size input_length, char *output, Tcl_Size *output_length) {
     /* keep track of our encoded position */
     char* c = output;
@@ -43,7 +195,7 @@ int base64_decode(const char *input, Tcl_Size input_length, char *output, Tcl_Si
     /* initialise the decoder state */
     base64_init_decodestate(&s);
     /* decode the input data */
-    cnt = base64_decode_block(input, input_length, c, &s);
+    cnt = base64_decode_block_fast(input, input_length, c, &s);
     c += cnt;
     /* note: there is no base64_decode_blockend! */
     /*---------- STOP DECODING  ----------*/
@@ -54,4 +206,32 @@ int base64_decode(const char *input, Tcl_Size input_length, char *output, Tcl_Si
     /* store length of decoded data */
     *output_length = c - output;
     return 0;
-}
\ No newline at end of file
+}
+int base64_decode_stream(const char *input, Tcl_Size input_length, base64_write_proc *write_proc,
+                         void *client_data, Tcl_Size *output_length) {
+    /* base64_decode_block writes the pending partial byte past the
+       decoded data, so leave some room for it */
+    char output[BASE64_STREAM_CHUNK_SIZE / 4 * 3 + 4];
+    base64_decodestate s;
+    Tcl_Size total = 0;
+
+    base64_init_decodestate(&s);
+    while (input_length > 0) {
+        Tcl_Size len = input_length < BASE64_STREAM_CHUNK_SIZE ? input_length : BASE64_STREAM_CHUNK_SIZE;
+        size_t cnt = base64_decode_block_fast(input, len, output, &s);
+        input += len;
+        input_length -= len;
+        if (cnt > 0) {
+            int rc = write_proc(client_data, output, (Tcl_Size) cnt);
+            if (rc != 0) {
+                return rc;
+            }
+            total += (Tcl_Size) cnt;
+        }
+    }
+
+    if (output_length != NULL) {
+        *output_length = total;
+    }
+    return 0;
+}
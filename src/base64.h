@@ -12,8 +12,20 @@ extern "C" {
 
 int base64_encode(const char *input, Tcl_Size input_length, char *output, Tcl_Size *output_length);
 
+// The output must have room for base64_decode_maxlength(input_length) + 1
+// bytes. Uses SSSE3 when the CPU has it.
 int base64_decode(const char *input, Tcl_Size input_length, char *output, Tcl_Size *output_length);
 
+// Receives the decoded data from base64_decode_stream. Returns 0 on success,
+// anything else stops the decoding.
+typedef int (base64_write_proc)(void *client_data, const char *data, Tcl_Size length);
+
+// Decodes the input in fixed-size chunks and passes each decoded chunk to
+// write_proc, so the decoded data never has to be in memory as a whole.
+// Returns 0 on success or the value returned by write_proc.
+int base64_decode_stream(const char *input, Tcl_Size input_length, base64_write_proc *write_proc,
+                         void *client_data, Tcl_Size *output_length);
+
 #ifdef __cplusplus
 }
 #endif
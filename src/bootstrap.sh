@@ -52,4 +52,81 @@ unpack() {
     mv "$output_directory"/*/* "$output_directory"
     return 0
   fi
-}
\ No newline at end of file
+}
+# Packages are defined as ttrek_package_N functions, and PKG_DEPS_N lists
+# the packages that package N depends on. Each package is started in
+# background as soon as all its dependencies are installed. The threads
+# from TTREK_MAKE_THREADS are shared between the running packages, and
+# TTREK_JOBS limits the number of packages that are built at the same time.
+run_packages() {
+    local total="$1"
+    local max_jobs="${TTREK_JOBS:-$DEFAULT_THREADS}"
+    local free_threads="$DEFAULT_THREADS"
+    local running=0 finished=0 failed=0
+    local job_tty="$IS_TTY"
+    local n d deps left slots threads rc status_fifo
+    local -a ready state pids used_threads
+
+    case "$max_jobs" in ''|*[!0-9]*|0) max_jobs=1;; esac
+    case "$free_threads" in ''|*[!0-9]*|0) free_threads=1;; esac
+    # Progress bars can't be shown for several packages at once
+    [ "$max_jobs" -eq 1 ] || job_tty=0
+
+    # Finished packages report their exit status through this pipe
+    status_fifo="$ROOT_BUILD_DIR/.jobs.$$"
+    rm -f "$status_fifo"
+    mkfifo "$status_fifo"
+    exec 3<>"$status_fifo"
+    rm -f "$status_fifo"
+
+    while [ "$finished" -lt "$total" ]; do
+        if [ "$failed" -eq 0 ]; then
+            ready=()
+            for (( n = 1; n <= total; n++ )); do
+                [ -z "${state[n]}" ] || continue
+                deps="PKG_DEPS_$n"
+                for d in ${!deps}; do
+                    [ "${state[d]}" = done ] || continue 2
+                done
+                ready+=("$n")
+            done
+            left="${#ready[@]}"
+            for n in "${ready[@]}"; do
+                [ "$running" -lt "$max_jobs" ] || break
+                [ "$free_threads" -gt 0 ] || [ "$running" -eq 0 ] || break
+                slots=$(( max_jobs - running ))
+                [ "$left" -ge "$slots" ] || slots="$left"
+                threads=$(( free_threads / slots ))
+                [ "$threads" -gt 0 ] || threads=1
+                (
+                    trap "echo $n \$? >&3" EXIT
+                    IS_TTY="$job_tty"
+                    DEFAULT_THREADS="$threads"
+                    "ttrek_package_$n"
+                ) &
+                pids[n]=$!
+                state[n]=running
+                used_threads[n]="$threads"
+                free_threads=$(( free_threads - threads ))
+                running=$(( running + 1 ))
+                left=$(( left - 1 ))
+            done
+        fi
+        [ "$running" -gt 0 ] || break
+        read -r n rc <&3
+        wait "${pids[n]}" || true
+        state[n]=done
+        free_threads=$(( free_threads + used_threads[n] ))
+        running=$(( running - 1 ))
+        finished=$(( finished + 1 ))
+        [ "$rc" -eq 0 ] || [ "$failed" -ne 0 ] || failed="$rc"
+    done
+
+    exec 3>&-
+
+    [ "$failed" -eq 0 ] || exit "$failed"
+    if [ "$finished" -lt "$total" ]; then
+        echo "${_R}Could not resolve the build order of packages${_T}"
+        exit 1
+    fi
+}
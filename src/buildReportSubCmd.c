@@ -0,0 +1,309 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "subCmdDecls.h"
+#include "ttrek_buildHistory.h"
+
+static const char *stage_names[BUILD_HISTORY_STAGES + 1] = {
+        NULL, "Sources", "Configure", "Build", "Install"
+};
+
+// The packages must be valid, see ttrek_BuildHistoryIsValidPackage()
+static Tcl_Obj *ttrek_BuildReportPackageName(cJSON *package_root) {
+    return Tcl_ObjPrintf("%s@%s", cJSON_GetStringValue(cJSON_GetObjectItem(package_root, "name")),
+                         cJSON_GetStringValue(cJSON_GetObjectItem(package_root, "version")));
+}
+
+static int ttrek_BuildReportIsSamePackage(cJSON *package_a, cJSON *package_b) {
+    return ttrek_BuildHistoryIsValidPackage(package_b)
+           && strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(package_a, "name")),
+                     cJSON_GetStringValue(cJSON_GetObjectItem(package_b, "name"))) == 0
+           && strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(package_a, "version")),
+                     cJSON_GetStringValue(cJSON_GetObjectItem(package_b, "version"))) == 0;
+}
+
+static int ttrek_BuildReportIsSuccess(cJSON *package_root) {
+    return strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(package_root, "status")), "ok") == 0;
+}
+
+// Returns the average duration of the last max_runs successful full builds
+// of the package in the runs before the last one, or -1 if there are no
+// such builds.
+static int ttrek_BuildReportAverageDuration(cJSON *runs, cJSON *last_run, cJSON *package_root, int max_runs) {
+
+    // The runs are from the oldest to the newest, the durations of the
+    // last max_runs builds are kept
+    int num_runs = cJSON_GetArraySize(runs);
+    if (max_runs > num_runs) {
+        max_runs = num_runs;
+    }
+    if (max_runs == 0) {
+        return -1;
+    }
+    int *durations = (int *) Tcl_Alloc(sizeof(int) * max_runs);
+    int count = 0;
+
+    cJSON *run_root;
+    cJSON_ArrayForEach(run_root, runs) {
+        if (run_root == last_run) {
+            break;
+        }
+        cJSON *prev_package_root;
+        cJSON_ArrayForEach(prev_package_root, cJSON_GetObjectItem(run_root, "packages")) {
+            if (!ttrek_BuildReportIsSamePackage(package_root, prev_package_root)) {
+                continue;
+            }
+            if (ttrek_BuildReportIsSuccess(prev_package_root) && ttrek_BuildHistoryIsFullBuild(prev_package_root)) {
+                durations[count % max_runs] = ttrek_BuildHistoryGetPackageDuration(prev_package_root);
+                count++;
+            }
+            break;
+        }
+    }
+
+    int average = -1;
+    if (count > 0) {
+        int num_durations = count < max_runs ? count : max_runs;
+        int total = 0;
+        for (int i = 0; i < num_durations; i++) {
+            total += durations[i];
+        }
+        average = total / num_durations;
+    }
+
+    Tcl_Free((char *) durations);
+    return average;
+}
+
+static void ttrek_BuildReportPrintPackages(cJSON *runs, cJSON *last_run, cJSON **packages, int num_packages,
+                                           int max_runs) {
+
+    int name_width = (int) strlen("Package");
+    for (int i = 0; i < num_packages; i++) {
+        Tcl_Obj *name_ptr = ttrek_BuildReportPackageName(packages[i]);
+        if (Tcl_GetCharLength(name_ptr) > name_width) {
+            name_width = (int) Tcl_GetCharLength(name_ptr);
+        }
+        Tcl_BounceRefCount(name_ptr);
+    }
+
+    fprintf(stdout, "%-*s", name_width, "Package");
+    for (int stage = 1; stage <= BUILD_HISTORY_STAGES; stage++) {
+        fprintf(stdout, "  %10s", stage_names[stage]);
+    }
+    fprintf(stdout, "  %10s  %10s  %7s\n", "Total", "Average", "Change");
+
+    for (int i = 0; i < num_packages; i++) {
+
+        cJSON *package_root = packages[i];
+        cJSON *stages_root = cJSON_GetObjectItem(package_root, "stages");
+
+        Tcl_Obj *line_ptr = ttrek_BuildReportPackageName(package_root);
+        Tcl_IncrRefCount(line_ptr);
+        fprintf(stdout, "%-*s", name_width, Tcl_GetString(line_ptr));
+
+        for (int stage = 1; stage <= BUILD_HISTORY_STAGES; stage++) {
+            char stage_str[8];
+            snprintf(stage_str, sizeof(stage_str), "%d", stage);
+            cJSON *stage_root = cJSON_GetObjectItem(stages_root, stage_str);
+            cJSON *duration_node = cJSON_GetObjectItem(stage_root, "duration");
+            Tcl_SetObjLength(line_ptr, 0);
+            if (!cJSON_IsNumber(duration_node)) {
+                ttrek_BuildHistoryFormatDuration(line_ptr, -1);
+            } else {
+                ttrek_BuildHistoryFormatDuration(line_ptr, (int) duration_node->valuedouble);
+                if (cJSON_IsTrue(cJSON_GetObjectItem(stage_root, "cached"))) {
+                    Tcl_AppendToObj(line_ptr, "*", 1);
+                }
+            }
+            fprintf(stdout, "  %10s", Tcl_GetString(line_ptr));
+        }
+
+        int duration = ttrek_BuildHistoryGetPackageDuration(package_root);
+        Tcl_SetObjLength(line_ptr, 0);
+        ttrek_BuildHistoryFormatDuration(line_ptr, duration);
+        if (!ttrek_BuildReportIsSuccess(package_root)) {
+            Tcl_AppendToObj(line_ptr, "!", 1);
+        }
+        fprintf(stdout, "  %10s", Tcl_GetString(line_ptr));
+
+        int average = ttrek_BuildReportAverageDuration(runs, last_run, package_root, max_runs);
+        Tcl_SetObjLength(line_ptr, 0);
+        ttrek_BuildHistoryFormatDuration(line_ptr, average);
+        fprintf(stdout, "  %10s", Tcl_GetString(line_ptr));
+
+        if (average > 0 && duration >= 0 && ttrek_BuildHistoryIsFullBuild(package_root)) {
+            fprintf(stdout, "  %+6d%%\n", (duration - average) * 100 / average);
+        } else {
+            fprintf(stdout, "  %7s\n", "-");
+        }
+
+        Tcl_DecrRefCount(line_ptr);
+
+    }
+
+}
+
+// Prints the longest chain of dependent packages in the run. Packages in
+// the run are stored in the order of installation, i.e. dependencies come
+// before the packages that require them.
+static void ttrek_BuildReportPrintCriticalPath(cJSON *lock_root, cJSON **packages, int count) {
+
+    if (count == 0) {
+        return;
+    }
+
+    int *path_duration = (int *) Tcl_Alloc(sizeof(int) * count);
+    int *path_prev = (int *) Tcl_Alloc(sizeof(int) * count);
+    int last = 0;
+
+    cJSON *lock_packages = cJSON_GetObjectItem(lock_root, "packages");
+
+    for (int i = 0; i < count; i++) {
+        cJSON *lock_package = cJSON_GetObjectItem(lock_packages,
+            cJSON_GetStringValue(cJSON_GetObjectItem(packages[i], "name")));
+        cJSON *requires = cJSON_GetObjectItem(lock_package, "requires");
+
+        path_prev[i] = -1;
+        path_duration[i] = 0;
+        for (int j = 0; j < i; j++) {
+            const char *dep_name = cJSON_GetStringValue(cJSON_GetObjectItem(packages[j], "name"));
+            if (cJSON_HasObjectItem(requires, dep_name) && path_duration[j] > path_duration[i]) {
+                path_duration[i] = path_duration[j];
+                path_prev[i] = j;
+            }
+        }
+
+        int duration = ttrek_BuildHistoryGetPackageDuration(packages[i]);
+        path_duration[i] += (duration < 0 ? 0 : duration);
+        if (path_duration[i] > path_duration[last]) {
+            last = i;
+        }
+    }
+
+    Tcl_Obj *path_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(path_ptr);
+    for (int i = last; i != -1; i = path_prev[i]) {
+        cJSON *package_root = packages[i];
+        Tcl_Obj *item_ptr = ttrek_BuildReportPackageName(package_root);
+        Tcl_AppendToObj(item_ptr, " (", 2);
+        ttrek_BuildHistoryFormatDuration(item_ptr, ttrek_BuildHistoryGetPackageDuration(package_root));
+        Tcl_AppendToObj(item_ptr, ")", 1);
+        if (Tcl_GetCharLength(path_ptr) > 0) {
+            Tcl_AppendToObj(item_ptr, " -> ", 4);
+        }
+        Tcl_AppendObjToObj(item_ptr, path_ptr);
+        Tcl_SetStringObj(path_ptr, Tcl_GetString(item_ptr), -1);
+        Tcl_BounceRefCount(item_ptr);
+    }
+
+    Tcl_Obj *total_ptr = Tcl_NewObj();
+    ttrek_BuildHistoryFormatDuration(total_ptr, path_duration[last]);
+    fprintf(stdout, "\nCritical path (%s):\n    %s\n", Tcl_GetString(total_ptr), Tcl_GetString(path_ptr));
+    Tcl_BounceRefCount(total_ptr);
+
+    Tcl_DecrRefCount(path_ptr);
+    Tcl_Free((char *) path_prev);
+    Tcl_Free((char *) path_duration);
+
+}
+
+int ttrek_BuildReportSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+
+    int option_user = 0;
+    int option_global = 0;
+    int option_runs = 5;
+    Tcl_ArgvInfo ArgTable[] = {
+            {TCL_ARGV_CONSTANT, "-u",        INT2PTR(1), &option_user,     "run in user mode",                                          NULL},
+            {TCL_ARGV_CONSTANT, "-g",        INT2PTR(1), &option_global,   "run in global mode",                                        NULL},
+            {TCL_ARGV_INT,      "-runs",     NULL,       &option_runs,     "number of previous runs to compare with",                   NULL},
+            {TCL_ARGV_END,      NULL,        NULL,       NULL,             NULL,                                                        NULL}
+    };
+
+    Tcl_Obj **remObjv;
+    if (TCL_OK != Tcl_ParseArgsObjv(interp, ArgTable, &objc, objv, &remObjv)) {
+        return TCL_ERROR;
+    }
+    ckfree(remObjv);
+
+    if (option_user && option_global) {
+        fprintf(stderr, "error: conflicting options -u and -g\n");
+        return TCL_ERROR;
+    }
+
+    if (option_runs < 1) {
+        fprintf(stderr, "error: the number of runs must be a positive integer\n");
+        return TCL_ERROR;
+    }
+
+    ttrek_mode_t mode = option_user ? MODE_USER : (option_global ? MODE_GLOBAL : MODE_LOCAL);
+    ttrek_state_t *state_ptr = ttrek_CreateState(interp, 0, 0, 0, mode, STRATEGY_LATEST);
+
+    if (!state_ptr) {
+        fprintf(stderr, "error: initializing ttrek state failed\n");
+        return TCL_ERROR;
+    }
+
+    cJSON *history_root;
+    if (TCL_OK != ttrek_BuildHistoryLoad(interp, state_ptr, &history_root)) {
+        fprintf(stderr, "error: could not read build history\n");
+        ttrek_DestroyState(state_ptr);
+        return TCL_ERROR;
+    }
+
+    cJSON *runs = cJSON_GetObjectItem(history_root, "runs");
+    cJSON *last_run = NULL;
+    cJSON *run_root;
+    cJSON_ArrayForEach(run_root, runs) {
+        last_run = run_root;
+    }
+
+    // The packages of the last run, without the damaged entries
+    cJSON *packages_root = cJSON_GetObjectItem(last_run, "packages");
+    cJSON **packages = (cJSON **) Tcl_Alloc(sizeof(cJSON *) * (cJSON_GetArraySize(packages_root) + 1));
+    int num_packages = 0;
+    cJSON *package_root;
+    cJSON_ArrayForEach(package_root, packages_root) {
+        if (ttrek_BuildHistoryIsValidPackage(package_root)) {
+            packages[num_packages++] = package_root;
+        }
+    }
+
+    if (num_packages == 0) {
+        fprintf(stdout, "No builds recorded yet.\n");
+        goto done;
+    }
+
+    char time_str[64] = "-";
+    cJSON *time_node = cJSON_GetObjectItem(last_run, "time");
+    time_t run_time = cJSON_IsNumber(time_node) ? (time_t) time_node->valuedouble : 0;
+    struct tm *run_tm = localtime(&run_time);
+    if (run_tm != NULL) {
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", run_tm);
+    }
+
+    fprintf(stdout, "Last install: %s\n", time_str);
+    const char *use_flags = cJSON_GetStringValue(cJSON_GetObjectItem(last_run, "use"));
+    if (use_flags != NULL && use_flags[0] != '\0') {
+        fprintf(stdout, "Use flags: %s\n", use_flags);
+    }
+    fprintf(stdout, "\n");
+
+    ttrek_BuildReportPrintPackages(runs, last_run, packages, num_packages, option_runs);
+
+    fprintf(stdout, "\n* - stage was skipped, its results were cached\n"
+                    "! - package failed to build\n");
+
+    ttrek_BuildReportPrintCriticalPath(state_ptr->lock_root, packages, num_packages);
+
+done:
+    Tcl_Free((char *) packages);
+    cJSON_Delete(history_root);
+    ttrek_DestroyState(state_ptr);
+    return TCL_OK;
+}
@@ -5,6 +5,10 @@
  */
 
 #include "common.h"
+#include "fsmonitor/fsmonitor.h"
+#include "ttrek_index.h"
+#include "ttrek_git.h"
+#include "ttrek_jsonCache.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,10 +17,17 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include "cjson/cJSON.h"
 #include <openssl/sha.h>
 
+extern char **environ;
+
 static int tjson_TreeToJson(Tcl_Interp *interp, cJSON *item, int num_spaces, Tcl_DString *dsPtr);
+static int ttrek_WriteAll(int fd, const char *buf, ssize_t len);
 
 static struct {
     Tcl_Obj *ld_library_path;
@@ -306,6 +317,90 @@ int ttrek_WriteChars(Tcl_Interp *interp, Tcl_Obj *path_ptr, Tcl_Obj *contents_pt
     return TCL_OK;
 }
 
+// The SHA-256 hashes of the JSON files as they were last read or written,
+// by the path of the file. Used to skip writing files that did not change.
+static Tcl_HashTable json_hashes_ht;
+static int json_hashes_initialized = 0;
+
+static void ttrek_JsonHashCompute(const char *data, Tcl_Size len, unsigned char *hash) {
+    SHA256((const unsigned char *) data, len, hash);
+}
+
+static int ttrek_JsonHashIsSame(Tcl_Obj *path_ptr, const unsigned char *hash) {
+    if (!json_hashes_initialized) {
+        return 0;
+    }
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&json_hashes_ht, Tcl_GetString(path_ptr));
+    return entry != NULL && memcmp(Tcl_GetHashValue(entry), hash, SHA256_DIGEST_LENGTH) == 0;
+}
+
+void ttrek_JsonHashSet(Tcl_Obj *path_ptr, const unsigned char *hash) {
+    if (!json_hashes_initialized) {
+        Tcl_InitHashTable(&json_hashes_ht, TCL_STRING_KEYS);
+        json_hashes_initialized = 1;
+    }
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&json_hashes_ht, Tcl_GetString(path_ptr), &is_new);
+    if (is_new) {
+        Tcl_SetHashValue(entry, Tcl_Alloc(SHA256_DIGEST_LENGTH));
+    }
+    memcpy(Tcl_GetHashValue(entry), hash, SHA256_DIGEST_LENGTH);
+}
+
+// Writes the file so that it has either the old or the new contents
+// after a crash: the data is written to a temp file in the same directory,
+// synced to disk and renamed over the target.
+int ttrek_WriteFileAtomic(Tcl_Interp *interp, Tcl_Obj *path_ptr, const char *data, Tcl_Size len, int permissions) {
+
+    const char *path = Tcl_GetString(path_ptr);
+    Tcl_Obj *temp_path_ptr = Tcl_ObjPrintf("%s.tmp.%d", path, (int) getpid());
+    Tcl_IncrRefCount(temp_path_ptr);
+    const char *temp_path = Tcl_GetString(temp_path_ptr);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, permissions);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open %s: %s\n", temp_path, strerror(errno));
+        Tcl_DecrRefCount(temp_path_ptr);
+        return TCL_ERROR;
+    }
+
+    if (ttrek_WriteAll(fd, data, len) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "error: could not write %s: %s\n", temp_path, strerror(errno));
+        close(fd);
+        unlink(temp_path);
+        Tcl_DecrRefCount(temp_path_ptr);
+        return TCL_ERROR;
+    }
+    close(fd);
+
+    if (rename(temp_path, path) != 0) {
+        fprintf(stderr, "error: could not rename %s to %s: %s\n", temp_path, path, strerror(errno));
+        unlink(temp_path);
+        Tcl_DecrRefCount(temp_path_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(temp_path_ptr);
+
+    // Make the rename itself durable
+    Tcl_Obj *normalized_path_ptr = Tcl_FSGetNormalizedPath(interp, path_ptr);
+    const char *normalized_path = normalized_path_ptr != NULL ? Tcl_GetString(normalized_path_ptr) : NULL;
+    const char *slash = normalized_path != NULL ? strrchr(normalized_path, '/') : NULL;
+    if (slash != NULL) {
+        Tcl_DString dir_ds;
+        Tcl_DStringInit(&dir_ds);
+        Tcl_DStringAppend(&dir_ds, normalized_path, slash == normalized_path ? 1 : slash - normalized_path);
+        int dir_fd = open(Tcl_DStringValue(&dir_ds), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        Tcl_DStringFree(&dir_ds);
+    }
+
+    return TCL_OK;
+
+}
+
 int ttrek_WriteJsonFile(Tcl_Interp *interp, Tcl_Obj *path_ptr, cJSON *root) {
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
@@ -313,14 +408,59 @@ int ttrek_WriteJsonFile(Tcl_Interp *interp, Tcl_Obj *path_ptr, cJSON *root) {
         Tcl_DStringFree(&ds);
         return TCL_ERROR;
     }
-    Tcl_Obj *contents_ptr = Tcl_DStringToObj(&ds);
-    Tcl_IncrRefCount(contents_ptr);
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    ttrek_JsonHashCompute(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), hash);
+    if (ttrek_JsonHashIsSame(path_ptr, hash) && ttrek_CheckFileExists(path_ptr) == TCL_OK) {
+        DBG2(printf("skip writing unchanged file %s", Tcl_GetString(path_ptr)));
+        Tcl_DStringFree(&ds);
+        return TCL_OK;
+    }
+
+    int result = ttrek_WriteFileAtomic(interp, path_ptr, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), 0666);
     Tcl_DStringFree(&ds);
-    int result = ttrek_WriteChars(interp, path_ptr, contents_ptr, 0666);
-    Tcl_DecrRefCount(contents_ptr);
+    if (result == TCL_OK) {
+        ttrek_JsonHashSet(path_ptr, hash);
+    }
     return result;
 }
 
+// Returns the SHA-256 of the JSON tree as ttrek_WriteJsonFile() would
+// write it to a file, as a hex string with refcount=0.
+Tcl_Obj *ttrek_GetJsonTreeHash(Tcl_Interp *interp, cJSON *root) {
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    if (TCL_OK != tjson_TreeToJson(interp, root, 2, &ds)) {
+        Tcl_DStringFree(&ds);
+        return NULL;
+    }
+    Tcl_Obj *data_ptr = Tcl_NewByteArrayObj((const unsigned char *) Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_IncrRefCount(data_ptr);
+    Tcl_Obj *rc = ttrek_GetHashSHA256(data_ptr);
+    Tcl_DecrRefCount(data_ptr);
+    Tcl_DStringFree(&ds);
+    return rc;
+}
+
+// Returns the SHA-256 of the JSON file, as a hex string with refcount=0,
+// or NULL if the file can't be read.
+Tcl_Obj *ttrek_GetJsonFileHash(Tcl_Interp *interp, Tcl_Obj *path_ptr) {
+    Tcl_Obj *contents_ptr = Tcl_NewStringObj("", -1);
+    Tcl_IncrRefCount(contents_ptr);
+    if (TCL_OK != ttrek_ReadChars(interp, path_ptr, &contents_ptr)) {
+        Tcl_DecrRefCount(contents_ptr);
+        return NULL;
+    }
+    Tcl_Size contents_len;
+    const char *contents = Tcl_GetStringFromObj(contents_ptr, &contents_len);
+    Tcl_Obj *data_ptr = Tcl_NewByteArrayObj((const unsigned char *) contents, contents_len);
+    Tcl_IncrRefCount(data_ptr);
+    Tcl_Obj *rc = ttrek_GetHashSHA256(data_ptr);
+    Tcl_DecrRefCount(data_ptr);
+    Tcl_DecrRefCount(contents_ptr);
+    return rc;
+}
+
 int ttrek_ReadChars(Tcl_Interp *interp, Tcl_Obj *path_ptr, Tcl_Obj **contents_ptr) {
     Tcl_Channel chan = Tcl_OpenFileChannel(interp, Tcl_GetString(path_ptr), "r", 0666);
     Tcl_SetChannelOption(interp, chan, "-encoding", "utf-8");
@@ -341,105 +481,264 @@ int ttrek_FileToJson(Tcl_Interp *interp, Tcl_Obj *path_ptr, cJSON **root) {
         Tcl_DecrRefCount(contents_ptr);
         return TCL_ERROR;
     }
-    *root = cJSON_Parse(Tcl_GetString(contents_ptr));
+    Tcl_Size contents_len;
+    const char *contents = Tcl_GetStringFromObj(contents_ptr, &contents_len);
+    *root = cJSON_Parse(contents);
+    // remember the hash, so that the file is not written back if unchanged
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    ttrek_JsonHashCompute(contents, contents_len, hash);
+    ttrek_JsonHashSet(path_ptr, hash);
     Tcl_DecrRefCount(contents_ptr);
     return TCL_OK;
 }
 
-int ttrek_ExecuteCommand(Tcl_Interp *interp, Tcl_Size argc, const char *argv[], Tcl_Obj *resultObj) {
-    void *handle;
-    int rc;
-    Tcl_ResetResult(interp);
-    Tcl_Channel chan = Tcl_OpenCommandChannel(interp, argc, argv, TCL_STDOUT);
-    if (!chan) {
-        SetResult("could not open command channel");
-        return TCL_ERROR;
+static int ttrek_CreatePipe(int fds[2]) {
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    // Only the duplicated descriptors should be inherited by the child
+    if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+static int ttrek_WriteAll(int fd, const char *buf, ssize_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
     }
-    if (Tcl_GetChannelHandle(chan, TCL_READABLE, &handle) != TCL_OK) {
-        SetResult("could not get channel handle");
+    return 0;
+}
+
+static void ttrek_AppendExternalToObj(Tcl_Obj *obj, Tcl_DString *ds) {
+    Tcl_DString utf;
+    Tcl_ExternalToUtfDString(NULL, Tcl_DStringValue(ds), Tcl_DStringLength(ds), &utf);
+    Tcl_AppendToObj(obj, Tcl_DStringValue(&utf), Tcl_DStringLength(&utf));
+    Tcl_DStringFree(&utf);
+}
+
+// Runs the command and waits for it to exit. The output of the command is
+// appended to stdout_obj and stderr_obj. If any of them is NULL, then
+// the corresponding stream is forwarded to our stdout/stderr as soon as
+// it arrives. If stdout_obj and stderr_obj are the same object, stderr of
+// the command is redirected to its stdout.
+//
+// TCL_OK is returned if the command was executed, its exit status is stored
+// in exit_status_ptr. For commands terminated by a signal, the exit status
+// is 128 + signal number, as in shells.
+int ttrek_ExecuteCommandEx(Tcl_Interp *interp, Tcl_Size argc, const char *argv[], Tcl_Obj *stdout_obj,
+                           Tcl_Obj *stderr_obj, int *exit_status_ptr) {
+
+    int stdout_pipe[2] = {-1, -1};
+    int stderr_pipe[2] = {-1, -1};
+    int merge_stderr = (stdout_obj != NULL && stdout_obj == stderr_obj);
+    posix_spawn_file_actions_t file_actions;
+    pid_t pid;
+    int status;
+    int err;
+
+    if (argc < 1 || argv[0] == NULL) {
+        SetResult("no command to execute");
         return TCL_ERROR;
     }
 
-    // sleep for 100ms
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = 100000000;
+    if (ttrek_CreatePipe(stdout_pipe) != 0) {
+        goto pipe_error;
+    }
+    if (!merge_stderr && ttrek_CreatePipe(stderr_pipe) != 0) {
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
+        goto pipe_error;
+    }
 
-    if (resultObj != NULL) {
-        while (!Tcl_Eof(chan)) {
-            if (Tcl_ReadChars(chan, resultObj, -1, 0) < 0) {
-                goto read_error;
-            }
-            nanosleep(&ts, NULL);
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawn_file_actions_adddup2(&file_actions, stdout_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&file_actions, merge_stderr ? stdout_pipe[1] : stderr_pipe[1],
+                                     STDERR_FILENO);
+
+    // Make sure that what we have printed so far goes before the output
+    // of the command.
+    fflush(stdout);
+    fflush(stderr);
+
+    DBG2(printf("spawn: %s", argv[0]));
+    err = posix_spawnp(&pid, argv[0], &file_actions, NULL, (char *const *) argv, environ);
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    close(stdout_pipe[1]);
+    if (!merge_stderr) {
+        close(stderr_pipe[1]);
+    }
+
+    if (err != 0) {
+        close(stdout_pipe[0]);
+        if (!merge_stderr) {
+            close(stderr_pipe[0]);
         }
-        goto wait;
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "could not execute \"", argv[0], "\": ", strerror(err), (char *) NULL);
+        return TCL_ERROR;
     }
 
-    // make "chan" non-blocking
-    Tcl_SetChannelOption(interp, chan, "-blocking", "0");
-    Tcl_SetChannelOption(interp, chan, "-buffering", "none");
-    Tcl_SetChannelOption(interp, chan, "-translation", "binary");
+    Tcl_DString stdout_ds, stderr_ds;
+    Tcl_DStringInit(&stdout_ds);
+    Tcl_DStringInit(&stderr_ds);
+
+    struct pollfd fds[2];
+    int nfds = 0;
+    fds[nfds].fd = stdout_pipe[0];
+    fds[nfds++].events = POLLIN;
+    if (!merge_stderr) {
+        fds[nfds].fd = stderr_pipe[0];
+        fds[nfds++].events = POLLIN;
+    }
+
+    // Read from the pipes as soon as the command writes something,
+    // until all of them are closed.
+    int open_fds = nfds;
+    int rc = TCL_OK;
+    char buf[16384];
+    while (open_fds > 0) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = TCL_ERROR;
+            break;
+        }
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t len = read(fds[i].fd, buf, sizeof(buf));
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            if (len <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_fds--;
+                continue;
+            }
+            int is_stdout = (fds[i].fd == stdout_pipe[0]);
+            Tcl_Obj *target_obj = is_stdout ? stdout_obj : stderr_obj;
+            if (target_obj != NULL) {
+                Tcl_DStringAppend(is_stdout ? &stdout_ds : &stderr_ds, buf, len);
+            } else {
+                ttrek_WriteAll(is_stdout ? STDOUT_FILENO : STDERR_FILENO, buf, len);
+            }
+        }
+    }
 
-    resultObj = Tcl_NewObj();
-    Tcl_IncrRefCount(resultObj);
-    while (!Tcl_Eof(chan)) {
-        if (Tcl_ReadChars(chan, resultObj, -1, 0) < 0) {
-            Tcl_DecrRefCount(resultObj);
-            goto read_error;
+    if (rc != TCL_OK) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "error reading output from command: ",
+            Tcl_PosixError(interp), (char *) NULL);
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].fd >= 0) {
+                close(fds[i].fd);
+            }
         }
-        if (Tcl_GetCharLength(resultObj) > 0) {
-            fprintf(stdout, "%s", Tcl_GetString(resultObj));
-            fflush(stdout);
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
         }
-        nanosleep(&ts, NULL);
     }
-    Tcl_DecrRefCount(resultObj);
-    resultObj = NULL;
 
-    // make "chan" blocking to properly detect a possible runtime error
-    // during Tcl_Close();
-    Tcl_SetChannelOption(interp, chan, "-blocking", "1");
+    if (stdout_obj != NULL) {
+        ttrek_AppendExternalToObj(stdout_obj, &stdout_ds);
+    }
+    if (stderr_obj != NULL && !merge_stderr) {
+        ttrek_AppendExternalToObj(stderr_obj, &stderr_ds);
+    }
+    Tcl_DStringFree(&stdout_ds);
+    Tcl_DStringFree(&stderr_ds);
+
+    if (status == -1) {
+        *exit_status_ptr = -1;
+    } else if (WIFEXITED(status)) {
+        *exit_status_ptr = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        *exit_status_ptr = 128 + WTERMSIG(status);
+    } else {
+        *exit_status_ptr = -1;
+    }
+
+    DBG2(printf("exit status: %d", *exit_status_ptr));
 
-wait:
-    rc = Tcl_Close(interp, chan);
+    return rc;
 
-    // If we were called in a mode where we show the output of a command,
-    // try to show the exact reason why the command failed.
-    if (rc != TCL_OK && resultObj == NULL) {
-        fprintf(stderr, "Interp result: %s\n", Tcl_GetString(Tcl_GetObjResult(interp)));
-        Tcl_Obj *options = Tcl_GetReturnOptions(interp, rc);
-        Tcl_Obj *key = Tcl_NewStringObj("-errorcode", -1);
-        Tcl_IncrRefCount(key);
-        Tcl_Obj *errorCode;
-        Tcl_DictObjGet(NULL, options, key, &errorCode);
-        Tcl_DecrRefCount(key);
-        fprintf(stderr, "Exit status: %s\n", Tcl_GetString(errorCode));
-        Tcl_DecrRefCount(options);
+pipe_error:
+    Tcl_ResetResult(interp);
+    Tcl_AppendResult(interp, "could not create pipe: ", Tcl_PosixError(interp), (char *) NULL);
+    return TCL_ERROR;
+}
+
+// Runs the command. If resultObj is NULL, the output of the command is shown
+// as it arrives. Otherwise, stdout of the command is stored in resultObj.
+// stderr of the command is shown as it arrives, unless the last argument
+// is "2>@1". In this case, it is redirected to stdout of the command.
+int ttrek_ExecuteCommand(Tcl_Interp *interp, Tcl_Size argc, const char *argv[], Tcl_Obj *resultObj) {
+    int exit_status;
+    int rc;
+
+    Tcl_ResetResult(interp);
+
+    int merge_stderr = (argc > 1 && strcmp(argv[argc - 1], "2>@1") == 0);
+    const char **cmd_argv = argv;
+    if (merge_stderr) {
+        cmd_argv = ckalloc(sizeof(char *) * argc);
+        memcpy(cmd_argv, argv, sizeof(char *) * (argc - 1));
+        cmd_argv[--argc] = NULL;
     }
 
-    if (resultObj != NULL) {
-        Tcl_Size len;
-        char *str;
-        // If the process produced anything on stderr, it will have been
-        // returned in the interpreter result.  It needs to be appended to
-        // the result string.
-        str = Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &len);
-        Tcl_AppendToObj(resultObj, str, len);
+    if (resultObj == NULL) {
+
+        rc = ttrek_ExecuteCommandEx(interp, argc, cmd_argv, NULL, NULL, &exit_status);
+
+    } else {
+
+        rc = ttrek_ExecuteCommandEx(interp, argc, cmd_argv, resultObj, (merge_stderr ? resultObj : NULL),
+                                    &exit_status);
+
         // If the last character of the result is a newline, then remove
         // the newline character.
-        str = Tcl_GetStringFromObj(resultObj, &len);
+        Tcl_Size len;
+        const char *str = Tcl_GetStringFromObj(resultObj, &len);
         if (len > 0 && str[len - 1] == '\n') {
             Tcl_SetObjLength(resultObj, len - 1);
         }
+
     }
 
-    return rc;
+    if (merge_stderr) {
+        ckfree(cmd_argv);
+    }
 
-read_error:
-    Tcl_ResetResult(interp);
-    Tcl_AppendResult(interp, "error reading output from command: ",
-        Tcl_PosixError(interp), (char *) NULL);
-    return TCL_ERROR;
+    if (rc == TCL_OK && exit_status != 0) {
+        // If we were called in a mode where we show the output of a command,
+        // try to show the exact reason why the command failed.
+        if (resultObj == NULL) {
+            fprintf(stderr, "Exit status: %d\n", exit_status);
+        }
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("child process exited abnormally with status %d", exit_status));
+        rc = TCL_ERROR;
+    }
+
+    return rc;
 }
 
 Tcl_Obj *ttrek_GetProjectDirForLocalMode(Tcl_Interp *interp) {
@@ -591,15 +890,17 @@ cJSON *ttrek_GetSpecRoot(Tcl_Interp *interp, Tcl_Obj *project_home_dir_ptr) {
     return spec_root;
 }
 
-cJSON *ttrek_GetLockRoot(Tcl_Interp *interp, Tcl_Obj *project_home_dir_ptr) {
+cJSON *ttrek_GetLockRoot(Tcl_Interp *interp, Tcl_Obj *project_home_dir_ptr, Tcl_Obj *cache_dir_ptr) {
 
     Tcl_Obj *path_to_lock_file_ptr = ttrek_GetFilePath(interp, project_home_dir_ptr, LOCK_JSON_FILE);
+    Tcl_Obj *path_to_cache_file_ptr = ttrek_GetFilePath(interp, cache_dir_ptr, LOCK_CACHE_FILE);
 
     cJSON *lock_root = NULL;
     if (TCL_OK == ttrek_CheckFileExists(path_to_lock_file_ptr)) {
-        if (TCL_OK != ttrek_FileToJson(interp, path_to_lock_file_ptr, &lock_root)) {
+        if (TCL_OK != ttrek_JsonCacheLoad(interp, path_to_lock_file_ptr, path_to_cache_file_ptr, &lock_root)) {
             fprintf(stderr, "error: could not read %s\n", Tcl_GetString(path_to_lock_file_ptr));
             Tcl_DecrRefCount(path_to_lock_file_ptr);
+            Tcl_DecrRefCount(path_to_cache_file_ptr);
             return NULL;
         }
     } else {
@@ -607,19 +908,78 @@ cJSON *ttrek_GetLockRoot(Tcl_Interp *interp, Tcl_Obj *project_home_dir_ptr) {
     }
 
     Tcl_DecrRefCount(path_to_lock_file_ptr);
+    Tcl_DecrRefCount(path_to_cache_file_ptr);
 
     return lock_root;
 }
 
-cJSON *ttrek_GetManifestRoot(Tcl_Interp *interp, Tcl_Obj *project_venv_dir_ptr) {
+// Applies the changes from the manifest journal. Each line of the journal
+// is a record {"package": name, "value": {...}}, where a missing value means
+// that the package was removed. A truncated last line is left from
+// an interrupted write and is ignored.
+static int ttrek_ManifestJournalReplay(Tcl_Interp *interp, Tcl_Obj *journal_path_ptr, cJSON *manifest_root) {
+
+    Tcl_Obj *contents_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(contents_ptr);
+    if (TCL_OK != ttrek_ReadChars(interp, journal_path_ptr, &contents_ptr)) {
+        Tcl_DecrRefCount(contents_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_DString line_ds;
+    Tcl_DStringInit(&line_ds);
+
+    int num_records = 0;
+    Tcl_Size len;
+    const char *str = Tcl_GetStringFromObj(contents_ptr, &len);
+    const char *end = str + len;
+    while (str < end) {
+        const char *eol = memchr(str, '\n', end - str);
+        if (eol == NULL) {
+            DBG2(printf("ignore truncated record in manifest journal"));
+            break;
+        }
+
+        Tcl_DStringSetLength(&line_ds, 0);
+        Tcl_DStringAppend(&line_ds, str, eol - str);
+        str = eol + 1;
+
+        cJSON *record = cJSON_Parse(Tcl_DStringValue(&line_ds));
+        const char *package_name = cJSON_GetStringValue(cJSON_GetObjectItem(record, "package"));
+        if (package_name == NULL) {
+            fprintf(stderr, "warning: invalid record in manifest journal %s\n", Tcl_GetString(journal_path_ptr));
+            cJSON_Delete(record);
+            continue;
+        }
+
+        cJSON_DeleteItemFromObject(manifest_root, package_name);
+        cJSON *value = cJSON_DetachItemFromObject(record, "value");
+        if (value != NULL) {
+            cJSON_AddItemToObject(manifest_root, package_name, value);
+        }
+        cJSON_Delete(record);
+        num_records++;
+    }
+
+    DBG2(printf("replayed %d records from manifest journal", num_records));
+
+    Tcl_DStringFree(&line_ds);
+    Tcl_DecrRefCount(contents_ptr);
+    return TCL_OK;
+
+}
+
+cJSON *ttrek_GetManifestRoot(Tcl_Interp *interp, Tcl_Obj *project_venv_dir_ptr, Tcl_Obj *cache_dir_ptr) {
 
     Tcl_Obj *path_to_manifest_file_ptr = ttrek_GetFilePath(interp, project_venv_dir_ptr, MANIFEST_JSON_FILE);
+    Tcl_Obj *path_to_cache_file_ptr = ttrek_GetFilePath(interp, cache_dir_ptr, MANIFEST_CACHE_FILE);
 
     cJSON *manifest_root = NULL;
     if (TCL_OK == ttrek_CheckFileExists(path_to_manifest_file_ptr)) {
-        if (TCL_OK != ttrek_FileToJson(interp, path_to_manifest_file_ptr, &manifest_root)) {
+        if (TCL_OK != ttrek_JsonCacheLoad(interp, path_to_manifest_file_ptr, path_to_cache_file_ptr, &manifest_root)) {
             fprintf(stderr, "error: could not read %s\n", Tcl_GetString(path_to_manifest_file_ptr));
             Tcl_DecrRefCount(path_to_manifest_file_ptr);
+            Tcl_DecrRefCount(path_to_cache_file_ptr);
             return NULL;
         }
     } else {
@@ -627,10 +987,163 @@ cJSON *ttrek_GetManifestRoot(Tcl_Interp *interp, Tcl_Obj *project_venv_dir_ptr)
     }
 
     Tcl_DecrRefCount(path_to_manifest_file_ptr);
+    Tcl_DecrRefCount(path_to_cache_file_ptr);
+
+    Tcl_Obj *path_to_journal_file_ptr = ttrek_GetFilePath(interp, project_venv_dir_ptr, MANIFEST_JOURNAL_FILE);
+    if (TCL_OK == ttrek_CheckFileExists(path_to_journal_file_ptr)) {
+        if (TCL_OK != ttrek_ManifestJournalReplay(interp, path_to_journal_file_ptr, manifest_root)) {
+            fprintf(stderr, "error: could not read %s\n", Tcl_GetString(path_to_journal_file_ptr));
+            Tcl_DecrRefCount(path_to_journal_file_ptr);
+            cJSON_Delete(manifest_root);
+            return NULL;
+        }
+    }
+    Tcl_DecrRefCount(path_to_journal_file_ptr);
 
     return manifest_root;
 }
 
+// Remembers that the manifest entry of the package has changed. With the
+// journal enabled, ttrek_ManifestSave() appends only these entries to
+// the journal instead of rewriting the whole manifest.
+void ttrek_ManifestMarkChanged(ttrek_state_t *state_ptr, const char *package_name) {
+    int is_new;
+    Tcl_CreateHashEntry(&state_ptr->manifest_changed_ht, package_name, &is_new);
+}
+
+// Appends a record with the current manifest entry for each changed
+// package to ds.
+static void ttrek_ManifestJournalRecords(ttrek_state_t *state_ptr, Tcl_DString *ds) {
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->manifest_changed_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+
+        const char *package_name = Tcl_GetHashKey(&state_ptr->manifest_changed_ht, entry);
+        cJSON *record = cJSON_CreateObject();
+        cJSON_AddStringToObject(record, "package", package_name);
+        ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+        if (package_ptr != NULL && package_ptr->manifest_node != NULL) {
+            cJSON_AddItemToObject(record, "value", cJSON_Duplicate(package_ptr->manifest_node, 1));
+        }
+        char *record_str = cJSON_PrintUnformatted(record);
+        cJSON_Delete(record);
+
+        Tcl_DStringAppend(ds, record_str, -1);
+        Tcl_DStringAppend(ds, "\n", 1);
+        cJSON_free(record_str);
+
+    }
+}
+
+static int ttrek_ManifestJournalAppend(ttrek_state_t *state_ptr, Tcl_DString *ds) {
+
+    const char *journal_path = Tcl_GetString(state_ptr->manifest_journal_path_ptr);
+    int fd = open(journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open %s: %s\n", journal_path, strerror(errno));
+        return TCL_ERROR;
+    }
+
+    int rc = TCL_OK;
+    if (ttrek_WriteAll(fd, Tcl_DStringValue(ds), Tcl_DStringLength(ds)) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "error: could not write %s: %s\n", journal_path, strerror(errno));
+        rc = TCL_ERROR;
+    }
+
+    close(fd);
+    return rc;
+
+}
+
+static void ttrek_ManifestClearChanged(ttrek_state_t *state_ptr) {
+    Tcl_DeleteHashTable(&state_ptr->manifest_changed_ht);
+    Tcl_InitHashTable(&state_ptr->manifest_changed_ht, TCL_STRING_KEYS);
+}
+
+// Returns the manifest, loading it on first use. Commands like 'run' and
+// 'list' do not need the manifest, so ttrek_CreateState() does not load it.
+// Returns NULL and sets the interp result if the manifest could not be
+// read. The failure is remembered, so that ttrek_ManifestSave() does not
+// overwrite the unreadable manifest.
+cJSON *ttrek_StateGetManifestRoot(ttrek_state_t *state_ptr) {
+    if (!state_ptr->is_manifest_loaded) {
+        state_ptr->is_manifest_loaded = 1;
+        state_ptr->manifest_root = ttrek_GetManifestRoot(state_ptr->interp, state_ptr->project_venv_dir_ptr,
+                                                         state_ptr->project_build_dir_ptr);
+        if (state_ptr->manifest_root != NULL) {
+            ttrek_IndexAddManifest(state_ptr);
+        }
+    }
+    if (state_ptr->manifest_root == NULL) {
+        Tcl_Interp *interp = state_ptr->interp;
+        SetResult("could not load " MANIFEST_JSON_FILE);
+    }
+    return state_ptr->manifest_root;
+}
+
+// Saves the manifest. This is the commit step of the command, it is
+// called only after the lock file is saved. With the journal enabled,
+// the changed entries are appended to the journal, and the manifest is
+// rewritten (and the journal removed) only when the journal would grow
+// larger than the manifest itself.
+int ttrek_ManifestSave(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    if (!state_ptr->is_manifest_loaded) {
+        // nothing could have changed
+        return TCL_OK;
+    }
+
+    if (state_ptr->manifest_root == NULL) {
+        fprintf(stderr, "error: not saving %s, it could not be loaded\n", MANIFEST_JSON_FILE);
+        SetResult("could not load " MANIFEST_JSON_FILE);
+        return TCL_ERROR;
+    }
+
+    const char *journal_path = Tcl_GetString(state_ptr->manifest_journal_path_ptr);
+    struct stat journal_st;
+    int journal_exists = (stat(journal_path, &journal_st) == 0);
+
+    if (state_ptr->with_manifest_journal) {
+
+        Tcl_DString ds;
+        Tcl_DStringInit(&ds);
+        ttrek_ManifestJournalRecords(state_ptr, &ds);
+
+        struct stat manifest_st;
+        if (stat(Tcl_GetString(state_ptr->manifest_json_path_ptr), &manifest_st) == 0
+            && (journal_exists ? journal_st.st_size : 0) + Tcl_DStringLength(&ds) <= manifest_st.st_size) {
+
+            DBG2(printf("manifest changes are kept in the journal"));
+            int rc = TCL_OK;
+            if (Tcl_DStringLength(&ds) > 0) {
+                rc = ttrek_ManifestJournalAppend(state_ptr, &ds);
+            }
+            Tcl_DStringFree(&ds);
+            if (rc == TCL_OK) {
+                ttrek_ManifestClearChanged(state_ptr);
+            }
+            return rc;
+        }
+
+        Tcl_DStringFree(&ds);
+        DBG2(printf("compact manifest journal"));
+
+    }
+
+    if (TCL_OK != ttrek_WriteJsonFile(interp, state_ptr->manifest_json_path_ptr, state_ptr->manifest_root)) {
+        return TCL_ERROR;
+    }
+
+    if (journal_exists && unlink(journal_path) != 0) {
+        fprintf(stderr, "error: could not remove %s: %s\n", journal_path, strerror(errno));
+        return TCL_ERROR;
+    }
+
+    ttrek_ManifestClearChanged(state_ptr);
+    return TCL_OK;
+
+}
+
 static int ttrek_LockFile(ttrek_state_t *state_ptr) {
     int fd = open(Tcl_GetString(state_ptr->locking_file_path_ptr), O_WRONLY | O_CREAT, 0666);
     if (fd == -1) {
@@ -663,6 +1176,10 @@ ttrek_state_t *ttrek_CreateState(Tcl_Interp *interp, int option_yes, int option_
     if (!state_ptr) {
         return NULL;
     }
+
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    state_ptr->start_time = (Tcl_WideInt) now.sec * 1000000 + now.usec;
     DBG2(printf("allocated state: %p", (void *)state_ptr));
 
     state_ptr->interp = interp;
@@ -709,6 +1226,13 @@ ttrek_state_t *ttrek_CreateState(Tcl_Interp *interp, int option_yes, int option_
     state_ptr->mode = mode;
     state_ptr->is_local_build = 0;
     state_ptr->strategy = strategy;
+    state_ptr->jobs = 1;
+    state_ptr->fsmonitor_state_ptr = NULL;
+    Tcl_InitHashTable(&state_ptr->snapshot_paths_ht, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&state_ptr->manifest_changed_ht, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&state_ptr->planned_versions_ht, TCL_STRING_KEYS);
+    state_ptr->snapshot_backend = SNAPSHOT_GIT;
+    state_ptr->git_session_ptr = NULL;
     state_ptr->project_home_dir_ptr = project_home_dir_ptr;
     state_ptr->project_venv_dir_ptr = project_venv_dir_ptr;
     state_ptr->project_install_dir_ptr = ttrek_GetVenvSubDir(interp, project_venv_dir_ptr, INSTALL_DIR);
@@ -719,16 +1243,25 @@ ttrek_state_t *ttrek_CreateState(Tcl_Interp *interp, int option_yes, int option_
     // we do not check if the manifest file exists here
     // because it is not required to exist
     state_ptr->manifest_json_path_ptr = ttrek_GetFilePath(interp, project_venv_dir_ptr, MANIFEST_JSON_FILE);
+    state_ptr->manifest_journal_path_ptr = ttrek_GetFilePath(interp, project_venv_dir_ptr, MANIFEST_JOURNAL_FILE);
+    // TTREK_MANIFEST_JOURNAL=1 saves the manifest changes to an append-only
+    // journal, instead of rewriting the whole manifest
+    const char *manifest_journal_env = getenv("TTREK_MANIFEST_JOURNAL");
+    state_ptr->with_manifest_journal = (manifest_journal_env != NULL && strcmp(manifest_journal_env, "0") != 0);
     state_ptr->spec_json_path_ptr = path_to_spec_file_ptr;
     state_ptr->lock_json_path_ptr = path_lock_file_ptr;
     state_ptr->spec_root = ttrek_GetSpecRoot(interp, project_home_dir_ptr);
     if (mode == MODE_BOOTSTRAP) {
         state_ptr->lock_root = cJSON_CreateObject();
         state_ptr->manifest_root = cJSON_CreateObject();
+        state_ptr->is_manifest_loaded = 1;
     } else {
-        state_ptr->lock_root = ttrek_GetLockRoot(interp, project_home_dir_ptr);
-        state_ptr->manifest_root = ttrek_GetManifestRoot(interp, project_venv_dir_ptr);
+        state_ptr->lock_root = ttrek_GetLockRoot(interp, project_home_dir_ptr, state_ptr->project_build_dir_ptr);
+        // the manifest is loaded on first use, see ttrek_StateGetManifestRoot()
+        state_ptr->manifest_root = NULL;
+        state_ptr->is_manifest_loaded = 0;
     }
+    ttrek_IndexInit(state_ptr);
 
     // print all refCount for all dir_ptr in state_ptr
     DBG(fprintf(stderr, "project_home_dir_ptr refCount: %" TCL_SIZE_MODIFIER "d\n",
@@ -782,12 +1315,27 @@ void ttrek_DestroyState(ttrek_state_t *state_ptr) {
     Tcl_DecrRefCount(state_ptr->spec_json_path_ptr);
     Tcl_DecrRefCount(state_ptr->lock_json_path_ptr);
     Tcl_DecrRefCount(state_ptr->manifest_json_path_ptr);
+    Tcl_DecrRefCount(state_ptr->manifest_journal_path_ptr);
     // DBG2(printf("release spec_root: %p", (void *)state_ptr->spec_root));
     cJSON_Delete(state_ptr->spec_root);
     // DBG2(printf("release lock_root: %p", (void *)state_ptr->lock_root));
     cJSON_Delete(state_ptr->lock_root);
     // DBG2(printf("release manifest_root: %p", (void *)state_ptr->manifest_root));
     cJSON_Delete(state_ptr->manifest_root);
+    ttrek_IndexFree(state_ptr);
+    ttrek_GitSessionFree(state_ptr);
+    Tcl_DeleteHashTable(&state_ptr->snapshot_paths_ht);
+    Tcl_DeleteHashTable(&state_ptr->manifest_changed_ht);
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->planned_versions_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&state_ptr->planned_versions_ht);
+    if (state_ptr->fsmonitor_state_ptr != NULL) {
+        ttrek_FSMonitor_RemoveWatch(state_ptr->interp, state_ptr->fsmonitor_state_ptr);
+        Tcl_Free((char *) state_ptr->fsmonitor_state_ptr);
+    }
     DBG2(printf("release state: %p", (void *)state_ptr));
     Tcl_Free((char *) state_ptr);
     DBG2(printf("return: ok"));
@@ -28,6 +28,19 @@ typedef int Tcl_Size;
 
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
+// The access, modification and status change times of struct stat as
+// struct timespec, they are named st_atimespec, st_mtimespec and
+// st_ctimespec on macOS
+#ifdef __APPLE__
+# define ST_ATIM(st) ((st).st_atimespec)
+# define ST_MTIM(st) ((st).st_mtimespec)
+# define ST_CTIM(st) ((st).st_ctimespec)
+#else
+# define ST_ATIM(st) ((st).st_atim)
+# define ST_MTIM(st) ((st).st_mtim)
+# define ST_CTIM(st) ((st).st_ctim)
+#endif
+
 #ifdef DEBUG
 # define DBG(x) x
 #ifndef __FUNCTION_NAME__
@@ -73,7 +86,13 @@ typedef int Tcl_Size;
 #define SPEC_JSON_FILE     "ttrek.json"
 #define LOCK_JSON_FILE     "ttrek-lock.json"
 #define MANIFEST_JSON_FILE "ttrek-manifest.json"
+#define MANIFEST_JOURNAL_FILE "ttrek-manifest.journal"
+// The binary caches of the parsed lock file and manifest, in the build dir
+#define LOCK_CACHE_FILE     "ttrek-lock.cache"
+#define MANIFEST_CACHE_FILE "ttrek-manifest.cache"
 #define DIRTY_FILE   ".dirty"
+// The snapshot store of the venv, see ttrek_store.h
+#define SNAPSHOT_STORE_DIR ".ttrek-store"
 #define LOCKING_FILE ".lock"
 #define LOCKING_FILE_IGNORE_RULE "/.lock"
 #define BUILD_DIR_IGNORE_RULE    "/build"
@@ -95,6 +114,16 @@ typedef enum {
     STRATEGY_LOCKED
 } ttrek_strategy_t;
 
+// Where the snapshots of the venv are kept, to roll back an interrupted
+// install
+typedef enum {
+    SNAPSHOT_GIT,
+    SNAPSHOT_STORE
+} ttrek_snapshot_backend_t;
+
+struct ttrek_fsmonitor_state_s;
+typedef struct ttrek_git_session_s ttrek_git_session_t;
+
 typedef struct {
     Tcl_Interp *interp;
     Tcl_Obj *project_home_dir_ptr;
@@ -105,18 +134,45 @@ typedef struct {
     Tcl_Obj *spec_json_path_ptr;
     Tcl_Obj *lock_json_path_ptr;
     Tcl_Obj *manifest_json_path_ptr;
+    Tcl_Obj *manifest_journal_path_ptr;
     Tcl_Obj *dirty_file_path_ptr;
     Tcl_Obj *locking_file_path_ptr;
     cJSON *spec_root;
     cJSON *lock_root;
+    // Use ttrek_StateGetManifestRoot(), the manifest is loaded on first use
     cJSON *manifest_root;
+    int is_manifest_loaded;
+    // The packages of the lock file and the manifest by name,
+    // see ttrek_index.h
+    Tcl_HashTable index_ht;
     int with_locking;
+    int with_manifest_journal;
+    // The packages whose manifest entries were changed by the command,
+    // see ttrek_ManifestMarkChanged()
+    Tcl_HashTable manifest_changed_ht;
+    // The versions that the packages of the execution plan are installed
+    // at (name -> version object), see ttrek_SetPlannedVersion()
+    Tcl_HashTable planned_versions_ht;
     int option_yes;
     int option_force;
     ttrek_mode_t mode;
     int is_local_build;
     ttrek_strategy_t strategy;
     int lock_fd;
+    // The number of packages that can be built at the same time
+    int jobs;
+    // Tracks the changes in the install directory between packages,
+    // created on the first install
+    struct ttrek_fsmonitor_state_s *fsmonitor_state_ptr;
+    // The paths in the venv that were changed by the command, relative to
+    // the venv directory. Only these are updated by ttrek_SnapshotSave().
+    Tcl_HashTable snapshot_paths_ht;
+    ttrek_snapshot_backend_t snapshot_backend;
+    // The repository of the venv, opened on the first git operation and
+    // closed by ttrek_DestroyState(), see ttrek_git.c
+    ttrek_git_session_t *git_session_ptr;
+    // When the command started, in microseconds
+    Tcl_WideInt start_time;
 } ttrek_state_t;
 
 int ttrek_ResolvePath(Tcl_Interp *interp, Tcl_Obj *path_ptr, Tcl_Obj *filename_ptr, Tcl_Obj **output_path_ptr);
@@ -131,21 +187,31 @@ int ttrek_EnsureSkeletonExists(Tcl_Interp *interp, ttrek_state_t *state_ptr);
 Tcl_Obj *ttrek_GetVenvSubDir(Tcl_Interp *interp, Tcl_Obj *project_venv_dir_ptr, const char *subdir);
 
 int ttrek_WriteJsonFile(Tcl_Interp *interp, Tcl_Obj *path_ptr, cJSON *root);
+Tcl_Obj *ttrek_GetJsonTreeHash(Tcl_Interp *interp, cJSON *root);
+Tcl_Obj *ttrek_GetJsonFileHash(Tcl_Interp *interp, Tcl_Obj *path_ptr);
+int ttrek_WriteFileAtomic(Tcl_Interp *interp, Tcl_Obj *path_ptr, const char *data, Tcl_Size len, int permissions);
 
 int ttrek_ReadChars(Tcl_Interp *interp, Tcl_Obj *path_ptr, Tcl_Obj **contents_ptr);
 
 int ttrek_FileToJson(Tcl_Interp *interp, Tcl_Obj *path_ptr, cJSON **root);
+void ttrek_JsonHashSet(Tcl_Obj *path_ptr, const unsigned char *hash);
 
 int ttrek_WriteChars(Tcl_Interp *interp, Tcl_Obj *path_ptr, Tcl_Obj *contents_ptr, int permissions);
 
 int ttrek_TouchFile(Tcl_Interp *interp, Tcl_Obj *path_ptr);
 
 int ttrek_ExecuteCommand(Tcl_Interp *interp, Tcl_Size argc, const char *argv[], Tcl_Obj *resultObj);
+int ttrek_ExecuteCommandEx(Tcl_Interp *interp, Tcl_Size argc, const char *argv[], Tcl_Obj *stdout_obj,
+                           Tcl_Obj *stderr_obj, int *exit_status_ptr);
 
 Tcl_Obj *ttrek_GetProjectVenvDir(Tcl_Interp *interp, Tcl_Obj *project_home_dir_ptr);
 ttrek_state_t *ttrek_CreateState(Tcl_Interp *interp, int option_yes, int option_force, int with_locking, ttrek_mode_t mode, ttrek_strategy_t strategy);
 void ttrek_DestroyState(ttrek_state_t *state_ptr);
 
+cJSON *ttrek_StateGetManifestRoot(ttrek_state_t *state_ptr);
+void ttrek_ManifestMarkChanged(ttrek_state_t *state_ptr, const char *package_name);
+int ttrek_ManifestSave(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+
 ttrek_strategy_t ttrek_StrategyFromString(const char *strategy_str, ttrek_strategy_t default_strategy);
 int ttrek_GetDirectDependencies(Tcl_Interp *interp, cJSON *spec_root, Tcl_Obj *list_ptr);
 
@@ -5,105 +5,856 @@
  */
 
 #include "subCmdDecls.h"
+#include "ttrek_hostHistory.h"
+#include "registry.h"
 #include <curl/curl.h>
+#include <openssl/evp.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define TTREK_DOWNLOAD_DEFAULT_RETRY_COUNT 4
+#define TTREK_DOWNLOAD_DEFAULT_SEGMENTS 4
+#define TTREK_DOWNLOAD_MAX_SEGMENTS 16
+// Files smaller than this are not worth splitting into segments
+#define TTREK_DOWNLOAD_SEGMENT_MIN_SIZE (8 * 1024 * 1024)
+#define TTREK_DOWNLOAD_PART_EXT ".part"
+#define TTREK_DOWNLOAD_MIRRORS_ENV "TTREK_DOWNLOAD_MIRRORS"
+#define TTREK_DOWNLOAD_MAX_SOURCES 8
+// How many sources race for the first byte, and how long (ms) to wait for
+// a source before the next one joins the race
+#define TTREK_DOWNLOAD_RACE_SIZE 3
+#define TTREK_DOWNLOAD_RACE_DELAY 250
+#define TTREK_DOWNLOAD_RACE_TIMEOUT 15000
+// The delay before a retry grows from the base to the max (ms)
+#define TTREK_DOWNLOAD_BACKOFF_BASE 1000
+#define TTREK_DOWNLOAD_BACKOFF_MAX 30000
+
+typedef struct ttrek_download_s ttrek_download_t;
+
+typedef struct {
+    Tcl_Obj *url_ptr;
+    Tcl_Obj *host_ptr;
+    // The position in the list of sources, used to keep the order of
+    // sources with the same score
+    int order;
+    double score;
+    CURL *curl_handle;
+    Tcl_WideInt start_time;
+    int has_first_byte;
+} ttrek_download_source_t;
+
+typedef struct {
+    ttrek_download_t *dl;
+    // The first and the last byte of the segment, and the next byte to
+    // download. The segment is done when pos is past end.
+    curl_off_t start;
+    curl_off_t end;
+    curl_off_t pos;
+    CURL *curl_handle;
+} ttrek_download_segment_t;
+
+// The state of a download that is kept between the attempts, so that
+// an attempt continues where the previous one stopped.
+struct ttrek_download_s {
+    Tcl_Obj *url_ptr;
+    Tcl_Obj *part_ptr;
+    int fd;
+    // Number of bytes in the part file when downloading in one stream
+    curl_off_t offset;
+    // SHA-256 of the first offset bytes, when an expected hash is given
+    EVP_MD_CTX *hash_ctx;
+    int hash_in_sync;
+    const char *expected_sha256;
+    // What we know about the file on the server
+    int probed;
+    int accept_ranges;
+    curl_off_t size;
+    int max_segments;
+    int num_segments;
+    ttrek_download_segment_t segments[TTREK_DOWNLOAD_MAX_SEGMENTS];
+};
+
+static void ttrek_DownloadSetError(Tcl_Interp *interp, Tcl_Obj *url_ptr, CURLcode ret, long status_code) {
+    // The standard curl message is uninformative for HTTP errors:
+    //     HTTP response code said error
+    // so we show the status code instead.
+    if (ret == CURLE_HTTP_RETURNED_ERROR) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad HTTP status code (%ld)"
+            " while downloading \"%s\"", status_code, Tcl_GetString(url_ptr)));
+    } else {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while downloading"
+            " \"%s\": %s", Tcl_GetString(url_ptr), curl_easy_strerror(ret)));
+    }
+}
 
-#define TTREK_DOWNLOAD_DEFAULT_RETRY_COUNT 3
+static CURL *ttrek_DownloadNewHandle(Tcl_Obj *url_ptr) {
+    CURL *curl_handle = curl_easy_init();
+    curl_easy_setopt(curl_handle, CURLOPT_URL, Tcl_GetString(url_ptr));
+    // The race, the probe and the download itself can go over the same
+    // connection
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, ttrek_RegistryGetShare());
+    // Follow redirects
+    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L);
+    // Give up on a stalled connection instead of waiting forever, the next
+    // attempt will continue from where this one stopped.
+    curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME, 60L);
+    return curl_handle;
+}
 
-static size_t write_callback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
-    return Tcl_Write((Tcl_Channel)userdata, ptr, size * nmemb);
+static int ttrek_DownloadWriteAt(int fd, const char *ptr, size_t len, curl_off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, ptr, len, (off_t) offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= (size_t) n;
+        offset += n;
+    }
+    return 0;
 }
 
-static int ttrek_DownloadFile(Tcl_Interp *interp, Tcl_Obj *url_ptr, Tcl_Obj *file_ptr) {
+static void ttrek_DownloadReset(ttrek_download_t *dl) {
+    if (dl->fd >= 0 && ftruncate(dl->fd, 0) != 0) {
+        DBG2(printf("could not truncate the part file"));
+    }
+    dl->offset = 0;
+    dl->num_segments = 0;
+    dl->hash_in_sync = 0;
+}
 
-    DBG2(printf("URL[%s] -> [%s]", Tcl_GetString(url_ptr), Tcl_GetString(file_ptr)));
+// Brings the hash up to date with the contents of the part file. Needed
+// when a part file is left by a previous run, or after a segmented
+// download where the bytes arrive out of order.
+static int ttrek_DownloadHashFile(ttrek_download_t *dl, curl_off_t size) {
+    char buf[65536];
+    curl_off_t pos = 0;
+    EVP_DigestInit_ex(dl->hash_ctx, EVP_sha256(), NULL);
+    while (pos < size) {
+        size_t want = (size - pos) < (curl_off_t) sizeof(buf) ? (size_t) (size - pos) : sizeof(buf);
+        ssize_t n = pread(dl->fd, buf, want, (off_t) pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return TCL_ERROR;
+        }
+        EVP_DigestUpdate(dl->hash_ctx, buf, (size_t) n);
+        pos += n;
+    }
+    dl->hash_in_sync = 1;
+    return TCL_OK;
+}
 
-    Tcl_Channel chan = Tcl_FSOpenFileChannel(interp, file_ptr, "wb", 0644);
-    if (chan == NULL) {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to open output file"
-            " for writing: \"%s\" (%s[%d] - %s)", Tcl_GetString(file_ptr),
-            Tcl_ErrnoId(), Tcl_GetErrno(), Tcl_ErrnoMsg(Tcl_GetErrno())));
+static int ttrek_DownloadCheckHash(Tcl_Interp *interp, ttrek_download_t *dl, curl_off_t size) {
+    if (dl->expected_sha256 == NULL) {
+        return TCL_OK;
+    }
+    if (!dl->hash_in_sync && ttrek_DownloadHashFile(dl, size) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not read \"%s\"", Tcl_GetString(dl->part_ptr)));
         return TCL_ERROR;
     }
 
-    CURL *curl_handle = curl_easy_init();
-    curl_easy_setopt(curl_handle, CURLOPT_URL, Tcl_GetString(url_ptr));
-    // Follow redirects
-    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)chan);
+    unsigned char hash_bin[EVP_MAX_MD_SIZE];
+    unsigned int hash_len;
+    EVP_DigestFinal_ex(dl->hash_ctx, hash_bin, &hash_len);
+    dl->hash_in_sync = 0;
+
+    char hash_hex[EVP_MAX_MD_SIZE * 2 + 1];
+    for (unsigned int i = 0; i < hash_len; i++) {
+        snprintf(&hash_hex[i * 2], 3, "%02x", hash_bin[i]);
+    }
+
+    if (strcasecmp(hash_hex, dl->expected_sha256) != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("checksum mismatch for \"%s\": expected %s, got %s",
+            Tcl_GetString(dl->url_ptr), dl->expected_sha256, hash_hex));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static size_t ttrek_DownloadHeaderCallback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ttrek_download_t *dl = (ttrek_download_t *) userdata;
+    size_t len = size * nmemb;
+    // A status line starts the headers of the next response in case of
+    // redirects, only the last response matters.
+    if (len >= 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+        dl->accept_ranges = 0;
+    } else if (len >= 20 && strncasecmp(ptr, "Accept-Ranges: bytes", 20) == 0) {
+        dl->accept_ranges = 1;
+    }
+    return len;
+}
+
+// Asks the server for the file size and whether it supports ranges, to
+// decide whether the file can be downloaded in segments.
+static void ttrek_DownloadProbe(ttrek_download_t *dl) {
+    dl->probed = 1;
+    dl->size = -1;
+    dl->accept_ranges = 0;
+
+    CURL *curl_handle = ttrek_DownloadNewHandle(dl->url_ptr);
+    curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, ttrek_DownloadHeaderCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *) dl);
+
+    if (curl_easy_perform(curl_handle) == CURLE_OK) {
+        curl_off_t size;
+        if (curl_easy_getinfo(curl_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size) == CURLE_OK) {
+            dl->size = size;
+        }
+    } else {
+        dl->accept_ranges = 0;
+    }
+
+    curl_easy_cleanup(curl_handle);
+    DBG2(printf("size: %" CURL_FORMAT_CURL_OFF_T " accept ranges: %d", dl->size, dl->accept_ranges));
+}
+
+static size_t ttrek_DownloadStreamCallback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ttrek_download_t *dl = (ttrek_download_t *) userdata;
+    size_t len = size * nmemb;
+    if (ttrek_DownloadWriteAt(dl->fd, ptr, len, dl->offset) != 0) {
+        return 0;
+    }
+    dl->offset += (curl_off_t) len;
+    if (dl->hash_in_sync) {
+        EVP_DigestUpdate(dl->hash_ctx, ptr, len);
+    }
+    return len;
+}
+
+// Downloads the file in one stream, starting at the end of the part file.
+static int ttrek_DownloadStream(Tcl_Interp *interp, ttrek_download_t *dl) {
+    if (dl->expected_sha256 != NULL && !dl->hash_in_sync) {
+        if (ttrek_DownloadHashFile(dl, dl->offset) != TCL_OK) {
+            ttrek_DownloadReset(dl);
+            EVP_DigestInit_ex(dl->hash_ctx, EVP_sha256(), NULL);
+            dl->hash_in_sync = 1;
+        }
+    }
+
+    if (dl->offset > 0) {
+        fprintf(stdout, "Resuming download from byte %" CURL_FORMAT_CURL_OFF_T " ...\n", dl->offset);
+        fflush(stdout);
+    }
+
+    CURL *curl_handle = ttrek_DownloadNewHandle(dl->url_ptr);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, ttrek_DownloadStreamCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) dl);
+    curl_off_t resume_from = dl->offset;
+    if (resume_from > 0) {
+        curl_easy_setopt(curl_handle, CURLOPT_RESUME_FROM_LARGE, resume_from);
+    }
 
     CURLcode ret = curl_easy_perform(curl_handle);
 
-    // Get a status code. We will use it to show a more detailed message,
-    // since the standard curl message is uninformative in this case:
-    //     HTTP response code said error
     long status_code = -1;
     curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &status_code);
+    curl_easy_cleanup(curl_handle);
 
-    if (Tcl_Close(interp, chan) != TCL_OK) {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while closing output"
-            " channel: %s[%d] - %s", Tcl_ErrnoId(), Tcl_GetErrno(),
-            Tcl_ErrnoMsg(Tcl_GetErrno())));
-        goto error;
+    // libcurl takes a 416 response to a resumed request as "the file is
+    // already complete" and returns CURLE_OK. Only a 206 response means
+    // that the part file really was continued, otherwise it could be
+    // anything, e.g. the preallocated file of an interrupted segmented
+    // download.
+    if (ret == CURLE_OK && resume_from > 0 && status_code != 0 && status_code != 206) {
+        ttrek_DownloadReset(dl);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not resume the download of \"%s\""
+            " (HTTP status code %ld)", Tcl_GetString(dl->url_ptr), status_code));
+        return TCL_ERROR;
     }
 
-    curl_easy_cleanup(curl_handle);
-
-    // Return TCL_OK if all is good
     if (ret == CURLE_OK) {
         return TCL_OK;
     }
 
-    // Produce an error message
+    // The server cannot continue from our offset: either it does not
+    // support ranges or the file has changed. The next attempt starts over.
+    if (ret == CURLE_RANGE_ERROR || (ret == CURLE_HTTP_RETURNED_ERROR && status_code == 416)) {
+        ttrek_DownloadReset(dl);
+    }
 
-    if (ret == CURLE_HTTP_RETURNED_ERROR) {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad HTTP status code (%ld)"
-            " while downloading \"%s\"", status_code, Tcl_GetString(url_ptr)));
+    ttrek_DownloadSetError(interp, dl->url_ptr, ret, status_code);
+    return TCL_ERROR;
+}
+
+static size_t ttrek_DownloadSegmentCallback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ttrek_download_segment_t *seg = (ttrek_download_segment_t *) userdata;
+    size_t len = size * nmemb;
+
+    // Make sure we got the range we asked for and not the whole file
+    long status_code = -1;
+    curl_easy_getinfo(seg->curl_handle, CURLINFO_RESPONSE_CODE, &status_code);
+    if (status_code != 206 || seg->pos + (curl_off_t) len > seg->end + 1) {
+        return 0;
+    }
+
+    if (ttrek_DownloadWriteAt(seg->dl->fd, ptr, len, seg->pos) != 0) {
+        return 0;
+    }
+    seg->pos += (curl_off_t) len;
+    return len;
+}
+
+static void ttrek_DownloadSplit(ttrek_download_t *dl) {
+    int n = dl->max_segments;
+    curl_off_t seg_size = dl->size / n;
+    for (int i = 0; i < n; i++) {
+        ttrek_download_segment_t *seg = &dl->segments[i];
+        seg->dl = dl;
+        seg->start = seg_size * i;
+        seg->end = (i == n - 1) ? dl->size - 1 : seg_size * (i + 1) - 1;
+        seg->pos = seg->start;
+        seg->curl_handle = NULL;
+    }
+    dl->num_segments = n;
+}
+
+// Downloads the unfinished segments of the file at the same time. Segments
+// that fail keep their progress, so the next attempt only downloads what
+// is missing.
+static int ttrek_DownloadSegments(Tcl_Interp *interp, ttrek_download_t *dl) {
+    if (dl->num_segments == 0) {
+        // The part file may be left by a previous run, and we don't know
+        // which of its segments are complete. Start over.
+        if (ftruncate(dl->fd, 0) != 0 || ftruncate(dl->fd, (off_t) dl->size) != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not allocate \"%s\": %s",
+                Tcl_GetString(dl->part_ptr), Tcl_ErrnoMsg(errno)));
+            return TCL_ERROR;
+        }
+        dl->hash_in_sync = 0;
+        ttrek_DownloadSplit(dl);
     } else {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while downloading"
-            " \"%s\": %s", Tcl_GetString(url_ptr), curl_easy_strerror(ret)));
+        fprintf(stdout, "Resuming segmented download ...\n");
+        fflush(stdout);
     }
 
-error:
-    Tcl_FSDeleteFile(file_ptr);
+    CURLM *multi_handle = curl_multi_init();
+
+    for (int i = 0; i < dl->num_segments; i++) {
+        ttrek_download_segment_t *seg = &dl->segments[i];
+        if (seg->pos > seg->end) {
+            continue;
+        }
+        char range[64];
+        snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T,
+                 seg->pos, seg->end);
+        seg->curl_handle = ttrek_DownloadNewHandle(dl->url_ptr);
+        curl_easy_setopt(seg->curl_handle, CURLOPT_RANGE, range);
+        curl_easy_setopt(seg->curl_handle, CURLOPT_WRITEFUNCTION, ttrek_DownloadSegmentCallback);
+        curl_easy_setopt(seg->curl_handle, CURLOPT_WRITEDATA, (void *) seg);
+        curl_easy_setopt(seg->curl_handle, CURLOPT_PRIVATE, (void *) seg);
+        curl_multi_add_handle(multi_handle, seg->curl_handle);
+    }
+
+    CURLMcode mc = CURLM_OK;
+    CURLcode first_error = CURLE_OK;
+    long first_error_status = -1;
+    int still_running = 0;
+    do {
+        mc = curl_multi_perform(multi_handle, &still_running);
+        if (mc == CURLM_OK && still_running) {
+            mc = curl_multi_poll(multi_handle, NULL, 0, 1000, NULL);
+        }
+        if (mc != CURLM_OK) {
+            break;
+        }
+
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(multi_handle, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            ttrek_download_segment_t *seg;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &seg);
+            if (msg->data.result != CURLE_OK && first_error == CURLE_OK) {
+                first_error = msg->data.result;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &first_error_status);
+            }
+            DBG2(printf("segment %" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T " done: %d",
+                        seg->start, seg->end, msg->data.result));
+        }
+    } while (still_running);
+
+    for (int i = 0; i < dl->num_segments; i++) {
+        ttrek_download_segment_t *seg = &dl->segments[i];
+        if (seg->curl_handle != NULL) {
+            curl_multi_remove_handle(multi_handle, seg->curl_handle);
+            curl_easy_cleanup(seg->curl_handle);
+            seg->curl_handle = NULL;
+        }
+        if (seg->pos <= seg->end && first_error == CURLE_OK && mc == CURLM_OK) {
+            // The server closed the connection without an error, but we
+            // don't have the whole segment.
+            first_error = CURLE_PARTIAL_FILE;
+        }
+    }
+    curl_multi_cleanup(multi_handle);
+
+    if (mc != CURLM_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while downloading \"%s\": %s",
+            Tcl_GetString(dl->url_ptr), curl_multi_strerror(mc)));
+        return TCL_ERROR;
+    }
+
+    if (first_error == CURLE_OK) {
+        return TCL_OK;
+    }
+
+    if (first_error == CURLE_HTTP_RETURNED_ERROR && first_error_status == 416) {
+        // The file on the server has changed since we asked for its size
+        dl->probed = 0;
+        ttrek_DownloadReset(dl);
+    }
+
+    ttrek_DownloadSetError(interp, dl->url_ptr, first_error, first_error_status);
     return TCL_ERROR;
+}
+
+static int ttrek_DownloadFile(Tcl_Interp *interp, ttrek_download_t *dl, Tcl_Obj *file_ptr) {
+
+    DBG2(printf("URL[%s] -> [%s]", Tcl_GetString(dl->url_ptr), Tcl_GetString(file_ptr)));
+
+    if (dl->fd < 0) {
+        dl->fd = open(Tcl_GetString(dl->part_ptr), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (dl->fd < 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to open output file"
+                " for writing: \"%s\" (%s[%d] - %s)", Tcl_GetString(dl->part_ptr),
+                Tcl_ErrnoId(), errno, Tcl_ErrnoMsg(errno)));
+            return TCL_ERROR;
+        }
+        // A part file left by a previous run is continued from its end
+        struct stat st;
+        dl->offset = (fstat(dl->fd, &st) == 0) ? (curl_off_t) st.st_size : 0;
+        dl->hash_in_sync = 0;
+    }
+
+    if (!dl->probed && dl->max_segments > 1) {
+        ttrek_DownloadProbe(dl);
+    }
+
+    // A part file that is not smaller than the file on the server has
+    // nothing to continue
+    if (dl->num_segments == 0 && dl->size > 0 && dl->offset >= dl->size) {
+        ttrek_DownloadReset(dl);
+    }
+
+    int rc;
+    curl_off_t size;
+    if (dl->max_segments > 1 && dl->accept_ranges && dl->size >= TTREK_DOWNLOAD_SEGMENT_MIN_SIZE) {
+        rc = ttrek_DownloadSegments(interp, dl);
+        size = dl->size;
+    } else {
+        rc = ttrek_DownloadStream(interp, dl);
+        size = dl->offset;
+    }
+
+    if (rc != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (ttrek_DownloadCheckHash(interp, dl, size) != TCL_OK) {
+        // The data is bad, the next attempt has to start over
+        dl->probed = 0;
+        ttrek_DownloadReset(dl);
+        return TCL_ERROR;
+    }
+
+    if (close(dl->fd) != 0) {
+        dl->fd = -1;
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while closing output"
+            " file: %s[%d] - %s", Tcl_ErrnoId(), errno, Tcl_ErrnoMsg(errno)));
+        return TCL_ERROR;
+    }
+    dl->fd = -1;
+
+    if (Tcl_FSRenameFile(dl->part_ptr, file_ptr) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not rename \"%s\" to \"%s\": %s",
+            Tcl_GetString(dl->part_ptr), Tcl_GetString(file_ptr), Tcl_ErrnoMsg(Tcl_GetErrno())));
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
 
 }
 
+static void ttrek_DownloadInit(ttrek_download_t *dl, Tcl_Obj *url_ptr, Tcl_Obj *file_ptr,
+                               const char *expected_sha256, int max_segments) {
+    memset(dl, 0, sizeof(*dl));
+    dl->url_ptr = url_ptr;
+    Tcl_IncrRefCount(dl->url_ptr);
+    dl->part_ptr = Tcl_ObjPrintf("%s%s", Tcl_GetString(file_ptr), TTREK_DOWNLOAD_PART_EXT);
+    Tcl_IncrRefCount(dl->part_ptr);
+    dl->fd = -1;
+    dl->expected_sha256 = expected_sha256;
+    dl->hash_ctx = EVP_MD_CTX_new();
+    dl->max_segments = max_segments;
+}
+
+static void ttrek_DownloadFree(ttrek_download_t *dl, int remove_part) {
+    if (dl->fd >= 0) {
+        close(dl->fd);
+    }
+    if (remove_part) {
+        Tcl_FSDeleteFile(dl->part_ptr);
+    }
+    EVP_MD_CTX_free(dl->hash_ctx);
+    Tcl_DecrRefCount(dl->part_ptr);
+    Tcl_DecrRefCount(dl->url_ptr);
+}
+
+// Switches the download to another source. Without a checksum we can't
+// tell whether the sources serve the same bytes, so the data from the
+// previous source is dropped.
+static void ttrek_DownloadSetUrl(ttrek_download_t *dl, Tcl_Obj *url_ptr) {
+    if (strcmp(Tcl_GetString(dl->url_ptr), Tcl_GetString(url_ptr)) == 0) {
+        return;
+    }
+    Tcl_DecrRefCount(dl->url_ptr);
+    dl->url_ptr = url_ptr;
+    Tcl_IncrRefCount(dl->url_ptr);
+    dl->probed = 0;
+    // The segments are made for the size reported by the previous source
+    dl->num_segments = 0;
+    if (dl->expected_sha256 == NULL) {
+        ttrek_DownloadReset(dl);
+    }
+}
+
+static Tcl_WideInt ttrek_DownloadNow(void) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt) now.sec * 1000 + now.usec / 1000;
+}
+
+static Tcl_Obj *ttrek_DownloadGetHost(Tcl_Obj *url_ptr) {
+    Tcl_Obj *host_ptr = NULL;
+    CURLU *url_handle = curl_url();
+    char *host;
+    if (curl_url_set(url_handle, CURLUPART_URL, Tcl_GetString(url_ptr), 0) == CURLUE_OK
+        && curl_url_get(url_handle, CURLUPART_HOST, &host, 0) == CURLUE_OK) {
+        host_ptr = Tcl_NewStringObj(host, -1);
+        curl_free(host);
+        // Different ports on the same host are usually different servers
+        char *port;
+        if (curl_url_get(url_handle, CURLUPART_PORT, &port, 0) == CURLUE_OK) {
+            Tcl_AppendPrintfToObj(host_ptr, ":%s", port);
+            curl_free(port);
+        }
+    } else {
+        host_ptr = Tcl_NewStringObj(Tcl_GetString(url_ptr), -1);
+    }
+    curl_url_cleanup(url_handle);
+    Tcl_IncrRefCount(host_ptr);
+    return host_ptr;
+}
+
+static void ttrek_DownloadAddSource(ttrek_download_source_t *sources, int *num_sources_ptr, Tcl_Obj *url_ptr,
+                                    cJSON *history_root) {
+    if (*num_sources_ptr >= TTREK_DOWNLOAD_MAX_SOURCES) {
+        Tcl_BounceRefCount(url_ptr);
+        return;
+    }
+    ttrek_download_source_t *source = &sources[(*num_sources_ptr)++];
+    memset(source, 0, sizeof(*source));
+    source->order = *num_sources_ptr;
+    source->url_ptr = url_ptr;
+    Tcl_IncrRefCount(source->url_ptr);
+    source->host_ptr = ttrek_DownloadGetHost(url_ptr);
+    source->score = ttrek_HostHistoryGetScore(history_root, Tcl_GetString(source->host_ptr));
+    DBG2(printf("source: %s score: %f", Tcl_GetString(url_ptr), source->score));
+}
+
+// The sources are the upstream URL, the local mirrors from the
+// TTREK_DOWNLOAD_MIRRORS environment variable and the ttrek mirror. The
+// mirrors keep the files by the SHA-256 of the upstream URL.
+static int ttrek_DownloadGetSources(Tcl_Obj *url_ptr, cJSON *history_root, ttrek_download_source_t *sources) {
+    int num_sources = 0;
+
+    ttrek_DownloadAddSource(sources, &num_sources, url_ptr, history_root);
+
+    Tcl_Obj *url_hash_ptr = ttrek_GetHashSHA256(url_ptr);
+    Tcl_IncrRefCount(url_hash_ptr);
+
+    const char *mirrors = getenv(TTREK_DOWNLOAD_MIRRORS_ENV);
+    if (mirrors != NULL) {
+        Tcl_Obj *mirrors_ptr = Tcl_NewStringObj(mirrors, -1);
+        Tcl_IncrRefCount(mirrors_ptr);
+        Tcl_Size mirror_count;
+        Tcl_Obj **mirror_objv;
+        if (Tcl_ListObjGetElements(NULL, mirrors_ptr, &mirror_count, &mirror_objv) == TCL_OK) {
+            for (Tcl_Size i = 0; i < mirror_count; i++) {
+                ttrek_DownloadAddSource(sources, &num_sources, Tcl_ObjPrintf("%s/%s.archive",
+                    Tcl_GetString(mirror_objv[i]), Tcl_GetString(url_hash_ptr)), history_root);
+            }
+        }
+        Tcl_DecrRefCount(mirrors_ptr);
+    }
+
+    ttrek_DownloadAddSource(sources, &num_sources, Tcl_ObjPrintf("%s/%s.archive", DOWNLOAD_URL,
+        Tcl_GetString(url_hash_ptr)), history_root);
+
+    Tcl_DecrRefCount(url_hash_ptr);
+    return num_sources;
+}
+
+static void ttrek_DownloadFreeSources(ttrek_download_source_t *sources, int num_sources) {
+    for (int i = 0; i < num_sources; i++) {
+        Tcl_DecrRefCount(sources[i].url_ptr);
+        Tcl_DecrRefCount(sources[i].host_ptr);
+    }
+}
+
+static int ttrek_DownloadCompareSources(const void *a, const void *b) {
+    const ttrek_download_source_t *source_a = *(ttrek_download_source_t * const *) a;
+    const ttrek_download_source_t *source_b = *(ttrek_download_source_t * const *) b;
+    if (source_a->score != source_b->score) {
+        return source_a->score < source_b->score ? -1 : 1;
+    }
+    return source_a->order - source_b->order;
+}
+
+static size_t ttrek_DownloadRaceCallback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
+    UNUSED(ptr);
+    ttrek_download_source_t *source = (ttrek_download_source_t *) userdata;
+    if (size * nmemb > 0) {
+        source->has_first_byte = 1;
+    }
+    // The answer to "0-0" is a single byte, let the transfer finish so that
+    // the connection can be reused by the download. A server that ignores
+    // the range sends the whole file, stop the transfer then.
+    long status_code = 0;
+    curl_easy_getinfo(source->curl_handle, CURLINFO_RESPONSE_CODE, &status_code);
+    if (status_code != 206) {
+        return 0;
+    }
+    return size * nmemb;
+}
+
+// Asks the sources for the first byte of the file, the best sources by
+// their history first. The next source joins the race when the previous
+// ones have not answered in TTREK_DOWNLOAD_RACE_DELAY ms, up to
+// TTREK_DOWNLOAD_RACE_SIZE sources. When all the started sources have
+// failed, the next one is started until no sources are left. The first
+// source to answer wins.
+// Returns the winner or NULL if no source has answered.
+static ttrek_download_source_t *ttrek_DownloadRace(ttrek_download_source_t *sources, int num_sources,
+                                                   cJSON *history_root) {
+
+    ttrek_download_source_t *ordered[TTREK_DOWNLOAD_MAX_SOURCES];
+    for (int i = 0; i < num_sources; i++) {
+        ordered[i] = &sources[i];
+        sources[i].score = ttrek_HostHistoryGetScore(history_root, Tcl_GetString(sources[i].host_ptr));
+    }
+    qsort(ordered, (size_t) num_sources, sizeof(ordered[0]), ttrek_DownloadCompareSources);
+
+    int race_size = num_sources < TTREK_DOWNLOAD_RACE_SIZE ? num_sources : TTREK_DOWNLOAD_RACE_SIZE;
+
+    CURLM *multi_handle = curl_multi_init();
+    ttrek_download_source_t *winner = NULL;
+    int num_started = 0;
+    int num_running = 0;
+    Tcl_WideInt start_time = ttrek_DownloadNow();
+    Tcl_WideInt next_start_time = start_time;
+
+    while (winner == NULL) {
+
+        Tcl_WideInt now = ttrek_DownloadNow();
+
+        if ((num_started < race_size && now >= next_start_time)
+            || (num_started < num_sources && num_running == 0)) {
+            ttrek_download_source_t *source = ordered[num_started++];
+            DBG2(printf("start racing: %s", Tcl_GetString(source->url_ptr)));
+            source->curl_handle = ttrek_DownloadNewHandle(source->url_ptr);
+            source->has_first_byte = 0;
+            source->start_time = now;
+            curl_easy_setopt(source->curl_handle, CURLOPT_RANGE, "0-0");
+            curl_easy_setopt(source->curl_handle, CURLOPT_WRITEFUNCTION, ttrek_DownloadRaceCallback);
+            curl_easy_setopt(source->curl_handle, CURLOPT_WRITEDATA, (void *) source);
+            curl_easy_setopt(source->curl_handle, CURLOPT_PRIVATE, (void *) source);
+            curl_easy_setopt(source->curl_handle, CURLOPT_TIMEOUT_MS, (long) TTREK_DOWNLOAD_RACE_TIMEOUT);
+            curl_multi_add_handle(multi_handle, source->curl_handle);
+            num_running++;
+            next_start_time = now + TTREK_DOWNLOAD_RACE_DELAY;
+        }
+
+        if (num_running == 0) {
+            break;
+        }
+
+        int still_running;
+        if (curl_multi_perform(multi_handle, &still_running) != CURLM_OK) {
+            break;
+        }
+
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(multi_handle, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            ttrek_download_source_t *source;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &source);
+            num_running--;
+            // The transfer is stopped by us when the server ignores the
+            // range, an empty file is fine too.
+            if (source->has_first_byte || msg->data.result == CURLE_OK) {
+                double latency = (double) (ttrek_DownloadNow() - source->start_time);
+                DBG2(printf("won: %s in %f ms", Tcl_GetString(source->url_ptr), latency));
+                ttrek_HostHistoryAddSuccess(history_root, Tcl_GetString(source->host_ptr), latency);
+                if (winner == NULL) {
+                    winner = source;
+                }
+            } else {
+                DBG2(printf("failed: %s: %s", Tcl_GetString(source->url_ptr),
+                            curl_easy_strerror(msg->data.result)));
+                ttrek_HostHistoryAddFailure(history_root, Tcl_GetString(source->host_ptr));
+            }
+        }
+
+        if (winner == NULL && num_running > 0) {
+            long timeout = 1000;
+            if (num_started < race_size) {
+                Tcl_WideInt wait = next_start_time - ttrek_DownloadNow();
+                timeout = wait < 0 ? 0 : (long) wait;
+            }
+            curl_multi_poll(multi_handle, NULL, 0, (int) timeout, NULL);
+        }
+
+    }
+
+    // Stop the sources that are still racing
+    for (int i = 0; i < num_started; i++) {
+        curl_multi_remove_handle(multi_handle, ordered[i]->curl_handle);
+        curl_easy_cleanup(ordered[i]->curl_handle);
+        ordered[i]->curl_handle = NULL;
+    }
+    curl_multi_cleanup(multi_handle);
+
+    return winner;
+
+}
+
+// Full jitter: a random delay between zero and the exponentially growing
+// limit, so that the clients that failed at the same time don't come back
+// at the same time.
+static void ttrek_DownloadBackoff(int attempt) {
+    long limit = TTREK_DOWNLOAD_BACKOFF_BASE;
+    for (int i = 1; i < attempt && limit < TTREK_DOWNLOAD_BACKOFF_MAX; i++) {
+        limit *= 2;
+    }
+    if (limit > TTREK_DOWNLOAD_BACKOFF_MAX) {
+        limit = TTREK_DOWNLOAD_BACKOFF_MAX;
+    }
+    long delay = (long) ((double) rand() / RAND_MAX * (double) limit);
+    fprintf(stdout, "Waiting %.1fs before the next attempt ...\n", (double) delay / 1000);
+    fflush(stdout);
+    Tcl_Sleep((int) delay);
+}
+
 int ttrek_DownloadSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
 
+    const char *option_sha256 = NULL;
+    int option_segments = TTREK_DOWNLOAD_DEFAULT_SEGMENTS;
+    Tcl_ArgvInfo ArgTable[] = {
+            {TCL_ARGV_STRING,   "-sha256",   NULL,       &option_sha256,   "expected SHA-256 hash of the file",                  NULL},
+            {TCL_ARGV_INT,      "-segments", NULL,       &option_segments, "number of parts to download large files in at once", NULL},
+            {TCL_ARGV_END,      NULL,        NULL,       NULL,             NULL,                                                 NULL}
+    };
+
+    Tcl_Obj **remObjv;
+    if (TCL_OK != Tcl_ParseArgsObjv(interp, ArgTable, &objc, objv, &remObjv)) {
+        return TCL_ERROR;
+    }
+
     if (objc != 3) {
+        ckfree(remObjv);
         SetResult("not enough arguments");
         return TCL_ERROR;
     }
 
-    Tcl_Obj *url_ptr = objv[1];
-    Tcl_Obj *file_ptr = objv[2];
+    if (option_segments < 1 || option_segments > TTREK_DOWNLOAD_MAX_SEGMENTS) {
+        ckfree(remObjv);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("the number of segments must be between 1 and %d",
+            TTREK_DOWNLOAD_MAX_SEGMENTS));
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *url_ptr = remObjv[1];
+    Tcl_Obj *file_ptr = remObjv[2];
+    Tcl_IncrRefCount(url_ptr);
+    Tcl_IncrRefCount(file_ptr);
+    ckfree(remObjv);
+
+    srand((unsigned int) (time(NULL) ^ getpid()));
+
+    cJSON *history_root;
+    if (TCL_OK != ttrek_HostHistoryLoad(interp, &history_root)) {
+        history_root = cJSON_CreateObject();
+    }
+
+    ttrek_download_source_t sources[TTREK_DOWNLOAD_MAX_SOURCES];
+    int num_sources = ttrek_DownloadGetSources(url_ptr, history_root, sources);
+
+    ttrek_download_t dl;
+    ttrek_DownloadInit(&dl, url_ptr, file_ptr, option_sha256, option_segments);
 
     int retry_current = 0;
     // Maximum number of retries
     int retry_count = TTREK_DOWNLOAD_DEFAULT_RETRY_COUNT;
-    int rc = TCL_OK;
+    int rc = TCL_ERROR;
 
     while(1) {
 
         if (++retry_current != 1) {
+            ttrek_DownloadBackoff(retry_current - 1);
             fprintf(stdout, "Attempt %d of %d to download file: %s ...\n", retry_current,
                 retry_count, Tcl_GetString(url_ptr));
             fflush(stdout);
         }
 
-        rc = ttrek_DownloadFile(interp, url_ptr, file_ptr);
+        ttrek_download_source_t *source = ttrek_DownloadRace(sources, num_sources, history_root);
+
+        if (source == NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("none of the %d sources of \"%s\" answered",
+                num_sources, Tcl_GetString(url_ptr)));
+        } else {
+
+            if (source != &sources[0]) {
+                fprintf(stdout, "Downloading from %s ...\n", Tcl_GetString(source->url_ptr));
+                fflush(stdout);
+            }
+
+            // The part file is kept between the attempts, so each attempt
+            // continues where the previous one stopped.
+            ttrek_DownloadSetUrl(&dl, source->url_ptr);
+            rc = ttrek_DownloadFile(interp, &dl, file_ptr);
+
+            // If we successfully downloaded the file, then we don't need
+            // to do anything else.
+            if (rc == TCL_OK) {
+                Tcl_ResetResult(interp);
+                break;
+            }
+
+            ttrek_HostHistoryAddFailure(history_root, Tcl_GetString(source->host_ptr));
 
-        // If we successfully downloaded the file, then return TCL_OK. In this
-        // case, we don't need to do anything else.
-        if (rc == TCL_OK) {
-            return TCL_OK;
         }
 
-        // If the number of attempts is exhausted, then exit from the loop
-        // to try a fallback URL.
+        // If the number of attempts is exhausted, then we can't do
+        // anything else.
         if (retry_current >= retry_count) {
             break;
         }
@@ -115,23 +866,15 @@ int ttrek_DownloadSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[
 
     };
 
-    // Try using a fallback URL
-    Tcl_Obj *url_hash_ptr = ttrek_GetHashSHA256(url_ptr);
-
-    Tcl_Obj *url_fallback_ptr = Tcl_ObjPrintf("%s/%s.archive", DOWNLOAD_URL,
-        Tcl_GetString(url_hash_ptr));
-
-    Tcl_BounceRefCount(url_hash_ptr);
-
-    fprintf(stdout, "Attempt to use a fallback URL to download the file ...\n");
-    fflush(stdout);
-
-    rc = ttrek_DownloadFile(interp, url_fallback_ptr, file_ptr);
+    ttrek_DownloadFree(&dl, rc != TCL_OK);
+    ttrek_DownloadFreeSources(sources, num_sources);
 
-    Tcl_BounceRefCount(url_fallback_ptr);
+    // The history is only a hint, it is fine if we can't save it
+    ttrek_HostHistorySave(interp, history_root);
+    cJSON_Delete(history_root);
 
-    // Return what we got from the fallback URL. If there is an error there,
-    // we can't do anything else.
+    Tcl_DecrRefCount(url_ptr);
+    Tcl_DecrRefCount(file_ptr);
 
     return rc;
 
@@ -0,0 +1,458 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "subCmdDecls.h"
+#include "ttrek_unpack.h"
+#include "registry.h"
+#include <curl/curl.h>
+#include <openssl/evp.h>
+#include <archive.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TTREK_FETCH_PART_EXT ".part"
+// How long to wait for the network in one go when libarchive needs more data
+#define TTREK_FETCH_POLL_TIMEOUT 1000
+
+// The archive is extracted while it is being downloaded. libarchive pulls
+// the data through the read callback, which runs the transfer until curl
+// has delivered the next chunk. Nothing is written to disk except the
+// extracted files and, if requested, a copy of the archive.
+typedef struct {
+    Tcl_Obj *url_ptr;
+    CURLM *multi_handle;
+    CURL *curl_handle;
+    // Set when the transfer is over, result is its outcome
+    int done;
+    CURLcode result;
+    long status_code;
+    // Bytes from curl that libarchive has not seen yet
+    char *buf;
+    size_t buf_len;
+    size_t buf_size;
+    // Bytes returned by the last read, they must stay valid until the
+    // next read
+    char *lent;
+    size_t lent_size;
+    // The copy of the archive, when it is kept
+    int keep_fd;
+    EVP_MD_CTX *hash_ctx;
+    // The size of the archive, for the build history
+    curl_off_t num_bytes;
+} ttrek_fetch_t;
+
+static int ttrek_FetchWriteAll(int fd, const char *ptr, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, ptr, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static size_t ttrek_FetchWriteCallback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ttrek_fetch_t *f = (ttrek_fetch_t *) userdata;
+    size_t len = size * nmemb;
+    if (f->buf_len + len > f->buf_size) {
+        f->buf_size = (f->buf_len + len) * 2;
+        f->buf = Tcl_Realloc(f->buf, f->buf_size);
+    }
+    memcpy(f->buf + f->buf_len, ptr, len);
+    f->buf_len += len;
+    f->num_bytes += (curl_off_t) len;
+    if (f->keep_fd >= 0 && ttrek_FetchWriteAll(f->keep_fd, ptr, len) != 0) {
+        return 0;
+    }
+    if (f->hash_ctx != NULL) {
+        EVP_DigestUpdate(f->hash_ctx, ptr, len);
+    }
+    return len;
+}
+
+// Runs the transfer until curl has delivered more data or the transfer
+// is over.
+static void ttrek_FetchPump(ttrek_fetch_t *f) {
+    while (f->buf_len == 0 && !f->done) {
+
+        int running;
+        if (curl_multi_perform(f->multi_handle, &running) != CURLM_OK) {
+            f->result = CURLE_RECV_ERROR;
+            f->done = 1;
+            break;
+        }
+
+        if (running == 0) {
+            CURLMsg *msg;
+            int msgs_left;
+            f->result = CURLE_RECV_ERROR;
+            while ((msg = curl_multi_info_read(f->multi_handle, &msgs_left)) != NULL) {
+                if (msg->msg == CURLMSG_DONE) {
+                    f->result = msg->data.result;
+                }
+            }
+            curl_easy_getinfo(f->curl_handle, CURLINFO_RESPONSE_CODE, &f->status_code);
+            f->done = 1;
+            break;
+        }
+
+        if (f->buf_len == 0) {
+            curl_multi_poll(f->multi_handle, NULL, 0, TTREK_FETCH_POLL_TIMEOUT, NULL);
+        }
+
+    }
+}
+
+static la_ssize_t ttrek_FetchReadCallback(struct archive *a, void *client_data, const void **buff) {
+    ttrek_fetch_t *f = (ttrek_fetch_t *) client_data;
+
+    ttrek_FetchPump(f);
+
+    if (f->buf_len == 0) {
+        if (f->result != CURLE_OK) {
+            archive_set_error(a, EIO, "download failed: %s", curl_easy_strerror(f->result));
+            return -1;
+        }
+        // The end of the archive
+        return 0;
+    }
+
+    // Hand the received bytes to libarchive and let curl fill the
+    // buffer that libarchive is done with.
+    char *tmp = f->lent;
+    size_t tmp_size = f->lent_size;
+    f->lent = f->buf;
+    f->lent_size = f->buf_size;
+    f->buf = tmp;
+    f->buf_size = tmp_size;
+
+    la_ssize_t len = (la_ssize_t) f->buf_len;
+    f->buf_len = 0;
+    *buff = f->lent;
+    return len;
+}
+
+static void ttrek_FetchInit(ttrek_fetch_t *f, Tcl_Obj *url_ptr) {
+    memset(f, 0, sizeof(*f));
+    f->url_ptr = url_ptr;
+    f->keep_fd = -1;
+
+    f->curl_handle = curl_easy_init();
+    curl_easy_setopt(f->curl_handle, CURLOPT_URL, Tcl_GetString(url_ptr));
+    curl_easy_setopt(f->curl_handle, CURLOPT_SHARE, ttrek_RegistryGetShare());
+    // Follow redirects
+    curl_easy_setopt(f->curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(f->curl_handle, CURLOPT_FAILONERROR, 1L);
+    // Give up on a stalled connection, the fallback download will retry
+    curl_easy_setopt(f->curl_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(f->curl_handle, CURLOPT_LOW_SPEED_TIME, 60L);
+    curl_easy_setopt(f->curl_handle, CURLOPT_WRITEFUNCTION, ttrek_FetchWriteCallback);
+    curl_easy_setopt(f->curl_handle, CURLOPT_WRITEDATA, (void *) f);
+
+    f->multi_handle = curl_multi_init();
+    curl_multi_add_handle(f->multi_handle, f->curl_handle);
+}
+
+static void ttrek_FetchFree(ttrek_fetch_t *f) {
+    curl_multi_remove_handle(f->multi_handle, f->curl_handle);
+    curl_easy_cleanup(f->curl_handle);
+    curl_multi_cleanup(f->multi_handle);
+    if (f->keep_fd >= 0) {
+        close(f->keep_fd);
+    }
+    if (f->hash_ctx != NULL) {
+        EVP_MD_CTX_free(f->hash_ctx);
+    }
+    if (f->buf != NULL) {
+        Tcl_Free(f->buf);
+    }
+    if (f->lent != NULL) {
+        Tcl_Free(f->lent);
+    }
+}
+
+static int ttrek_FetchCheckHash(Tcl_Interp *interp, ttrek_fetch_t *f, const char *expected_sha256) {
+    unsigned char hash_bin[EVP_MAX_MD_SIZE];
+    unsigned int hash_len;
+    EVP_DigestFinal_ex(f->hash_ctx, hash_bin, &hash_len);
+
+    char hash_hex[EVP_MAX_MD_SIZE * 2 + 1];
+    for (unsigned int i = 0; i < hash_len; i++) {
+        snprintf(&hash_hex[i * 2], 3, "%02x", hash_bin[i]);
+    }
+
+    if (strcasecmp(hash_hex, expected_sha256) != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("checksum mismatch for \"%s\": expected %s, got %s",
+            Tcl_GetString(f->url_ptr), expected_sha256, hash_hex));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// Downloads and extracts the archive in one pass. Sets is_transfer_failed
+// when the download itself went wrong, as opposed to a broken archive,
+// so that the caller knows the download is worth another try. Sets
+// size_ptr to the size of the archive.
+static int ttrek_FetchUnpack(Tcl_Interp *interp, Tcl_Obj *url_ptr, Tcl_Obj *part_ptr, Tcl_Obj *output_dir_ptr,
+                             const char *expected_sha256, int *is_transfer_failed, curl_off_t *size_ptr) {
+
+    *is_transfer_failed = 0;
+    *size_ptr = 0;
+
+    ttrek_fetch_t f;
+    ttrek_FetchInit(&f, url_ptr);
+
+    if (part_ptr != NULL) {
+        f.keep_fd = open(Tcl_GetString(part_ptr), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (f.keep_fd < 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to open output file"
+                " for writing: \"%s\" (%s[%d] - %s)", Tcl_GetString(part_ptr),
+                Tcl_ErrnoId(), errno, Tcl_ErrnoMsg(errno)));
+            ttrek_FetchFree(&f);
+            return TCL_ERROR;
+        }
+    }
+
+    if (expected_sha256 != NULL) {
+        f.hash_ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(f.hash_ctx, EVP_sha256(), NULL);
+    }
+
+    int rc = TCL_ERROR;
+
+    struct archive *a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+
+    if (archive_read_open(a, (void *) &f, NULL, ttrek_FetchReadCallback, NULL) != ARCHIVE_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to open archive \"%s\":"
+            " %s", Tcl_GetString(url_ptr), archive_error_string(a)));
+    } else if (ttrek_UnpackArchive(interp, a, url_ptr, output_dir_ptr) == TCL_OK) {
+        rc = TCL_OK;
+    }
+
+    archive_read_free(a);
+
+    // The archive may be followed by padding that libarchive doesn't
+    // read. It is still a part of the file for the copy and the checksum.
+    if (rc == TCL_OK) {
+        while (!f.done) {
+            f.buf_len = 0;
+            ttrek_FetchPump(&f);
+        }
+    }
+
+    if (f.done && f.result != CURLE_OK) {
+        // The standard curl message is uninformative for HTTP errors, so
+        // we show the status code instead.
+        if (f.result == CURLE_HTTP_RETURNED_ERROR) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad HTTP status code (%ld)"
+                " while downloading \"%s\"", f.status_code, Tcl_GetString(url_ptr)));
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while downloading"
+                " \"%s\": %s", Tcl_GetString(url_ptr), curl_easy_strerror(f.result)));
+        }
+        *is_transfer_failed = 1;
+        rc = TCL_ERROR;
+    } else if (rc == TCL_OK && expected_sha256 != NULL) {
+        // The files are already extracted at this point. They are
+        // removed before the fallback, see ttrek_FetchUnpackSubCmd().
+        if (ttrek_FetchCheckHash(interp, &f, expected_sha256) != TCL_OK) {
+            // The copy is bad too, the fallback download has to start over
+            if (f.keep_fd >= 0 && ftruncate(f.keep_fd, 0) != 0) {
+                DBG2(printf("could not truncate the part file"));
+            }
+            *is_transfer_failed = 1;
+            rc = TCL_ERROR;
+        }
+    }
+
+    if (rc == TCL_OK && f.keep_fd >= 0) {
+        int fd = f.keep_fd;
+        f.keep_fd = -1;
+        if (close(fd) != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while closing output"
+                " file: %s[%d] - %s", Tcl_ErrnoId(), errno, Tcl_ErrnoMsg(errno)));
+            rc = TCL_ERROR;
+        }
+    }
+
+    *size_ptr = f.num_bytes;
+    ttrek_FetchFree(&f);
+    return rc;
+
+}
+
+// Appends the size of the archive to the timing file of the install
+// script, see stage_time() in install_common_static.sh. This is only
+// a hint for the build time estimates, failures are ignored.
+static void ttrek_FetchRecordSize(const char *timing_file, curl_off_t size) {
+    int fd = open(timing_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        DBG2(printf("could not open %s: %s", timing_file, strerror(errno)));
+        return;
+    }
+    char line[64];
+    int len = snprintf(line, sizeof(line), "size 1 %" CURL_FORMAT_CURL_OFF_T "\n", size);
+    if (ttrek_FetchWriteAll(fd, line, (size_t) len) != 0) {
+        DBG2(printf("could not write %s: %s", timing_file, strerror(errno)));
+    }
+    close(fd);
+}
+
+int ttrek_FetchUnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+
+    const char *option_sha256 = NULL;
+    int option_keep = 0;
+    const char *option_timing = NULL;
+    Tcl_ArgvInfo ArgTable[] = {
+            {TCL_ARGV_STRING,   "-sha256", NULL,       &option_sha256, "expected SHA-256 hash of the archive",      NULL},
+            {TCL_ARGV_CONSTANT, "-keep",   INT2PTR(1), &option_keep,   "keep a copy of the archive",                NULL},
+            {TCL_ARGV_STRING,   "-timing", NULL,       &option_timing, "build timing file to record the size in",   NULL},
+            {TCL_ARGV_END,      NULL,      NULL,       NULL,           NULL,                                        NULL}
+    };
+
+    Tcl_Obj **remObjv;
+    if (TCL_OK != Tcl_ParseArgsObjv(interp, ArgTable, &objc, objv, &remObjv)) {
+        return TCL_ERROR;
+    }
+
+    if (objc != 4) {
+        ckfree(remObjv);
+        SetResult("not enough arguments");
+        return TCL_ERROR;
+    }
+
+    // The archive file is where the copy of the archive goes with -keep.
+    // Otherwise, it is only used when we fall back to a separate download.
+    Tcl_Obj *url_ptr = remObjv[1];
+    Tcl_Obj *file_ptr = remObjv[2];
+    Tcl_Obj *output_dir_ptr = remObjv[3];
+    Tcl_IncrRefCount(url_ptr);
+    Tcl_IncrRefCount(file_ptr);
+    Tcl_IncrRefCount(output_dir_ptr);
+    ckfree(remObjv);
+
+    Tcl_Obj *part_ptr = NULL;
+    if (option_keep) {
+        // The same part file as the download subcommand uses, so that
+        // the fallback download continues where the stream stopped.
+        part_ptr = Tcl_ObjPrintf("%s%s", Tcl_GetString(file_ptr), TTREK_FETCH_PART_EXT);
+        Tcl_IncrRefCount(part_ptr);
+    }
+
+    int is_transfer_failed;
+    curl_off_t size;
+    int rc = ttrek_FetchUnpack(interp, url_ptr, part_ptr, output_dir_ptr, option_sha256,
+                               &is_transfer_failed, &size);
+
+    if (rc == TCL_OK) {
+
+        if (part_ptr != NULL && Tcl_FSRenameFile(part_ptr, file_ptr) != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not rename \"%s\" to \"%s\": %s",
+                Tcl_GetString(part_ptr), Tcl_GetString(file_ptr), Tcl_ErrnoMsg(Tcl_GetErrno())));
+            rc = TCL_ERROR;
+        }
+
+    } else if (is_transfer_failed) {
+
+        // The download subcommand knows how to resume, retry and use
+        // mirrors. Let it fetch the archive and unpack it from the file.
+        fprintf(stderr, "WARNING: streaming download failed with: %s\n", Tcl_GetStringResult(interp));
+        fprintf(stderr, "WARNING: falling back to a separate download and unpack\n");
+        fflush(stderr);
+        Tcl_ResetResult(interp);
+        // The size of the archive is known again once it is downloaded
+        size = 0;
+
+        // Whatever was extracted from the stream is unverified, and the
+        // fallback may get a different archive from a mirror. Don't let
+        // any of these files stay in the output directory.
+        Tcl_Obj *error_ptr = NULL;
+        if (TCL_OK != Tcl_FSRemoveDirectory(output_dir_ptr, 1, &error_ptr)) {
+            int error_code = Tcl_GetErrno();
+            if (error_ptr != NULL) {
+                Tcl_DecrRefCount(error_ptr);
+            }
+            if (error_code != ENOENT) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not clean up \"%s\": %s",
+                    Tcl_GetString(output_dir_ptr), Tcl_ErrnoMsg(error_code)));
+                rc = TCL_ERROR;
+                goto done;
+            }
+        }
+        if (TCL_OK != Tcl_FSCreateDirectory(output_dir_ptr)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not create directory \"%s\": %s",
+                Tcl_GetString(output_dir_ptr), Tcl_ErrnoMsg(Tcl_GetErrno())));
+            rc = TCL_ERROR;
+            goto done;
+        }
+
+        Tcl_Obj *download_objv[5];
+        Tcl_Size download_objc = 0;
+        download_objv[download_objc++] = Tcl_NewStringObj("download", -1);
+        if (option_sha256 != NULL) {
+            download_objv[download_objc++] = Tcl_NewStringObj("-sha256", -1);
+            download_objv[download_objc++] = Tcl_NewStringObj(option_sha256, -1);
+        }
+        download_objv[download_objc++] = url_ptr;
+        download_objv[download_objc++] = file_ptr;
+        for (Tcl_Size i = 0; i < download_objc; i++) {
+            Tcl_IncrRefCount(download_objv[i]);
+        }
+
+        rc = ttrek_DownloadSubCmd(interp, download_objc, download_objv);
+
+        for (Tcl_Size i = 0; i < download_objc; i++) {
+            Tcl_DecrRefCount(download_objv[i]);
+        }
+
+        if (rc == TCL_OK) {
+            Tcl_StatBuf *stat_ptr = Tcl_AllocStatBuf();
+            if (Tcl_FSStat(file_ptr, stat_ptr) == 0) {
+                size = (curl_off_t) Tcl_GetSizeFromStat(stat_ptr);
+            }
+            Tcl_Free((char *) stat_ptr);
+
+            Tcl_Obj *unpack_objv[3] = { Tcl_NewStringObj("unpack", -1), file_ptr, output_dir_ptr };
+            Tcl_IncrRefCount(unpack_objv[0]);
+            rc = ttrek_UnpackSubCmd(interp, 3, unpack_objv);
+            Tcl_DecrRefCount(unpack_objv[0]);
+            if (!option_keep) {
+                Tcl_FSDeleteFile(file_ptr);
+            }
+        }
+
+    } else if (part_ptr != NULL) {
+
+        // The archive is broken, there is nothing to continue
+        Tcl_FSDeleteFile(part_ptr);
+
+    }
+
+    if (rc == TCL_OK && option_timing != NULL && size > 0) {
+        ttrek_FetchRecordSize(option_timing, size);
+    }
+
+done:
+    if (part_ptr != NULL) {
+        Tcl_DecrRefCount(part_ptr);
+    }
+    Tcl_DecrRefCount(url_ptr);
+    Tcl_DecrRefCount(file_ptr);
+    Tcl_DecrRefCount(output_dir_ptr);
+
+    return rc;
+
+}
@@ -5,80 +5,28 @@
  */
 
 #include "fsmonitor.h"
+#include "walk.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
-int ttrek_DiffList(Tcl_Interp *interp, Tcl_Obj *list1, Tcl_Obj *list2, Tcl_Obj *diff, Tcl_Size ncut) {
+// What is known about a file in the install directory. A file is considered
+// modified when any of these fields changes.
+typedef struct {
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    // The scan in which the file was seen last time
+    int generation;
+} ttrek_fsmonitor_entry_t;
 
-    Tcl_HashTable ht;
-    Tcl_InitHashTable(&ht, TCL_STRING_KEYS);
-
-    // add all elements of list1 to the hash table
-    Tcl_Size list1_len;
-    if (TCL_OK != Tcl_ListObjLength(interp, list1, &list1_len)) {
-        fprintf(stderr, "error: could not get length of list1\n");
-        return TCL_ERROR;
-    }
-
-    for (Tcl_Size i = 0; i < list1_len; i++) {
-        Tcl_Obj *elem;
-        if (TCL_OK != Tcl_ListObjIndex(interp, list1, i, &elem)) {
-            fprintf(stderr, "error: could not get element %" TCL_SIZE_MODIFIER "d"
-                " of list1\n", i);
-            return TCL_ERROR;
-        }
-        Tcl_Size elem_len;
-        const char *elem_str = Tcl_GetStringFromObj(elem, &elem_len);
-        if (elem_len < ncut) {
-            fprintf(stderr, "error: element %" TCL_SIZE_MODIFIER "d of list2 is"
-                " shorter than ncut\n", i);
-            return TCL_ERROR;
-        }
-        int dummyNewEntry;
-        Tcl_CreateHashEntry(&ht, &elem_str[ncut], &dummyNewEntry);
-    }
-
-    // remove all elements of list2 from the hash table
-    Tcl_Size list2_len;
-    if (TCL_OK != Tcl_ListObjLength(interp, list2, &list2_len)) {
-        fprintf(stderr, "error: could not get length of list2\n");
-        return TCL_ERROR;
-    }
-
-    for (Tcl_Size i = 0; i < list2_len; i++) {
-        Tcl_Obj *elem;
-        if (TCL_OK != Tcl_ListObjIndex(interp, list2, i, &elem)) {
-            fprintf(stderr, "error: could not get element %" TCL_SIZE_MODIFIER "d"
-                " of list2\n", i);
-            return TCL_ERROR;
-        }
-        Tcl_Size elem_len;
-        const char *elem_str = Tcl_GetStringFromObj(elem, &elem_len);
-        if (elem_len < ncut) {
-            fprintf(stderr, "error: element %" TCL_SIZE_MODIFIER "d of list2 is"
-                " shorter than ncut\n", i);
-            return TCL_ERROR;
-        }
-        Tcl_HashEntry *entry = Tcl_FindHashEntry(&ht, &elem_str[ncut]);
-        if (entry) {
-            Tcl_DeleteHashEntry(entry);
-        }
-    }
-
-    // add all remaining elements of the hash table to the diff list
-    Tcl_HashSearch search;
-    Tcl_HashEntry *entry;
-    for (entry = Tcl_FirstHashEntry(&ht, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
-        const char *key = Tcl_GetHashKey(&ht, entry);
-        Tcl_ListObjAppendElement(interp, diff, Tcl_NewStringObj(key, -1));
-    }
-
-    Tcl_DeleteHashTable(&ht);
-    return TCL_OK;
-
-}
-
-int ttrek_MatchInDirectory(Tcl_Interp *interp, Tcl_Obj *result_ptr, Tcl_Obj *path_ptr, const char *pattern, int recursive, Tcl_GlobTypeData *types) {
+static int ttrek_MatchInDirectoryGlob(Tcl_Interp *interp, Tcl_Obj *result_ptr, Tcl_Obj *path_ptr, const char *pattern, int recursive, Tcl_GlobTypeData *types) {
     // get the list of files in the directory
     Tcl_Obj *files_ptr = Tcl_NewListObj(0, NULL);
     Tcl_IncrRefCount(files_ptr);
@@ -140,7 +88,7 @@ int ttrek_MatchInDirectory(Tcl_Interp *interp, Tcl_Obj *result_ptr, Tcl_Obj *pat
                 Tcl_DecrRefCount(dirs_ptr);
                 return TCL_ERROR;
             }
-            if (TCL_OK != ttrek_MatchInDirectory(interp, result_ptr, dir, pattern, recursive, types)) {
+            if (TCL_OK != ttrek_MatchInDirectoryGlob(interp, result_ptr, dir, pattern, recursive, types)) {
                 fprintf(stderr, "error: could not match in directory %s\n", Tcl_GetString(dir));
                 Tcl_DecrRefCount(dirs_ptr);
                 return TCL_ERROR;
@@ -150,65 +98,557 @@ int ttrek_MatchInDirectory(Tcl_Interp *interp, Tcl_Obj *result_ptr, Tcl_Obj *pat
     return TCL_OK;
 }
 
-int ttrek_FSMonitor_AddWatch(Tcl_Interp *interp, Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr) {
-    // list all files in the project_install_dir_ptr
 
-    state_ptr->files_before = Tcl_NewListObj(0, NULL);
-    Tcl_IncrRefCount(state_ptr->files_before);
+// Returns 1 if the entry is in a hidden directory, or if it is hidden itself
+// and the pattern does not start with a dot. Such entries are skipped by glob.
+static int ttrek_MatchIsHidden(const ttrek_walk_entry_t *entry, const char *pattern, const char **tail_ptr) {
+    const char *tail = entry->path;
+    for (const char *p = entry->path; *p != '\0'; p++) {
+        if (*p == '/') {
+            if (tail[0] == '.') {
+                return 1;
+            }
+            tail = p + 1;
+        }
+    }
+    *tail_ptr = tail;
+    return tail[0] == '.' && pattern[0] != '.';
+}
 
-    Tcl_GlobTypeData filetypes;
-    filetypes.type = TCL_GLOB_TYPE_FILE;
-    filetypes.perm = 0;
-    filetypes.macCreator = NULL;
-    filetypes.macType = NULL;
-    if (TCL_OK != ttrek_MatchInDirectory(interp, state_ptr->files_before, project_install_dir_ptr, "*", 1, &filetypes)) {
-        fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(project_install_dir_ptr));
-        Tcl_DecrRefCount(state_ptr->files_before);
+static int ttrek_MatchType(Tcl_Obj *path_ptr, const ttrek_walk_entry_t *entry, int type_mask) {
+    if (type_mask == 0) {
+        return 1;
+    }
+    switch (entry->type) {
+        case TTREK_WALK_TYPE_FILE:
+            return (type_mask & TCL_GLOB_TYPE_FILE) != 0;
+        case TTREK_WALK_TYPE_DIR:
+            return (type_mask & TCL_GLOB_TYPE_DIR) != 0;
+        case TTREK_WALK_TYPE_LINK: {
+            if (type_mask & TCL_GLOB_TYPE_LINK) {
+                return 1;
+            }
+            // Like glob, the type of the link target is checked for
+            // the other types
+            Tcl_Obj *link_path_ptr = Tcl_ObjPrintf("%s/%s", Tcl_GetString(path_ptr), entry->path);
+            Tcl_IncrRefCount(link_path_ptr);
+            struct stat st;
+            int rc = stat(Tcl_GetString(link_path_ptr), &st);
+            Tcl_DecrRefCount(link_path_ptr);
+            if (rc != 0) {
+                return 0;
+            }
+            return S_ISDIR(st.st_mode) ? (type_mask & TCL_GLOB_TYPE_DIR) != 0 : (type_mask & TCL_GLOB_TYPE_FILE) != 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Returns the same files as the recursive glob above, but reads
+// the directories with ttrek_Walk(). Filters other than file, directory
+// and link types are handled by glob, as well as non-native filesystems.
+int ttrek_MatchInDirectory(Tcl_Interp *interp, Tcl_Obj *result_ptr, Tcl_Obj *path_ptr, const char *pattern, int recursive, Tcl_GlobTypeData *types, int num_threads) {
+
+    int type_mask = types != NULL ? types->type : 0;
+    int supported_types = TCL_GLOB_TYPE_FILE | TCL_GLOB_TYPE_DIR | TCL_GLOB_TYPE_LINK;
+
+    const char *native_path = Tcl_FSGetNativePath(path_ptr);
+    if (native_path == NULL || (type_mask & ~supported_types) ||
+        (types != NULL && (types->perm != 0 || types->macType != NULL || types->macCreator != NULL))) {
+
+        return ttrek_MatchInDirectoryGlob(interp, result_ptr, path_ptr, pattern, recursive, types);
+    }
+
+    ttrek_walk_t *walk;
+    if (TCL_OK != ttrek_Walk(interp, native_path, recursive ? 0 : TTREK_WALK_NO_RECURSE, num_threads, &walk)) {
+        fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(path_ptr));
         return TCL_ERROR;
     }
 
+    for (Tcl_Size i = 0; i < walk->entries_len; i++) {
+        ttrek_walk_entry_t *entry = &walk->entries[i];
+        const char *tail;
+        if (ttrek_MatchIsHidden(entry, pattern, &tail) || !Tcl_StringMatch(tail, pattern) ||
+            !ttrek_MatchType(path_ptr, entry, type_mask)) {
+            continue;
+        }
+        Tcl_Obj *file_path_ptr = Tcl_DuplicateObj(path_ptr);
+        Tcl_AppendToObj(file_path_ptr, "/", 1);
+        Tcl_AppendToObj(file_path_ptr, entry->path, entry->path_len);
+        Tcl_ListObjAppendElement(interp, result_ptr, file_path_ptr);
+    }
+
+    ttrek_WalkFree(walk);
     return TCL_OK;
+
 }
 
-int ttrek_FSMonitor_ReadChanges(Tcl_Interp *interp, Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr) {
-    Tcl_Obj *files_after = Tcl_NewListObj(0, NULL);
-    Tcl_IncrRefCount(files_after);
-
-    Tcl_GlobTypeData filetypes;
-    filetypes.type = TCL_GLOB_TYPE_FILE;
-    filetypes.perm = 0;
-    filetypes.macCreator = NULL;
-    filetypes.macType = NULL;
-    if (TCL_OK != ttrek_MatchInDirectory(interp, files_after, project_install_dir_ptr, "*", 1, &filetypes)) {
-        fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(project_install_dir_ptr));
-        Tcl_DecrRefCount(files_after);
-        return TCL_ERROR;
+static void ttrek_FSMonitor_ClearIndex(ttrek_fsmonitor_state_t *state_ptr) {
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+    for (entry = Tcl_FirstHashEntry(&state_ptr->index_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_Free((char *) Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&state_ptr->index_ht);
+}
+
+static void ttrek_FSMonitor_ResetChanges(ttrek_fsmonitor_state_t *state_ptr) {
+    if (state_ptr->files_diff != NULL) {
+        Tcl_DecrRefCount(state_ptr->files_diff);
+    }
+    if (state_ptr->files_modified != NULL) {
+        Tcl_DecrRefCount(state_ptr->files_modified);
     }
     state_ptr->files_diff = Tcl_NewListObj(0, NULL);
     Tcl_IncrRefCount(state_ptr->files_diff);
+    state_ptr->files_modified = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(state_ptr->files_modified);
+}
 
-    Tcl_Size project_install_dir_len;
-    // Here we just need to get the length of project_install_dir_ptr in
-    // project_install_dir_len, so we can ignore the result of the function.
-    Tcl_GetStringFromObj(project_install_dir_ptr, &project_install_dir_len);
+// Compares a file with its index entry and records it as created or
+// modified. Nothing is recorded when the index is being built.
+static void ttrek_FSMonitor_UpdateEntry(ttrek_fsmonitor_state_t *state_ptr, const char *path, Tcl_Size path_len,
+                                        ino_t ino, off_t size, time_t mtime_sec, long mtime_nsec, int is_initial) {
 
-    // project_install_dir_len + 1 to cut the slash in the beginning of the path for file in the diff list
-    if (TCL_OK != ttrek_DiffList(interp, files_after, state_ptr->files_before, state_ptr->files_diff, project_install_dir_len + 1)) {
-        fprintf(stderr, "error: could not diff files\n");
-        Tcl_DecrRefCount(files_after);
-        Tcl_DecrRefCount(state_ptr->files_diff);
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&state_ptr->index_ht, path, &is_new);
+
+    ttrek_fsmonitor_entry_t *file_ptr;
+    if (is_new) {
+        file_ptr = (ttrek_fsmonitor_entry_t *) Tcl_Alloc(sizeof(ttrek_fsmonitor_entry_t));
+        Tcl_SetHashValue(entry, file_ptr);
+        if (!is_initial) {
+            Tcl_ListObjAppendElement(NULL, state_ptr->files_diff, Tcl_NewStringObj(path, path_len));
+        }
+    } else {
+        file_ptr = (ttrek_fsmonitor_entry_t *) Tcl_GetHashValue(entry);
+        if (!is_initial && (file_ptr->ino != ino || file_ptr->size != size ||
+            file_ptr->mtime_sec != mtime_sec || file_ptr->mtime_nsec != mtime_nsec)) {
+
+            Tcl_ListObjAppendElement(NULL, state_ptr->files_modified, Tcl_NewStringObj(path, path_len));
+        }
+    }
+
+    file_ptr->ino = ino;
+    file_ptr->size = size;
+    file_ptr->mtime_sec = mtime_sec;
+    file_ptr->mtime_nsec = mtime_nsec;
+    file_ptr->generation = state_ptr->generation;
+
+}
+
+static void ttrek_FSMonitor_RemoveEntry(ttrek_fsmonitor_state_t *state_ptr, const char *path) {
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&state_ptr->index_ht, path);
+    if (entry != NULL) {
+        Tcl_Free((char *) Tcl_GetHashValue(entry));
+        Tcl_DeleteHashEntry(entry);
+    }
+}
+
+#ifdef __linux__
+
+// The changes in the watched directories that are reported to the tracker
+#define TTREK_FSMONITOR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB \
+                                | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static void ttrek_FSMonitor_CloseNotify(ttrek_fsmonitor_state_t *state_ptr) {
+    if (state_ptr->inotify_fd < 0) {
+        return;
+    }
+    close(state_ptr->inotify_fd);
+    state_ptr->inotify_fd = -1;
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->watches_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&state_ptr->watches_ht);
+}
+
+// Watches a directory of the install directory. The relative path
+// of the directory is kept by watch descriptor to resolve the events.
+static int ttrek_FSMonitor_WatchDirectory(ttrek_fsmonitor_state_t *state_ptr, Tcl_Obj *project_install_dir_ptr,
+                                          const char *path, Tcl_Size path_len) {
+
+    Tcl_Obj *dir_path_ptr = Tcl_DuplicateObj(project_install_dir_ptr);
+    Tcl_IncrRefCount(dir_path_ptr);
+    if (path_len > 0) {
+        Tcl_AppendToObj(dir_path_ptr, "/", 1);
+        Tcl_AppendToObj(dir_path_ptr, path, path_len);
+    }
+    int wd = inotify_add_watch(state_ptr->inotify_fd, Tcl_GetString(dir_path_ptr), TTREK_FSMONITOR_EVENTS);
+    if (wd < 0) {
+        // The directory could be removed right after it was created
+        int rc = (errno == ENOENT || errno == ENOTDIR) ? TCL_OK : TCL_ERROR;
+        if (rc != TCL_OK) {
+            DBG2(printf("could not watch %s: %s", Tcl_GetString(dir_path_ptr), strerror(errno)));
+        }
+        Tcl_DecrRefCount(dir_path_ptr);
+        return rc;
+    }
+    Tcl_DecrRefCount(dir_path_ptr);
+
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&state_ptr->watches_ht, INT2PTR(wd), &is_new);
+    if (!is_new) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
+    }
+    Tcl_Obj *path_ptr = Tcl_NewStringObj(path, path_len);
+    Tcl_IncrRefCount(path_ptr);
+    Tcl_SetHashValue(entry, path_ptr);
+    return TCL_OK;
+
+}
+
+// Starts watching the install directory with inotify, so that the files
+// changed by a package are known without scanning the whole directory.
+// Falls back to scans when inotify is not available or there are too
+// many directories to watch.
+static void ttrek_FSMonitor_OpenNotify(ttrek_fsmonitor_state_t *state_ptr, Tcl_Obj *project_install_dir_ptr,
+                                       ttrek_walk_t *walk) {
+
+    ttrek_FSMonitor_CloseNotify(state_ptr);
+    state_ptr->needs_rescan = 0;
+
+    state_ptr->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (state_ptr->inotify_fd < 0) {
+        DBG2(printf("inotify is not available: %s", strerror(errno)));
+        return;
+    }
+    Tcl_InitHashTable(&state_ptr->watches_ht, TCL_ONE_WORD_KEYS);
+
+    int rc = ttrek_FSMonitor_WatchDirectory(state_ptr, project_install_dir_ptr, "", 0);
+    for (Tcl_Size i = 0; i < walk->entries_len && rc == TCL_OK; i++) {
+        ttrek_walk_entry_t *entry = &walk->entries[i];
+        if (entry->type == TTREK_WALK_TYPE_DIR) {
+            rc = ttrek_FSMonitor_WatchDirectory(state_ptr, project_install_dir_ptr, entry->path, entry->path_len);
+        }
+    }
+
+    if (rc != TCL_OK) {
+        DBG2(printf("could not watch the install directory, scan it after each package instead"));
+        ttrek_FSMonitor_CloseNotify(state_ptr);
+    }
+
+}
+
+static void ttrek_FSMonitor_AddCandidate(Tcl_HashTable *candidates_ht, const char *path, Tcl_Size path_len) {
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, path, path_len);
+    int is_new;
+    Tcl_CreateHashEntry(candidates_ht, Tcl_DStringValue(&ds), &is_new);
+    Tcl_DStringFree(&ds);
+}
+
+// A directory was created or moved into the install directory. Files could
+// be created in it before it was watched, so all of them are candidates.
+static int ttrek_FSMonitor_WatchNewDirectory(ttrek_fsmonitor_state_t *state_ptr, Tcl_Obj *project_install_dir_ptr,
+                                             const char *path, Tcl_Size path_len, Tcl_HashTable *candidates_ht) {
+
+    if (TCL_OK != ttrek_FSMonitor_WatchDirectory(state_ptr, project_install_dir_ptr, path, path_len)) {
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *dir_path_ptr = Tcl_ObjPrintf("%s/%s", Tcl_GetString(project_install_dir_ptr), path);
+    Tcl_IncrRefCount(dir_path_ptr);
+    ttrek_walk_t *walk;
+    int rc = ttrek_Walk(NULL, Tcl_GetString(dir_path_ptr), 0, 1, &walk);
+    Tcl_DecrRefCount(dir_path_ptr);
+    if (rc != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    for (Tcl_Size i = 0; i < walk->entries_len && rc == TCL_OK; i++) {
+        ttrek_walk_entry_t *entry = &walk->entries[i];
+        Tcl_DStringSetLength(&ds, 0);
+        Tcl_DStringAppend(&ds, path, path_len);
+        Tcl_DStringAppend(&ds, "/", 1);
+        Tcl_DStringAppend(&ds, entry->path, entry->path_len);
+        if (entry->type == TTREK_WALK_TYPE_DIR) {
+            rc = ttrek_FSMonitor_WatchDirectory(state_ptr, project_install_dir_ptr, Tcl_DStringValue(&ds),
+                                                Tcl_DStringLength(&ds));
+        } else {
+            ttrek_FSMonitor_AddCandidate(candidates_ht, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+        }
+    }
+    Tcl_DStringFree(&ds);
+
+    ttrek_WalkFree(walk);
+    return rc;
+
+}
+
+// Reads the pending events and collects the paths of the files that could
+// be created, modified or removed. Moved directories leave the paths
+// in the index out of date, then the install directory is scanned instead.
+static void ttrek_FSMonitor_ReadEvents(ttrek_fsmonitor_state_t *state_ptr, Tcl_Obj *project_install_dir_ptr,
+                                       Tcl_HashTable *candidates_ht) {
+
+    _Alignas(struct inotify_event) char buffer[16 * 1024];
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+
+    for (;;) {
+
+        ssize_t len = read(state_ptr->inotify_fd, buffer, sizeof(buffer));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN) {
+                state_ptr->needs_rescan = 1;
+            }
+            break;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + len;) {
+
+            const struct inotify_event *event = (const struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                DBG2(printf("inotify queue overflow"));
+                state_ptr->needs_rescan = 1;
+                continue;
+            }
+
+            Tcl_HashEntry *entry = Tcl_FindHashEntry(&state_ptr->watches_ht, INT2PTR(event->wd));
+            if (entry == NULL) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // The directory was removed
+                Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
+                Tcl_DeleteHashEntry(entry);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            Tcl_Size dir_len;
+            const char *dir = Tcl_GetStringFromObj((Tcl_Obj *) Tcl_GetHashValue(entry), &dir_len);
+            Tcl_DStringSetLength(&ds, 0);
+            if (dir_len > 0) {
+                Tcl_DStringAppend(&ds, dir, dir_len);
+                Tcl_DStringAppend(&ds, "/", 1);
+            }
+            Tcl_DStringAppend(&ds, event->name, -1);
+
+            if (!(event->mask & IN_ISDIR)) {
+                ttrek_FSMonitor_AddCandidate(candidates_ht, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                if (TCL_OK != ttrek_FSMonitor_WatchNewDirectory(state_ptr, project_install_dir_ptr,
+                                                                Tcl_DStringValue(&ds), Tcl_DStringLength(&ds),
+                                                                candidates_ht)) {
+                    state_ptr->needs_rescan = 1;
+                }
+            } else if (event->mask & IN_MOVED_FROM) {
+                state_ptr->needs_rescan = 1;
+            }
+
+        }
+
+    }
+
+    Tcl_DStringFree(&ds);
+
+}
+
+// Updates the index with the candidates from the events. Whether a file
+// was created or modified is decided by the index, as in a scan.
+static void ttrek_FSMonitor_ApplyCandidates(ttrek_fsmonitor_state_t *state_ptr, Tcl_Obj *project_install_dir_ptr,
+                                            Tcl_HashTable *candidates_ht, int is_initial) {
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, Tcl_GetString(project_install_dir_ptr), -1);
+    Tcl_DStringAppend(&ds, "/", 1);
+    Tcl_Size dir_len = Tcl_DStringLength(&ds);
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(candidates_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+
+        const char *path = Tcl_GetHashKey(candidates_ht, entry);
+        Tcl_DStringSetLength(&ds, dir_len);
+        Tcl_DStringAppend(&ds, path, -1);
+
+        struct stat st;
+        if (lstat(Tcl_DStringValue(&ds), &st) != 0 || S_ISDIR(st.st_mode)) {
+            ttrek_FSMonitor_RemoveEntry(state_ptr, path);
+            continue;
+        }
+
+        ttrek_FSMonitor_UpdateEntry(state_ptr, path, -1, st.st_ino, st.st_size, ST_MTIM(st).tv_sec,
+                                    ST_MTIM(st).tv_nsec, is_initial);
+
+    }
+
+    Tcl_DStringFree(&ds);
+
+}
+
+#endif
+
+static int ttrek_FSMonitor_ScanInstallDir(Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr,
+                                          int is_initial) {
+
+    ttrek_walk_t *walk;
+    if (TCL_OK != ttrek_Walk(NULL, Tcl_GetString(project_install_dir_ptr), TTREK_WALK_STAT, state_ptr->num_threads,
+                             &walk)) {
+        return TCL_ERROR;
+    }
+
+    state_ptr->generation++;
+
+    for (Tcl_Size i = 0; i < walk->entries_len; i++) {
+        ttrek_walk_entry_t *entry = &walk->entries[i];
+        if (entry->type != TTREK_WALK_TYPE_DIR) {
+            ttrek_FSMonitor_UpdateEntry(state_ptr, entry->path, entry->path_len, entry->ino, entry->size,
+                                        entry->mtime_sec, entry->mtime_nsec, is_initial);
+        }
+    }
+
+#ifdef __linux__
+    // The watches are set up with the first scan, and set up again after
+    // the scans that replace the events
+    if (is_initial || state_ptr->inotify_fd >= 0) {
+        ttrek_FSMonitor_OpenNotify(state_ptr, project_install_dir_ptr, walk);
+    }
+#endif
+
+    ttrek_WalkFree(walk);
+
+    // Forget the files that were not seen in this scan, they were removed
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->index_ht, &search);
+    while (entry != NULL) {
+        ttrek_fsmonitor_entry_t *file_ptr = (ttrek_fsmonitor_entry_t *) Tcl_GetHashValue(entry);
+        Tcl_HashEntry *next_entry = Tcl_NextHashEntry(&search);
+        if (file_ptr->generation != state_ptr->generation) {
+            Tcl_Free((char *) file_ptr);
+            Tcl_DeleteHashEntry(entry);
+        }
+        entry = next_entry;
+    }
+
+    return TCL_OK;
+
+}
+
+// Brings the index up to date. With inotify, only the files from the events
+// are checked, otherwise the whole install directory is scanned.
+static int ttrek_FSMonitor_Update(Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr,
+                                  int is_initial) {
+
+#ifdef __linux__
+    if (state_ptr->inotify_fd >= 0) {
+
+        Tcl_HashTable candidates_ht;
+        Tcl_InitHashTable(&candidates_ht, TCL_STRING_KEYS);
+        ttrek_FSMonitor_ReadEvents(state_ptr, project_install_dir_ptr, &candidates_ht);
+
+        if (!state_ptr->needs_rescan) {
+            ttrek_FSMonitor_ApplyCandidates(state_ptr, project_install_dir_ptr, &candidates_ht, is_initial);
+            Tcl_DeleteHashTable(&candidates_ht);
+            return TCL_OK;
+        }
+
+        DBG2(printf("the events are incomplete, scan the install directory"));
+        Tcl_DeleteHashTable(&candidates_ht);
+
+    }
+#endif
+
+    return ttrek_FSMonitor_ScanInstallDir(project_install_dir_ptr, state_ptr, is_initial);
+
+}
+
+// Starts tracking changes in the install directory. When the watch is already
+// active, the index from the previous ReadChanges call is used as the baseline.
+// The events since then, e.g. of the files removed before the package is
+// reinstalled, are applied to it first.
+int ttrek_FSMonitor_AddWatch(Tcl_Interp *interp, Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr) {
+
+    if (state_ptr->is_active) {
+        ttrek_FSMonitor_ResetChanges(state_ptr);
+#ifdef __linux__
+        if (state_ptr->inotify_fd >= 0 && TCL_OK != ttrek_FSMonitor_Update(project_install_dir_ptr, state_ptr, 1)) {
+            fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(project_install_dir_ptr));
+            ttrek_FSMonitor_RemoveWatch(interp, state_ptr);
+            return TCL_ERROR;
+        }
+#endif
+        return TCL_OK;
+    }
+
+    Tcl_InitHashTable(&state_ptr->index_ht, TCL_STRING_KEYS);
+    state_ptr->generation = 0;
+    state_ptr->files_diff = NULL;
+    state_ptr->files_modified = NULL;
+    state_ptr->inotify_fd = -1;
+    state_ptr->needs_rescan = 0;
+    ttrek_FSMonitor_ResetChanges(state_ptr);
+    state_ptr->is_active = 1;
+
+    if (TCL_OK != ttrek_FSMonitor_ScanInstallDir(project_install_dir_ptr, state_ptr, 1)) {
+        fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(project_install_dir_ptr));
+        ttrek_FSMonitor_RemoveWatch(interp, state_ptr);
         return TCL_ERROR;
     }
 
-    Tcl_DecrRefCount(files_after);
     return TCL_OK;
+
+}
+
+// Fills files_diff with the files created since the last scan, and
+// files_modified with the existing files whose inode, size or mtime changed.
+int ttrek_FSMonitor_ReadChanges(Tcl_Interp *interp, Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr) {
+
+    UNUSED(interp);
+
+    ttrek_FSMonitor_ResetChanges(state_ptr);
+
+    if (TCL_OK != ttrek_FSMonitor_Update(project_install_dir_ptr, state_ptr, 0)) {
+        fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(project_install_dir_ptr));
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+
+}
+
+// Forgets a file that is removed by ttrek, so that it is reported as
+// created rather than modified when a package installs it again.
+void ttrek_FSMonitor_ForgetFile(ttrek_fsmonitor_state_t *state_ptr, const char *path) {
+    if (state_ptr != NULL && state_ptr->is_active) {
+        ttrek_FSMonitor_RemoveEntry(state_ptr, path);
+    }
 }
 
 int ttrek_FSMonitor_RemoveWatch(Tcl_Interp *interp, ttrek_fsmonitor_state_t *state_ptr) {
     UNUSED(interp);
-    Tcl_DecrRefCount(state_ptr->files_before);
+    if (!state_ptr->is_active) {
+        return TCL_OK;
+    }
+    ttrek_FSMonitor_ClearIndex(state_ptr);
+#ifdef __linux__
+    ttrek_FSMonitor_CloseNotify(state_ptr);
+#endif
     if (state_ptr->files_diff) {
         Tcl_DecrRefCount(state_ptr->files_diff);
+        state_ptr->files_diff = NULL;
+    }
+    if (state_ptr->files_modified) {
+        Tcl_DecrRefCount(state_ptr->files_modified);
+        state_ptr->files_modified = NULL;
     }
+    state_ptr->is_active = 0;
     return TCL_OK;
 }
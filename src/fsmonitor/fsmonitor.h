@@ -9,13 +9,35 @@
 
 #include "../common.h"
 
-typedef struct {
-    Tcl_Obj *files_before;
+typedef struct ttrek_fsmonitor_state_s {
+    // relative path -> inode, size and mtime of the file, as seen by
+    // the last scan. The index is kept between packages and is updated from
+    // inotify events, so that the install directory is scanned only once.
+    // Without inotify, it is scanned once per package instead of twice.
+    Tcl_HashTable index_ht;
+    int generation;
+    int is_active;
+    // The number of threads that scan the install directory
+    int num_threads;
+    // Files created since the last scan
     Tcl_Obj *files_diff;
+    // Existing files whose inode, size or mtime changed since the last scan
+    Tcl_Obj *files_modified;
+    // inotify descriptor, or -1 when the install directory is scanned
+    // after each package instead
+    int inotify_fd;
+    // watch descriptor -> relative path of the watched directory
+    Tcl_HashTable watches_ht;
+    // Set when the events are incomplete, e.g. the queue overflowed,
+    // then the install directory is scanned
+    int needs_rescan;
 } ttrek_fsmonitor_state_t;
 
+int ttrek_MatchInDirectory(Tcl_Interp *interp, Tcl_Obj *result_ptr, Tcl_Obj *path_ptr, const char *pattern, int recursive, Tcl_GlobTypeData *types, int num_threads);
+
 int ttrek_FSMonitor_AddWatch(Tcl_Interp *interp, Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr);
 int ttrek_FSMonitor_ReadChanges(Tcl_Interp *interp, Tcl_Obj *project_install_dir_ptr, ttrek_fsmonitor_state_t *state_ptr);
 int ttrek_FSMonitor_RemoveWatch(Tcl_Interp *interp, ttrek_fsmonitor_state_t *state_ptr);
+void ttrek_FSMonitor_ForgetFile(ttrek_fsmonitor_state_t *state_ptr, const char *path);
 
 #endif //TTREK_FSMONITOR_H
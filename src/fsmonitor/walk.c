@@ -0,0 +1,395 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "walk.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define TTREK_WALK_CHUNK_SIZE  (64 * 1024)
+#define TTREK_WALK_BUFFER_SIZE (32 * 1024)
+
+struct ttrek_walk_chunk_s {
+    struct ttrek_walk_chunk_s *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+typedef struct {
+    // Points to the arena of the worker that found the directory
+    const char *path;
+    Tcl_Size path_len;
+} ttrek_walk_dir_t;
+
+// The state shared between the threads. The directories that are not read
+// yet are kept in the queue, the threads take them one by one.
+typedef struct {
+    int root_fd;
+    int flags;
+    Tcl_Mutex mutex;
+    Tcl_Condition cond;
+    ttrek_walk_dir_t *queue;
+    Tcl_Size queue_len;
+    Tcl_Size queue_size;
+    // The number of threads that are reading a directory right now
+    int active;
+    // errno of the first failure and the directory where it happened
+    int error;
+    char *error_path;
+} ttrek_walk_shared_t;
+
+// Each thread writes to its own arena and list of entries,
+// they are merged when all threads are done.
+typedef struct {
+    ttrek_walk_shared_t *shared;
+    ttrek_walk_chunk_t *arena;
+    ttrek_walk_entry_t *entries;
+    Tcl_Size entries_len;
+    Tcl_Size entries_size;
+    ttrek_walk_dir_t *dirs;
+    Tcl_Size dirs_len;
+    Tcl_Size dirs_size;
+    char *buffer;
+} ttrek_walk_worker_t;
+
+#ifdef SYS_getdents64
+struct ttrek_linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static char *ttrek_WalkArenaAlloc(ttrek_walk_chunk_t **arena_ptr, size_t size) {
+    ttrek_walk_chunk_t *chunk = *arena_ptr;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > TTREK_WALK_CHUNK_SIZE ? size : TTREK_WALK_CHUNK_SIZE;
+        chunk = (ttrek_walk_chunk_t *) Tcl_Alloc(sizeof(ttrek_walk_chunk_t) + chunk_size);
+        chunk->next = *arena_ptr;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        *arena_ptr = chunk;
+    }
+    char *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static void ttrek_WalkArenaFree(ttrek_walk_chunk_t *chunk) {
+    while (chunk != NULL) {
+        ttrek_walk_chunk_t *next = chunk->next;
+        Tcl_Free((char *) chunk);
+        chunk = next;
+    }
+}
+
+static void ttrek_WalkAddEntry(ttrek_walk_worker_t *worker, const ttrek_walk_dir_t *dir, int dir_fd,
+                               const char *name, unsigned char d_type) {
+
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;
+    }
+
+    ttrek_walk_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+
+    switch (d_type) {
+        case DT_REG:
+            entry.type = TTREK_WALK_TYPE_FILE;
+            break;
+        case DT_DIR:
+            entry.type = TTREK_WALK_TYPE_DIR;
+            break;
+        case DT_LNK:
+            entry.type = TTREK_WALK_TYPE_LINK;
+            break;
+        default:
+            entry.type = TTREK_WALK_TYPE_OTHER;
+    }
+
+    // Some filesystems do not fill d_type, then we need to stat the file
+    if ((worker->shared->flags & TTREK_WALK_STAT) || d_type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            // The file could be removed after we read the directory
+            return;
+        }
+        if (S_ISREG(st.st_mode)) {
+            entry.type = TTREK_WALK_TYPE_FILE;
+        } else if (S_ISDIR(st.st_mode)) {
+            entry.type = TTREK_WALK_TYPE_DIR;
+        } else if (S_ISLNK(st.st_mode)) {
+            entry.type = TTREK_WALK_TYPE_LINK;
+        } else {
+            entry.type = TTREK_WALK_TYPE_OTHER;
+        }
+        entry.ino = st.st_ino;
+        entry.size = st.st_size;
+        entry.mode = st.st_mode;
+        entry.mtime_sec = ST_MTIM(st).tv_sec;
+        entry.mtime_nsec = ST_MTIM(st).tv_nsec;
+    }
+
+    size_t name_len = strlen(name);
+    Tcl_Size path_len = dir->path_len > 0 ? dir->path_len + 1 + name_len : name_len;
+    char *path = ttrek_WalkArenaAlloc(&worker->arena, path_len + 1);
+    if (dir->path_len > 0) {
+        memcpy(path, dir->path, dir->path_len);
+        path[dir->path_len] = '/';
+    }
+    memcpy(path + path_len - name_len, name, name_len + 1);
+    entry.path = path;
+    entry.path_len = path_len;
+
+    if (worker->entries_len == worker->entries_size) {
+        worker->entries_size = worker->entries_size ? worker->entries_size * 2 : 1024;
+        worker->entries = (ttrek_walk_entry_t *) Tcl_Realloc((char *) worker->entries,
+                                                             worker->entries_size * sizeof(ttrek_walk_entry_t));
+    }
+    worker->entries[worker->entries_len++] = entry;
+
+    if (entry.type == TTREK_WALK_TYPE_DIR && !(worker->shared->flags & TTREK_WALK_NO_RECURSE)) {
+        if (worker->dirs_len == worker->dirs_size) {
+            worker->dirs_size = worker->dirs_size ? worker->dirs_size * 2 : 64;
+            worker->dirs = (ttrek_walk_dir_t *) Tcl_Realloc((char *) worker->dirs,
+                                                            worker->dirs_size * sizeof(ttrek_walk_dir_t));
+        }
+        worker->dirs[worker->dirs_len].path = path;
+        worker->dirs[worker->dirs_len].path_len = path_len;
+        worker->dirs_len++;
+    }
+
+}
+
+// Reads one directory. Returns 0 on success or errno on failure.
+static int ttrek_WalkReadDir(ttrek_walk_worker_t *worker, const ttrek_walk_dir_t *dir) {
+
+    int dir_fd = openat(worker->shared->root_fd, dir->path_len > 0 ? dir->path : ".",
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0) {
+        // The directory could be removed after its parent was read
+        return errno == ENOENT ? 0 : errno;
+    }
+
+#ifdef SYS_getdents64
+    // getdents64() returns many entries at once without the buffering
+    // and locking of readdir()
+    for (;;) {
+        long nread = syscall(SYS_getdents64, dir_fd, worker->buffer, TTREK_WALK_BUFFER_SIZE);
+        if (nread < 0) {
+            int error = errno;
+            close(dir_fd);
+            return error;
+        }
+        if (nread == 0) {
+            break;
+        }
+        for (long offset = 0; offset < nread;) {
+            struct ttrek_linux_dirent64 *dirent = (struct ttrek_linux_dirent64 *) (worker->buffer + offset);
+            ttrek_WalkAddEntry(worker, dir, dir_fd, dirent->d_name, dirent->d_type);
+            offset += dirent->d_reclen;
+        }
+    }
+    close(dir_fd);
+#else
+    DIR *dirp = fdopendir(dir_fd);
+    if (dirp == NULL) {
+        int error = errno;
+        close(dir_fd);
+        return error;
+    }
+    struct dirent *dirent;
+    while ((dirent = readdir(dirp)) != NULL) {
+        ttrek_WalkAddEntry(worker, dir, dir_fd, dirent->d_name, dirent->d_type);
+    }
+    closedir(dirp);
+#endif
+
+    return 0;
+
+}
+
+static void ttrek_WalkRun(ttrek_walk_worker_t *worker) {
+
+    ttrek_walk_shared_t *shared = worker->shared;
+
+    Tcl_MutexLock(&shared->mutex);
+    for (;;) {
+
+        while (shared->queue_len == 0 && shared->active > 0 && !shared->error) {
+            Tcl_ConditionWait(&shared->cond, &shared->mutex, NULL);
+        }
+
+        // Nothing to read and nobody can add more directories
+        if (shared->error || shared->queue_len == 0) {
+            break;
+        }
+
+        ttrek_walk_dir_t dir = shared->queue[--shared->queue_len];
+        shared->active++;
+        Tcl_MutexUnlock(&shared->mutex);
+
+        int error = ttrek_WalkReadDir(worker, &dir);
+
+        Tcl_MutexLock(&shared->mutex);
+        shared->active--;
+
+        if (error && !shared->error) {
+            shared->error = error;
+            shared->error_path = Tcl_Alloc(dir.path_len + 1);
+            memcpy(shared->error_path, dir.path, dir.path_len + 1);
+        }
+
+        if (worker->dirs_len > 0) {
+            if (shared->queue_len + worker->dirs_len > shared->queue_size) {
+                shared->queue_size = (shared->queue_len + worker->dirs_len) * 2;
+                shared->queue = (ttrek_walk_dir_t *) Tcl_Realloc((char *) shared->queue,
+                                                                 shared->queue_size * sizeof(ttrek_walk_dir_t));
+            }
+            memcpy(shared->queue + shared->queue_len, worker->dirs, worker->dirs_len * sizeof(ttrek_walk_dir_t));
+            shared->queue_len += worker->dirs_len;
+            worker->dirs_len = 0;
+        }
+
+        Tcl_ConditionNotify(&shared->cond);
+
+    }
+    Tcl_ConditionNotify(&shared->cond);
+    Tcl_MutexUnlock(&shared->mutex);
+
+}
+
+static Tcl_ThreadCreateType ttrek_WalkThreadProc(void *clientData) {
+    ttrek_WalkRun((ttrek_walk_worker_t *) clientData);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+// Lists the directory tree under root. Directories are read by num_threads
+// threads at the same time, the paths are stored in an arena that is freed
+// with ttrek_WalkFree().
+int ttrek_Walk(Tcl_Interp *interp, const char *root, int flags, int num_threads, ttrek_walk_t **walk_ptr) {
+
+    UNUSED(interp);
+
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        fprintf(stderr, "error: could not open directory %s: %s\n", root, strerror(errno));
+        return TCL_ERROR;
+    }
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    ttrek_walk_shared_t shared;
+    memset(&shared, 0, sizeof(shared));
+    shared.root_fd = root_fd;
+    shared.flags = flags;
+    shared.queue_size = 64;
+    shared.queue = (ttrek_walk_dir_t *) Tcl_Alloc(shared.queue_size * sizeof(ttrek_walk_dir_t));
+    shared.queue[0].path = "";
+    shared.queue[0].path_len = 0;
+    shared.queue_len = 1;
+
+    ttrek_walk_worker_t *workers = (ttrek_walk_worker_t *) Tcl_Alloc(num_threads * sizeof(ttrek_walk_worker_t));
+    memset(workers, 0, num_threads * sizeof(ttrek_walk_worker_t));
+    Tcl_ThreadId *thread_ids = (Tcl_ThreadId *) Tcl_Alloc(num_threads * sizeof(Tcl_ThreadId));
+
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].shared = &shared;
+        workers[i].buffer = Tcl_Alloc(TTREK_WALK_BUFFER_SIZE);
+    }
+
+    // The current thread is the first worker
+    int num_started = 1;
+    for (int i = 1; i < num_threads; i++) {
+        if (TCL_OK != Tcl_CreateThread(&thread_ids[num_started], ttrek_WalkThreadProc, &workers[num_started],
+                                       TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE)) {
+            DBG2(printf("could not create walk thread, continue with %d threads", num_started));
+            break;
+        }
+        num_started++;
+    }
+
+    ttrek_WalkRun(&workers[0]);
+
+    for (int i = 1; i < num_started; i++) {
+        int result;
+        Tcl_JoinThread(thread_ids[i], &result);
+    }
+
+    close(root_fd);
+    Tcl_MutexFinalize(&shared.mutex);
+    Tcl_ConditionFinalize(&shared.cond);
+    Tcl_Free((char *) shared.queue);
+    Tcl_Free((char *) thread_ids);
+
+    ttrek_walk_t *walk = (ttrek_walk_t *) Tcl_Alloc(sizeof(ttrek_walk_t));
+    walk->entries_len = 0;
+    walk->arena = NULL;
+
+    for (int i = 0; i < num_threads; i++) {
+        walk->entries_len += workers[i].entries_len;
+    }
+    walk->entries = (ttrek_walk_entry_t *) Tcl_Alloc((walk->entries_len + 1) * sizeof(ttrek_walk_entry_t));
+
+    Tcl_Size offset = 0;
+    for (int i = 0; i < num_threads; i++) {
+        ttrek_walk_worker_t *worker = &workers[i];
+        if (worker->entries_len > 0) {
+            memcpy(walk->entries + offset, worker->entries, worker->entries_len * sizeof(ttrek_walk_entry_t));
+            offset += worker->entries_len;
+        }
+        // Chain the arenas of all workers
+        if (worker->arena != NULL) {
+            ttrek_walk_chunk_t *last = worker->arena;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = walk->arena;
+            walk->arena = worker->arena;
+        }
+        if (worker->entries != NULL) {
+            Tcl_Free((char *) worker->entries);
+        }
+        if (worker->dirs != NULL) {
+            Tcl_Free((char *) worker->dirs);
+        }
+        Tcl_Free(worker->buffer);
+    }
+    Tcl_Free((char *) workers);
+
+    if (shared.error) {
+        fprintf(stderr, "error: could not read directory %s/%s: %s\n", root, shared.error_path,
+                strerror(shared.error));
+        Tcl_Free(shared.error_path);
+        ttrek_WalkFree(walk);
+        return TCL_ERROR;
+    }
+
+    DBG2(printf("found %" TCL_SIZE_MODIFIER "d entries in %s", walk->entries_len, root));
+
+    *walk_ptr = walk;
+    return TCL_OK;
+
+}
+
+void ttrek_WalkFree(ttrek_walk_t *walk) {
+    ttrek_WalkArenaFree(walk->arena);
+    Tcl_Free((char *) walk->entries);
+    Tcl_Free((char *) walk);
+}
@@ -0,0 +1,52 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_WALK_H
+#define TTREK_WALK_H
+
+#include "../common.h"
+#include <sys/types.h>
+
+// Flags for ttrek_Walk
+#define TTREK_WALK_NO_RECURSE 1
+// Fill ino, size, mode and mtime of every entry
+#define TTREK_WALK_STAT       2
+
+typedef enum {
+    TTREK_WALK_TYPE_FILE,
+    TTREK_WALK_TYPE_DIR,
+    TTREK_WALK_TYPE_LINK,
+    TTREK_WALK_TYPE_OTHER
+} ttrek_walk_type_t;
+
+typedef struct {
+    // The path relative to the walked directory. It is stored in the arena
+    // of the walk and is valid until ttrek_WalkFree().
+    const char *path;
+    Tcl_Size path_len;
+    ttrek_walk_type_t type;
+    // The fields below are set only with TTREK_WALK_STAT
+    ino_t ino;
+    off_t size;
+    mode_t mode;
+    time_t mtime_sec;
+    long mtime_nsec;
+} ttrek_walk_entry_t;
+
+typedef struct ttrek_walk_chunk_s ttrek_walk_chunk_t;
+
+typedef struct {
+    // All files, directories and links in the walked directory,
+    // in no particular order
+    ttrek_walk_entry_t *entries;
+    Tcl_Size entries_len;
+    ttrek_walk_chunk_t *arena;
+} ttrek_walk_t;
+
+int ttrek_Walk(Tcl_Interp *interp, const char *root, int flags, int num_threads, ttrek_walk_t **walk_ptr);
+void ttrek_WalkFree(ttrek_walk_t *walk);
+
+#endif //TTREK_WALK_H
@@ -0,0 +1,111 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "subCmdDecls.h"
+#include "ttrek_git.h"
+#include "ttrek_snapshot.h"
+#include "ttrek_store.h"
+
+static Tcl_Obj *ttrek_GcFormatSize(Tcl_WideInt size) {
+    if (size < 0) {
+        Tcl_Obj *size_ptr = ttrek_GcFormatSize(-size);
+        Tcl_Obj *result_ptr = Tcl_ObjPrintf("-%s", Tcl_GetString(size_ptr));
+        Tcl_BounceRefCount(size_ptr);
+        return result_ptr;
+    }
+    if (size < 1024) {
+        return Tcl_ObjPrintf("%" TCL_LL_MODIFIER "d bytes", size);
+    }
+    if (size < 1024 * 1024) {
+        return Tcl_ObjPrintf("%.1f KiB", (double) size / 1024);
+    }
+    return Tcl_ObjPrintf("%.1f MiB", (double) size / (1024 * 1024));
+}
+
+static void ttrek_GcPrintStats(const char *title, ttrek_git_objects_stats_t *stats_ptr) {
+    Tcl_Obj *loose_size_ptr = ttrek_GcFormatSize(stats_ptr->loose_size);
+    Tcl_Obj *pack_size_ptr = ttrek_GcFormatSize(stats_ptr->pack_size);
+    fprintf(stdout, "%-8s %" TCL_LL_MODIFIER "d loose objects (%s), %" TCL_LL_MODIFIER "d packs (%s)\n", title,
+            stats_ptr->loose_count, Tcl_GetString(loose_size_ptr), stats_ptr->pack_count,
+            Tcl_GetString(pack_size_ptr));
+    Tcl_BounceRefCount(loose_size_ptr);
+    Tcl_BounceRefCount(pack_size_ptr);
+}
+
+int ttrek_GcSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+
+    int option_user = 0;
+    int option_global = 0;
+    Tcl_ArgvInfo ArgTable[] = {
+            {TCL_ARGV_CONSTANT, "-u",        INT2PTR(1), &option_user,     "run in user mode",   NULL},
+            {TCL_ARGV_CONSTANT, "-g",        INT2PTR(1), &option_global,   "run in global mode", NULL},
+            {TCL_ARGV_END,      NULL,        NULL,       NULL,             NULL,                 NULL}
+    };
+
+    Tcl_Obj **remObjv;
+    if (TCL_OK != Tcl_ParseArgsObjv(interp, ArgTable, &objc, objv, &remObjv)) {
+        return TCL_ERROR;
+    }
+    ckfree(remObjv);
+
+    if (option_user && option_global) {
+        fprintf(stderr, "error: conflicting options -u and -g\n");
+        return TCL_ERROR;
+    }
+
+    int with_locking = 1;
+    ttrek_mode_t mode = option_user ? MODE_USER : (option_global ? MODE_GLOBAL : MODE_LOCAL);
+    ttrek_state_t *state_ptr = ttrek_CreateState(interp, 0, 0, with_locking, mode, STRATEGY_LATEST);
+
+    if (!state_ptr) {
+        fprintf(stderr, "error: initializing ttrek state failed\n");
+        return TCL_ERROR;
+    }
+
+    // Restore the last snapshot if the last run was interrupted, so that
+    // the index matches HEAD before packing
+    if (TCL_OK != ttrek_SnapshotEnsureReady(interp, state_ptr)) {
+        fprintf(stderr, "error: ensuring snapshot of the venv is ready failed\n");
+        ttrek_DestroyState(state_ptr);
+        return TCL_ERROR;
+    }
+
+    if (state_ptr->snapshot_backend == SNAPSHOT_STORE) {
+        Tcl_WideInt num_removed, removed_size;
+        if (TCL_OK != ttrek_StoreGc(interp, state_ptr, &num_removed, &removed_size)) {
+            fprintf(stderr, "error: cleaning up snapshot store failed\n");
+            ttrek_DestroyState(state_ptr);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *removed_size_ptr = ttrek_GcFormatSize(removed_size);
+        fprintf(stdout, "Removed %" TCL_LL_MODIFIER "d unused objects, reclaimed %s.\n", num_removed,
+                Tcl_GetString(removed_size_ptr));
+        Tcl_BounceRefCount(removed_size_ptr);
+        ttrek_DestroyState(state_ptr);
+        return TCL_OK;
+    }
+
+    ttrek_git_gc_result_t result;
+    if (TCL_OK != ttrek_GitGc(state_ptr, &result)) {
+        fprintf(stderr, "error: packing git repository failed\n");
+        ttrek_DestroyState(state_ptr);
+        return TCL_ERROR;
+    }
+
+    ttrek_GcPrintStats("before:", &result.before);
+    ttrek_GcPrintStats("after:", &result.after);
+
+    Tcl_WideInt reclaimed = (result.before.loose_size + result.before.pack_size)
+                            - (result.after.loose_size + result.after.pack_size);
+    Tcl_Obj *reclaimed_ptr = ttrek_GcFormatSize(reclaimed);
+    fprintf(stdout, "\nPacked %" TCL_LL_MODIFIER "d objects, reclaimed %s.\n", result.num_packed,
+            Tcl_GetString(reclaimed_ptr));
+    Tcl_BounceRefCount(reclaimed_ptr);
+
+    ttrek_DestroyState(state_ptr);
+    return TCL_OK;
+
+}
@@ -6,7 +6,7 @@
 
 #include <string.h>
 #include "subCmdDecls.h"
-#include "ttrek_git.h"
+#include "ttrek_snapshot.h"
 #include "ttrek_telemetry.h"
 
 int ttrek_InitSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
@@ -65,15 +65,28 @@ int ttrek_InitSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
 
     int option_yes = 0;
     int option_force = 0;
+    const char *option_snapshot = "git";
     Tcl_ArgvInfo ArgTable[] = {
-            {TCL_ARGV_CONSTANT, "-y", INT2PTR(1), &option_yes,   "Automatically answer yes to all the questions",                 NULL},
-            {TCL_ARGV_CONSTANT, "-f", INT2PTR(1), &option_force, "Removes various protections against unfortunate side effects.", NULL},
-            {TCL_ARGV_END,      NULL, NULL,       NULL,          NULL,                                                            NULL}
+            {TCL_ARGV_CONSTANT, "-y",        INT2PTR(1), &option_yes,      "Automatically answer yes to all the questions",                 NULL},
+            {TCL_ARGV_CONSTANT, "-f",        INT2PTR(1), &option_force,    "Removes various protections against unfortunate side effects.", NULL},
+            {TCL_ARGV_STRING,   "-snapshot", NULL,       &option_snapshot, "Where to keep the snapshots of the venv (git, store)",          NULL},
+            {TCL_ARGV_END,      NULL,        NULL,       NULL,             NULL,                                                            NULL}
     };
 
     Tcl_Obj **remObjv;
     Tcl_ParseArgsObjv(interp, ArgTable, &objc, objv, &remObjv);
 
+    ttrek_snapshot_backend_t snapshot_backend;
+    if (TCL_OK != ttrek_SnapshotBackendFromString(option_snapshot, &snapshot_backend)) {
+        fprintf(stderr, "error: unknown snapshot backend \"%s\"\n", option_snapshot);
+        Tcl_DecrRefCount(path_to_spec_ptr);
+        Tcl_DecrRefCount(path_to_lock_ptr);
+        Tcl_DecrRefCount(spec_file_name_ptr);
+        Tcl_DecrRefCount(lock_file_name_ptr);
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
 //    fprintf(stderr, "option_yes: %d\n", option_yes);
 //    fprintf(stderr, "option_force: %d\n", option_force);
 
@@ -137,8 +150,8 @@ int ttrek_InitSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
         return TCL_ERROR;
     }
 
-    if (TCL_OK != ttrek_GitInit(state_ptr)) {
-        fprintf(stderr, "error: initializing git repository failed\n");
+    if (TCL_OK != ttrek_SnapshotInit(interp, state_ptr, snapshot_backend)) {
+        fprintf(stderr, "error: initializing snapshots of the venv failed\n");
         ttrek_DestroyState(state_ptr);
         return TCL_ERROR;
     }
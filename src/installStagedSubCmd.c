@@ -0,0 +1,70 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "subCmdDecls.h"
+#include "ttrek_staging.h"
+
+// Usage: ttrek install-staged <staging dir> <install dir> <files list>
+//
+// This internal subcommand is called by install scripts at the end of
+// the install stage. It moves the files installed to the staging directory
+// into the install directory, and writes the list of new files.
+int ttrek_InstallStagedSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+
+    if (objc != 4) {
+        SetResult("wrong # args: should be \"install-staged staging_dir install_dir files_list\"");
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *staging_dir_ptr = objv[1];
+    Tcl_Obj *install_dir_ptr = objv[2];
+    Tcl_Obj *files_path_ptr = objv[3];
+
+    Tcl_Obj *files_list_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(files_list_ptr);
+
+    if (TCL_OK != ttrek_StagingMerge(interp, staging_dir_ptr, install_dir_ptr, files_list_ptr)) {
+        SetResult("could not move installed files from the staging directory");
+        Tcl_DecrRefCount(files_list_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_Size files_len;
+    Tcl_Obj **files_ptrs;
+    Tcl_ListObjGetElements(interp, files_list_ptr, &files_len, &files_ptrs);
+
+    if (files_len == 0) {
+        fprintf(stderr, "warning: no files were installed to the staging directory %s\n",
+                Tcl_GetString(staging_dir_ptr));
+    }
+
+    Tcl_Obj *contents_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(contents_ptr);
+    for (Tcl_Size i = 0; i < files_len; i++) {
+        Tcl_AppendObjToObj(contents_ptr, files_ptrs[i]);
+        Tcl_AppendToObj(contents_ptr, "\n", 1);
+    }
+    Tcl_DecrRefCount(files_list_ptr);
+
+    int rc = ttrek_WriteChars(interp, files_path_ptr, contents_ptr, 0644);
+    Tcl_DecrRefCount(contents_ptr);
+    if (rc != TCL_OK) {
+        SetResult("could not write the list of installed files");
+        return TCL_ERROR;
+    }
+
+    // Remove what is left in the staging directory, e.g. files installed
+    // outside of the install directory.
+    Tcl_Obj *error_ptr;
+    if (TCL_OK != Tcl_FSRemoveDirectory(staging_dir_ptr, 1, &error_ptr)) {
+        fprintf(stderr, "warning: could not remove staging directory %s: %s\n",
+                Tcl_GetString(staging_dir_ptr), Tcl_GetString(error_ptr));
+        Tcl_DecrRefCount(error_ptr);
+    }
+
+    return TCL_OK;
+
+}
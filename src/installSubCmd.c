@@ -10,7 +10,7 @@
 #include "subCmdDecls.h"
 #include "common.h"
 #include "ttrek_resolvo.h"
-#include "ttrek_git.h"
+#include "ttrek_snapshot.h"
 #include "ttrek_buildInstructions.h"
 #include "ttrek_scripts.h"
 #include "ttrek_genInstall.h"
@@ -85,6 +85,7 @@ int ttrek_InstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]
     int option_force = 0;
     int option_mode = MODE_LOCAL;
     int option_fail_verbose = 0;
+    int option_jobs = 1;
 
     const char *option_strategy = NULL;
     Tcl_ArgvInfo ArgTable[] = {
@@ -96,6 +97,7 @@ int ttrek_InstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]
             {TCL_ARGV_CONSTANT, "-force",        INT2PTR(1),              &option_force,        "force installation of already installed packages",                   NULL},
             {TCL_ARGV_CONSTANT, "-bootstrap",    INT2PTR(MODE_BOOTSTRAP), &option_mode,         "generate bootstrap script",                                          NULL},
             {TCL_ARGV_STRING,   "-strategy",     NULL,                    &option_strategy,     "strategy used for resolving dependencies (latest, favored, locked)", NULL},
+            {TCL_ARGV_INT,      "-jobs",         NULL,                    &option_jobs,         "number of packages to build at the same time",                       NULL},
             {TCL_ARGV_END,      NULL,            NULL,                     NULL,            NULL,                                                                 NULL}
 //            TCL_ARGV_AUTO_REST, TCL_ARGV_AUTO_HELP, TCL_ARGV_TABLE_END
     };
@@ -105,6 +107,12 @@ int ttrek_InstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]
 
     DBG(fprintf(stderr, "strategy: %s\n", (option_strategy == NULL ? "<NULL>" : option_strategy)));
 
+    if (option_jobs < 1) {
+        fprintf(stderr, "error: the number of jobs must be a positive integer\n");
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
     int with_locking;
 
     if ((ttrek_mode_t)option_mode == MODE_BOOTSTRAP) {
@@ -124,13 +132,24 @@ int ttrek_InstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]
         return TCL_ERROR;
     }
 
+    state_ptr->jobs = option_jobs;
+
+    // Commands that change the manifest fail before touching the venv
+    // if the manifest could not be loaded
+    if (ttrek_StateGetManifestRoot(state_ptr) == NULL) {
+        fprintf(stderr, "error: could not load %s\n", MANIFEST_JSON_FILE);
+        ttrek_DestroyState(state_ptr);
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
     if ((ttrek_mode_t)option_mode == MODE_BOOTSTRAP) {
         DBG2(printf("skip git initialization in bootstrap mode"));
         goto skipGitReady;
     }
 
-    if (TCL_OK != ttrek_EnsureGitReady(interp, state_ptr)) {
-        fprintf(stderr, "error: ensuring git repository is ready failed\n");
+    if (TCL_OK != ttrek_SnapshotEnsureReady(interp, state_ptr)) {
+        fprintf(stderr, "error: ensuring snapshot of the venv is ready failed\n");
         ttrek_DestroyState(state_ptr);
         ckfree(remObjv);
         return TCL_ERROR;
@@ -214,7 +233,7 @@ skipGitReady: ; // empty statement
     }
 
     if (!abort) {
-        if (TCL_OK != ttrek_GitAmend(state_ptr)) {
+        if (TCL_OK != ttrek_SnapshotSave(interp, state_ptr)) {
             fprintf(stderr, "error: committing changes failed\n");
             ttrek_DestroyState(state_ptr);
             return TCL_ERROR;
@@ -13,17 +13,23 @@ ARCHIVE_FILE="${PACKAGE}-${VERSION}.archive"
 BUILD_DIR="$ROOT_BUILD_DIR/build/${PACKAGE}-${VERSION}"
 PATCH_DIR="$ROOT_BUILD_DIR/source"
 BUILD_LOG_DIR="$ROOT_BUILD_DIR/logs/${PACKAGE}-${VERSION}"
+BUILD_STAMP_DIR="$ROOT_BUILD_DIR/build/${PACKAGE}-${VERSION}.stamps"
+BUILD_TIMING_FILE="$BUILD_LOG_DIR/timing"
+# The install stage puts files here via DESTDIR, then ttrek moves them
+# to INSTALL_DIR.
+STAGING_DIR="$ROOT_BUILD_DIR/staging/${PACKAGE}-${VERSION}"
 
 if [ -z "$SOURCE_DIR" ]; then
     SOURCE_DIR="$ROOT_BUILD_DIR/source/${PACKAGE}-${VERSION}"
-    rm -rf "$SOURCE_DIR"
     mkdir -p "$SOURCE_DIR"
 fi
 
 mkdir -p "$DOWNLOAD_DIR"
-rm -rf "$BUILD_DIR"
 mkdir -p "$BUILD_DIR"
-rm -rf "$BUILD_LOG_DIR"
+mkdir -p "$BUILD_STAMP_DIR"
+# The logs are kept when the script continues a build that was stopped
+# after TTREK_LAST_STAGE.
+[ -n "$TTREK_KEEP_LOGS" ] || rm -rf "$BUILD_LOG_DIR"
 mkdir -p "$BUILD_LOG_DIR"
 
 if [ -n "$TTREK_MAKE_THREADS" ]; then
@@ -33,14 +33,23 @@ progress() {
     [ $# -eq 1 ] || printf '\033[1A\r\033[K'
 }
 
+# Records the stage transitions as "<event> <stage> <unix time>" lines,
+# to be collected by ttrek into the build history. "fetch-unpack -timing"
+# adds the size of the archive as a "size 1 <bytes>" line.
+stage_time() {
+    [ -z "$BUILD_TIMING_FILE" ] || echo "$1 $2 $(date +%s)" >> "$BUILD_TIMING_FILE"
+}
+
 stage() {
     [ "$STAGE" != "$1" ] || return 0
     STAGE="$1"
     if [ "$STAGE" = ok ]; then
+        stage_time ok 5
         progress
         STAGE_MSG=": ${_G}Done.${_T}"
         STAGE=5
     elif [ "$STAGE" = fail ]; then
+        stage_time fail 5
         STAGE_MSG="${_R}Fail.${_T}"
         if [ $IS_TTY -eq 1 ]; then
             printf "\033[3D - $STAGE_MSG"
@@ -52,6 +61,19 @@ stage() {
         fi
         STAGE=5
     else
+        # Stop after the specified stage, the rest of the script
+        # will be run later.
+        if [ -n "$TTREK_LAST_STAGE" ] && [ "$STAGE" -gt "$TTREK_LAST_STAGE" ]; then
+            stage_time stop "$STAGE"
+            exit 0
+        fi
+        stage_time start "$STAGE"
+        if [ "$STAGE" = 4 ] && [ -n "$STAGING_DIR" ]; then
+            rm -rf "$STAGING_DIR"
+            mkdir -p "$STAGING_DIR"
+            DESTDIR="$STAGING_DIR"
+            export DESTDIR
+        fi
         STAGE_MSG=" [${STAGE}/4]:"
         [ "$STAGE" != 1 ] || STAGE_MSG="$STAGE_MSG Getting sources..."
         [ "$STAGE" != 2 ] || STAGE_MSG="$STAGE_MSG Configuring sources..."
@@ -87,4 +109,38 @@ cmd() {
     "$@"
 }
 
+# Stage fingerprints. A cached stage is skipped if its fingerprint matches
+# the one recorded after its previous successful run, and if none of
+# the preceding stages has been executed in this run.
+stage_changed() {
+    [ -z "$STAGE_DIRTY" ] || return 0
+    [ -f "$BUILD_STAMP_DIR/$1" ] || return 0
+    [ "$(cat "$BUILD_STAMP_DIR/$1")" = "$2" ] || return 0
+    # Sources could be removed by the user
+    [ "$STAGE" != 1 ] || [ -n "$(ls -A "$SOURCE_DIR")" ] || return 0
+    stage_time cached "$STAGE"
+    return 1
+}
+stage_reset() {
+    STAGE_DIRTY=1
+    # Forget the fingerprints of this stage and all subsequent stages
+    I="$1"
+    while [ -e "$BUILD_STAMP_DIR/$I" ]; do
+        rm -f "$BUILD_STAMP_DIR/$I"
+        I=$(( I + 1 ))
+    done
+    # Start getting sources and configuring from a clean state, but only
+    # once per stage as several blocks can belong to the same stage.
+    case "$STAGE_RESET" in *" $2 "*) return 0;; esac
+    STAGE_RESET="$STAGE_RESET $2 "
+    if [ "$2" = 1 ]; then
+        find "$SOURCE_DIR" -mindepth 1 -delete
+    elif [ "$2" = 2 ]; then
+        find "$BUILD_DIR" -mindepth 1 -delete
+    fi
+}
+stage_done() {
+    echo "$2" > "$BUILD_STAMP_DIR/$1"
+}
+
 init_tty
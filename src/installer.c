@@ -5,15 +5,31 @@
  */
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include "installer.h"
 #include "registry.h"
 #include "base64.h"
+#include "ttrek_staging.h"
 #include "fsmonitor/fsmonitor.h"
+#include "fsmonitor/walk.h"
+#include "ttrek_verify.h"
+#include "ttrek_index.h"
+#include "ttrek_snapshot.h"
 #include "ttrek_genInstall.h"
 #include "ttrek_useflags.h"
 
 #define MAX_INSTALL_SCRIPT_LEN 1048576
-#define MAX_PATCH_FILE_SIZE 1048576
+#define BACKUP_JOURNAL_EXT ".journal"
+#define INSTALL_COMMIT_FILE "install.commit"
+#define PATCH_CACHE_DIR "patch-cache"
 
 static char STRING_VERSION[] = "version";
 static char STRING_REQUIRES[] = "requires";
@@ -39,7 +55,8 @@ static void ttrek_AddPackageToSpec(cJSON *spec_root, const char *package_name,
     fprintf(stderr, "Added dependency %s to spec: %s\n", package_name, version_requirement);
 }
 
-static void ttrek_AddPackageToManifest(cJSON *manifest_root, const char *package_name, Tcl_Obj *files_diff) {
+static void ttrek_AddPackageToManifest(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name,
+                                       Tcl_Obj *files_diff) {
 
     // add the files that were added to the package
     cJSON *item_node = cJSON_CreateObject();
@@ -53,18 +70,24 @@ static void ttrek_AddPackageToManifest(cJSON *manifest_root, const char *package
     }
     cJSON_AddItemToObject(item_node, STRING_FILES, files_node);
 
-    if (cJSON_HasObjectItem(manifest_root, package_name)) {
-        // modify the value
-        cJSON_ReplaceItemInObject(manifest_root, package_name, item_node);
+    // record size, mode, mtime and hash of the files for 'ttrek verify'
+    cJSON *file_info_node;
+    if (TCL_OK == ttrek_VerifyGetFileInfo(interp, state_ptr->project_install_dir_ptr, files_diff,
+                                          ttrek_VerifyDefaultThreads(), &file_info_node)) {
+        cJSON_AddItemToObject(item_node, VERIFY_FILE_INFO, file_info_node);
     } else {
-        cJSON_AddItemToObject(manifest_root, package_name, item_node);
+        fprintf(stderr, "warning: could not compute checksums of files in package %s\n", package_name);
     }
 
+    ttrek_IndexSetManifestPackage(state_ptr, package_name, item_node);
+
 }
 
-static void ttrek_AddPackageToLock(cJSON *lock_root, const char *direct_version_requirement, const char *package_name,
+static void ttrek_AddPackageToLock(ttrek_state_t *state_ptr, const char *direct_version_requirement, const char *package_name,
                                    const char *package_version, cJSON *deps_node, Tcl_Obj * iuse_list_ptr, Tcl_Obj * use_list_ptr) {
 
+    cJSON *lock_root = state_ptr->lock_root;
+
     // add direct requirement to dependencies
     cJSON *deps;
     if (cJSON_HasObjectItem(lock_root, STRING_DEPENDENCIES)) {
@@ -88,8 +111,8 @@ static void ttrek_AddPackageToLock(cJSON *lock_root, const char *direct_version_
     cJSON_AddStringToObject(item_node, STRING_VERSION, package_version);
     cJSON *reqs_node = cJSON_CreateObject();
 
-    for (int i = 0; i < cJSON_GetArraySize(deps_node); i++) {
-        cJSON *dep_item = cJSON_GetArrayItem(deps_node, i);
+    cJSON *dep_item;
+    cJSON_ArrayForEach(dep_item, deps_node) {
         const char *dep_name = dep_item->string;
         const char *dep_version_requirement = dep_item->valuestring;
         DBG(fprintf(stderr, "AddPackageToLock: dep_name: %s\n", dep_name));
@@ -124,25 +147,156 @@ static void ttrek_AddPackageToLock(cJSON *lock_root, const char *direct_version_
     cJSON_AddItemToObject(item_node, STRING_USE, use_node);
 
     // add the package to the packages list
+    ttrek_IndexSetLockPackage(state_ptr, package_name, item_node);
+}
 
-    cJSON *packages = cJSON_HasObjectItem(lock_root, STRING_PACKAGES) ? cJSON_GetObjectItem(lock_root, STRING_PACKAGES) : NULL;
-    if (!packages) {
-        packages = cJSON_CreateObject();
-        cJSON_AddItemToObject(lock_root, STRING_PACKAGES, packages);
+#ifdef FICLONE
+// Creates a reflink of the file, i.e. a copy that shares data blocks with
+// the original. Works only on filesystems with copy-on-write support
+// (btrfs, xfs).
+static int ttrek_CloneFile(const char *file_path, const char *backup_file_path) {
+    int src_fd = open(file_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(src_fd);
+        return -1;
+    }
+    int dst_fd = open(backup_file_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (dst_fd < 0) {
+        close(src_fd);
+        return -1;
+    }
+    int rc = ioctl(dst_fd, FICLONE, src_fd);
+    if (rc == 0) {
+        struct timespec times[2] = {ST_ATIM(st), ST_MTIM(st)};
+        futimens(dst_fd, times);
+    }
+    close(dst_fd);
+    close(src_fd);
+    if (rc != 0) {
+        unlink(backup_file_path);
     }
+    return rc;
+}
+#endif
+
+static int ttrek_PatchWriteToFd(void *client_data, const char *data, Tcl_Size length) {
+    int fd = *(int *) client_data;
+    while (length > 0) {
+        ssize_t n = write(fd, data, (size_t) length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
 
-    if (cJSON_HasObjectItem(packages, package_name)) {
-        // modify the value
-        cJSON_ReplaceItemInObject(packages, package_name, item_node);
-    } else {
-        cJSON_AddItemToObject(packages, package_name, item_node);
+static int ttrek_PatchWriteToStdout(void *client_data, const char *data, Tcl_Size length) {
+    UNUSED(client_data);
+    return fwrite(data, 1, (size_t) length, stdout) == (size_t) length ? 0 : -1;
+}
+
+// The SHA-256 of the encoded patch, as a hex string. It identifies
+// the patch in the patch cache and in the stage fingerprints.
+static void ttrek_GetPatchHash(const char *base64_patch_diff, char hash_hex[SHA256_DIGEST_LENGTH * 2 + 1]) {
+    unsigned char hash_bin[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *) base64_patch_diff, strlen(base64_patch_diff), hash_bin);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        snprintf(&hash_hex[i * 2], 3, "%02x", hash_bin[i]);
+    }
+}
+
+// Returns the path of the decoded patch in the patch cache. The cache is
+// keyed by the SHA-256 of the encoded patch, so the same patch is decoded
+// only once, no matter how many packages or runs use it.
+static int ttrek_GetCachedPatch(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *base64_patch_diff,
+                                Tcl_Obj **blob_path_ptr) {
+    size_t base64_len = strlen(base64_patch_diff);
+    char hash_hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    ttrek_GetPatchHash(base64_patch_diff, hash_hex);
+
+    Tcl_Obj *cache_dir_ptr;
+    ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr, Tcl_NewStringObj(PATCH_CACHE_DIR, -1),
+                      &cache_dir_ptr);
+    if (TCL_OK != ttrek_EnsureDirectoryExists(interp, cache_dir_ptr)) {
+        fprintf(stderr, "error: could not create patch cache dir\n");
+        Tcl_DecrRefCount(cache_dir_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *path_ptr;
+    ttrek_ResolvePath(interp, cache_dir_ptr, Tcl_NewStringObj(hash_hex, -1), &path_ptr);
+    Tcl_DecrRefCount(cache_dir_ptr);
+
+    if (ttrek_CheckFileExists(path_ptr) == TCL_OK) {
+        DBG2(printf("patch cache hit: %s", hash_hex));
+        *blob_path_ptr = path_ptr;
+        return TCL_OK;
+    }
+
+    // Decode into a temp file first, so that an interrupted run never
+    // leaves a truncated patch in the cache.
+    Tcl_Obj *temp_path_ptr = Tcl_ObjPrintf("%s.%d", Tcl_GetString(path_ptr), (int) getpid());
+    Tcl_IncrRefCount(temp_path_ptr);
+
+    int fd = open(Tcl_GetString(temp_path_ptr), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open %s: %s\n", Tcl_GetString(temp_path_ptr), strerror(errno));
+        goto error;
+    }
+
+    int rc = base64_decode_stream(base64_patch_diff, (Tcl_Size) base64_len, ttrek_PatchWriteToFd, &fd, NULL);
+    if (close(fd) != 0) {
+        rc = -1;
+    }
+    if (rc != 0 || rename(Tcl_GetString(temp_path_ptr), Tcl_GetString(path_ptr)) != 0) {
+        fprintf(stderr, "error: could not write %s: %s\n", Tcl_GetString(path_ptr), strerror(errno));
+        unlink(Tcl_GetString(temp_path_ptr));
+        goto error;
     }
+
+    Tcl_DecrRefCount(temp_path_ptr);
+    *blob_path_ptr = path_ptr;
+    return TCL_OK;
+
+error:
+    Tcl_DecrRefCount(temp_path_ptr);
+    Tcl_DecrRefCount(path_ptr);
+    return TCL_ERROR;
+}
+
+// Places the cached patch where the install script expects it. The patch is
+// only read by the install script, so it can share the data with the cache.
+static int ttrek_PlacePatchFile(Tcl_Obj *blob_path_ptr, Tcl_Obj *patch_file_path_ptr) {
+    const char *blob_path = Tcl_GetString(blob_path_ptr);
+    const char *patch_file_path = Tcl_GetString(patch_file_path_ptr);
+
+    if (unlink(patch_file_path) != 0 && errno != ENOENT) {
+        return TCL_ERROR;
+    }
+    if (linkat(AT_FDCWD, blob_path, AT_FDCWD, patch_file_path, 0) == 0) {
+        return TCL_OK;
+    }
+#ifdef FICLONE
+    if (ttrek_CloneFile(blob_path, patch_file_path) == 0) {
+        return TCL_OK;
+    }
+#endif
+    return Tcl_FSCopyFile(blob_path_ptr, patch_file_path_ptr);
 }
 
 static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr, const char *package_name,
                                          const char *package_version, const char *os, const char *arch,
-                                         const char *direct_version_requirement, int package_num_current,
-                                         int package_num_total) {
+                                         int package_num_current, int package_num_total,
+                                         cJSON **install_spec_root_ptr, Tcl_Obj **path_to_install_file_ptr) {
 
     char install_spec_url[256];
     snprintf(install_spec_url, sizeof(install_spec_url), "%s/%s/%s/%s/%s", REGISTRY_URL, package_name, package_version,
@@ -158,6 +312,8 @@ static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *stat
     // DBG2(printf("got JSON: [%s]", Tcl_DStringValue(&ds)));
 
     cJSON *install_spec_root = cJSON_Parse(Tcl_DStringValue(&ds));
+    Tcl_DStringFree(&ds);
+
     cJSON *install_script_node = cJSON_GetObjectItem(install_spec_root, "install_script");
     if (!install_script_node) {
         fprintf(stderr, "error: install_script not found in spec file\n");
@@ -165,9 +321,30 @@ static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *stat
         return TCL_ERROR;
     }
 
+    // The patches and the dependencies are part of the stage fingerprints,
+    // a change in them rebuilds the package.
+    cJSON *patches = cJSON_GetObjectItem(install_spec_root, "patches");
+    Tcl_Obj *patch_hashes_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(patch_hashes_ptr);
+    cJSON *patch_item;
+    cJSON_ArrayForEach(patch_item, patches) {
+        if (cJSON_IsString(patch_item)) {
+            char hash_hex[SHA256_DIGEST_LENGTH * 2 + 1];
+            ttrek_GetPatchHash(patch_item->valuestring, hash_hex);
+            Tcl_ListObjAppendElement(interp, patch_hashes_ptr, Tcl_ObjPrintf("%s %s", patch_item->string, hash_hex));
+        }
+    }
+
+    Tcl_Obj *dependencies_ptr = ttrek_GetDependencyVersions(interp, state_ptr,
+                                                            cJSON_GetObjectItem(install_spec_root, STRING_DEPENDENCIES));
+    Tcl_IncrRefCount(dependencies_ptr);
+
     Tcl_Obj *install_script_full = ttrek_generateInstallScript(interp, package_name,
                                                                package_version, NULL, install_script_node,
+                                                               patch_hashes_ptr, dependencies_ptr,
                                                                global_use_flags_ht_ptr, state_ptr);
+    Tcl_DecrRefCount(patch_hashes_ptr);
+    Tcl_DecrRefCount(dependencies_ptr);
 
     if (install_script_full == NULL) {
         fprintf(stderr, "error: could not generate install script: %s\n",
@@ -177,19 +354,12 @@ static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *stat
     }
     Tcl_IncrRefCount(install_script_full);
 
-    cJSON *patches = cJSON_GetObjectItem(install_spec_root, "patches");
     if (patches) {
         for (int i = 0; i < cJSON_GetArraySize(patches); i++) {
             cJSON *patch_item = cJSON_GetArrayItem(patches, i);
             const char *patch_name = patch_item->string;
             const char *base64_patch_diff = patch_item->valuestring;
             fprintf(stderr, "patch_name: %s\n", patch_name);
-//            fprintf(stderr, "patch_diff: %s\n", base64_patch_diff);
-
-            char patch_diff[1024 * 1024];
-            Tcl_Size patch_diff_len;
-            base64_decode(base64_patch_diff, strnlen(base64_patch_diff, MAX_PATCH_FILE_SIZE), patch_diff,
-                          &patch_diff_len);
 
             char patch_filename[256];
             snprintf(patch_filename, sizeof(patch_filename), "source/patch-%s-%s-%s", package_name, package_version,
@@ -197,21 +367,48 @@ static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *stat
 
             if (state_ptr->mode == MODE_BOOTSTRAP) {
 
-                Tcl_Obj *patch_bootstrap = Tcl_ObjPrintf(
+                // The patch is decoded straight to the output, chunk by chunk,
+                // between the heredoc header and trailer.
+                Tcl_Obj *patch_header = Tcl_ObjPrintf(
                     "\n"
-                    "cat <<'__TTREK_PATCH_EOF__' > \"$ROOT_BUILD_DIR/%s\"\n"
-                    "%s\n"
-                    "__TTREK_PATCH_EOF__\n", patch_filename, patch_diff);
+                    "cat <<'__TTREK_PATCH_EOF__' > \"$ROOT_BUILD_DIR/%s\"\n", patch_filename);
+                ttrek_OutputBootstrap(state_ptr, Tcl_GetString(patch_header));
+                Tcl_BounceRefCount(patch_header);
 
-                ttrek_OutputBootstrap(state_ptr, Tcl_GetString(patch_bootstrap));
-                Tcl_BounceRefCount(patch_bootstrap);
+                int rc = base64_decode_stream(base64_patch_diff, (Tcl_Size) strlen(base64_patch_diff),
+                                              ttrek_PatchWriteToStdout, NULL, NULL);
+
+                ttrek_OutputBootstrap(state_ptr, "\n__TTREK_PATCH_EOF__\n");
+
+                if (rc != 0) {
+                    fprintf(stderr, "error: could not decode patch %s\n", patch_name);
+                    Tcl_DecrRefCount(install_script_full);
+                    cJSON_free(install_spec_root);
+                    return TCL_ERROR;
+                }
 
             } else {
 
+                Tcl_Obj *blob_path_ptr;
+                if (TCL_OK != ttrek_GetCachedPatch(interp, state_ptr, base64_patch_diff, &blob_path_ptr)) {
+                    fprintf(stderr, "error: could not decode patch %s\n", patch_name);
+                    Tcl_DecrRefCount(install_script_full);
+                    cJSON_free(install_spec_root);
+                    return TCL_ERROR;
+                }
+
                 Tcl_Obj *patch_file_path_ptr;
                 ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr, Tcl_NewStringObj(patch_filename, -1),
                                   &patch_file_path_ptr);
-                ttrek_WriteChars(interp, patch_file_path_ptr, Tcl_NewStringObj(patch_diff, -1), 0644);
+                int rc = ttrek_PlacePatchFile(blob_path_ptr, patch_file_path_ptr);
+                Tcl_DecrRefCount(blob_path_ptr);
+                Tcl_DecrRefCount(patch_file_path_ptr);
+                if (rc != TCL_OK) {
+                    fprintf(stderr, "error: could not write patch %s\n", patch_name);
+                    Tcl_DecrRefCount(install_script_full);
+                    cJSON_free(install_spec_root);
+                    return TCL_ERROR;
+                }
 
             }
         }
@@ -220,80 +417,67 @@ static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *stat
     if (state_ptr->mode == MODE_BOOTSTRAP) {
         DBG2(printf("send install script to stdout in bootstrap mode"));
 
-        Tcl_Obj *package_counter = ttrek_generatePackageCounter(interp, package_num_current, package_num_total);
-        ttrek_OutputBootstrap(state_ptr, Tcl_GetString(package_counter));
-        Tcl_BounceRefCount(package_counter);
-
-        ttrek_OutputBootstrap(state_ptr, Tcl_GetString(install_script_full));
+        Tcl_Obj *package_script = ttrek_generateBootstrapPackage(interp, package_num_current, package_num_total,
+                                                                 install_script_full);
+        ttrek_OutputBootstrap(state_ptr, Tcl_GetString(package_script));
+        Tcl_BounceRefCount(package_script);
 
-        cJSON_free(install_spec_root);
         Tcl_DecrRefCount(install_script_full);
+        *install_spec_root_ptr = install_spec_root;
+        *path_to_install_file_ptr = NULL;
         return TCL_OK;
     }
 
     char install_filename[256];
     snprintf(install_filename, sizeof(install_filename), "install-%s-%s.sh", package_name, package_version);
 
-    Tcl_Obj *path_to_install_file_ptr;
     ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr, Tcl_NewStringObj(install_filename, -1),
-                      &path_to_install_file_ptr);
-    ttrek_WriteChars(interp, path_to_install_file_ptr, install_script_full, 0744);
+                      path_to_install_file_ptr);
+    ttrek_WriteChars(interp, *path_to_install_file_ptr, install_script_full, 0744);
 
     Tcl_DecrRefCount(install_script_full);
 
-    char package_num_current_str[5];
-    snprintf(package_num_current_str, sizeof(package_num_current_str), "%d", package_num_current);
-    char package_num_total_str[5];
-    snprintf(package_num_total_str, sizeof(package_num_total_str), "%d", package_num_total);
-
-    Tcl_Size argc = 3;
-    const char *argv[4] = {
-            Tcl_GetString(path_to_install_file_ptr),
-            package_num_current_str,
-            package_num_total_str,
-            NULL
-    };
-    DBG(fprintf(stderr, "path_to_install_file: %s\n", Tcl_GetString(path_to_install_file_ptr)));
-
-    ttrek_fsmonitor_state_t *fsmonitor_state_ptr = (ttrek_fsmonitor_state_t *) Tcl_Alloc(
-            sizeof(ttrek_fsmonitor_state_t));
-    fsmonitor_state_ptr->files_before = NULL;
-    fsmonitor_state_ptr->files_diff = NULL;
-    if (TCL_OK != ttrek_FSMonitor_AddWatch(interp, state_ptr->project_install_dir_ptr, fsmonitor_state_ptr)) {
-        fprintf(stderr, "error: could not add watch on install directory\n");
-        Tcl_Free((char *) fsmonitor_state_ptr);
-        cJSON_free(install_spec_root);
-        Tcl_DStringFree(&ds);
-        return TCL_ERROR;
-    }
+    *install_spec_root_ptr = install_spec_root;
+    return TCL_OK;
+}
 
-    if (ttrek_ExecuteCommand(interp, argc, argv, NULL) != TCL_OK) {
-        fprintf(stderr, "error: could not execute install script to completion: %s\n",
-                Tcl_GetString(path_to_install_file_ptr));
-        (void) ttrek_FSMonitor_RemoveWatch(interp, fsmonitor_state_ptr);
-        Tcl_Free((char *) fsmonitor_state_ptr);
-        cJSON_free(install_spec_root);
-        Tcl_DStringFree(&ds);
-        return TCL_ERROR;
+void ttrek_SetPlannedVersion(ttrek_state_t *state_ptr, const char *package_name, const char *package_version) {
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&state_ptr->planned_versions_ht, package_name, &is_new);
+    if (!is_new) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
     }
+    Tcl_Obj *version_ptr = Tcl_NewStringObj(package_version, -1);
+    Tcl_IncrRefCount(version_ptr);
+    Tcl_SetHashValue(entry, version_ptr);
+}
 
-    if (TCL_OK != ttrek_FSMonitor_ReadChanges(interp, state_ptr->project_install_dir_ptr, fsmonitor_state_ptr)) {
-        fprintf(stderr, "error: could not read changes from file system\n");
-        (void) ttrek_FSMonitor_RemoveWatch(interp, fsmonitor_state_ptr);
-        Tcl_Free((char *) fsmonitor_state_ptr);
-        cJSON_free(install_spec_root);
-        Tcl_DStringFree(&ds);
-        return TCL_ERROR;
+// Returns the list of name@version of the dependencies, with refcount=0.
+// The version is the one from the execution plan, or the installed one
+// if the dependency is not going to be installed.
+Tcl_Obj *ttrek_GetDependencyVersions(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *deps_node) {
+    Tcl_Obj *list_ptr = Tcl_NewListObj(0, NULL);
+    cJSON *dep_node;
+    cJSON_ArrayForEach(dep_node, deps_node) {
+        const char *dep_name = dep_node->string;
+        const char *dep_version = "";
+        Tcl_HashEntry *entry = Tcl_FindHashEntry(&state_ptr->planned_versions_ht, dep_name);
+        if (entry != NULL) {
+            dep_version = Tcl_GetString((Tcl_Obj *) Tcl_GetHashValue(entry));
+        } else {
+            ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, dep_name);
+            if (package_ptr != NULL && package_ptr->version != NULL) {
+                dep_version = package_ptr->version;
+            }
+        }
+        Tcl_ListObjAppendElement(interp, list_ptr, Tcl_ObjPrintf("%s@%s", dep_name, dep_version));
     }
+    return list_ptr;
+}
 
-//    Tcl_Size files_diff_len;
-//    Tcl_ListObjLength(interp, fsmonitor_state_ptr->files_diff, &files_diff_len);
-//    for (int i = 0; i < files_diff_len; i++) {
-//        Tcl_Obj *file_diff_ptr;
-//        Tcl_ListObjIndex(interp, fsmonitor_state_ptr->files_diff, i, &file_diff_ptr);
-//        fprintf(stderr, "file_diff: %s\n", Tcl_GetString(file_diff_ptr));
-//    }
-
+void ttrek_AddInstalledPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr,
+                               const char *package_name, const char *package_version,
+                               const char *direct_version_requirement, cJSON *install_spec_root, Tcl_Obj *files_diff) {
 
     cJSON *iuse_node = cJSON_GetObjectItem(install_spec_root, STRING_IUSE);
     Tcl_Obj *iuse_list_ptr = Tcl_NewListObj(0, NULL);
@@ -313,35 +497,33 @@ static int ttrek_InstallScriptAndPatches(Tcl_Interp *interp, ttrek_state_t *stat
     if (strncmp(direct_version_requirement, "none", 4) != 0) {
         if (strnlen(direct_version_requirement, 256) > 0) {
             ttrek_AddPackageToSpec(state_ptr->spec_root, package_name, direct_version_requirement);
-            ttrek_AddPackageToLock(state_ptr->lock_root, direct_version_requirement, package_name, package_version,
+            ttrek_AddPackageToLock(state_ptr, direct_version_requirement, package_name, package_version,
                                    deps_node, iuse_list_ptr, use_list_ptr);
         } else {
             char package_version_with_caret_op[256];
             snprintf(package_version_with_caret_op, sizeof(package_version_with_caret_op), "^%s", package_version);
             ttrek_AddPackageToSpec(state_ptr->spec_root, package_name, package_version_with_caret_op);
-            ttrek_AddPackageToLock(state_ptr->lock_root, package_version_with_caret_op, package_name, package_version,
+            ttrek_AddPackageToLock(state_ptr, package_version_with_caret_op, package_name, package_version,
                                    deps_node, iuse_list_ptr, use_list_ptr);
         }
     } else {
-        ttrek_AddPackageToLock(state_ptr->lock_root, NULL, package_name, package_version, deps_node, iuse_list_ptr, use_list_ptr);
+        ttrek_AddPackageToLock(state_ptr, NULL, package_name, package_version, deps_node, iuse_list_ptr, use_list_ptr);
+    }
+    ttrek_AddPackageToManifest(interp, state_ptr, package_name, files_diff);
+
+    // The files of every package that is recorded in the manifest must get
+    // into the snapshot, no matter how the package was built.
+    Tcl_Size files_len;
+    Tcl_Obj **files_ptrs;
+    Tcl_ListObjGetElements(interp, files_diff, &files_len, &files_ptrs);
+    for (Tcl_Size i = 0; i < files_len; i++) {
+        ttrek_SnapshotTrackInstalledFile(state_ptr, Tcl_GetString(files_ptrs[i]));
     }
-    ttrek_AddPackageToManifest(state_ptr->manifest_root, package_name, fsmonitor_state_ptr->files_diff);
+
+    ttrek_ManifestMarkChanged(state_ptr, package_name);
 
     Tcl_DecrRefCount(iuse_list_ptr);
     Tcl_DecrRefCount(use_list_ptr);
-
-    if (TCL_OK != ttrek_FSMonitor_RemoveWatch(interp, fsmonitor_state_ptr)) {
-        fprintf(stderr, "error: could not remove watch on install directory\n");
-        Tcl_Free((char *) fsmonitor_state_ptr);
-        cJSON_free(install_spec_root);
-        Tcl_DStringFree(&ds);
-        return TCL_ERROR;
-    }
-
-    Tcl_Free((char *) fsmonitor_state_ptr);
-    cJSON_free(install_spec_root);
-    Tcl_DStringFree(&ds);
-    return TCL_OK;
 }
 
 static int ttrek_EnsureDirectoryTreeExists(Tcl_Interp *interp, Tcl_Obj *file_path_ptr) {
@@ -372,16 +554,62 @@ static int ttrek_EnsureDirectoryTreeExists(Tcl_Interp *interp, Tcl_Obj *file_pat
     return TCL_OK;
 }
 
-static int ttrek_BackupPackageFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
-    cJSON *package = cJSON_GetObjectItem(state_ptr->manifest_root, package_name);
-    if (!package) {
+static Tcl_Obj *ttrek_GetBackupJournalPath(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
+    Tcl_Obj *journal_path_ptr;
+    ttrek_ResolvePath(interp, state_ptr->project_temp_dir_ptr,
+                      Tcl_ObjPrintf("%s%s", package_name, BACKUP_JOURNAL_EXT), &journal_path_ptr);
+    return journal_path_ptr;
+}
+
+// Backs up a single file. A hard link is enough here, because the file is
+// deleted from the install directory right after the backup and the install
+// script creates a new file in its place. If the hard link cannot be created
+// (e.g. the temp directory is on another filesystem), a reflink and then
+// a regular copy are tried.
+static int ttrek_BackupFile(Tcl_Interp *interp, Tcl_Obj *file_path_ptr, Tcl_Obj *backup_file_path_ptr) {
+    const char *file_path = Tcl_GetString(file_path_ptr);
+    const char *backup_file_path = Tcl_GetString(backup_file_path_ptr);
+
+    int rc = linkat(AT_FDCWD, file_path, AT_FDCWD, backup_file_path, 0);
+    // Directories in the backup are created on demand to avoid checking
+    // them for each file.
+    if (rc != 0 && errno == ENOENT && ttrek_CheckFileExists(file_path_ptr) == TCL_OK) {
+        if (TCL_OK != ttrek_EnsureDirectoryTreeExists(interp, backup_file_path_ptr)) {
+            return TCL_ERROR;
+        }
+        rc = linkat(AT_FDCWD, file_path, AT_FDCWD, backup_file_path, 0);
+    }
+    if (rc == 0) {
         return TCL_OK;
     }
 
-    cJSON *files = cJSON_GetObjectItem(package, STRING_FILES);
-    if (!files) {
+#ifdef FICLONE
+    if (ttrek_CloneFile(file_path, backup_file_path) == 0) {
         return TCL_OK;
     }
+#endif
+
+    return Tcl_FSCopyFile(file_path_ptr, backup_file_path_ptr);
+}
+
+static int ttrek_BackupPackageFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    if (!package_ptr || !package_ptr->files) {
+        return TCL_OK;
+    }
+
+    cJSON *files = package_ptr->files;
+
+    // A journal left by an interrupted run means that some of the package
+    // files may exist only in the backup. Put them back first.
+    Tcl_Obj *journal_path_ptr = ttrek_GetBackupJournalPath(interp, state_ptr, package_name);
+    if (ttrek_CheckFileExists(journal_path_ptr) == TCL_OK) {
+        if (TCL_OK != ttrek_RestoreTempFiles(interp, state_ptr, package_name)) {
+            fprintf(stderr, "error: could not restore files of %s from interrupted installation\n", package_name);
+            Tcl_DecrRefCount(journal_path_ptr);
+            return TCL_ERROR;
+        }
+    }
 
     Tcl_Obj *temp_package_dir_ptr;
     ttrek_ResolvePath(interp, state_ptr->project_temp_dir_ptr, Tcl_NewStringObj(package_name, -1),
@@ -392,6 +620,7 @@ static int ttrek_BackupPackageFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr
         if (TCL_OK != Tcl_FSRemoveDirectory(temp_package_dir_ptr, 1, &error_ptr)) {
             fprintf(stderr, "error: could not remove temp dir for package %s\n", package_name);
             Tcl_DecrRefCount(temp_package_dir_ptr);
+            Tcl_DecrRefCount(journal_path_ptr);
             return TCL_ERROR;
         }
     }
@@ -399,62 +628,68 @@ static int ttrek_BackupPackageFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr
     if (TCL_OK != Tcl_FSCreateDirectory(temp_package_dir_ptr)) {
         fprintf(stderr, "error: could not create temp dir for package %s\n", package_name);
         Tcl_DecrRefCount(temp_package_dir_ptr);
+        Tcl_DecrRefCount(journal_path_ptr);
         return TCL_ERROR;
     }
 
     Tcl_Obj *file_path_ptr;
     Tcl_Obj *temp_file_path_ptr;
-    for (int i = 0; i < cJSON_GetArraySize(files); i++) {
-        cJSON *file = cJSON_GetArrayItem(files, i);
+    cJSON *file;
+    cJSON_ArrayForEach(file, files) {
         const char *file_path = file->valuestring;
 
-        // move the file from install dir to temp dir
-
         ttrek_ResolvePath(interp, state_ptr->project_install_dir_ptr, Tcl_NewStringObj(file_path, -1), &file_path_ptr);
         ttrek_ResolvePath(interp, temp_package_dir_ptr, Tcl_NewStringObj(file_path, -1), &temp_file_path_ptr);
 
-        // create directory structure if it does not exist in temp_file_path_ptr
-
-        if (TCL_OK != ttrek_EnsureDirectoryTreeExists(interp, temp_file_path_ptr)) {
-            fprintf(stderr, "error: could not create directory tree for %s\n", file_path);
-            Tcl_DecrRefCount(file_path_ptr);
-            Tcl_DecrRefCount(temp_package_dir_ptr);
-            Tcl_DecrRefCount(temp_file_path_ptr);
-            return TCL_ERROR;
-        }
-
-        if (TCL_OK != Tcl_FSCopyFile(file_path_ptr, temp_file_path_ptr)) {
+        if (TCL_OK != ttrek_BackupFile(interp, file_path_ptr, temp_file_path_ptr)) {
             fprintf(stderr, "error: could not copy file %s to temp dir (%s)\n", Tcl_GetString(file_path_ptr),
                     Tcl_GetString(temp_file_path_ptr));
             Tcl_DecrRefCount(file_path_ptr);
             Tcl_DecrRefCount(temp_package_dir_ptr);
             Tcl_DecrRefCount(temp_file_path_ptr);
+            Tcl_DecrRefCount(journal_path_ptr);
             return TCL_ERROR;
         }
         Tcl_DecrRefCount(file_path_ptr);
         Tcl_DecrRefCount(temp_file_path_ptr);
     }
+    Tcl_DecrRefCount(temp_package_dir_ptr);
 
-    return TCL_OK;
+    // The journal is written only when the backup is complete. From now on,
+    // the package files can be deleted from the install directory, and
+    // the backup is restored from the journal if the installation fails
+    // or is interrupted. The list of files is kept in the journal, since
+    // the manifest is updated as soon as the new version is installed.
+    cJSON *journal_root = cJSON_CreateObject();
+    cJSON_AddStringToObject(journal_root, "package", package_name);
+    cJSON_AddItemToObject(journal_root, STRING_FILES, cJSON_Duplicate(files, 1));
+    int rc = ttrek_WriteJsonFile(interp, journal_path_ptr, journal_root);
+    if (TCL_OK != rc) {
+        fprintf(stderr, "error: could not write backup journal for package %s\n", package_name);
+    }
+    cJSON_Delete(journal_root);
+    Tcl_DecrRefCount(journal_path_ptr);
+
+    return rc;
 }
 
 static int ttrek_DeletePackageFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
-    cJSON *package = cJSON_GetObjectItem(state_ptr->manifest_root, package_name);
-    if (!package) {
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    if (!package_ptr || !package_ptr->files) {
         return TCL_OK;
     }
 
-    cJSON *files = cJSON_GetObjectItem(package, STRING_FILES);
-    if (!files) {
-        return TCL_OK;
-    }
+    cJSON *files = package_ptr->files;
 
     Tcl_Obj *file_path_ptr;
-    for (int i = 0; i < cJSON_GetArraySize(files); i++) {
-        cJSON *file = cJSON_GetArrayItem(files, i);
+    cJSON *file;
+    cJSON_ArrayForEach(file, files) {
         const char *file_path = file->valuestring;
         ttrek_ResolvePath(interp, state_ptr->project_install_dir_ptr, Tcl_NewStringObj(file_path, -1), &file_path_ptr);
         DBG(fprintf(stderr, "deleting... file_path: %s\n", Tcl_GetString(file_path_ptr)));
+        ttrek_SnapshotTrackInstalledFile(state_ptr, file_path);
+        // The package can install the file again, it is a new file then
+        ttrek_FSMonitor_ForgetFile(state_ptr->fsmonitor_state_ptr, file_path);
         if (TCL_OK != Tcl_FSDeleteFile(file_path_ptr)) {
             fprintf(stderr, "error: could not delete file %s\n", file_path);
             Tcl_DecrRefCount(file_path_ptr);
@@ -466,46 +701,266 @@ static int ttrek_DeletePackageFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr
     return TCL_OK;
 }
 
-int ttrek_RestoreTempFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
-    cJSON *package = cJSON_GetObjectItem(state_ptr->manifest_root, package_name);
-    if (!package) {
+// Removes the directories that held files of the uninstalled package and
+// have no files left in them, empty subdirectories included. Directories
+// that still have files, e.g. of other packages, are kept.
+static int ttrek_PruneEmptyDirectories(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *files) {
+
+    // The directories of the package files and their parents
+    Tcl_HashTable dirs_ht;
+    Tcl_InitHashTable(&dirs_ht, TCL_STRING_KEYS);
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    cJSON *file;
+    cJSON_ArrayForEach(file, files) {
+        if (!cJSON_IsString(file)) {
+            continue;
+        }
+        Tcl_DStringSetLength(&ds, 0);
+        Tcl_DStringAppend(&ds, file->valuestring, -1);
+        char *path = Tcl_DStringValue(&ds);
+        for (char *p = strrchr(path, '/'); p != NULL && p > path; p = strrchr(path, '/')) {
+            *p = '\0';
+            int is_new;
+            Tcl_CreateHashEntry(&dirs_ht, path, &is_new);
+            if (!is_new) {
+                break;
+            }
+        }
+    }
+
+    if (dirs_ht.numEntries == 0) {
+        Tcl_DStringFree(&ds);
+        Tcl_DeleteHashTable(&dirs_ht);
+        return TCL_OK;
+    }
+
+    ttrek_walk_t *walk;
+    if (TCL_OK != ttrek_Walk(interp, Tcl_GetString(state_ptr->project_install_dir_ptr), 0, state_ptr->jobs,
+                             &walk)) {
+        Tcl_DStringFree(&ds);
+        Tcl_DeleteHashTable(&dirs_ht);
+        return TCL_ERROR;
+    }
+
+    // The directories that still have files somewhere below them
+    Tcl_HashTable used_dirs_ht;
+    Tcl_InitHashTable(&used_dirs_ht, TCL_STRING_KEYS);
+    for (Tcl_Size i = 0; i < walk->entries_len; i++) {
+        ttrek_walk_entry_t *entry = &walk->entries[i];
+        if (entry->type == TTREK_WALK_TYPE_DIR) {
+            continue;
+        }
+        Tcl_DStringSetLength(&ds, 0);
+        Tcl_DStringAppend(&ds, entry->path, entry->path_len);
+        char *path = Tcl_DStringValue(&ds);
+        for (char *p = strrchr(path, '/'); p != NULL && p > path; p = strrchr(path, '/')) {
+            *p = '\0';
+            int is_new;
+            Tcl_CreateHashEntry(&used_dirs_ht, path, &is_new);
+            if (!is_new) {
+                break;
+            }
+        }
+    }
+
+    // Remove the topmost directories without files, with their empty
+    // subdirectories
+    int rc = TCL_OK;
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&dirs_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+
+        const char *dir = Tcl_GetHashKey(&dirs_ht, entry);
+        if (Tcl_FindHashEntry(&used_dirs_ht, dir) != NULL) {
+            continue;
+        }
+
+        const char *slash = strrchr(dir, '/');
+        if (slash != NULL) {
+            Tcl_DStringSetLength(&ds, 0);
+            Tcl_DStringAppend(&ds, dir, slash - dir);
+            if (Tcl_FindHashEntry(&used_dirs_ht, Tcl_DStringValue(&ds)) == NULL) {
+                // The parent is removed as well
+                continue;
+            }
+        }
+
+        Tcl_Obj *dir_path_ptr;
+        ttrek_ResolvePath(interp, state_ptr->project_install_dir_ptr, Tcl_NewStringObj(dir, -1), &dir_path_ptr);
+        DBG2(printf("remove empty directory: %s", Tcl_GetString(dir_path_ptr)));
+        Tcl_Obj *error_ptr = NULL;
+        if (TCL_OK != Tcl_FSRemoveDirectory(dir_path_ptr, 1, &error_ptr) && Tcl_FSAccess(dir_path_ptr, F_OK) == 0) {
+            fprintf(stderr, "error: could not remove directory %s\n", Tcl_GetString(dir_path_ptr));
+            rc = TCL_ERROR;
+        }
+        if (error_ptr != NULL) {
+            Tcl_DecrRefCount(error_ptr);
+        }
+        Tcl_DecrRefCount(dir_path_ptr);
+
+    }
+
+    ttrek_WalkFree(walk);
+    Tcl_DeleteHashTable(&used_dirs_ht);
+    Tcl_DeleteHashTable(&dirs_ht);
+    Tcl_DStringFree(&ds);
+    return rc;
+
+}
+
+// Moves a file or a directory from the backup back to the install
+// directory. The backup may be a copy on another filesystem (see
+// ttrek_BackupFile()), then rename() fails with EXDEV and the backup is
+// copied and removed instead.
+static int ttrek_RestoreMove(Tcl_Obj *temp_path_ptr, Tcl_Obj *path_ptr) {
+    if (rename(Tcl_GetString(temp_path_ptr), Tcl_GetString(path_ptr)) == 0) {
         return TCL_OK;
     }
+    if (errno != EXDEV) {
+        return TCL_ERROR;
+    }
+
+    struct stat st;
+    if (lstat(Tcl_GetString(temp_path_ptr), &st) != 0) {
+        return TCL_ERROR;
+    }
 
-    cJSON *files = cJSON_GetObjectItem(package, STRING_FILES);
-    if (!files) {
+    Tcl_Obj *error_ptr = NULL;
+    int rc;
+    if (S_ISDIR(st.st_mode)) {
+        rc = Tcl_FSCopyDirectory(temp_path_ptr, path_ptr, &error_ptr);
+        if (rc == TCL_OK) {
+            rc = Tcl_FSRemoveDirectory(temp_path_ptr, 1, &error_ptr);
+        }
+    } else {
+        rc = Tcl_FSCopyFile(temp_path_ptr, path_ptr);
+        if (rc == TCL_OK) {
+            rc = Tcl_FSDeleteFile(temp_path_ptr);
+        }
+    }
+    if (error_ptr != NULL) {
+        Tcl_DecrRefCount(error_ptr);
+    }
+    return rc;
+}
+
+// Moves back the topmost directory of the file that is missing in
+// the install directory. This way, a whole directory tree is restored
+// with a single rename.
+static int ttrek_RestoreMissingDirectory(Tcl_Interp *interp, ttrek_state_t *state_ptr,
+                                         Tcl_Obj *temp_package_dir_ptr, const char *file_path) {
+    Tcl_Size len;
+    Tcl_Obj *file_path_ptr = Tcl_NewStringObj(file_path, -1);
+    Tcl_IncrRefCount(file_path_ptr);
+    Tcl_Obj *list_ptr = Tcl_FSSplitPath(file_path_ptr, &len);
+    Tcl_IncrRefCount(list_ptr);
+    Tcl_DecrRefCount(file_path_ptr);
+
+    int rc = TCL_ERROR;
+    for (Tcl_Size i = 1; i < len; i++) {
+        Tcl_Obj *dir_path_ptr;
+        ttrek_ResolvePath(interp, state_ptr->project_install_dir_ptr, Tcl_FSJoinPath(list_ptr, i), &dir_path_ptr);
+        if (ttrek_CheckFileExists(dir_path_ptr) == TCL_OK) {
+            Tcl_DecrRefCount(dir_path_ptr);
+            continue;
+        }
+        Tcl_Obj *temp_dir_path_ptr;
+        ttrek_ResolvePath(interp, temp_package_dir_ptr, Tcl_FSJoinPath(list_ptr, i), &temp_dir_path_ptr);
+        rc = ttrek_RestoreMove(temp_dir_path_ptr, dir_path_ptr);
+        Tcl_DecrRefCount(temp_dir_path_ptr);
+        Tcl_DecrRefCount(dir_path_ptr);
+        break;
+    }
+
+    Tcl_DecrRefCount(list_ptr);
+    return rc;
+}
+
+// Restores the package files from the backup made before the installation.
+// Each step can be repeated, so that a restore interrupted half-way is
+// completed by the next run. The journal is removed only after all files
+// are back in place.
+int ttrek_RestoreTempFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
+    Tcl_Obj *journal_path_ptr = ttrek_GetBackupJournalPath(interp, state_ptr, package_name);
+    if (ttrek_CheckFileExists(journal_path_ptr) != TCL_OK) {
+        // The backup was never completed, so the package files were not deleted
+        Tcl_DecrRefCount(journal_path_ptr);
         return TCL_OK;
     }
 
-    for (int i = 0; i < cJSON_GetArraySize(files); i++) {
-        cJSON *file = cJSON_GetArrayItem(files, i);
+    cJSON *journal_root;
+    if (TCL_OK != ttrek_FileToJson(interp, journal_path_ptr, &journal_root)) {
+        fprintf(stderr, "error: could not read backup journal for package %s\n", package_name);
+        Tcl_DecrRefCount(journal_path_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *temp_package_dir_ptr;
+    ttrek_ResolvePath(interp, state_ptr->project_temp_dir_ptr, Tcl_NewStringObj(package_name, -1),
+                      &temp_package_dir_ptr);
+
+    int rc = TCL_OK;
+    cJSON *files = cJSON_GetObjectItem(journal_root, STRING_FILES);
+    cJSON *file;
+    cJSON_ArrayForEach(file, files) {
         const char *file_path = file->valuestring;
         // move the file from temp dir to install dir
-        Tcl_Obj *temp_package_dir_ptr;
-        ttrek_ResolvePath(interp, state_ptr->project_temp_dir_ptr, Tcl_NewStringObj(package_name, -1),
-                          &temp_package_dir_ptr);
         Tcl_Obj *temp_file_path_ptr;
         ttrek_ResolvePath(interp, temp_package_dir_ptr, Tcl_NewStringObj(file_path, -1), &temp_file_path_ptr);
         Tcl_Obj *file_path_ptr;
         ttrek_ResolvePath(interp, state_ptr->project_install_dir_ptr, Tcl_NewStringObj(file_path, -1), &file_path_ptr);
-        if (TCL_OK != Tcl_FSRenameFile(temp_file_path_ptr, file_path_ptr)) {
-            fprintf(stderr, "error: could not move file %s to install dir\n", file_path);
-            Tcl_DecrRefCount(temp_package_dir_ptr);
-            Tcl_DecrRefCount(temp_file_path_ptr);
-            Tcl_DecrRefCount(file_path_ptr);
-            return TCL_ERROR;
+
+        if (TCL_OK != ttrek_RestoreMove(temp_file_path_ptr, file_path_ptr)) {
+            if (ttrek_CheckFileExists(temp_file_path_ptr) != TCL_OK) {
+                // The file was already moved back by an interrupted restore
+                // or together with its directory.
+                if (ttrek_CheckFileExists(file_path_ptr) != TCL_OK) {
+                    fprintf(stderr, "error: backup of file %s is missing\n", file_path);
+                    rc = TCL_ERROR;
+                }
+            } else if (TCL_OK != ttrek_RestoreMissingDirectory(interp, state_ptr, temp_package_dir_ptr, file_path)) {
+                fprintf(stderr, "error: could not move file %s to install dir\n", file_path);
+                rc = TCL_ERROR;
+            }
         }
-        Tcl_DecrRefCount(temp_package_dir_ptr);
+
         Tcl_DecrRefCount(temp_file_path_ptr);
         Tcl_DecrRefCount(file_path_ptr);
+        if (rc != TCL_OK) {
+            break;
+        }
     }
-    return TCL_OK;
+
+    Tcl_DecrRefCount(temp_package_dir_ptr);
+    cJSON_Delete(journal_root);
+
+    if (rc == TCL_OK) {
+        rc = ttrek_DeleteTempFiles(interp, state_ptr, package_name);
+    }
+
+    Tcl_DecrRefCount(journal_path_ptr);
+    return rc;
 }
 
 int ttrek_DeleteTempFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name) {
+    // Remove the journal first, a backup without journal is considered
+    // incomplete and will be discarded.
+    Tcl_Obj *journal_path_ptr = ttrek_GetBackupJournalPath(interp, state_ptr, package_name);
+    if (ttrek_CheckFileExists(journal_path_ptr) == TCL_OK && TCL_OK != Tcl_FSDeleteFile(journal_path_ptr)) {
+        fprintf(stderr, "error: could not remove backup journal for package %s\n", package_name);
+        Tcl_DecrRefCount(journal_path_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(journal_path_ptr);
+
     Tcl_Obj *temp_package_dir_ptr;
     ttrek_ResolvePath(interp, state_ptr->project_temp_dir_ptr, Tcl_NewStringObj(package_name, -1),
                       &temp_package_dir_ptr);
+    if (ttrek_CheckFileExists(temp_package_dir_ptr) != TCL_OK) {
+        Tcl_DecrRefCount(temp_package_dir_ptr);
+        return TCL_OK;
+    }
     Tcl_Obj *error_ptr;
     int result = Tcl_FSRemoveDirectory(temp_package_dir_ptr, 1, &error_ptr);
     if (TCL_ERROR == result && error_ptr) {
@@ -516,10 +971,214 @@ int ttrek_DeleteTempFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const ch
     return result;
 }
 
-int ttrek_InstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr, const char *package_name,
-                         const char *package_version, const char *os, const char *arch,
-                         const char *direct_version_requirement, int package_name_exists_in_lock_p,
-                         int package_num_current, int package_num_total) {
+static Tcl_Obj *ttrek_GetInstallCommitPath(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+    Tcl_Obj *commit_path_ptr;
+    ttrek_ResolvePath(interp, state_ptr->project_temp_dir_ptr, Tcl_NewStringObj(INSTALL_COMMIT_FILE, -1),
+                      &commit_path_ptr);
+    return commit_path_ptr;
+}
+
+// The lock file, the manifest and the removal of the backups can't be
+// saved in one step. Before the lock file is written, the commit marker
+// records the hash of the new lock file, the changed manifest entries and
+// the packages whose backups are retired by this commit. If the command
+// is interrupted, the next run compares the lock file with the marker to
+// tell whether the installation was committed, see
+// ttrek_CompleteInstallCommit().
+int ttrek_BeginInstallCommit(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *packages_ptr) {
+
+    Tcl_Obj *lock_hash_ptr = ttrek_GetJsonTreeHash(interp, state_ptr->lock_root);
+    if (lock_hash_ptr == NULL) {
+        return TCL_ERROR;
+    }
+
+    cJSON *commit_root = cJSON_CreateObject();
+    cJSON_AddStringToObject(commit_root, "lock", Tcl_GetString(lock_hash_ptr));
+    Tcl_BounceRefCount(lock_hash_ptr);
+
+    cJSON *packages_node = cJSON_AddArrayToObject(commit_root, STRING_PACKAGES);
+    Tcl_Size packages_len;
+    Tcl_Obj **packages_ptrs;
+    Tcl_ListObjGetElements(interp, packages_ptr, &packages_len, &packages_ptrs);
+    for (Tcl_Size i = 0; i < packages_len; i++) {
+        cJSON_AddItemToArray(packages_node, cJSON_CreateString(Tcl_GetString(packages_ptrs[i])));
+    }
+
+    cJSON *manifest_node = cJSON_AddObjectToObject(commit_root, "manifest");
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->manifest_changed_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        const char *package_name = Tcl_GetHashKey(&state_ptr->manifest_changed_ht, entry);
+        ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+        if (package_ptr != NULL && package_ptr->manifest_node != NULL) {
+            cJSON_AddItemToObject(manifest_node, package_name, cJSON_Duplicate(package_ptr->manifest_node, 1));
+        } else {
+            cJSON_AddNullToObject(manifest_node, package_name);
+        }
+    }
+
+    Tcl_Obj *commit_path_ptr = ttrek_GetInstallCommitPath(interp, state_ptr);
+    int rc = ttrek_WriteJsonFile(interp, commit_path_ptr, commit_root);
+    if (rc != TCL_OK) {
+        fprintf(stderr, "error: could not write %s\n", Tcl_GetString(commit_path_ptr));
+    }
+    Tcl_DecrRefCount(commit_path_ptr);
+    cJSON_Delete(commit_root);
+    return rc;
+
+}
+
+// Retires the backups once the lock file and the manifest are saved, and
+// removes the commit marker.
+int ttrek_EndInstallCommit(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *packages_ptr) {
+
+    int rc = TCL_OK;
+    Tcl_Size packages_len;
+    Tcl_Obj **packages_ptrs;
+    Tcl_ListObjGetElements(interp, packages_ptr, &packages_len, &packages_ptrs);
+    for (Tcl_Size i = 0; i < packages_len; i++) {
+        if (TCL_OK != ttrek_DeleteTempFiles(interp, state_ptr, Tcl_GetString(packages_ptrs[i]))) {
+            rc = TCL_ERROR;
+        }
+    }
+
+    // The marker stays if a backup could not be removed, the next run
+    // finishes the job.
+    if (rc == TCL_OK) {
+        Tcl_Obj *commit_path_ptr = ttrek_GetInstallCommitPath(interp, state_ptr);
+        if (ttrek_CheckFileExists(commit_path_ptr) == TCL_OK && TCL_OK != Tcl_FSDeleteFile(commit_path_ptr)) {
+            fprintf(stderr, "error: could not remove %s\n", Tcl_GetString(commit_path_ptr));
+            rc = TCL_ERROR;
+        }
+        Tcl_DecrRefCount(commit_path_ptr);
+    }
+
+    return rc;
+
+}
+
+// Finishes a commit that was interrupted. If the lock file is the one
+// recorded in the commit marker, the installation was committed: the
+// manifest entries are saved (they may not have made it to the manifest)
+// and the backups are removed instead of being restored. Otherwise,
+// the marker is dropped and the backups are restored as usual.
+static int ttrek_CompleteInstallCommit(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    Tcl_Obj *commit_path_ptr = ttrek_GetInstallCommitPath(interp, state_ptr);
+    if (ttrek_CheckFileExists(commit_path_ptr) != TCL_OK) {
+        Tcl_DecrRefCount(commit_path_ptr);
+        return TCL_OK;
+    }
+
+    cJSON *commit_root;
+    if (TCL_OK != ttrek_FileToJson(interp, commit_path_ptr, &commit_root)) {
+        fprintf(stderr, "error: could not read %s\n", Tcl_GetString(commit_path_ptr));
+        Tcl_DecrRefCount(commit_path_ptr);
+        return TCL_ERROR;
+    }
+
+    int is_committed = 0;
+    const char *expected_lock_hash = cJSON_GetStringValue(cJSON_GetObjectItem(commit_root, "lock"));
+    if (expected_lock_hash != NULL && ttrek_CheckFileExists(state_ptr->lock_json_path_ptr) == TCL_OK) {
+        Tcl_Obj *lock_hash_ptr = ttrek_GetJsonFileHash(interp, state_ptr->lock_json_path_ptr);
+        if (lock_hash_ptr != NULL) {
+            is_committed = (strcmp(Tcl_GetString(lock_hash_ptr), expected_lock_hash) == 0);
+            Tcl_BounceRefCount(lock_hash_ptr);
+        }
+    }
+
+    int rc = TCL_OK;
+    if (is_committed) {
+
+        fprintf(stderr, "completing interrupted installation\n");
+
+        cJSON *entry;
+        cJSON_ArrayForEach(entry, cJSON_GetObjectItem(commit_root, "manifest")) {
+            ttrek_IndexSetManifestPackage(state_ptr, entry->string,
+                                          cJSON_IsNull(entry) ? NULL : cJSON_Duplicate(entry, 1));
+            ttrek_ManifestMarkChanged(state_ptr, entry->string);
+        }
+
+        if (TCL_OK != ttrek_ManifestSave(interp, state_ptr)) {
+            fprintf(stderr, "error: could not write %s\n", Tcl_GetString(state_ptr->manifest_json_path_ptr));
+            rc = TCL_ERROR;
+        }
+
+        cJSON *package;
+        cJSON_ArrayForEach(package, cJSON_GetObjectItem(commit_root, STRING_PACKAGES)) {
+            if (rc == TCL_OK && cJSON_IsString(package)) {
+                rc = ttrek_DeleteTempFiles(interp, state_ptr, package->valuestring);
+            }
+        }
+
+    }
+
+    cJSON_Delete(commit_root);
+
+    if (rc == TCL_OK && TCL_OK != Tcl_FSDeleteFile(commit_path_ptr)) {
+        fprintf(stderr, "error: could not remove %s\n", Tcl_GetString(commit_path_ptr));
+        rc = TCL_ERROR;
+    }
+
+    Tcl_DecrRefCount(commit_path_ptr);
+    return rc;
+
+}
+
+// Completes the restore of packages whose installation was interrupted,
+// e.g. by a crash or by the user.
+int ttrek_RestoreInterruptedInstalls(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    if (TCL_OK != ttrek_CompleteInstallCommit(interp, state_ptr)) {
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *journals_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(journals_ptr);
+
+    Tcl_GlobTypeData filetypes;
+    filetypes.type = TCL_GLOB_TYPE_FILE;
+    filetypes.perm = 0;
+    filetypes.macCreator = NULL;
+    filetypes.macType = NULL;
+    if (ttrek_CheckFileExists(state_ptr->project_temp_dir_ptr) == TCL_OK &&
+        TCL_OK != ttrek_MatchInDirectory(interp, journals_ptr, state_ptr->project_temp_dir_ptr,
+                                         "*" BACKUP_JOURNAL_EXT, 0, &filetypes, 1)) {
+        fprintf(stderr, "error: could not list files in %s\n", Tcl_GetString(state_ptr->project_temp_dir_ptr));
+        Tcl_DecrRefCount(journals_ptr);
+        return TCL_ERROR;
+    }
+
+    int rc = TCL_OK;
+    Tcl_Size journals_len;
+    Tcl_ListObjLength(interp, journals_ptr, &journals_len);
+    for (Tcl_Size i = 0; i < journals_len && rc == TCL_OK; i++) {
+        Tcl_Obj *journal_path_ptr;
+        Tcl_ListObjIndex(interp, journals_ptr, i, &journal_path_ptr);
+
+        cJSON *journal_root;
+        if (TCL_OK != ttrek_FileToJson(interp, journal_path_ptr, &journal_root)) {
+            fprintf(stderr, "error: could not read backup journal %s\n", Tcl_GetString(journal_path_ptr));
+            rc = TCL_ERROR;
+            break;
+        }
+
+        const char *package_name = cJSON_GetStringValue(cJSON_GetObjectItem(journal_root, "package"));
+        if (package_name != NULL) {
+            fprintf(stderr, "restoring package files from interrupted installation: %s\n", package_name);
+            rc = ttrek_RestoreTempFiles(interp, state_ptr, package_name);
+        }
+        cJSON_Delete(journal_root);
+    }
+
+    Tcl_DecrRefCount(journals_ptr);
+    return rc;
+}
+
+int ttrek_PrepareInstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr,
+                                const char *package_name, const char *package_version, const char *os, const char *arch,
+                                int package_name_exists_in_lock_p, int package_num_current, int package_num_total,
+                                cJSON **install_spec_root_ptr, Tcl_Obj **path_to_install_file_ptr) {
 
     if (package_name_exists_in_lock_p) {
         if (TCL_OK != ttrek_BackupPackageFiles(interp, state_ptr, package_name)) {
@@ -528,33 +1187,233 @@ int ttrek_InstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashT
         }
         if (TCL_OK != ttrek_DeletePackageFiles(interp, state_ptr, package_name)) {
             fprintf(stderr, "error: could not delete package files from existing installation\n");
+            ttrek_RestoreTempFiles(interp, state_ptr, package_name);
             return TCL_ERROR;
         }
     }
 
     if (TCL_OK !=
         ttrek_InstallScriptAndPatches(interp, state_ptr, global_use_flags_ht_ptr, package_name, package_version, os, arch,
-                                      direct_version_requirement, package_num_current, package_num_total)) {
+                                      package_num_current, package_num_total, install_spec_root_ptr,
+                                      path_to_install_file_ptr)) {
 
         fprintf(stderr, "error: installing script & patches failed\n");
 
+        if (package_name_exists_in_lock_p) {
+            ttrek_RestoreTempFiles(interp, state_ptr, package_name);
+        }
+
         return TCL_ERROR;
     }
 
     return TCL_OK;
 }
 
+// Starts watching the install directory for the files of packages that
+// ignore DESTDIR, see ttrek_ReadUnstagedFiles().
+int ttrek_WatchInstallDirectory(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
 
-static int ttrek_RemovePackageFromLockRoot(cJSON *lock_root, const char *package_name) {
-    // remove it from "packages" in the lock root
-    if (!cJSON_HasObjectItem(lock_root, "packages")) {
+    if (state_ptr->fsmonitor_state_ptr == NULL) {
+        state_ptr->fsmonitor_state_ptr = (ttrek_fsmonitor_state_t *) Tcl_Alloc(sizeof(ttrek_fsmonitor_state_t));
+        state_ptr->fsmonitor_state_ptr->is_active = 0;
+        state_ptr->fsmonitor_state_ptr->num_threads = state_ptr->jobs;
+    }
+
+    if (TCL_OK != ttrek_FSMonitor_AddWatch(interp, state_ptr->project_install_dir_ptr, state_ptr->fsmonitor_state_ptr)) {
+        fprintf(stderr, "error: could not add watch on install directory\n");
         return TCL_ERROR;
     }
-    cJSON *packages = cJSON_GetObjectItem(lock_root, "packages");
-    if (!cJSON_HasObjectItem(packages, package_name)) {
+
+    return TCL_OK;
+}
+
+// Stops watching the install directory after a failed install, the install
+// directory is in unknown state then and the index is rebuilt on next watch.
+void ttrek_UnwatchInstallDirectory(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+    if (state_ptr->fsmonitor_state_ptr != NULL) {
+        ttrek_FSMonitor_RemoveWatch(interp, state_ptr->fsmonitor_state_ptr);
+    }
+}
+
+// Packages that ignore DESTDIR write directly to the install directory.
+// Returns the new files in the install directory since
+// ttrek_WatchInstallDirectory() that are not in staged_files_ptr, with
+// a warning for each. Files of other packages that were replaced from
+// the staging directory are reported as modified as well, so these are
+// only tracked in the snapshot.
+int ttrek_ReadUnstagedFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *staged_files_ptr,
+                            Tcl_Obj **unstaged_files_ptr) {
+
+    ttrek_fsmonitor_state_t *fsmonitor_state_ptr = state_ptr->fsmonitor_state_ptr;
+
+    if (TCL_OK != ttrek_FSMonitor_ReadChanges(interp, state_ptr->project_install_dir_ptr, fsmonitor_state_ptr)) {
+        fprintf(stderr, "error: could not read changes in install directory\n");
+        ttrek_FSMonitor_RemoveWatch(interp, fsmonitor_state_ptr);
         return TCL_ERROR;
     }
-    cJSON_DeleteItemFromObject(packages, package_name);
+
+    Tcl_HashTable staged_ht;
+    Tcl_InitHashTable(&staged_ht, TCL_STRING_KEYS);
+
+    Tcl_Size staged_len;
+    Tcl_Obj **staged_ptrs;
+    Tcl_ListObjGetElements(interp, staged_files_ptr, &staged_len, &staged_ptrs);
+    for (Tcl_Size i = 0; i < staged_len; i++) {
+        int is_new;
+        Tcl_CreateHashEntry(&staged_ht, Tcl_GetString(staged_ptrs[i]), &is_new);
+    }
+
+    Tcl_Obj *unstaged_files = Tcl_NewListObj(0, NULL);
+
+    Tcl_Size changed_len;
+    Tcl_Obj **changed_ptrs;
+    Tcl_ListObjGetElements(interp, fsmonitor_state_ptr->files_diff, &changed_len, &changed_ptrs);
+    for (Tcl_Size i = 0; i < changed_len; i++) {
+        if (Tcl_FindHashEntry(&staged_ht, Tcl_GetString(changed_ptrs[i])) != NULL) {
+            continue;
+        }
+        fprintf(stderr, "warning: %s was installed outside of the staging directory\n",
+                Tcl_GetString(changed_ptrs[i]));
+        Tcl_ListObjAppendElement(interp, unstaged_files, changed_ptrs[i]);
+    }
+
+    Tcl_ListObjGetElements(interp, fsmonitor_state_ptr->files_modified, &changed_len, &changed_ptrs);
+    for (Tcl_Size i = 0; i < changed_len; i++) {
+        DBG2(printf("modified: %s", Tcl_GetString(changed_ptrs[i])));
+        ttrek_SnapshotTrackInstalledFile(state_ptr, Tcl_GetString(changed_ptrs[i]));
+    }
+
+    Tcl_DeleteHashTable(&staged_ht);
+
+    *unstaged_files_ptr = unstaged_files;
+    return TCL_OK;
+}
+
+// Removes the files found by ttrek_ReadUnstagedFiles(), so that the package
+// that installs them again is seen creating them.
+int ttrek_DeleteUnstagedFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *unstaged_files_ptr) {
+
+    Tcl_Size unstaged_len;
+    Tcl_Obj **unstaged_ptrs;
+    Tcl_ListObjGetElements(interp, unstaged_files_ptr, &unstaged_len, &unstaged_ptrs);
+    for (Tcl_Size i = 0; i < unstaged_len; i++) {
+        const char *file_path = Tcl_GetString(unstaged_ptrs[i]);
+        Tcl_Obj *file_path_ptr;
+        ttrek_ResolvePath(interp, state_ptr->project_install_dir_ptr, Tcl_NewStringObj(file_path, -1), &file_path_ptr);
+        ttrek_SnapshotTrackInstalledFile(state_ptr, file_path);
+        ttrek_FSMonitor_ForgetFile(state_ptr->fsmonitor_state_ptr, file_path);
+        if (TCL_OK != Tcl_FSDeleteFile(file_path_ptr)) {
+            fprintf(stderr, "error: could not delete file %s\n", file_path);
+            Tcl_DecrRefCount(file_path_ptr);
+            return TCL_ERROR;
+        }
+        Tcl_DecrRefCount(file_path_ptr);
+    }
+
+    return TCL_OK;
+}
+
+// Runs the install script and returns the files it installed: the files
+// that were moved from the staging directory, and the files that were
+// written directly to the install directory. Such files are still tracked,
+// so that they are removed on uninstall.
+int ttrek_ExecuteInstallScript(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name,
+                               const char *package_version, Tcl_Obj *path_to_install_file_ptr,
+                               int package_num_current, int package_num_total, Tcl_Obj **files_diff_ptr) {
+
+    char package_num_current_str[5];
+    snprintf(package_num_current_str, sizeof(package_num_current_str), "%d", package_num_current);
+    char package_num_total_str[5];
+    snprintf(package_num_total_str, sizeof(package_num_total_str), "%d", package_num_total);
+
+    Tcl_Size argc = 3;
+    const char *argv[4] = {
+            Tcl_GetString(path_to_install_file_ptr),
+            package_num_current_str,
+            package_num_total_str,
+            NULL
+    };
+    DBG(fprintf(stderr, "path_to_install_file: %s\n", Tcl_GetString(path_to_install_file_ptr)));
+
+    if (TCL_OK != ttrek_WatchInstallDirectory(interp, state_ptr)) {
+        return TCL_ERROR;
+    }
+
+    if (ttrek_ExecuteCommand(interp, argc, argv, NULL) != TCL_OK) {
+        fprintf(stderr, "error: could not execute install script to completion: %s\n",
+                Tcl_GetString(path_to_install_file_ptr));
+        // The install directory is in unknown state now, rebuild the index
+        // before the next package.
+        ttrek_FSMonitor_RemoveWatch(interp, state_ptr->fsmonitor_state_ptr);
+        return TCL_ERROR;
+    }
+
+    // The install script moves the files from the staging directory to
+    // the install directory and saves the list of new files.
+    Tcl_Obj *files_diff;
+    if (TCL_OK != ttrek_StagingReadFiles(interp, state_ptr, package_name, package_version, &files_diff)) {
+        fprintf(stderr, "error: could not read the list of installed files\n");
+        ttrek_FSMonitor_RemoveWatch(interp, state_ptr->fsmonitor_state_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *unstaged_files;
+    if (TCL_OK != ttrek_ReadUnstagedFiles(interp, state_ptr, files_diff, &unstaged_files)) {
+        Tcl_DecrRefCount(files_diff);
+        return TCL_ERROR;
+    }
+    Tcl_ListObjAppendList(interp, files_diff, unstaged_files);
+    Tcl_BounceRefCount(unstaged_files);
+
+    *files_diff_ptr = files_diff;
+    return TCL_OK;
+}
+
+int ttrek_InstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr, const char *package_name,
+                         const char *package_version, const char *os, const char *arch,
+                         const char *direct_version_requirement, int package_name_exists_in_lock_p,
+                         int package_num_current, int package_num_total) {
+
+    cJSON *install_spec_root;
+    Tcl_Obj *path_to_install_file_ptr;
+
+    if (TCL_OK != ttrek_PrepareInstallPackage(interp, state_ptr, global_use_flags_ht_ptr, package_name, package_version,
+                                              os, arch, package_name_exists_in_lock_p, package_num_current,
+                                              package_num_total, &install_spec_root, &path_to_install_file_ptr)) {
+        return TCL_ERROR;
+    }
+
+    // In bootstrap mode, the install script is sent to the output
+    if (path_to_install_file_ptr == NULL) {
+        cJSON_Delete(install_spec_root);
+        return TCL_OK;
+    }
+
+    Tcl_Obj *files_diff;
+    int rc = ttrek_ExecuteInstallScript(interp, state_ptr, package_name, package_version, path_to_install_file_ptr,
+                                        package_num_current, package_num_total, &files_diff);
+    Tcl_DecrRefCount(path_to_install_file_ptr);
+
+    if (rc == TCL_OK) {
+        ttrek_AddInstalledPackage(interp, state_ptr, global_use_flags_ht_ptr, package_name, package_version,
+                                  direct_version_requirement, install_spec_root, files_diff);
+        Tcl_DecrRefCount(files_diff);
+    }
+
+    cJSON_Delete(install_spec_root);
+    return rc;
+}
+
+
+static int ttrek_RemovePackageFromLockRoot(ttrek_state_t *state_ptr, const char *package_name) {
+    cJSON *lock_root = state_ptr->lock_root;
+
+    // remove it from "packages" in the lock root
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    if (!package_ptr || !package_ptr->lock_node) {
+        return TCL_ERROR;
+    }
+    ttrek_IndexSetLockPackage(state_ptr, package_name, NULL);
 
     // remove it from "dependencies" as well
     if (!cJSON_HasObjectItem(lock_root, "dependencies")) {
@@ -579,11 +1438,12 @@ static int ttrek_RemovePackageFromSpecRoot(cJSON *spec_root, const char *package
     return TCL_OK;
 }
 
-static int ttrek_RemovePackageFromManifestRoot(cJSON *manifest_root, const char *package_name) {
-    if (!cJSON_HasObjectItem(manifest_root, package_name)) {
+static int ttrek_RemovePackageFromManifestRoot(ttrek_state_t *state_ptr, const char *package_name) {
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    if (!package_ptr || !package_ptr->manifest_node) {
         return TCL_ERROR;
     }
-    cJSON_DeleteItemFromObject(manifest_root, package_name);
+    ttrek_IndexSetManifestPackage(state_ptr, package_name, NULL);
     return TCL_OK;
 }
 
@@ -594,8 +1454,14 @@ int ttrek_UninstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, const c
         return TCL_ERROR;
     }
 
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    if (package_ptr != NULL && package_ptr->files != NULL &&
+        TCL_OK != ttrek_PruneEmptyDirectories(interp, state_ptr, package_ptr->files)) {
+        fprintf(stderr, "warning: could not remove empty directories of package %s\n", package_name);
+    }
+
     // remove it from the lock root
-    if (TCL_OK != ttrek_RemovePackageFromLockRoot(state_ptr->lock_root, package_name)) {
+    if (TCL_OK != ttrek_RemovePackageFromLockRoot(state_ptr, package_name)) {
         fprintf(stderr, "error: could not remove %s from lock file\n", package_name);
         return TCL_ERROR;
     }
@@ -607,11 +1473,12 @@ int ttrek_UninstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, const c
     }
 
     // remove it from the manifest root
-    if (TCL_OK != ttrek_RemovePackageFromManifestRoot(state_ptr->manifest_root, package_name)) {
+    if (TCL_OK != ttrek_RemovePackageFromManifestRoot(state_ptr, package_name)) {
         fprintf(stderr, "error: could not remove %s from spec file\n", package_name);
         return TCL_ERROR;
     }
 
+    ttrek_ManifestMarkChanged(state_ptr, package_name);
 
     return TCL_OK;
 }
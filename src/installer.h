@@ -18,9 +18,32 @@ int ttrek_InstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashT
                          const char *direct_version_requirement, int package_name_exists_in_lock_p,
                          int package_num_current, int package_num_total);
 
+int ttrek_PrepareInstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr,
+                                const char *package_name, const char *package_version, const char *os, const char *arch,
+                                int package_name_exists_in_lock_p, int package_num_current, int package_num_total,
+                                cJSON **install_spec_root_ptr, Tcl_Obj **path_to_install_file_ptr);
+
+int ttrek_ExecuteInstallScript(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name,
+                               const char *package_version, Tcl_Obj *path_to_install_file_ptr,
+                               int package_num_current, int package_num_total, Tcl_Obj **files_diff_ptr);
+int ttrek_WatchInstallDirectory(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+void ttrek_UnwatchInstallDirectory(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+int ttrek_ReadUnstagedFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *staged_files_ptr,
+                            Tcl_Obj **unstaged_files_ptr);
+int ttrek_DeleteUnstagedFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *unstaged_files_ptr);
+
+void ttrek_AddInstalledPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_HashTable *global_use_flags_ht_ptr,
+                               const char *package_name, const char *package_version,
+                               const char *direct_version_requirement, cJSON *install_spec_root, Tcl_Obj *files_diff);
+
 int ttrek_UninstallPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name);
 int ttrek_DeleteTempFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name);
 int ttrek_RestoreTempFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name);
+int ttrek_RestoreInterruptedInstalls(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+void ttrek_SetPlannedVersion(ttrek_state_t *state_ptr, const char *package_name, const char *package_version);
+Tcl_Obj *ttrek_GetDependencyVersions(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *deps_node);
+int ttrek_BeginInstallCommit(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *packages_ptr);
+int ttrek_EndInstallCommit(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *packages_ptr);
 
 #ifdef __cplusplus
 }
@@ -15,8 +15,8 @@ static int ttrek_GetLockPackages(Tcl_Interp *interp, cJSON *lock_root, Tcl_Obj *
 
     cJSON *packages = cJSON_GetObjectItem(lock_root, "packages");
 
-    for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-        cJSON *package = cJSON_GetArrayItem(packages, i);
+    cJSON *package;
+    cJSON_ArrayForEach(package, packages) {
         char package_str[256];
         snprintf(package_str, 256, "%s@%s", package->string, cJSON_GetObjectItem(package, "version")->valuestring);
         Tcl_Obj *package_name = Tcl_NewStringObj(package_str, -1);
@@ -37,8 +37,8 @@ static int ttrek_GetLockPackagesThatMatch(Tcl_Interp *interp, cJSON *lock_root,
 
     cJSON *packages = cJSON_GetObjectItem(lock_root, "packages");
 
-    for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-        cJSON *package = cJSON_GetArrayItem(packages, i);
+    cJSON *package;
+    cJSON_ArrayForEach(package, packages) {
         if (Tcl_StringMatch(package->string, Tcl_GetString(pattern))) {
             char package_str[256];
             snprintf(package_str, 256, "%s@%s", package->string, cJSON_GetObjectItem(package, "version")->valuestring);
@@ -4,10 +4,26 @@
  * SPDX-License-Identifier: MIT.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <curl/curl.h>
 #include "common.h"
+#include "registry.h"
 #include "ttrek_telemetry.h"
 
+// The registry client of the process. The easy handle is reused for all
+// the requests, so that they go over the same connection, and the DNS
+// cache, the connections and the TLS sessions are kept in a share that
+// other handles can join. The registry is only called from the main
+// thread, so the share needs no locking.
+static CURL *registry_curl_handle = NULL;
+static CURLSH *registry_share_handle = NULL;
+
+// What the registry requests cost during the command
+static int registry_num_requests = 0;
+static long registry_num_connects = 0;
+static curl_off_t registry_total_time = 0;
+
 static size_t write_memory_cb(const void *contents, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
@@ -20,6 +36,58 @@ static size_t write_memory_cb(const void *contents, size_t size, size_t nmemb, v
     return realsize;
 }
 
+CURLSH *ttrek_RegistryGetShare(void) {
+    if (registry_share_handle == NULL) {
+        registry_share_handle = curl_share_init();
+        curl_share_setopt(registry_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(registry_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(registry_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+    return registry_share_handle;
+}
+
+static CURL *ttrek_RegistryGetHandle(void) {
+    if (registry_curl_handle != NULL) {
+        return registry_curl_handle;
+    }
+    CURL *curl_handle = curl_easy_init();
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, ttrek_RegistryGetShare());
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_memory_cb);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "ttrek/1.0");
+    // HTTP/2 if the server and libcurl support it, it falls back to
+    // HTTP/1.1 otherwise
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    // Ask for a compressed response in any encoding libcurl was built with
+    // (gzip and deflate with zlib, zstd and br when available). The body is
+    // decoded on the fly, before it reaches write_memory_cb.
+    curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+    registry_curl_handle = curl_handle;
+    return curl_handle;
+}
+
+// Frees the registry client. With TTREK_REGISTRY_STATS=1, prints how many
+// requests were made to the registry during the command and how many
+// connections they had to open.
+void ttrek_RegistryFree(void) {
+
+    const char *stats_env = getenv("TTREK_REGISTRY_STATS");
+    if (stats_env != NULL && strcmp(stats_env, "0") != 0 && registry_num_requests > 0) {
+        fprintf(stderr, "registry: %d requests, %ld connections opened, %.3fs\n", registry_num_requests,
+                registry_num_connects, (double) registry_total_time / 1000000);
+    }
+
+    if (registry_curl_handle != NULL) {
+        curl_easy_cleanup(registry_curl_handle);
+        registry_curl_handle = NULL;
+    }
+    if (registry_share_handle != NULL) {
+        curl_share_cleanup(registry_share_handle);
+        registry_share_handle = NULL;
+    }
+
+}
+
 int ttrek_RegistryGet(const char *url, Tcl_DString *dsPtr, cJSON *postData) {
     int rc = TCL_OK;
 
@@ -30,11 +98,9 @@ int ttrek_RegistryGet(const char *url, Tcl_DString *dsPtr, cJSON *postData) {
 
     DBG2(printf("enter url: %s", url));
     struct curl_slist *chunk = NULL;
-    CURL *curl_handle = curl_easy_init();
+    CURL *curl_handle = ttrek_RegistryGetHandle();
     curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_memory_cb);
     curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, dsPtr);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "ttrek/1.0");
     // curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
 
     if (machineId != NULL) {
@@ -57,12 +123,24 @@ int ttrek_RegistryGet(const char *url, Tcl_DString *dsPtr, cJSON *postData) {
         chunk = curl_slist_append(chunk, "Content-Type: application/json");
     } else {
         DBG2(printf("prepare GET request"));
+        // The handle may have been used for a POST request before
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1L);
     }
 
     // set our custom set of headers
     curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, chunk);
 
     CURLcode ret = curl_easy_perform(curl_handle);
+
+    long num_connects = 0;
+    curl_off_t total_time = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_NUM_CONNECTS, &num_connects);
+    curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME_T, &total_time);
+    registry_num_requests++;
+    registry_num_connects += num_connects;
+    registry_total_time += total_time;
+    DBG2(printf("new connections: %ld", num_connects));
+
     if (ret == CURLE_OK) {
 //        fprintf(stderr, "%lu bytes retrieved\n", Tcl_DStringLength(dsPtr));
     } else {
@@ -78,7 +156,9 @@ error:
     rc = TCL_ERROR;
 
 done:
-    curl_easy_cleanup(curl_handle);
+    // the headers are freed below, the handle must not refer to them
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, NULL);
     // free the custom headers
     curl_slist_free_all(chunk);
     if (postDataStr != NULL) {
@@ -11,9 +11,12 @@
 extern "C" {
 #endif
 
+#include <curl/curl.h>
 #include "common.h"
 
 int ttrek_RegistryGet(const char *url, Tcl_DString *dsPtr, cJSON *postData);
+CURLSH *ttrek_RegistryGetShare(void);
+void ttrek_RegistryFree(void);
 
 #ifdef __cplusplus
 }
@@ -6,7 +6,7 @@
 
 #include <stdlib.h>
 #include "subCmdDecls.h"
-#include "ttrek_git.h"
+#include "ttrek_snapshot.h"
 #include "ttrek_scripts.h"
 
 int ttrek_RunSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
@@ -44,8 +44,8 @@ int ttrek_RunSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
         goto error;
     }
 
-    if (TCL_OK != ttrek_EnsureGitReady(interp, state_ptr)) {
-        SetResult("resetting git repository failed");
+    if (TCL_OK != ttrek_SnapshotEnsureReady(interp, state_ptr)) {
+        SetResult("resetting the venv to the last snapshot failed");
         goto error;
     }
 
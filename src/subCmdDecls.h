@@ -21,9 +21,14 @@ SubCmdProc(ttrek_ListSubCmd);
 SubCmdProc(ttrek_UninstallSubCmd);
 SubCmdProc(ttrek_DownloadSubCmd);
 SubCmdProc(ttrek_UnpackSubCmd);
+SubCmdProc(ttrek_FetchUnpackSubCmd);
+SubCmdProc(ttrek_InstallStagedSubCmd);
 SubCmdProc(ttrek_HelpSubCmd);
 SubCmdProc(ttrek_UseSubCmd);
 SubCmdProc(ttrek_ScriptsSubCmd);
+SubCmdProc(ttrek_BuildReportSubCmd);
+SubCmdProc(ttrek_VerifySubCmd);
+SubCmdProc(ttrek_GcSubCmd);
 
 #ifdef __cplusplus
 }
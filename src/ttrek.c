@@ -11,6 +11,7 @@
 #include "subCmdDecls.h"
 #include "common.h"
 #include "ttrek_telemetry.h"
+#include "registry.h"
 
 static const char *subcommands[] = {
         "init",
@@ -19,9 +20,14 @@ static const char *subcommands[] = {
         "run",
         "update",
         "ls",
+        "build-report",
+        "verify",
+        "gc",
         /* internal subcommands */
         "download",
         "unpack",
+        "fetch-unpack",
+        "install-staged",
         "help",
         "use-flags",
         "scripts",
@@ -35,8 +41,13 @@ enum subcommand {
     SUBCMD_RUN,
     SUBCMD_UPDATE,
     SUBCMD_LIST,
+    SUBCMD_BUILD_REPORT,
+    SUBCMD_VERIFY,
+    SUBCMD_GC,
     SUBCMD_DOWNLOAD,
     SUBCMD_UNPACK,
+    SUBCMD_FETCH_UNPACK,
+    SUBCMD_INSTALL_STAGED,
     SUBCMD_HELP,
     SUBCMD_USE_FLAGS,
     SUBCMD_SCRIPTS,
@@ -129,12 +140,43 @@ int main(int argc, char *argv[]) {
                 exitcode = 1;
             }
             break;
+        case SUBCMD_FETCH_UNPACK:
+            isCurlInitialized = curl_global_init(CURL_GLOBAL_ALL);
+            if (TCL_OK != ttrek_FetchUnpackSubCmd(interp, objc-1, &objv[1])) {
+                fprintf(stderr, "error: fetch-unpack subcommand failed: %s\n", Tcl_GetStringResult(interp));
+                exitcode = 1;
+            }
+            break;
+        case SUBCMD_INSTALL_STAGED:
+            if (TCL_OK != ttrek_InstallStagedSubCmd(interp, objc-1, &objv[1])) {
+                fprintf(stderr, "error: install-staged subcommand failed: %s\n", Tcl_GetStringResult(interp));
+                exitcode = 1;
+            }
+            break;
         case SUBCMD_LIST:
             if (TCL_OK != ttrek_ListSubCmd(interp, objc-1, &objv[1])) {
                 fprintf(stderr, "error: list subcommand failed: %s\n", Tcl_GetStringResult(interp));
                 exitcode = 1;
             }
             break;
+        case SUBCMD_BUILD_REPORT:
+            if (TCL_OK != ttrek_BuildReportSubCmd(interp, objc-1, &objv[1])) {
+                fprintf(stderr, "error: build-report subcommand failed: %s\n", Tcl_GetStringResult(interp));
+                exitcode = 1;
+            }
+            break;
+        case SUBCMD_VERIFY:
+            if (TCL_OK != ttrek_VerifySubCmd(interp, objc-1, &objv[1])) {
+                fprintf(stderr, "error: verify subcommand failed: %s\n", Tcl_GetStringResult(interp));
+                exitcode = 1;
+            }
+            break;
+        case SUBCMD_GC:
+            if (TCL_OK != ttrek_GcSubCmd(interp, objc-1, &objv[1])) {
+                fprintf(stderr, "error: gc subcommand failed: %s\n", Tcl_GetStringResult(interp));
+                exitcode = 1;
+            }
+            break;
         case SUBCMD_HELP:
             if (TCL_OK != ttrek_HelpSubCmd(interp, objc-1, &objv[1])) {
                 exitcode = 1;
@@ -165,6 +207,7 @@ done:
     ttrek_TelemetryFree();
     // DBG2(printf("free environment state..."));
     ttrek_EnvironmentStateFree();
+    ttrek_RegistryFree();
 
     if (isCurlInitialized == CURLE_OK) {
         // DBG2(printf("free curl..."));
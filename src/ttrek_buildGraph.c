@@ -0,0 +1,273 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "ttrek_buildGraph.h"
+#include "ttrek_staging.h"
+#include <string.h>
+#include <ctype.h>
+
+// The environment for the install scripts that are run by make. Make flags
+// are reset so that the packages' own make does not join our jobserver,
+// and the progress bar is disabled as the output of parallel jobs is mixed.
+#define BUILD_GRAPH_SCRIPT_ENV "MAKEFLAGS= MAKELEVEL= IS_TTY=0"
+
+// Returns the string in single quotes for use in a Makefile recipe. The dollar
+// sign is doubled, as it is special for make.
+static Tcl_Obj *ttrek_BuildGraphQuote(Tcl_Obj *obj) {
+    Tcl_Size len;
+    const char *str = Tcl_GetStringFromObj(obj, &len);
+    Tcl_Obj *rc = Tcl_NewStringObj("'", 1);
+    for (Tcl_Size i = 0; i < len; i++) {
+        if (str[i] == '\'') {
+            Tcl_AppendToObj(rc, "'\\''", 4);
+        } else if (str[i] == '$') {
+            Tcl_AppendToObj(rc, "$$", 2);
+        } else {
+            Tcl_AppendToObj(rc, &str[i], 1);
+        }
+    }
+    Tcl_AppendToObj(rc, "'", 1);
+    return rc;
+}
+
+// Returns a make target name for the package. Characters that have special
+// meaning for make are replaced with underscores.
+static Tcl_Obj *ttrek_BuildGraphTargetName(const char *package_name, const char *package_version) {
+    Tcl_Obj *name_ptr = Tcl_ObjPrintf("%s-%s", package_name, package_version);
+    Tcl_Size len;
+    const char *str = Tcl_GetStringFromObj(name_ptr, &len);
+    Tcl_Obj *rc = Tcl_NewObj();
+    for (Tcl_Size i = 0; i < len; i++) {
+        if (isalnum((unsigned char) str[i]) || strchr("._+-", str[i]) != NULL) {
+            Tcl_AppendToObj(rc, &str[i], 1);
+        } else {
+            Tcl_AppendToObj(rc, "_", 1);
+        }
+    }
+    Tcl_BounceRefCount(name_ptr);
+    return rc;
+}
+
+static Tcl_Obj *ttrek_BuildGraphFilePath(ttrek_build_graph_t *graph_ptr, Tcl_Obj *target_ptr, const char *suffix) {
+    Tcl_Obj *path_ptr;
+    ttrek_ResolvePath(graph_ptr->state_ptr->interp, graph_ptr->graph_dir_ptr,
+                      Tcl_ObjPrintf("%s.%s", Tcl_GetString(target_ptr), suffix), &path_ptr);
+    return path_ptr;
+}
+
+ttrek_build_graph_t *ttrek_BuildGraphCreate(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    Tcl_Obj *graph_dir_ptr;
+    if (TCL_OK != ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr,
+                                    Tcl_NewStringObj(BUILD_GRAPH_DIR, -1), &graph_dir_ptr)) {
+        return NULL;
+    }
+
+    // Stamps from the previous run are not valid, as the files of all planned
+    // packages were removed from the install directory. Interrupted builds
+    // are resumed from the stage fingerprints of the install scripts.
+    if (ttrek_CheckFileExists(graph_dir_ptr) == TCL_OK) {
+        Tcl_Obj *error_ptr;
+        if (TCL_OK != Tcl_FSRemoveDirectory(graph_dir_ptr, 1, &error_ptr)) {
+            fprintf(stderr, "error: could not remove build graph directory %s: %s\n",
+                    Tcl_GetString(graph_dir_ptr), Tcl_GetString(error_ptr));
+            Tcl_DecrRefCount(error_ptr);
+            Tcl_DecrRefCount(graph_dir_ptr);
+            return NULL;
+        }
+    }
+
+    if (TCL_OK != Tcl_FSCreateDirectory(graph_dir_ptr)) {
+        fprintf(stderr, "error: could not create build graph directory %s\n", Tcl_GetString(graph_dir_ptr));
+        Tcl_DecrRefCount(graph_dir_ptr);
+        return NULL;
+    }
+
+    ttrek_build_graph_t *graph_ptr = (ttrek_build_graph_t *) Tcl_Alloc(sizeof(ttrek_build_graph_t));
+    graph_ptr->state_ptr = state_ptr;
+    graph_ptr->graph_dir_ptr = graph_dir_ptr;
+    graph_ptr->rules_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(graph_ptr->rules_ptr);
+    graph_ptr->targets_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(graph_ptr->targets_ptr);
+    Tcl_InitHashTable(&graph_ptr->packages_ht, TCL_STRING_KEYS);
+
+    return graph_ptr;
+
+}
+
+void ttrek_BuildGraphDestroy(ttrek_build_graph_t *graph_ptr) {
+
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+    for (entry = Tcl_FirstHashEntry(&graph_ptr->packages_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&graph_ptr->packages_ht);
+
+    Tcl_DecrRefCount(graph_ptr->targets_ptr);
+    Tcl_DecrRefCount(graph_ptr->rules_ptr);
+    Tcl_DecrRefCount(graph_ptr->graph_dir_ptr);
+    Tcl_Free((char *) graph_ptr);
+
+}
+
+// Adds two edges for the package: the "built" edge runs the install script up
+// to the build stage, and the "installed" edge runs the rest of the script.
+// The stages that were already done are skipped by the script thanks to
+// the stage fingerprints. The package is built once all its dependencies
+// are installed.
+int ttrek_BuildGraphAddPackage(Tcl_Interp *interp, ttrek_build_graph_t *graph_ptr, const char *package_name,
+                               const char *package_version, Tcl_Obj *path_to_install_file_ptr,
+                               int package_num_current, int package_num_total, Tcl_Obj *deps_list_ptr) {
+
+    Tcl_Obj *target_ptr = ttrek_BuildGraphTargetName(package_name, package_version);
+    Tcl_IncrRefCount(target_ptr);
+    const char *target = Tcl_GetString(target_ptr);
+
+    Tcl_Obj *rules_ptr = graph_ptr->rules_ptr;
+
+    Tcl_AppendPrintfToObj(rules_ptr, "\n%s.built:", target);
+
+    Tcl_Size deps_len;
+    Tcl_Obj **deps_ptrs;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, deps_list_ptr, &deps_len, &deps_ptrs)) {
+        Tcl_DecrRefCount(target_ptr);
+        return TCL_ERROR;
+    }
+
+    for (Tcl_Size i = 0; i < deps_len; i++) {
+        Tcl_HashEntry *entry = Tcl_FindHashEntry(&graph_ptr->packages_ht, Tcl_GetString(deps_ptrs[i]));
+        if (entry == NULL) {
+            // The dependency is already installed
+            DBG2(printf("skip dependency %s of %s", Tcl_GetString(deps_ptrs[i]), package_name));
+            continue;
+        }
+        Tcl_AppendPrintfToObj(rules_ptr, " %s.installed", Tcl_GetString((Tcl_Obj *) Tcl_GetHashValue(entry)));
+    }
+
+    Tcl_Obj *script_ptr = ttrek_BuildGraphQuote(path_to_install_file_ptr);
+    Tcl_IncrRefCount(script_ptr);
+
+    Tcl_AppendPrintfToObj(rules_ptr,
+        "\n"
+        "\t@" BUILD_GRAPH_SCRIPT_ENV " TTREK_LAST_STAGE=3 %s %d %d\n"
+        "\t@touch $@\n",
+        Tcl_GetString(script_ptr), package_num_current, package_num_total);
+
+    // Packages are installed to their own staging directories and then moved
+    // to the install directory, so installations can run at the same time.
+    Tcl_AppendPrintfToObj(rules_ptr,
+        "\n%s.installed: %s.built\n"
+        "\t@" BUILD_GRAPH_SCRIPT_ENV " TTREK_KEEP_LOGS=1 %s %d %d\n"
+        "\t@touch $@\n",
+        target, target, Tcl_GetString(script_ptr), package_num_current, package_num_total);
+
+    Tcl_DecrRefCount(script_ptr);
+
+    Tcl_ListObjAppendElement(interp, graph_ptr->targets_ptr, Tcl_ObjPrintf("%s.installed", target));
+
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&graph_ptr->packages_ht, package_name, &is_new);
+    if (!is_new) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry));
+    }
+    Tcl_IncrRefCount(target_ptr);
+    Tcl_SetHashValue(entry, target_ptr);
+
+    DBG2(printf("added package %s as target %s", package_name, target));
+
+    Tcl_DecrRefCount(target_ptr);
+
+    return TCL_OK;
+
+}
+
+int ttrek_BuildGraphRun(Tcl_Interp *interp, ttrek_build_graph_t *graph_ptr, int jobs) {
+
+    Tcl_Obj *makefile_ptr = Tcl_NewStringObj("# This file is generated by ttrek. Do not edit.\n"
+                                             "\n"
+                                             ".PHONY: all\n"
+                                             "\n"
+                                             "all:", -1);
+    Tcl_IncrRefCount(makefile_ptr);
+
+    Tcl_Size targets_len;
+    Tcl_Obj **targets_ptrs;
+    Tcl_ListObjGetElements(interp, graph_ptr->targets_ptr, &targets_len, &targets_ptrs);
+    for (Tcl_Size i = 0; i < targets_len; i++) {
+        Tcl_AppendToObj(makefile_ptr, " ", 1);
+        Tcl_AppendObjToObj(makefile_ptr, targets_ptrs[i]);
+    }
+    Tcl_AppendToObj(makefile_ptr, "\n", 1);
+    Tcl_AppendObjToObj(makefile_ptr, graph_ptr->rules_ptr);
+
+    Tcl_Obj *makefile_path_ptr;
+    ttrek_ResolvePath(interp, graph_ptr->graph_dir_ptr, Tcl_NewStringObj(BUILD_GRAPH_FILE, -1), &makefile_path_ptr);
+
+    int rc = ttrek_WriteChars(interp, makefile_path_ptr, makefile_ptr, 0644);
+    Tcl_DecrRefCount(makefile_ptr);
+
+    if (rc != TCL_OK) {
+        fprintf(stderr, "error: could not write build graph to %s\n", Tcl_GetString(makefile_path_ptr));
+        Tcl_DecrRefCount(makefile_path_ptr);
+        return TCL_ERROR;
+    }
+
+    DBG2(printf("run build graph %s with %d jobs", Tcl_GetString(makefile_path_ptr), jobs));
+
+    char jobs_str[16];
+    snprintf(jobs_str, sizeof(jobs_str), "-j%d", jobs);
+
+    Tcl_Size argc = 6;
+    const char *argv[7] = {
+            "make",
+            "-C",
+            Tcl_GetString(graph_ptr->graph_dir_ptr),
+            "-f",
+            BUILD_GRAPH_FILE,
+            jobs_str,
+            NULL
+    };
+
+    rc = ttrek_ExecuteCommand(interp, argc, argv, NULL);
+    if (rc != TCL_OK) {
+        fprintf(stderr, "error: could not run build graph to completion: %s\n",
+                Tcl_GetString(makefile_path_ptr));
+    }
+
+    Tcl_DecrRefCount(makefile_path_ptr);
+    return rc;
+
+}
+
+int ttrek_BuildGraphIsInstalled(ttrek_build_graph_t *graph_ptr, const char *package_name) {
+
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&graph_ptr->packages_ht, package_name);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    Tcl_Obj *stamp_path_ptr = ttrek_BuildGraphFilePath(graph_ptr, (Tcl_Obj *) Tcl_GetHashValue(entry),
+                                                       "installed");
+    int rc = (ttrek_CheckFileExists(stamp_path_ptr) == TCL_OK);
+    Tcl_DecrRefCount(stamp_path_ptr);
+    return rc;
+
+}
+
+int ttrek_BuildGraphGetInstalledFiles(Tcl_Interp *interp, ttrek_build_graph_t *graph_ptr, const char *package_name,
+                                      const char *package_version, Tcl_Obj **files_diff_ptr) {
+
+    if (!ttrek_BuildGraphIsInstalled(graph_ptr, package_name)) {
+        fprintf(stderr, "error: package %s was not installed by build graph\n", package_name);
+        return TCL_ERROR;
+    }
+
+    return ttrek_StagingReadFiles(interp, graph_ptr->state_ptr, package_name, package_version, files_diff_ptr);
+
+}
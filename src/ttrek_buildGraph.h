@@ -0,0 +1,43 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_BUILDGRAPH_H
+#define TTREK_BUILDGRAPH_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUILD_GRAPH_DIR  "graph"
+#define BUILD_GRAPH_FILE "Makefile"
+
+typedef struct {
+    ttrek_state_t *state_ptr;
+    // The directory with the generated Makefile and stamp files
+    Tcl_Obj *graph_dir_ptr;
+    Tcl_Obj *rules_ptr;
+    Tcl_Obj *targets_ptr;
+    // Package name -> target name for all packages in the graph
+    Tcl_HashTable packages_ht;
+} ttrek_build_graph_t;
+
+ttrek_build_graph_t *ttrek_BuildGraphCreate(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+void ttrek_BuildGraphDestroy(ttrek_build_graph_t *graph_ptr);
+int ttrek_BuildGraphAddPackage(Tcl_Interp *interp, ttrek_build_graph_t *graph_ptr, const char *package_name,
+                               const char *package_version, Tcl_Obj *path_to_install_file_ptr,
+                               int package_num_current, int package_num_total, Tcl_Obj *deps_list_ptr);
+int ttrek_BuildGraphRun(Tcl_Interp *interp, ttrek_build_graph_t *graph_ptr, int jobs);
+int ttrek_BuildGraphIsInstalled(ttrek_build_graph_t *graph_ptr, const char *package_name);
+int ttrek_BuildGraphGetInstalledFiles(Tcl_Interp *interp, ttrek_build_graph_t *graph_ptr, const char *package_name,
+                                      const char *package_version, Tcl_Obj **files_diff_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_BUILDGRAPH_H
@@ -0,0 +1,359 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ttrek_buildHistory.h"
+
+cJSON *ttrek_BuildHistoryCreateRun(const char *use_flags) {
+    cJSON *run_root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(run_root, "time", (double) time(NULL));
+    cJSON_AddStringToObject(run_root, "use", (use_flags == NULL ? "" : use_flags));
+    cJSON_AddItemToObject(run_root, "packages", cJSON_CreateArray());
+    return run_root;
+}
+
+static Tcl_Obj *ttrek_BuildHistoryGetPath(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+    Tcl_Obj *path_ptr;
+    if (TCL_OK != ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr,
+                                    Tcl_NewStringObj(BUILD_HISTORY_FILE, -1), &path_ptr)) {
+        return NULL;
+    }
+    return path_ptr;
+}
+
+// Reads the stage transitions recorded by the install script and adds
+// the package with the duration of each stage to the run. Stages that
+// were skipped because their results were cached are marked as such,
+// their durations do not represent a real build. The size of the source
+// archive is recorded too, if it was downloaded in this run.
+int ttrek_BuildHistoryAddPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *run_root,
+                                 const char *package_name, const char *package_version, int is_success) {
+
+    Tcl_Obj *timing_path_ptr;
+    if (TCL_OK != ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr,
+                                    Tcl_ObjPrintf("logs/%s-%s/" BUILD_TIMING_FILE, package_name, package_version),
+                                    &timing_path_ptr)) {
+        return TCL_ERROR;
+    }
+
+    if (TCL_OK != ttrek_CheckFileExists(timing_path_ptr)) {
+        DBG2(printf("no timing file for %s@%s", package_name, package_version));
+        Tcl_DecrRefCount(timing_path_ptr);
+        return TCL_OK;
+    }
+
+    Tcl_Obj *contents_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(contents_ptr);
+    if (TCL_OK != ttrek_ReadChars(interp, timing_path_ptr, &contents_ptr)) {
+        Tcl_DecrRefCount(contents_ptr);
+        Tcl_DecrRefCount(timing_path_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(timing_path_ptr);
+
+    long long stage_duration[BUILD_HISTORY_STAGES + 1] = {0};
+    int stage_cached[BUILD_HISTORY_STAGES + 1] = {0};
+    int stage_exists[BUILD_HISTORY_STAGES + 1] = {0};
+    long long first_time = -1, last_time = -1;
+
+    int cur_stage = 0, cur_cached = 0;
+    long long cur_start = 0;
+    long long archive_size = 0;
+
+    const char *line = Tcl_GetString(contents_ptr);
+    while (*line != '\0') {
+
+        char event[16];
+        int stage;
+        long long event_time;
+        int is_parsed = (sscanf(line, "%15s %d %lld", event, &stage, &event_time) == 3);
+        if (is_parsed && strcmp(event, "size") == 0) {
+
+            // Not a stage transition, the value is the size in bytes
+            archive_size = event_time;
+
+        } else if (is_parsed) {
+
+            if (first_time == -1) {
+                first_time = event_time;
+            }
+            last_time = event_time;
+
+            if (strcmp(event, "cached") == 0) {
+                cur_cached = 1;
+            } else {
+                // Any other event ends the current stage
+                if (cur_stage != 0) {
+                    // A stage that was really executed takes precedence over
+                    // the same stage skipped when the script was continued.
+                    if (!stage_exists[cur_stage] || stage_cached[cur_stage] || !cur_cached) {
+                        stage_duration[cur_stage] = event_time - cur_start;
+                        stage_cached[cur_stage] = cur_cached;
+                        stage_exists[cur_stage] = 1;
+                    }
+                    cur_stage = 0;
+                }
+                if (strcmp(event, "start") == 0 && stage >= 1 && stage <= BUILD_HISTORY_STAGES) {
+                    cur_stage = stage;
+                    cur_start = event_time;
+                    cur_cached = 0;
+                }
+            }
+
+        }
+
+        const char *next = strchr(line, '\n');
+        if (next == NULL) {
+            break;
+        }
+        line = next + 1;
+    }
+
+    Tcl_DecrRefCount(contents_ptr);
+
+    // The timing file is left from a previous run if the install script
+    // was not started in this run.
+    if (first_time < (long long) cJSON_GetNumberValue(cJSON_GetObjectItem(run_root, "time"))) {
+        DBG2(printf("no timing in this run for %s@%s", package_name, package_version));
+        return TCL_OK;
+    }
+
+    cJSON *package_root = cJSON_CreateObject();
+    cJSON_AddStringToObject(package_root, "name", package_name);
+    cJSON_AddStringToObject(package_root, "version", package_version);
+    cJSON_AddStringToObject(package_root, "status", (is_success ? "ok" : "fail"));
+    cJSON_AddNumberToObject(package_root, "start", (double) first_time);
+    cJSON_AddNumberToObject(package_root, "end", (double) last_time);
+    if (archive_size > 0) {
+        cJSON_AddNumberToObject(package_root, "archive_size", (double) archive_size);
+    }
+
+    cJSON *stages_root = cJSON_CreateObject();
+    for (int i = 1; i <= BUILD_HISTORY_STAGES; i++) {
+        if (!stage_exists[i]) {
+            continue;
+        }
+        char stage_str[8];
+        snprintf(stage_str, sizeof(stage_str), "%d", i);
+        cJSON *stage_root = cJSON_CreateObject();
+        cJSON_AddNumberToObject(stage_root, "duration", (double) stage_duration[i]);
+        cJSON_AddBoolToObject(stage_root, "cached", stage_cached[i]);
+        cJSON_AddItemToObject(stages_root, stage_str, stage_root);
+    }
+    cJSON_AddItemToObject(package_root, "stages", stages_root);
+
+    cJSON_AddItemToArray(cJSON_GetObjectItem(run_root, "packages"), package_root);
+
+    return TCL_OK;
+}
+
+int ttrek_BuildHistoryLoad(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON **history_root_ptr) {
+
+    Tcl_Obj *history_path_ptr = ttrek_BuildHistoryGetPath(interp, state_ptr);
+    if (history_path_ptr == NULL) {
+        return TCL_ERROR;
+    }
+
+    cJSON *history_root = NULL;
+    if (TCL_OK == ttrek_CheckFileExists(history_path_ptr)) {
+        if (TCL_OK != ttrek_FileToJson(interp, history_path_ptr, &history_root)) {
+            Tcl_DecrRefCount(history_path_ptr);
+            return TCL_ERROR;
+        }
+    }
+    Tcl_DecrRefCount(history_path_ptr);
+
+    // Start a new history if there is no history yet or if it is damaged
+    if (history_root == NULL || !cJSON_IsArray(cJSON_GetObjectItem(history_root, "runs"))) {
+        cJSON_Delete(history_root);
+        history_root = cJSON_CreateObject();
+        cJSON_AddItemToObject(history_root, "runs", cJSON_CreateArray());
+    }
+
+    *history_root_ptr = history_root;
+    return TCL_OK;
+}
+
+// Appends the run to the history. Only the last BUILD_HISTORY_MAX_RUNS runs
+// are kept. The run is owned by the history after this call.
+int ttrek_BuildHistorySaveRun(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *run_root) {
+
+    cJSON *history_root;
+    if (TCL_OK != ttrek_BuildHistoryLoad(interp, state_ptr, &history_root)) {
+        cJSON_Delete(run_root);
+        return TCL_ERROR;
+    }
+
+    cJSON *runs = cJSON_GetObjectItem(history_root, "runs");
+    cJSON_AddItemToArray(runs, run_root);
+    while (cJSON_GetArraySize(runs) > BUILD_HISTORY_MAX_RUNS) {
+        cJSON_DeleteItemFromArray(runs, 0);
+    }
+
+    Tcl_Obj *history_path_ptr = ttrek_BuildHistoryGetPath(interp, state_ptr);
+    if (history_path_ptr == NULL) {
+        cJSON_Delete(history_root);
+        return TCL_ERROR;
+    }
+
+    int rc = ttrek_WriteJsonFile(interp, history_path_ptr, history_root);
+    Tcl_DecrRefCount(history_path_ptr);
+    cJSON_Delete(history_root);
+    return rc;
+}
+
+// Returns true if the package has the fields that identify it. Entries
+// of a damaged or hand-edited history that don't are skipped.
+int ttrek_BuildHistoryIsValidPackage(cJSON *package_root) {
+    return cJSON_IsString(cJSON_GetObjectItem(package_root, "name"))
+           && cJSON_IsString(cJSON_GetObjectItem(package_root, "version"))
+           && cJSON_IsString(cJSON_GetObjectItem(package_root, "status"));
+}
+
+// Returns the time spent in all stages of the package, or -1 if the package
+// has no recorded stages.
+int ttrek_BuildHistoryGetPackageDuration(cJSON *package_root) {
+    int duration = 0;
+    int num_stages = 0;
+    cJSON *stage_root;
+    cJSON_ArrayForEach(stage_root, cJSON_GetObjectItem(package_root, "stages")) {
+        cJSON *duration_node = cJSON_GetObjectItem(stage_root, "duration");
+        if (cJSON_IsNumber(duration_node)) {
+            duration += (int) duration_node->valuedouble;
+        }
+        num_stages++;
+    }
+    return num_stages == 0 ? -1 : duration;
+}
+
+// Returns true if all stages of the package were executed, i.e. none of
+// them was skipped because of cached results.
+int ttrek_BuildHistoryIsFullBuild(cJSON *package_root) {
+    int num_stages = 0;
+    cJSON *stage_root;
+    cJSON_ArrayForEach(stage_root, cJSON_GetObjectItem(package_root, "stages")) {
+        if (cJSON_IsTrue(cJSON_GetObjectItem(stage_root, "cached"))) {
+            return 0;
+        }
+        num_stages++;
+    }
+    return num_stages > 0;
+}
+
+// Without build history, the build time is guessed from the size of the
+// source archive. The size is recorded in the history by any build that
+// downloaded the archive, or else taken from the archive if it was kept.
+static int ttrek_BuildHistoryEstimateFromSize(Tcl_Interp *interp, ttrek_state_t *state_ptr,
+                                              const char *package_name, const char *package_version,
+                                              Tcl_WideUInt archive_size) {
+
+    if (archive_size == 0) {
+        Tcl_Obj *archive_path_ptr;
+        if (TCL_OK != ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr,
+                                        Tcl_ObjPrintf("download/%s-%s.archive", package_name, package_version),
+                                        &archive_path_ptr)) {
+            return BUILD_HISTORY_DEFAULT_DURATION;
+        }
+        Tcl_StatBuf *stat_ptr = Tcl_AllocStatBuf();
+        if (Tcl_FSStat(archive_path_ptr, stat_ptr) == 0) {
+            archive_size = Tcl_GetSizeFromStat(stat_ptr);
+        }
+        Tcl_Free((char *) stat_ptr);
+        Tcl_DecrRefCount(archive_path_ptr);
+    }
+
+    if (archive_size == 0) {
+        return BUILD_HISTORY_DEFAULT_DURATION;
+    }
+
+    // About one second per 32 KiB of compressed sources
+    int duration = (int) (archive_size / 32768);
+    if (duration < 10) {
+        duration = 10;
+    }
+    DBG2(printf("estimate %s@%s by archive size %" TCL_LL_MODIFIER "u: %ds", package_name, package_version,
+                archive_size, duration));
+
+    return duration;
+}
+
+// Returns the estimated build time of the package in seconds. The average
+// of the last successful full builds is used, preferring the builds of
+// the same version with the same USE flags, then the builds of the same
+// version, and then the builds of any version of the package.
+int ttrek_BuildHistoryEstimateDuration(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *history_root,
+                                       const char *package_name, const char *package_version, const char *use_flags) {
+
+    // The runs are from the oldest to the newest, only the last
+    // BUILD_HISTORY_ESTIMATE_RUNS builds of each tier are kept.
+    int durations[3][BUILD_HISTORY_ESTIMATE_RUNS];
+    int count[3] = {0, 0, 0};
+    // The last recorded archive size of the same version, or of any version
+    Tcl_WideUInt archive_size[2] = {0, 0};
+
+    cJSON *run_root;
+    cJSON_ArrayForEach(run_root, cJSON_GetObjectItem(history_root, "runs")) {
+        const char *run_use_flags = cJSON_GetStringValue(cJSON_GetObjectItem(run_root, "use"));
+        cJSON *package_root;
+        cJSON_ArrayForEach(package_root, cJSON_GetObjectItem(run_root, "packages")) {
+            if (!ttrek_BuildHistoryIsValidPackage(package_root)
+                || strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(package_root, "name")), package_name) != 0) {
+                continue;
+            }
+            int is_same_version =
+                strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(package_root, "version")), package_version) == 0;
+            cJSON *size_node = cJSON_GetObjectItem(package_root, "archive_size");
+            if (cJSON_IsNumber(size_node) && size_node->valuedouble > 0) {
+                for (int k = (is_same_version ? 0 : 1); k < 2; k++) {
+                    archive_size[k] = (Tcl_WideUInt) size_node->valuedouble;
+                }
+            }
+            if (strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(package_root, "status")), "ok") != 0
+                || !ttrek_BuildHistoryIsFullBuild(package_root)) {
+                break;
+            }
+            int tier = 2;
+            if (is_same_version) {
+                tier = (use_flags != NULL && run_use_flags != NULL && strcmp(use_flags, run_use_flags) == 0) ? 0 : 1;
+            }
+            // Builds of a more specific tier also count for the less specific ones
+            int duration = ttrek_BuildHistoryGetPackageDuration(package_root);
+            for (int k = tier; k < 3; k++) {
+                durations[k][count[k] % BUILD_HISTORY_ESTIMATE_RUNS] = duration;
+                count[k]++;
+            }
+            break;
+        }
+    }
+
+    for (int k = 0; k < 3; k++) {
+        if (count[k] > 0) {
+            int num_durations = count[k] < BUILD_HISTORY_ESTIMATE_RUNS ? count[k] : BUILD_HISTORY_ESTIMATE_RUNS;
+            int total = 0;
+            for (int i = 0; i < num_durations; i++) {
+                total += durations[k][i];
+            }
+            return total / num_durations;
+        }
+    }
+
+    return ttrek_BuildHistoryEstimateFromSize(interp, state_ptr, package_name, package_version,
+                                              archive_size[0] != 0 ? archive_size[0] : archive_size[1]);
+}
+
+void ttrek_BuildHistoryFormatDuration(Tcl_Obj *result_ptr, int seconds) {
+    if (seconds < 0) {
+        Tcl_AppendToObj(result_ptr, "-", 1);
+    } else if (seconds < 60) {
+        Tcl_AppendPrintfToObj(result_ptr, "%ds", seconds);
+    } else if (seconds < 3600) {
+        Tcl_AppendPrintfToObj(result_ptr, "%dm%02ds", seconds / 60, seconds % 60);
+    } else {
+        Tcl_AppendPrintfToObj(result_ptr, "%dh%02dm", seconds / 3600, (seconds % 3600) / 60);
+    }
+}
@@ -0,0 +1,42 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_BUILDHISTORY_H
+#define TTREK_BUILDHISTORY_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUILD_HISTORY_FILE     "history.json"
+#define BUILD_TIMING_FILE      "timing"
+#define BUILD_HISTORY_MAX_RUNS 50
+#define BUILD_HISTORY_STAGES   4
+// How many previous builds are averaged to estimate the build time
+#define BUILD_HISTORY_ESTIMATE_RUNS 5
+// The estimated build time of a package that has never been built
+#define BUILD_HISTORY_DEFAULT_DURATION 60
+
+cJSON *ttrek_BuildHistoryCreateRun(const char *use_flags);
+int ttrek_BuildHistoryAddPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *run_root,
+                                 const char *package_name, const char *package_version, int is_success);
+int ttrek_BuildHistorySaveRun(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *run_root);
+int ttrek_BuildHistoryLoad(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON **history_root_ptr);
+
+int ttrek_BuildHistoryIsValidPackage(cJSON *package_root);
+int ttrek_BuildHistoryGetPackageDuration(cJSON *package_root);
+int ttrek_BuildHistoryIsFullBuild(cJSON *package_root);
+int ttrek_BuildHistoryEstimateDuration(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *history_root,
+                                       const char *package_name, const char *package_version, const char *use_flags);
+void ttrek_BuildHistoryFormatDuration(Tcl_Obj *result_ptr, int seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_BUILDHISTORY_H
@@ -8,6 +8,7 @@
 #include "ttrek_buildInstructions.h"
 #include "ttrek_useflags.h"
 #include "ttrek_genInstall.h"
+#include "installer.h"
 
 static int ttrek_GetBuildInstructions(Tcl_Interp *interp, cJSON *spec_root, cJSON **instructions_node_ptr) {
 
@@ -79,9 +80,15 @@ int ttrek_RunBuildInstructions(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
 
     state_ptr->is_local_build = 1;
 
+    Tcl_Obj *dependencies_ptr = ttrek_GetDependencyVersions(interp, state_ptr,
+        cJSON_GetObjectItem(state_ptr->spec_root, "dependencies"));
+    Tcl_IncrRefCount(dependencies_ptr);
+
     Tcl_Obj *install_script_full = ttrek_generateInstallScript(interp, package_name,
         package_version, Tcl_GetString(state_ptr->project_home_dir_ptr),
-        install_script_node, &use_flags_ht, state_ptr);
+        install_script_node, NULL, dependencies_ptr, &use_flags_ht, state_ptr);
+
+    Tcl_DecrRefCount(dependencies_ptr);
 
     Tcl_DecrRefCount(use_flags_list_ptr);
     Tcl_DeleteHashTable(&use_flags_ht);
@@ -6,9 +6,11 @@
 
 #include "common.h"
 #include "ttrek_useflags.h"
+#include "ttrek_staging.h"
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 static const char install_script_common_dynamic[] = {
 #include "install_common_dynamic.sh.h"
@@ -41,6 +43,20 @@ static const char *pkg_counter_script =
 
 static const char *pkg_counter_template = "${%d:-1}";
 
+static const char *bootstrap_package_script_begin =
+        "\n"
+        "ttrek_package_%s() {\n";
+
+static const char *bootstrap_package_script_end =
+        "}\n";
+
+static const char *bootstrap_package_deps_script =
+        "PKG_DEPS_%s=%s\n";
+
+static const char *bootstrap_runner_script =
+        "\n"
+        "run_packages %s\n";
+
 static int ttrek_IsUseFlagEnabled(Tcl_Interp *interp, Tcl_HashTable *use_flags_ht_ptr,
                                   const cJSON *json, int *result) {
 
@@ -345,6 +361,23 @@ DEFINE_COMMAND(EnvVariable) {
 
 }
 
+// Returns true if the "download" command is directly followed by
+// an "unpack" command, so that the archive can be extracted while it is
+// being downloaded. Commands with use flags are left as they are.
+static int ttrek_SpecIsDownloadUnpack(const cJSON *download) {
+    if (download == NULL || cJSON_HasObjectItem(download, "if")) {
+        return 0;
+    }
+    const cJSON *unpack = download->next;
+    if (unpack == NULL || cJSON_HasObjectItem(unpack, "if")) {
+        return 0;
+    }
+    const char *download_cmd = cJSON_GetStringValue(cJSON_GetObjectItem(download, "cmd"));
+    const char *unpack_cmd = cJSON_GetStringValue(cJSON_GetObjectItem(unpack, "cmd"));
+    return download_cmd != NULL && strcmp(download_cmd, "download") == 0 &&
+           unpack_cmd != NULL && strcmp(unpack_cmd, "unpack") == 0;
+}
+
 DEFINE_COMMAND(Download) {
 
     UNUSED(use_flags_ht_ptr);
@@ -361,9 +394,26 @@ DEFINE_COMMAND(Download) {
         cmd = ttrek_AppendFormatToObj(interp, NULL, "cmd curl -sL -o %s %s",
                                       2, dq("$DOWNLOAD_DIR/$ARCHIVE_FILE"), osq(url));
     } else {
-        cmd = ttrek_AppendFormatToObj(interp, NULL, "cmd %s download %s %s",
-                                      3, osq(Tcl_NewStringObj(Tcl_GetNameOfExecutable(), -1)), osq(url),
-                                      dq("$DOWNLOAD_DIR/$ARCHIVE_FILE"));
+        // The archive is extracted as it arrives, the following "unpack"
+        // command is then skipped.
+        int is_fetch_unpack = ttrek_SpecIsDownloadUnpack(opts);
+        cmd = ttrek_AppendFormatToObj(interp, NULL, "cmd %s %s",
+                                      2, osq(Tcl_NewStringObj(Tcl_GetNameOfExecutable(), -1)),
+                                      Tcl_NewStringObj(is_fetch_unpack ? "fetch-unpack" : "download", -1));
+        // The checksum is verified while the file is being downloaded
+        Tcl_Obj *sha256 = ttrek_cJSONStringToObject(opts, "sha256");
+        if (sha256 != NULL) {
+            ttrek_AppendFormatToObj(interp, cmd, " -sha256 %s", 1, osq(sha256));
+        }
+        // The archive is not kept, its size for the build time estimates
+        // goes to the timing file, see ttrek_BuildHistoryAddPackage()
+        if (is_fetch_unpack) {
+            ttrek_AppendFormatToObj(interp, cmd, " -timing %s", 1, dq("$BUILD_TIMING_FILE"));
+        }
+        ttrek_AppendFormatToObj(interp, cmd, " %s %s", 2, osq(url), dq("$DOWNLOAD_DIR/$ARCHIVE_FILE"));
+        if (is_fetch_unpack) {
+            ttrek_AppendFormatToObj(interp, cmd, " %s", 1, dq("$SOURCE_DIR"));
+        }
     }
 
     APPEND_CMD(cmd, dq("$BUILD_LOG_DIR/download.log"));
@@ -457,10 +507,17 @@ DEFINE_COMMAND(Git) {
 DEFINE_COMMAND(Unpack) {
 
     UNUSED(use_flags_ht_ptr);
-    UNUSED(opts);
 
     Tcl_Obj *cmd;
 
+    // Already extracted by "fetch-unpack". In the list of commands, the
+    // first one points back to the last one, so make sure this is not
+    // the first command.
+    if (state_ptr->mode != MODE_BOOTSTRAP && opts->prev != NULL && opts->prev->next == opts &&
+        ttrek_SpecIsDownloadUnpack(opts->prev)) {
+        return TCL_OK;
+    }
+
     if (state_ptr->mode == MODE_BOOTSTRAP) {
         cmd = ttrek_AppendFormatToObj(interp, NULL, "cmd unpack %s %s", 2, dq("$DOWNLOAD_DIR/$ARCHIVE_FILE"),
                                       dq("$SOURCE_DIR"));
@@ -881,9 +938,92 @@ DEFINE_COMMAND(CmakeInstall) {
 }
 
 
+// Returns true if the commands of the specified stage can be skipped when
+// their inputs have not changed since the previous successful run. The install
+// stage is always executed, since the installed files are collected from
+// the staging directory.
+// In local builds, the build stage is also always executed, since the project
+// sources can be changed without any changes in the spec.
+static int ttrek_IsStageCacheable(const char *stage, int is_local_build) {
+    if (stage[0] == '1' || stage[0] == '2') {
+        return 1;
+    }
+    if (stage[0] == '3') {
+        return !is_local_build;
+    }
+    return 0;
+}
+
+// The environment variables that are picked up by the build tools. They
+// are part of the fingerprints of the configure and build stages.
+static const char *ttrek_buildEnvironment[] = {
+    "CC", "CXX", "CPP", "CFLAGS", "CXXFLAGS", "CPPFLAGS", "LDFLAGS", "LIBS",
+    "PKG_CONFIG_PATH", "CMAKE_PREFIX_PATH", NULL
+};
+
+// Returns the inputs of the configure and build stages that are not in
+// the spec: the dependencies and the build environment.
+static Tcl_Obj *ttrek_SpecToObj_GetBuildInputs(Tcl_Obj *dependencies_ptr) {
+    Tcl_Obj *buildInputs = Tcl_NewObj();
+    if (dependencies_ptr != NULL) {
+        Tcl_AppendToObj(buildInputs, "dependencies ", -1);
+        Tcl_AppendObjToObj(buildInputs, dependencies_ptr);
+        Tcl_AppendToObj(buildInputs, "\n", 1);
+    }
+    for (int i = 0; ttrek_buildEnvironment[i] != NULL; i++) {
+        const char *value = getenv(ttrek_buildEnvironment[i]);
+        if (value != NULL) {
+            Tcl_AppendPrintfToObj(buildInputs, "env %s=%s\n", ttrek_buildEnvironment[i], value);
+        }
+    }
+    return buildInputs;
+}
+
+// Wraps the commands of a cacheable stage into a block that is skipped when
+// the fingerprint of the stage inputs matches the one stored after the previous
+// successful run. The fingerprint covers the commands of the stage,
+// the commands without stage (cd, env_variable) that precede them, and
+// the inputs that are not in the spec: the patches for the sources stage,
+// the dependencies and the environment for the other stages.
+static void ttrek_SpecToObj_AppendCachedStage(Tcl_Interp *interp, Tcl_Obj *resultList, Tcl_Obj *stageList,
+                                              Tcl_Obj *fingerprintData, Tcl_Obj *sourceInputs,
+                                              Tcl_Obj *buildInputs, const char *stage, int stage_index) {
+
+    Tcl_Size listLen;
+    Tcl_Obj **elemPtrs;
+    Tcl_ListObjGetElements(interp, stageList, &listLen, &elemPtrs);
+    for (Tcl_Size i = 0; i < listLen; i++) {
+        Tcl_AppendObjToObj(fingerprintData, elemPtrs[i]);
+        Tcl_AppendToObj(fingerprintData, "\n", 1);
+    }
+    Tcl_AppendObjToObj(fingerprintData, stage[0] == '1' ? sourceInputs : buildInputs);
+
+    Tcl_Size size;
+    const char *str = Tcl_GetStringFromObj(fingerprintData, &size);
+    Tcl_Obj *data = Tcl_NewByteArrayObj((const unsigned char *) str, size);
+    Tcl_IncrRefCount(data);
+    Tcl_Obj *fingerprint = ttrek_GetHashSHA256(data);
+    Tcl_IncrRefCount(fingerprint);
+    Tcl_DecrRefCount(data);
+
+    DBG2(printf("stage %s (index %d) fingerprint: %s", stage, stage_index, Tcl_GetString(fingerprint)));
+
+    Tcl_ListObjAppendElement(interp, resultList, Tcl_ObjPrintf("if stage_changed %d %s; then",
+                                                               stage_index, Tcl_GetString(fingerprint)));
+    Tcl_ListObjAppendElement(interp, resultList, Tcl_ObjPrintf("stage_reset %d %s || fail",
+                                                               stage_index, stage));
+    Tcl_ListObjAppendList(interp, resultList, stageList);
+    Tcl_ListObjAppendElement(interp, resultList, Tcl_ObjPrintf("stage_done %d %s || fail",
+                                                               stage_index, Tcl_GetString(fingerprint)));
+    Tcl_ListObjAppendElement(interp, resultList, Tcl_NewStringObj("fi", -1));
+
+    Tcl_DecrRefCount(fingerprint);
+
+}
+
 static Tcl_Obj *
-ttrek_SpecToObj(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *spec, Tcl_HashTable *global_use_flags_ht_ptr,
-                int is_local_build) {
+ttrek_SpecToObj(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *spec, Tcl_Obj *patch_hashes_ptr,
+                Tcl_Obj *dependencies_ptr, Tcl_HashTable *global_use_flags_ht_ptr, int is_local_build) {
 
     static const struct {
         const char *cmd;
@@ -911,6 +1051,28 @@ ttrek_SpecToObj(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *spec, Tcl_H
 
     Tcl_Obj *resultList = Tcl_NewListObj(0, NULL);
 
+    // Commands of the current stage, if this stage is cacheable
+    Tcl_Obj *stageList = NULL;
+    // Inputs that are used to compute the fingerprint of the next cacheable stage
+    Tcl_Obj *fingerprintData = Tcl_NewObj();
+    Tcl_IncrRefCount(fingerprintData);
+    // Inputs of the stages that are not in the spec
+    Tcl_Obj *sourceInputs = Tcl_NewObj();
+    Tcl_IncrRefCount(sourceInputs);
+    if (patch_hashes_ptr != NULL) {
+        Tcl_AppendToObj(sourceInputs, "patches ", -1);
+        Tcl_AppendObjToObj(sourceInputs, patch_hashes_ptr);
+        Tcl_AppendToObj(sourceInputs, "\n", 1);
+    }
+    Tcl_Obj *buildInputs = ttrek_SpecToObj_GetBuildInputs(dependencies_ptr);
+    Tcl_IncrRefCount(buildInputs);
+
+    const char *current_stage = NULL;
+    int stage_index = 0;
+    // The bootstrap script always builds everything from scratch, so there
+    // is no need for stage fingerprints there.
+    int is_cache_enabled = (state_ptr->mode != MODE_BOOTSTRAP);
+
     const cJSON *cmd;
     cJSON_ArrayForEach(cmd, spec) {
 
@@ -946,21 +1108,79 @@ ttrek_SpecToObj(Tcl_Interp *interp, ttrek_state_t *state_ptr, cJSON *spec, Tcl_H
             continue;
         }
 
-        if (commands[cmdType].stage != NULL) {
-            Tcl_Obj *stageCmd = Tcl_NewStringObj("stage ", -1);
-            Tcl_AppendToObj(stageCmd, commands[cmdType].stage, -1);
-            Tcl_ListObjAppendElement(interp, resultList, stageCmd);
+        const char *stage = commands[cmdType].stage;
+
+        if (stage == NULL || current_stage == NULL || strcmp(stage, current_stage) != 0) {
+
+            if (stageList != NULL) {
+                ttrek_SpecToObj_AppendCachedStage(interp, resultList, stageList, fingerprintData,
+                                                  sourceInputs, buildInputs, current_stage, stage_index++);
+                Tcl_DecrRefCount(stageList);
+                stageList = NULL;
+                Tcl_SetObjLength(fingerprintData, 0);
+            }
+
+            current_stage = stage;
+
+            if (stage != NULL) {
+                Tcl_Obj *stageCmd = Tcl_NewStringObj("stage ", -1);
+                Tcl_AppendToObj(stageCmd, stage, -1);
+                Tcl_ListObjAppendElement(interp, resultList, stageCmd);
+
+                if (is_cache_enabled && ttrek_IsStageCacheable(stage, is_local_build)) {
+                    stageList = Tcl_NewListObj(0, NULL);
+                    Tcl_IncrRefCount(stageList);
+                } else {
+                    // The stages after the one that is always executed
+                    // cannot be skipped.
+                    is_cache_enabled = 0;
+                }
+            }
+
         }
 
-        if (commands[cmdType].handler(interp, state_ptr, cmd, global_use_flags_ht_ptr, resultList) != TCL_OK) {
+        Tcl_Obj *targetList = (stageList == NULL ? resultList : stageList);
+
+        Tcl_Size listLen;
+        Tcl_ListObjLength(interp, targetList, &listLen);
+
+        if (commands[cmdType].handler(interp, state_ptr, cmd, global_use_flags_ht_ptr, targetList) != TCL_OK) {
             goto error;
         }
 
+        // Commands without stage are always executed, but they affect
+        // the next stage. Add them to the fingerprint of that stage.
+        if (stage == NULL && is_cache_enabled) {
+            Tcl_Size newListLen;
+            Tcl_Obj **elemPtrs;
+            Tcl_ListObjGetElements(interp, targetList, &newListLen, &elemPtrs);
+            for (Tcl_Size i = listLen; i < newListLen; i++) {
+                Tcl_AppendObjToObj(fingerprintData, elemPtrs[i]);
+                Tcl_AppendToObj(fingerprintData, "\n", 1);
+            }
+        }
+
     }
 
+    if (stageList != NULL) {
+        ttrek_SpecToObj_AppendCachedStage(interp, resultList, stageList, fingerprintData,
+                                          sourceInputs, buildInputs, current_stage, stage_index);
+        Tcl_DecrRefCount(stageList);
+    }
+
+    Tcl_DecrRefCount(fingerprintData);
+    Tcl_DecrRefCount(sourceInputs);
+    Tcl_DecrRefCount(buildInputs);
+
     return resultList;
 
     error:
+    if (stageList != NULL) {
+        Tcl_DecrRefCount(stageList);
+    }
+    Tcl_DecrRefCount(fingerprintData);
+    Tcl_DecrRefCount(sourceInputs);
+    Tcl_DecrRefCount(buildInputs);
     Tcl_BounceRefCount(resultList);
     return NULL;
 }
@@ -986,6 +1206,49 @@ Tcl_Obj *ttrek_generatePackageCounter(Tcl_Interp *interp, int package_num_curren
 
 }
 
+// In bootstrap mode, the install script of each package is wrapped in a shell
+// function. These functions are called by the job runner when all
+// dependencies of the package have been installed.
+Tcl_Obj *ttrek_generateBootstrapPackage(Tcl_Interp *interp, int package_num_current, int package_num_total,
+                                        Tcl_Obj *install_script) {
+
+    Tcl_Obj *result = ttrek_AppendFormatToObj(interp, NULL, bootstrap_package_script_begin, 1,
+                                              Tcl_NewIntObj(package_num_current));
+
+    Tcl_Obj *package_counter = ttrek_generatePackageCounter(interp, package_num_current, package_num_total);
+    Tcl_AppendObjToObj(result, package_counter);
+    Tcl_BounceRefCount(package_counter);
+
+    Tcl_AppendObjToObj(result, install_script);
+    Tcl_AppendToObj(result, bootstrap_package_script_end, -1);
+
+    return result;
+
+}
+
+// deps_list_ptr is a list where the N-th element is the list of package
+// numbers that the package number N+1 depends on.
+Tcl_Obj *ttrek_generateBootstrapRunner(Tcl_Interp *interp, Tcl_Obj *deps_list_ptr) {
+
+    Tcl_Size listLen;
+    Tcl_Obj **elemPtrs;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, deps_list_ptr, &listLen, &elemPtrs)) {
+        return NULL;
+    }
+
+    Tcl_Obj *result = Tcl_NewStringObj("\n", 1);
+
+    for (Tcl_Size i = 0; i < listLen; i++) {
+        ttrek_AppendFormatToObj(interp, result, bootstrap_package_deps_script, 2,
+                                Tcl_NewSizeIntObj(i + 1), osq(elemPtrs[i]));
+    }
+
+    ttrek_AppendFormatToObj(interp, result, bootstrap_runner_script, 1, Tcl_NewSizeIntObj(listLen));
+
+    return result;
+
+}
+
 Tcl_Obj *ttrek_generateBootstrapScript(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
 
     UNUSED(interp);
@@ -1007,11 +1270,11 @@ Tcl_Obj *ttrek_generateBootstrapScript(Tcl_Interp *interp, ttrek_state_t *state_
 
 Tcl_Obj *ttrek_generateInstallScript(Tcl_Interp *interp, const char *package_name,
                                      const char *package_version, const char *source_dir,
-                                     cJSON *spec, Tcl_HashTable *global_use_flags_ht_ptr,
-                                     ttrek_state_t *state_ptr) {
+                                     cJSON *spec, Tcl_Obj *patch_hashes_ptr, Tcl_Obj *dependencies_ptr,
+                                     Tcl_HashTable *global_use_flags_ht_ptr, ttrek_state_t *state_ptr) {
 
-    Tcl_Obj *install_specific = ttrek_SpecToObj(interp, state_ptr, spec, global_use_flags_ht_ptr,
-                                                state_ptr->is_local_build);
+    Tcl_Obj *install_specific = ttrek_SpecToObj(interp, state_ptr, spec, patch_hashes_ptr, dependencies_ptr,
+                                                global_use_flags_ht_ptr, state_ptr->is_local_build);
     if (install_specific == NULL) {
         return NULL;
     }
@@ -1044,6 +1307,17 @@ Tcl_Obj *ttrek_generateInstallScript(Tcl_Interp *interp, const char *package_nam
     Tcl_Obj *install_full = Tcl_NewListObj(0, NULL);
     Tcl_ListObjAppendElement(interp, install_full, install_common);
     Tcl_ListObjAppendList(interp, install_full, install_specific);
+
+    // Move the installed files from the staging directory to the install
+    // directory. The bootstrap script installs the files directly.
+    if (state_ptr->mode != MODE_BOOTSTRAP) {
+        Tcl_ListObjAppendElement(interp, install_full, Tcl_NewStringObj("stage 4", -1));
+        Tcl_Obj *cmd = ttrek_AppendFormatToObj(interp, NULL, "cmd %s install-staged %s %s %s", 4,
+                                               osq(Tcl_NewStringObj(Tcl_GetNameOfExecutable(), -1)),
+                                               dq("$STAGING_DIR"), dq("$INSTALL_DIR"),
+                                               dq("$STAGING_DIR" STAGING_FILES_EXT));
+        ttrek_SpecToObj_AppendCommand(interp, install_full, cmd, dq("$BUILD_LOG_DIR/install-staged.log"));
+    }
     Tcl_ListObjAppendElement(interp, install_full, Tcl_NewStringObj("ok", -1));
 
     Tcl_Obj *rc = Tcl_NewObj();
@@ -15,13 +15,18 @@ extern "C" {
 
 Tcl_Obj *ttrek_generateInstallScript(Tcl_Interp *interp, const char *package_name,
                                      const char *package_version, const char *source_dir,
-                                     cJSON *spec, Tcl_HashTable *global_use_flags_ht_ptr,
-                                     ttrek_state_t *state_ptr);
+                                     cJSON *spec, Tcl_Obj *patch_hashes_ptr, Tcl_Obj *dependencies_ptr,
+                                     Tcl_HashTable *global_use_flags_ht_ptr, ttrek_state_t *state_ptr);
 
 Tcl_Obj *ttrek_generateBootstrapScript(Tcl_Interp *interp, ttrek_state_t *state_ptr);
 
 Tcl_Obj *ttrek_generatePackageCounter(Tcl_Interp *interp, int package_num_current, int package_num_total);
 
+Tcl_Obj *ttrek_generateBootstrapPackage(Tcl_Interp *interp, int package_num_current, int package_num_total,
+                                        Tcl_Obj *install_script);
+
+Tcl_Obj *ttrek_generateBootstrapRunner(Tcl_Interp *interp, Tcl_Obj *deps_list_ptr);
+
 #ifdef __cplusplus
 }
 #endif
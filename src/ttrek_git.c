@@ -5,97 +5,304 @@
  */
 
 #include <git2.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
 #include "ttrek_git.h"
 
 #define MAX_GIT_DEPTH 3
 
-int ttrek_GitInit(ttrek_state_t *state_ptr) {
-    // initialize the libgit2 library
+// Pack the repository when there are more loose objects than this, or
+// when they take more space than GIT_GC_LOOSE_SIZE (in MiB). Can be
+// changed with TTREK_GIT_GC_LOOSE_OBJECTS and TTREK_GIT_GC_LOOSE_SIZE,
+// 0 disables the check.
+#define GIT_GC_LOOSE_OBJECTS 2000
+#define GIT_GC_LOOSE_SIZE 256
+
+typedef enum {
+    GIT_OP_OPEN,
+    GIT_OP_RESET,
+    GIT_OP_STAGE,
+    GIT_OP_COMMIT,
+    GIT_OP_GC,
+    GIT_OP_MAX
+} ttrek_git_op_t;
+
+static const char *git_op_names[GIT_OP_MAX] = {"open", "reset", "stage", "commit", "gc"};
+
+// The repository of the venv, opened once per command and shared by
+// all git operations, together with the time spent in each of them.
+struct ttrek_git_session_s {
+    git_repository *repo;
+    git_index *index;
+    git_odb *odb;
+    Tcl_WideInt op_time[GIT_OP_MAX];
+    int op_count[GIT_OP_MAX];
+};
+
+static Tcl_WideInt ttrek_GitNow(void) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt) now.sec * 1000000 + now.usec;
+}
+
+static void ttrek_GitSessionAddTime(ttrek_git_session_t *session_ptr, ttrek_git_op_t op, Tcl_WideInt start_time) {
+    session_ptr->op_time[op] += ttrek_GitNow() - start_time;
+    session_ptr->op_count[op]++;
+}
+
+static void ttrek_GitPrintError(int error) {
+    const git_error *e = git_error_last();
+    fprintf(stderr, "Error %d/%d: %s\n", error, e != NULL ? e->klass : 0, e != NULL ? e->message : "unknown");
+}
+
+// Opens the repository of the venv (or creates it if do_init is set) on
+// first use. Returns NULL if the repository could not be opened.
+static ttrek_git_session_t *ttrek_GitSessionGet(ttrek_state_t *state_ptr, int do_init) {
+
+    if (state_ptr->git_session_ptr != NULL) {
+        return state_ptr->git_session_ptr;
+    }
+
+    Tcl_WideInt start_time = ttrek_GitNow();
+
     git_libgit2_init();
 
-    git_repository *repo = NULL;
-    git_index *index = NULL;
-    git_oid tree_oid;
-    git_signature *sig = NULL;
-    git_tree *tree = NULL;
+    ttrek_git_session_t *session_ptr = (ttrek_git_session_t *) Tcl_Alloc(sizeof(ttrek_git_session_t));
+    memset(session_ptr, 0, sizeof(ttrek_git_session_t));
 
-    // initialize a new git repository in the given path
-    int error = git_repository_init(&repo, Tcl_GetString(state_ptr->project_venv_dir_ptr), 0);
+    const char *venv_dir = Tcl_GetString(state_ptr->project_venv_dir_ptr);
+    int error;
+    if (do_init) {
+        error = git_repository_init(&session_ptr->repo, venv_dir, 0);
+    } else {
+        error = git_repository_open(&session_ptr->repo, venv_dir);
+    }
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        return TCL_ERROR;
+        if (do_init) {
+            ttrek_GitPrintError(error);
+        } else {
+            fprintf(stderr, "error: opening repository failed\n");
+        }
+        goto error;
     }
 
-    fprintf(stdout, "initialized empty git repository in %s\n", Tcl_GetString(state_ptr->project_venv_dir_ptr));
+    git_ignore_add_rule(session_ptr->repo, LOCKING_FILE_IGNORE_RULE);
+    git_ignore_add_rule(session_ptr->repo, BUILD_DIR_IGNORE_RULE);
+
+    error = git_repository_index(&session_ptr->index, session_ptr->repo);
+    if (error < 0) {
+        ttrek_GitPrintError(error);
+        goto error;
+    }
+
+    error = git_repository_odb(&session_ptr->odb, session_ptr->repo);
+    if (error < 0) {
+        ttrek_GitPrintError(error);
+        goto error;
+    }
+
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_OPEN, start_time);
+    state_ptr->git_session_ptr = session_ptr;
+    return session_ptr;
+
+error:
+    git_index_free(session_ptr->index);
+    git_repository_free(session_ptr->repo);
+    Tcl_Free((char *) session_ptr);
+    git_libgit2_shutdown();
+    return NULL;
+
+}
+
+// Closes the repository. With TTREK_GIT_TIMING=1, prints the time spent
+// in git operations during the command.
+void ttrek_GitSessionFree(ttrek_state_t *state_ptr) {
+
+    ttrek_git_session_t *session_ptr = state_ptr->git_session_ptr;
+    if (session_ptr == NULL) {
+        return;
+    }
+
+    Tcl_WideInt git_time = 0;
+    for (int op = 0; op < GIT_OP_MAX; op++) {
+        git_time += session_ptr->op_time[op];
+        DBG2(printf("%s: %d times, %" TCL_LL_MODIFIER "d us", git_op_names[op], session_ptr->op_count[op],
+                    session_ptr->op_time[op]));
+    }
+
+    const char *timing_env = getenv("TTREK_GIT_TIMING");
+    if (timing_env != NULL && strcmp(timing_env, "0") != 0) {
+        Tcl_WideInt run_time = ttrek_GitNow() - state_ptr->start_time;
+        fprintf(stderr, "git: %.3fs of %.3fs (%d%%):", (double) git_time / 1000000, (double) run_time / 1000000,
+                run_time > 0 ? (int) (git_time * 100 / run_time) : 0);
+        for (int op = 0; op < GIT_OP_MAX; op++) {
+            if (session_ptr->op_count[op] > 0) {
+                fprintf(stderr, " %s %.3fs", git_op_names[op], (double) session_ptr->op_time[op] / 1000000);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    git_odb_free(session_ptr->odb);
+    git_index_free(session_ptr->index);
+    git_repository_free(session_ptr->repo);
+    Tcl_Free((char *) session_ptr);
+    git_libgit2_shutdown();
+    state_ptr->git_session_ptr = NULL;
+
+}
+
+// Returns true if the stat data of the file is the same as when it
+// was added to the index, i.e. the file does not need to be hashed again.
+static int ttrek_GitIsEntryUpToDate(const git_index_entry *entry, const struct stat *st) {
+    return entry->file_size == (uint32_t) st->st_size
+           && entry->ino == (uint32_t) st->st_ino
+           && entry->mtime.seconds == (int32_t) ST_MTIM(*st).tv_sec
+           && entry->mtime.nanoseconds == (uint32_t) ST_MTIM(*st).tv_nsec
+           && entry->ctime.seconds == (int32_t) ST_CTIM(*st).tv_sec
+           && entry->ctime.nanoseconds == (uint32_t) ST_CTIM(*st).tv_nsec;
+}
+
+static int ttrek_GitStagePath(ttrek_state_t *state_ptr, git_index *index, const char *path, int *num_staged_ptr) {
+
+    Tcl_Obj *full_path_ptr;
+    ttrek_ResolvePath(NULL, state_ptr->project_venv_dir_ptr, Tcl_NewStringObj(path, -1), &full_path_ptr);
+    struct stat st;
+    int exists = (lstat(Tcl_GetString(full_path_ptr), &st) == 0);
+    Tcl_DecrRefCount(full_path_ptr);
+
+    const git_index_entry *entry = git_index_get_bypath(index, path, 0);
+
+    int error = 0;
+    if (!exists) {
+        if (entry == NULL) {
+            return TCL_OK;
+        }
+        DBG2(printf("remove: %s", path));
+        error = git_index_remove_bypath(index, path);
+    } else if (S_ISDIR(st.st_mode)) {
+        return TCL_OK;
+    } else {
+        if (entry != NULL && ttrek_GitIsEntryUpToDate(entry, &st)) {
+            return TCL_OK;
+        }
+        DBG2(printf("add: %s", path));
+        error = git_index_add_bypath(index, path);
+    }
 
-    // Create a new index
-    error = git_repository_index(&index, repo);
     if (error < 0) {
         const git_error *e = git_error_last();
         fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        goto cleanup;
+        return TCL_ERROR;
     }
 
+    (*num_staged_ptr)++;
+    return TCL_OK;
+
+}
+
+// Stages the files changed by the command and the manifest, instead of
+// adding the whole venv to the index. This way, only the changed files are
+// hashed and written to the object database.
+static int ttrek_GitStageChanges(ttrek_state_t *state_ptr, git_index *index) {
+
+    int num_staged = 0;
+
+    const char *top_level_files[] = {MANIFEST_JSON_FILE, MANIFEST_JOURNAL_FILE, NULL};
+    for (int i = 0; top_level_files[i] != NULL; i++) {
+        if (TCL_OK != ttrek_GitStagePath(state_ptr, index, top_level_files[i], &num_staged)) {
+            return TCL_ERROR;
+        }
+    }
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->snapshot_paths_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        const char *path = Tcl_GetHashKey(&state_ptr->snapshot_paths_ht, entry);
+        if (TCL_OK != ttrek_GitStagePath(state_ptr, index, path, &num_staged)) {
+            return TCL_ERROR;
+        }
+    }
+
+    DBG2(printf("staged %d of %d changed paths", num_staged, state_ptr->snapshot_paths_ht.numEntries));
+
+    // The changes are in the index now
+    Tcl_DeleteHashTable(&state_ptr->snapshot_paths_ht);
+    Tcl_InitHashTable(&state_ptr->snapshot_paths_ht, TCL_STRING_KEYS);
+
+    return TCL_OK;
+
+}
+
+int ttrek_GitInit(ttrek_state_t *state_ptr) {
+
+    // drop the repository opened before, if any
+    ttrek_GitSessionFree(state_ptr);
+
+    // initialize a new git repository in the given path
+    ttrek_git_session_t *session_ptr = ttrek_GitSessionGet(state_ptr, 1);
+    if (session_ptr == NULL) {
+        return TCL_ERROR;
+    }
+
+    fprintf(stdout, "initialized empty git repository in %s\n", Tcl_GetString(state_ptr->project_venv_dir_ptr));
+
+    Tcl_WideInt start_time = ttrek_GitNow();
+
+    git_oid tree_oid;
+    git_signature *sig = NULL;
+    git_tree *tree = NULL;
+    int rc = TCL_ERROR;
+
     // Write the index as a tree
-    error = git_index_write_tree(&tree_oid, index);
+    int error = git_index_write_tree(&tree_oid, session_ptr->index);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         goto cleanup;
     }
 
     // Write the index to disk
-    error = git_index_write(index);
+    error = git_index_write(session_ptr->index);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         goto cleanup;
     }
 
     // Create a tree from the tree OID
-    error = git_tree_lookup(&tree, repo, &tree_oid);
+    error = git_tree_lookup(&tree, session_ptr->repo, &tree_oid);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         goto cleanup;
     }
 
     // initial commit
     error = git_signature_now(&sig, "Author Name", "author@example.com");
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         goto cleanup;
     }
 
     // Create the initial commit
     git_oid commit_oid;
-    error = git_commit_create_v(&commit_oid, repo, "HEAD", sig, sig, NULL, "Initial commit", tree, 0);
+    error = git_commit_create_v(&commit_oid, session_ptr->repo, "HEAD", sig, sig, NULL, "Initial commit", tree, 0);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         goto cleanup;
     }
 
     printf("Created initial commit with OID: %s\n", git_oid_tostr_s(&commit_oid));
+    rc = TCL_OK;
 
-    // Clean up
+cleanup:
     git_signature_free(sig);
     git_tree_free(tree);
-    git_index_free(index);
-    git_repository_free(repo);
-    git_libgit2_shutdown();
-    return TCL_OK;
-
-    cleanup:
-    // Clean up
-    git_signature_free(sig);
-    git_tree_free(tree);
-    git_index_free(index);
-    git_repository_free(repo);
-    git_libgit2_shutdown();
-    return TCL_ERROR;
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_COMMIT, start_time);
+    return rc;
 }
 
 int list_untracked(git_repository *repo, Tcl_Obj *untracked_files) {
@@ -175,314 +382,512 @@ int ttrek_GitClean(ttrek_state_t *state_ptr, git_repository *repo) {
     return TCL_OK;
 }
 
-int ttrek_GitResetHard(ttrek_state_t *state_ptr) {
-    // git2
-    git_libgit2_init();
-    int error;
-    git_repository *repo = NULL;
-    git_commit *commit = NULL;
-    const char *commit_sha = "HEAD";
+static int ttrek_GitIsHexName(const char *name, int len) {
+    for (int i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char) name[i])) {
+            return 0;
+        }
+    }
+    return name[len] == '\0';
+}
+
+// Counts the loose objects in objects/XX/ and the packs in objects/pack/.
+// If remove_loose is set, the loose objects are removed instead.
+static int ttrek_GitObjectsWalk(git_repository *repo, ttrek_git_objects_stats_t *stats_ptr, int remove_loose) {
 
-    if (git_repository_open(&repo, Tcl_GetString(state_ptr->project_venv_dir_ptr)) != 0) {
-        fprintf(stderr, "error: opening repository failed\n");
-        git_libgit2_shutdown();
+    memset(stats_ptr, 0, sizeof(ttrek_git_objects_stats_t));
+
+    Tcl_DString path_ds;
+    Tcl_DStringInit(&path_ds);
+    Tcl_DStringAppend(&path_ds, git_repository_path(repo), -1);
+    Tcl_DStringAppend(&path_ds, "objects", -1);
+    Tcl_Size objects_len = Tcl_DStringLength(&path_ds);
+
+    DIR *objects_dir = opendir(Tcl_DStringValue(&path_ds));
+    if (objects_dir == NULL) {
+        fprintf(stderr, "error: could not open directory %s: %s\n", Tcl_DStringValue(&path_ds), strerror(errno));
+        Tcl_DStringFree(&path_ds);
         return TCL_ERROR;
     }
 
-    git_ignore_add_rule(repo, LOCKING_FILE_IGNORE_RULE);
-    git_ignore_add_rule(repo, BUILD_DIR_IGNORE_RULE);
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(objects_dir)) != NULL) {
+
+        int is_pack = strcmp(dir_entry->d_name, "pack") == 0;
+        if (!is_pack && !ttrek_GitIsHexName(dir_entry->d_name, 2)) {
+            continue;
+        }
+
+        Tcl_DStringSetLength(&path_ds, objects_len);
+        Tcl_DStringAppend(&path_ds, "/", 1);
+        Tcl_DStringAppend(&path_ds, dir_entry->d_name, -1);
+        Tcl_Size dir_len = Tcl_DStringLength(&path_ds);
+
+        DIR *dir = opendir(Tcl_DStringValue(&path_ds));
+        if (dir == NULL) {
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+
+            Tcl_DStringSetLength(&path_ds, dir_len);
+            Tcl_DStringAppend(&path_ds, "/", 1);
+            Tcl_DStringAppend(&path_ds, entry->d_name, -1);
+
+            struct stat st;
+            if (lstat(Tcl_DStringValue(&path_ds), &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+
+            if (is_pack) {
+                size_t name_len = strlen(entry->d_name);
+                if (name_len > 5 && strcmp(entry->d_name + name_len - 5, ".pack") == 0) {
+                    stats_ptr->pack_count++;
+                }
+                stats_ptr->pack_size += st.st_size;
+            } else if (remove_loose) {
+                if (unlink(Tcl_DStringValue(&path_ds)) != 0) {
+                    fprintf(stderr, "warning: could not remove %s: %s\n", Tcl_DStringValue(&path_ds),
+                            strerror(errno));
+                }
+            } else {
+                stats_ptr->loose_count++;
+                stats_ptr->loose_size += st.st_size;
+            }
+
+        }
+        closedir(dir);
+
+        if (remove_loose && !is_pack) {
+            Tcl_DStringSetLength(&path_ds, dir_len);
+            rmdir(Tcl_DStringValue(&path_ds));
+        }
 
-    // Get the OID of the commit to reset to
-    error = git_revparse_single((git_object **)&commit, repo, commit_sha);
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return 1;
     }
+    closedir(objects_dir);
 
-    // Perform the hard reset
-    error = git_reset(repo, (git_object *)commit, GIT_RESET_HARD, NULL);
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-    } else {
-        printf("Hard reset to %s successful.\n", commit_sha);
+    Tcl_DStringFree(&path_ds);
+    return TCL_OK;
+
+}
+
+// Removes the files of the packs in old_packs_ptr, except the given pack.
+// The list contains the names of the packs without the ".pack" extension.
+static void ttrek_GitRemovePacks(git_repository *repo, Tcl_Obj *old_packs_ptr, const char *keep_name) {
+
+    static const char *pack_exts[] = {".pack", ".idx", ".rev", ".bitmap", ".mtimes", NULL};
+
+    Tcl_Size packs_len;
+    Tcl_Obj **packs_ptrs;
+    Tcl_ListObjGetElements(NULL, old_packs_ptr, &packs_len, &packs_ptrs);
+
+    Tcl_DString path_ds;
+    Tcl_DStringInit(&path_ds);
+    for (Tcl_Size i = 0; i < packs_len; i++) {
+        const char *pack_name = Tcl_GetString(packs_ptrs[i]);
+        if (keep_name != NULL && strcmp(pack_name + 5, keep_name) == 0) {
+            continue;
+        }
+        for (int j = 0; pack_exts[j] != NULL; j++) {
+            Tcl_DStringSetLength(&path_ds, 0);
+            Tcl_DStringAppend(&path_ds, git_repository_path(repo), -1);
+            Tcl_DStringAppend(&path_ds, "objects/pack/", -1);
+            Tcl_DStringAppend(&path_ds, pack_name, -1);
+            Tcl_DStringAppend(&path_ds, pack_exts[j], -1);
+            if (unlink(Tcl_DStringValue(&path_ds)) != 0 && errno != ENOENT) {
+                fprintf(stderr, "warning: could not remove %s: %s\n", Tcl_DStringValue(&path_ds), strerror(errno));
+            }
+        }
     }
+    Tcl_DStringFree(&path_ds);
 
-    // git clean -f -x
-    if (TCL_OK != ttrek_GitClean(state_ptr, repo)) {
-        fprintf(stderr, "error: cleaning untracked files failed\n");
-        git_commit_free(commit);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+}
+
+// Returns the names of the packs that are not marked with a .keep file.
+static Tcl_Obj *ttrek_GitListPacks(git_repository *repo) {
+
+    Tcl_Obj *packs_ptr = Tcl_NewListObj(0, NULL);
+
+    Tcl_DString path_ds;
+    Tcl_DStringInit(&path_ds);
+    Tcl_DStringAppend(&path_ds, git_repository_path(repo), -1);
+    Tcl_DStringAppend(&path_ds, "objects/pack/", -1);
+    Tcl_Size dir_len = Tcl_DStringLength(&path_ds);
+
+    DIR *dir = opendir(Tcl_DStringValue(&path_ds));
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t name_len = strlen(entry->d_name);
+            if (name_len <= 5 || strncmp(entry->d_name, "pack-", 5) != 0
+                || strcmp(entry->d_name + name_len - 5, ".pack") != 0) {
+                continue;
+            }
+            Tcl_DStringSetLength(&path_ds, dir_len);
+            Tcl_DStringAppend(&path_ds, entry->d_name, (Tcl_Size) name_len - 5);
+            Tcl_DStringAppend(&path_ds, ".keep", 5);
+            if (access(Tcl_DStringValue(&path_ds), F_OK) == 0) {
+                continue;
+            }
+            Tcl_ListObjAppendElement(NULL, packs_ptr, Tcl_NewStringObj(entry->d_name, (Tcl_Size) name_len - 5));
+        }
+        closedir(dir);
     }
 
-    // Clean up
-    git_commit_free(commit);
-    git_repository_free(repo);
-    git_libgit2_shutdown();
-    return TCL_OK;
+    Tcl_DStringFree(&path_ds);
+    return packs_ptr;
+
 }
 
-int ttrek_GitCommit(ttrek_state_t *state_ptr, const char *message) {
-    // git2
-    git_libgit2_init();
-    int error;
-    git_repository *repo = NULL;
-    git_index *index = NULL;
-    git_oid tree_oid;
-    git_oid commit_oid;
-    git_signature *sig = NULL;
-    git_tree *tree = NULL;
-    git_commit *parent = NULL;
+// Every amend leaves the previous commit behind in the reflog. Dropping
+// the reflogs keeps the history of the venv bounded to the commits that
+// are still reachable.
+static void ttrek_GitDropReflogs(git_repository *repo) {
+    git_reference *head_ref = NULL;
+    if (git_reference_lookup(&head_ref, repo, "HEAD") == 0) {
+        if (git_reference_type(head_ref) == GIT_REFERENCE_SYMBOLIC) {
+            git_reflog_delete(repo, git_reference_symbolic_target(head_ref));
+        }
+        git_reference_free(head_ref);
+    }
+    git_reflog_delete(repo, "HEAD");
+}
 
-    if (git_repository_open(&repo, Tcl_GetString(state_ptr->project_venv_dir_ptr)) != 0) {
-        fprintf(stderr, "error: opening repository failed\n");
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+// Writes everything reachable from the refs and the index into a single
+// new pack, then removes all loose objects and the old packs. Whatever
+// is left out is unreachable.
+static int ttrek_GitRepack(ttrek_git_session_t *session_ptr, ttrek_git_gc_result_t *result_ptr) {
+
+    Tcl_WideInt start_time = ttrek_GitNow();
+
+    git_repository *repo = session_ptr->repo;
+    git_packbuilder *pb = NULL;
+    git_revwalk *walk = NULL;
+    int rc = TCL_ERROR;
+
+    if (TCL_OK != ttrek_GitObjectsWalk(repo, &result_ptr->before, 0)) {
+        goto done;
     }
 
-    // Get the index
-    error = git_repository_index(&index, repo);
+    ttrek_GitDropReflogs(repo);
+
+    int error = git_packbuilder_new(&pb, repo);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
     }
 
-    // Add all files to the index (including modified and deleted)
-    error = git_index_add_all(index, NULL, 0, NULL, NULL);
+    error = git_revwalk_new(&walk, repo);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
     }
 
-    // Write the index as a tree
-    error = git_index_write_tree(&tree_oid, index);
+    error = git_revwalk_push_head(walk);
+    if (error == 0) {
+        error = git_revwalk_push_glob(walk, "*");
+    }
+    if (error == 0) {
+        error = git_packbuilder_insert_walk(pb, walk);
+    }
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
+    }
+
+    // The index could refer to blobs that are not committed yet
+    size_t num_entries = git_index_entrycount(session_ptr->index);
+    for (size_t i = 0; i < num_entries; i++) {
+        const git_index_entry *entry = git_index_get_byindex(session_ptr->index, i);
+        error = git_packbuilder_insert(pb, &entry->id, entry->path);
+        if (error < 0) {
+            ttrek_GitPrintError(error);
+            goto done;
+        }
     }
 
-    // Write the index to disk
-    error = git_index_write(index);
+    Tcl_Obj *old_packs_ptr = ttrek_GitListPacks(repo);
+    Tcl_IncrRefCount(old_packs_ptr);
+
+    error = git_packbuilder_write(pb, NULL, 0, NULL, NULL);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        Tcl_DecrRefCount(old_packs_ptr);
+        goto done;
     }
 
-    // Create a tree from the tree OID
-    error = git_tree_lookup(&tree, repo, &tree_oid);
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+    result_ptr->num_packed = (Tcl_WideInt) git_packbuilder_object_count(pb);
+
+    // Only remove objects once they are safely in the new pack
+    ttrek_git_objects_stats_t removed_stats;
+    ttrek_GitObjectsWalk(repo, &removed_stats, 1);
+    ttrek_GitRemovePacks(repo, old_packs_ptr, git_packbuilder_name(pb));
+    Tcl_DecrRefCount(old_packs_ptr);
+
+    git_odb_refresh(session_ptr->odb);
+
+    if (TCL_OK != ttrek_GitObjectsWalk(repo, &result_ptr->after, 0)) {
+        goto done;
     }
 
-    // Get the parent commit
-    error = git_reference_name_to_id(&commit_oid, repo, "HEAD");
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+    rc = TCL_OK;
+
+done:
+    git_revwalk_free(walk);
+    git_packbuilder_free(pb);
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_GC, start_time);
+    return rc;
+
+}
+
+static Tcl_WideInt ttrek_GitGcThreshold(const char *env_name, Tcl_WideInt default_value) {
+    const char *value = getenv(env_name);
+    if (value == NULL) {
+        return default_value;
     }
+    return strtoll(value, NULL, 10);
+}
 
-    error = git_commit_lookup(&parent, repo, &commit_oid);
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
+// Packs the repository when the loose objects exceed the thresholds.
+// Called after the snapshot of the venv is written. Failures are not
+// fatal, the snapshot itself is already in place.
+static void ttrek_GitAutoGc(ttrek_git_session_t *session_ptr) {
+
+    Tcl_WideInt max_count = ttrek_GitGcThreshold("TTREK_GIT_GC_LOOSE_OBJECTS", GIT_GC_LOOSE_OBJECTS);
+    Tcl_WideInt max_size = ttrek_GitGcThreshold("TTREK_GIT_GC_LOOSE_SIZE", GIT_GC_LOOSE_SIZE) * 1024 * 1024;
+
+    if (max_count <= 0 && max_size <= 0) {
+        return;
+    }
+
+    ttrek_git_objects_stats_t stats;
+    if (TCL_OK != ttrek_GitObjectsWalk(session_ptr->repo, &stats, 0)) {
+        return;
+    }
+
+    DBG2(printf("loose objects: %" TCL_LL_MODIFIER "d (%" TCL_LL_MODIFIER "d bytes)", stats.loose_count,
+                stats.loose_size));
+
+    if ((max_count <= 0 || stats.loose_count < max_count) && (max_size <= 0 || stats.loose_size < max_size)) {
+        return;
+    }
+
+    ttrek_git_gc_result_t result;
+    if (TCL_OK != ttrek_GitRepack(session_ptr, &result)) {
+        fprintf(stderr, "warning: packing git repository failed\n");
+    }
+
+}
+
+int ttrek_GitGc(ttrek_state_t *state_ptr, ttrek_git_gc_result_t *result_ptr) {
+
+    ttrek_git_session_t *session_ptr = ttrek_GitSessionGet(state_ptr, 0);
+    if (session_ptr == NULL) {
         return TCL_ERROR;
     }
 
-    // Create the commit
-    error = git_signature_now(&sig, "Author Name", "author@example.com");
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_commit_free(parent);
-        git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
+    return ttrek_GitRepack(session_ptr, result_ptr);
+
+}
+
+int ttrek_GitResetHard(ttrek_state_t *state_ptr) {
+
+    ttrek_git_session_t *session_ptr = ttrek_GitSessionGet(state_ptr, 0);
+    if (session_ptr == NULL) {
         return TCL_ERROR;
     }
 
-    error = git_commit_create_v(&commit_oid, repo, "HEAD", sig, sig, NULL, message, tree, 1, parent);
+    Tcl_WideInt start_time = ttrek_GitNow();
+
+    int error;
+    git_commit *commit = NULL;
+    const char *commit_sha = "HEAD";
+
+    // Get the OID of the commit to reset to
+    error = git_revparse_single((git_object **)&commit, session_ptr->repo, commit_sha);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_signature_free(sig);
-        git_commit_free(parent);
-        git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
+        ttrek_GitPrintError(error);
+        ttrek_GitSessionAddTime(session_ptr, GIT_OP_RESET, start_time);
         return TCL_ERROR;
     }
 
-    printf("Created commit with OID: %s\n", git_oid_tostr_s(&commit_oid));
+    // Perform the hard reset
+    error = git_reset(session_ptr->repo, (git_object *)commit, GIT_RESET_HARD, NULL);
+    if (error < 0) {
+        ttrek_GitPrintError(error);
+    } else {
+        printf("Hard reset to %s successful.\n", commit_sha);
+    }
 
-    // Clean up
-    git_signature_free(sig);
-    git_commit_free(parent);
-    git_tree_free(tree);
-    git_index_free(index);
-    git_repository_free(repo);
-    git_libgit2_shutdown();
+    // git clean -f -x
+    int rc = ttrek_GitClean(state_ptr, session_ptr->repo);
+    if (TCL_OK != rc) {
+        fprintf(stderr, "error: cleaning untracked files failed\n");
+    }
 
-    return TCL_OK;
+    git_commit_free(commit);
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_RESET, start_time);
+    return rc;
 }
 
-int ttrek_GitAmend(ttrek_state_t *state_ptr) {
+// Stages the changes and writes the index as a tree. Also returns HEAD,
+// the parent of the new commit or the commit to amend.
+static int ttrek_GitWriteTree(ttrek_state_t *state_ptr, ttrek_git_session_t *session_ptr, git_tree **tree_ptr,
+                              git_commit **head_ptr) {
 
-    // we can amend the last commit by replacing its contents with the current index
+    Tcl_WideInt start_time = ttrek_GitNow();
 
-    git_libgit2_init();
-    int error;
-    git_repository *repo = NULL;
-    git_index *index = NULL;
     git_oid tree_oid;
-    git_oid commit_oid;
+    git_oid head_oid;
     git_tree *tree = NULL;
-    git_commit *parent = NULL;
-
-    if (git_repository_open(&repo, Tcl_GetString(state_ptr->project_venv_dir_ptr)) != 0) {
-        fprintf(stderr, "error: opening repository failed\n");
-        git_libgit2_shutdown();
-        return TCL_ERROR;
-    }
-
-    git_ignore_add_rule(repo, LOCKING_FILE_IGNORE_RULE);
-    git_ignore_add_rule(repo, BUILD_DIR_IGNORE_RULE);
+    git_commit *head = NULL;
+    int rc = TCL_ERROR;
 
-    // Get the index
-    error = git_repository_index(&index, repo);
+    // The index could have been changed on disk by a reset
+    int error = git_index_read(session_ptr->index, 0);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
     }
 
-    // Add all files to the index (including modified and deleted)
-    error = git_index_add_all(index, NULL, 0, NULL, NULL);
-    if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+    // Add the changed files to the index (including modified and deleted)
+    if (TCL_OK != ttrek_GitStageChanges(state_ptr, session_ptr->index)) {
+        goto done;
     }
 
     // Write the index as a tree
-    error = git_index_write_tree(&tree_oid, index);
+    error = git_index_write_tree(&tree_oid, session_ptr->index);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
     }
 
     // Write the index to disk
-    error = git_index_write(index);
+    error = git_index_write(session_ptr->index);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
     }
 
     // Create a tree from the tree OID
-    error = git_tree_lookup(&tree, repo, &tree_oid);
+    error = git_tree_lookup(&tree, session_ptr->repo, &tree_oid);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        ttrek_GitPrintError(error);
+        goto done;
     }
 
     // Get the parent commit
-    error = git_reference_name_to_id(&commit_oid, repo, "HEAD");
+    error = git_reference_name_to_id(&head_oid, session_ptr->repo, "HEAD");
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-        return TCL_ERROR;
+        goto done;
     }
 
-    error = git_commit_lookup(&parent, repo, &commit_oid);
+    error = git_commit_lookup(&head, session_ptr->repo, &head_oid);
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
+        ttrek_GitPrintError(error);
         git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
+        goto done;
+    }
+
+    *tree_ptr = tree;
+    *head_ptr = head;
+    rc = TCL_OK;
+
+done:
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_STAGE, start_time);
+    return rc;
+
+}
+
+int ttrek_GitCommit(ttrek_state_t *state_ptr, const char *message) {
+
+    ttrek_git_session_t *session_ptr = ttrek_GitSessionGet(state_ptr, 0);
+    if (session_ptr == NULL) {
         return TCL_ERROR;
     }
 
-    // Amend the commit
+    git_tree *tree;
+    git_commit *parent;
+    if (TCL_OK != ttrek_GitWriteTree(state_ptr, session_ptr, &tree, &parent)) {
+        return TCL_ERROR;
+    }
+
+    Tcl_WideInt start_time = ttrek_GitNow();
 
-    error = git_commit_amend(&commit_oid, parent, "HEAD", NULL, NULL, NULL, NULL, tree);
+    git_oid commit_oid;
+    git_signature *sig = NULL;
+    int rc = TCL_ERROR;
+
+    // Create the commit
+    int error = git_signature_now(&sig, "Author Name", "author@example.com");
     if (error < 0) {
-        const git_error *e = git_error_last();
-        fprintf(stderr, "Error %d/%d: %s\n", error, e->klass, e->message);
-        git_commit_free(parent);
-        git_tree_free(tree);
-        git_index_free(index);
-        git_repository_free(repo);
-        git_libgit2_shutdown();
+        ttrek_GitPrintError(error);
+        goto cleanup;
+    }
+
+    error = git_commit_create_v(&commit_oid, session_ptr->repo, "HEAD", sig, sig, NULL, message, tree, 1, parent);
+    if (error < 0) {
+        ttrek_GitPrintError(error);
+        goto cleanup;
+    }
+
+    printf("Created commit with OID: %s\n", git_oid_tostr_s(&commit_oid));
+    rc = TCL_OK;
+
+cleanup:
+    git_signature_free(sig);
+    git_commit_free(parent);
+    git_tree_free(tree);
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_COMMIT, start_time);
+
+    if (rc == TCL_OK) {
+        ttrek_GitAutoGc(session_ptr);
+    }
+    return rc;
+}
+
+int ttrek_GitAmend(ttrek_state_t *state_ptr) {
+
+    // we can amend the last commit by replacing its contents with the current index
+
+    ttrek_git_session_t *session_ptr = ttrek_GitSessionGet(state_ptr, 0);
+    if (session_ptr == NULL) {
         return TCL_ERROR;
     }
 
-    printf("Amended commit with OID: %s\n", git_oid_tostr_s(&commit_oid));
+    git_tree *tree;
+    git_commit *parent;
+    if (TCL_OK != ttrek_GitWriteTree(state_ptr, session_ptr, &tree, &parent)) {
+        return TCL_ERROR;
+    }
+
+    Tcl_WideInt start_time = ttrek_GitNow();
+
+    // Amend the commit
+    git_oid commit_oid;
+    int error = git_commit_amend(&commit_oid, parent, "HEAD", NULL, NULL, NULL, NULL, tree);
+    if (error < 0) {
+        ttrek_GitPrintError(error);
+    } else {
+        printf("Amended commit with OID: %s\n", git_oid_tostr_s(&commit_oid));
+    }
 
-    // Clean up
     git_commit_free(parent);
     git_tree_free(tree);
-    git_index_free(index);
-    git_repository_free(repo);
-    git_libgit2_shutdown();
+    ttrek_GitSessionAddTime(session_ptr, GIT_OP_COMMIT, start_time);
 
+    if (error < 0) {
+        return TCL_ERROR;
+    }
+
+    ttrek_GitAutoGc(session_ptr);
     return TCL_OK;
 
 }
@@ -500,18 +905,8 @@ int ttrek_EnsureGitReady(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
     Tcl_DecrRefCount(git_dir_ptr);
 
     if (exists) {
-        // try to open the repository
-        git_libgit2_init();
-        git_repository *repo = NULL;
-        if (git_repository_open(&repo, Tcl_GetString(state_ptr->project_venv_dir_ptr)) != 0) {
-            fprintf(stderr, "error: opening repository failed\n");
-            git_repository_free(repo);
-            git_libgit2_shutdown();
-            return TCL_ERROR;
-        }
-        git_repository_free(repo);
-        git_libgit2_shutdown();
-
+        // The repository is only opened when the last run was interrupted,
+        // so that commands like 'run' start without opening it.
         int dirty_dir_exists = 0;
         if (TCL_OK != ttrek_FileExists(interp, state_ptr->dirty_file_path_ptr, &dirty_dir_exists)) {
             fprintf(stderr, "error: checking if .dirty exists failed\n");
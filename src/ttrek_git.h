@@ -13,10 +13,25 @@
 extern "C" {
 #endif
 
+typedef struct {
+    Tcl_WideInt loose_count;
+    Tcl_WideInt loose_size;
+    Tcl_WideInt pack_count;
+    Tcl_WideInt pack_size;
+} ttrek_git_objects_stats_t;
+
+typedef struct {
+    ttrek_git_objects_stats_t before;
+    ttrek_git_objects_stats_t after;
+    Tcl_WideInt num_packed;
+} ttrek_git_gc_result_t;
+
 int ttrek_GitInit(ttrek_state_t *state_ptr);
 int ttrek_GitResetHard(ttrek_state_t *state_ptr);
 int ttrek_GitCommit(ttrek_state_t *state_ptr, const char *message);
 int ttrek_GitAmend(ttrek_state_t *state_ptr);
+int ttrek_GitGc(ttrek_state_t *state_ptr, ttrek_git_gc_result_t *result_ptr);
+void ttrek_GitSessionFree(ttrek_state_t *state_ptr);
 int ttrek_EnsureGitReady(Tcl_Interp *interp, ttrek_state_t *state_ptr);
 
 #ifdef __cplusplus
@@ -30,6 +30,15 @@ static const struct {
     },
     {"ls",
 #include "help_ls.txt.h"
+    },
+    {"build-report",
+#include "help_build-report.txt.h"
+    },
+    {"verify",
+#include "help_verify.txt.h"
+    },
+    {"gc",
+#include "help_gc.txt.h"
     },
     {NULL, NULL}
 };
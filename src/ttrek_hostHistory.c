@@ -0,0 +1,164 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "ttrek_hostHistory.h"
+
+static Tcl_Obj *ttrek_HostHistoryGetPath(Tcl_Interp *interp) {
+    Tcl_Obj *home_dir_ptr = ttrek_GetHomeDirectory();
+    if (home_dir_ptr == NULL) {
+        return NULL;
+    }
+    Tcl_IncrRefCount(home_dir_ptr);
+    Tcl_Obj *path_ptr;
+    if (TCL_OK != ttrek_ResolvePath(interp, home_dir_ptr, Tcl_NewStringObj(HOST_HISTORY_FILE, -1), &path_ptr)) {
+        path_ptr = NULL;
+    }
+    Tcl_DecrRefCount(home_dir_ptr);
+    return path_ptr;
+}
+
+int ttrek_HostHistoryLoad(Tcl_Interp *interp, cJSON **history_root_ptr) {
+
+    cJSON *history_root = NULL;
+
+    Tcl_Obj *path_ptr = ttrek_HostHistoryGetPath(interp);
+    if (path_ptr != NULL) {
+        if (TCL_OK == ttrek_CheckFileExists(path_ptr)) {
+            if (TCL_OK != ttrek_FileToJson(interp, path_ptr, &history_root)) {
+                Tcl_DecrRefCount(path_ptr);
+                return TCL_ERROR;
+            }
+        }
+        Tcl_DecrRefCount(path_ptr);
+    }
+
+    // Start a new history if there is no history yet or if it is damaged
+    if (history_root == NULL || !cJSON_IsObject(history_root)) {
+        cJSON_Delete(history_root);
+        history_root = cJSON_CreateObject();
+    }
+
+    *history_root_ptr = history_root;
+    return TCL_OK;
+
+}
+
+// Several downloads may run at the same time and the last one to save
+// wins. This is fine, the history is only a hint. For the same reason
+// the history is saved quietly: a failure is not reported to the user,
+// the caller gets TCL_ERROR and carries on.
+int ttrek_HostHistorySave(Tcl_Interp *interp, cJSON *history_root) {
+
+    Tcl_Obj *home_dir_ptr = ttrek_GetHomeDirectory();
+    if (home_dir_ptr == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_IncrRefCount(home_dir_ptr);
+    // Fails if the directory already exists, opening the file below
+    // tells us if it is really missing
+    Tcl_FSCreateDirectory(home_dir_ptr);
+    Tcl_DecrRefCount(home_dir_ptr);
+
+    Tcl_Obj *path_ptr = ttrek_HostHistoryGetPath(interp);
+    if (path_ptr == NULL) {
+        return TCL_ERROR;
+    }
+
+    char *history_str = cJSON_PrintUnformatted(history_root);
+    if (history_str == NULL) {
+        Tcl_DecrRefCount(path_ptr);
+        return TCL_ERROR;
+    }
+
+    const char *path = Tcl_GetString(path_ptr);
+    Tcl_Obj *temp_path_ptr = Tcl_ObjPrintf("%s.tmp.%d", path, (int) getpid());
+    Tcl_IncrRefCount(temp_path_ptr);
+    const char *temp_path = Tcl_GetString(temp_path_ptr);
+
+    int rc = TCL_ERROR;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        size_t len = strlen(history_str);
+        ssize_t written = write(fd, history_str, len);
+        if (close(fd) == 0 && written == (ssize_t) len && rename(temp_path, path) == 0) {
+            rc = TCL_OK;
+        } else {
+            unlink(temp_path);
+        }
+    }
+
+    DBG2(printf("save %s: %s", path, rc == TCL_OK ? "ok" : strerror(errno)));
+
+    cJSON_free(history_str);
+    Tcl_DecrRefCount(temp_path_ptr);
+    Tcl_DecrRefCount(path_ptr);
+    return rc;
+
+}
+
+static cJSON *ttrek_HostHistoryGetHost(cJSON *history_root, const char *host) {
+    cJSON *host_root = cJSON_GetObjectItem(history_root, host);
+    if (host_root == NULL) {
+        host_root = cJSON_CreateObject();
+        cJSON_AddItemToObject(history_root, host, host_root);
+    }
+    return host_root;
+}
+
+static void ttrek_HostHistorySetNumber(cJSON *host_root, const char *name, double value) {
+    cJSON *item = cJSON_GetObjectItem(host_root, name);
+    if (item == NULL) {
+        cJSON_AddNumberToObject(host_root, name, value);
+    } else {
+        cJSON_SetNumberValue(item, value);
+    }
+}
+
+void ttrek_HostHistoryAddSuccess(cJSON *history_root, const char *host, double latency_ms) {
+    cJSON *host_root = ttrek_HostHistoryGetHost(history_root, host);
+    cJSON *latency_node = cJSON_GetObjectItem(host_root, "latency");
+    if (cJSON_IsNumber(latency_node)) {
+        latency_ms = HOST_HISTORY_LATENCY_WEIGHT * latency_ms
+            + (1 - HOST_HISTORY_LATENCY_WEIGHT) * cJSON_GetNumberValue(latency_node);
+    }
+    // Whole milliseconds are precise enough
+    ttrek_HostHistorySetNumber(host_root, "latency", (double) (long) (latency_ms + 0.5));
+    ttrek_HostHistorySetNumber(host_root, "failures", 0);
+}
+
+void ttrek_HostHistoryAddFailure(cJSON *history_root, const char *host) {
+    cJSON *host_root = ttrek_HostHistoryGetHost(history_root, host);
+    cJSON *failures_node = cJSON_GetObjectItem(host_root, "failures");
+    double failures = cJSON_IsNumber(failures_node) ? cJSON_GetNumberValue(failures_node) : 0;
+    ttrek_HostHistorySetNumber(host_root, "failures", failures + 1);
+    ttrek_HostHistorySetNumber(host_root, "last_failure", (double) time(NULL));
+}
+
+// Returns the expected time to the first byte from the host in ms, with
+// a penalty for its recent failures. Lower is better.
+double ttrek_HostHistoryGetScore(cJSON *history_root, const char *host) {
+    cJSON *host_root = cJSON_GetObjectItem(history_root, host);
+    if (host_root == NULL) {
+        return HOST_HISTORY_DEFAULT_LATENCY;
+    }
+
+    cJSON *latency_node = cJSON_GetObjectItem(host_root, "latency");
+    double score = cJSON_IsNumber(latency_node) ? cJSON_GetNumberValue(latency_node)
+        : HOST_HISTORY_DEFAULT_LATENCY;
+
+    cJSON *last_failure_node = cJSON_GetObjectItem(host_root, "last_failure");
+    if (cJSON_IsNumber(last_failure_node)
+        && (double) time(NULL) - cJSON_GetNumberValue(last_failure_node) < HOST_HISTORY_FAILURE_TTL) {
+        score += HOST_HISTORY_FAILURE_PENALTY * cJSON_GetNumberValue(cJSON_GetObjectItem(host_root, "failures"));
+    }
+
+    return score;
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_HOSTHISTORY_H
+#define TTREK_HOSTHISTORY_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The latency and the failures of the hosts that ttrek downloads from,
+// kept in the ttrek home directory and shared by all projects.
+#define HOST_HISTORY_FILE "hosts.json"
+// How much a new latency sample counts in the running average
+#define HOST_HISTORY_LATENCY_WEIGHT 0.3
+// The latency assumed for a host we have never downloaded from (ms)
+#define HOST_HISTORY_DEFAULT_LATENCY 500
+// The penalty for each recent failure of a host (ms)
+#define HOST_HISTORY_FAILURE_PENALTY 5000
+// Failures older than this (seconds) no longer count against a host
+#define HOST_HISTORY_FAILURE_TTL (24 * 60 * 60)
+
+int ttrek_HostHistoryLoad(Tcl_Interp *interp, cJSON **history_root_ptr);
+int ttrek_HostHistorySave(Tcl_Interp *interp, cJSON *history_root);
+
+void ttrek_HostHistoryAddSuccess(cJSON *history_root, const char *host, double latency_ms);
+void ttrek_HostHistoryAddFailure(cJSON *history_root, const char *host);
+double ttrek_HostHistoryGetScore(cJSON *history_root, const char *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_HOSTHISTORY_H
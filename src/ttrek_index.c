@@ -0,0 +1,157 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "ttrek_index.h"
+#include <string.h>
+
+static void ttrek_IndexUpdateLockFields(ttrek_index_package_t *package_ptr) {
+    package_ptr->version = cJSON_GetStringValue(cJSON_GetObjectItem(package_ptr->lock_node, "version"));
+    package_ptr->requires = cJSON_GetObjectItem(package_ptr->lock_node, "requires");
+    package_ptr->iuse = cJSON_GetObjectItem(package_ptr->lock_node, "iuse");
+    package_ptr->use = cJSON_GetObjectItem(package_ptr->lock_node, "use");
+}
+
+static void ttrek_IndexUpdateManifestFields(ttrek_index_package_t *package_ptr) {
+    package_ptr->files = cJSON_GetObjectItem(package_ptr->manifest_node, "files");
+}
+
+static ttrek_index_package_t *ttrek_IndexGetOrCreatePackage(ttrek_state_t *state_ptr, const char *package_name) {
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&state_ptr->index_ht, package_name, &is_new);
+    if (is_new) {
+        ttrek_index_package_t *package_ptr = (ttrek_index_package_t *) Tcl_Alloc(sizeof(ttrek_index_package_t));
+        memset(package_ptr, 0, sizeof(ttrek_index_package_t));
+        Tcl_SetHashValue(entry, package_ptr);
+    }
+    return (ttrek_index_package_t *) Tcl_GetHashValue(entry);
+}
+
+static void ttrek_IndexDeleteIfEmpty(ttrek_state_t *state_ptr, const char *package_name) {
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&state_ptr->index_ht, package_name);
+    if (entry == NULL) {
+        return;
+    }
+    ttrek_index_package_t *package_ptr = (ttrek_index_package_t *) Tcl_GetHashValue(entry);
+    if (package_ptr->lock_node == NULL && package_ptr->manifest_node == NULL) {
+        Tcl_Free((char *) package_ptr);
+        Tcl_DeleteHashEntry(entry);
+    }
+}
+
+// Replaces, adds (old_item is NULL) or removes (new_item is NULL) an item
+// of the object. Unlike cJSON_ReplaceItemInObject(), this does not search
+// for the item by its key.
+static void ttrek_IndexReplaceItem(cJSON *object, cJSON *old_item, const char *name, cJSON *new_item) {
+    if (old_item == NULL) {
+        if (new_item != NULL) {
+            cJSON_AddItemToObject(object, name, new_item);
+        }
+        return;
+    }
+    if (new_item == NULL) {
+        cJSON_Delete(cJSON_DetachItemViaPointer(object, old_item));
+        return;
+    }
+    // cJSON_ReplaceItemViaPointer() keeps the key of the new item
+    if (!(new_item->type & cJSON_StringIsConst) && new_item->string != NULL) {
+        cJSON_free(new_item->string);
+    }
+    new_item->type &= ~cJSON_StringIsConst;
+    size_t name_len = strlen(name);
+    new_item->string = (char *) cJSON_malloc(name_len + 1);
+    memcpy(new_item->string, name, name_len + 1);
+    cJSON_ReplaceItemViaPointer(object, old_item, new_item);
+}
+
+// Builds the index of the packages in the lock file and the manifest,
+// if it is already loaded. Must be called after the lock is loaded.
+void ttrek_IndexInit(ttrek_state_t *state_ptr) {
+
+    Tcl_InitHashTable(&state_ptr->index_ht, TCL_STRING_KEYS);
+
+    cJSON *package_node;
+    cJSON_ArrayForEach(package_node, cJSON_GetObjectItem(state_ptr->lock_root, "packages")) {
+        ttrek_index_package_t *package_ptr = ttrek_IndexGetOrCreatePackage(state_ptr, package_node->string);
+        package_ptr->lock_node = package_node;
+        ttrek_IndexUpdateLockFields(package_ptr);
+    }
+
+    ttrek_IndexAddManifest(state_ptr);
+
+}
+
+// Adds the packages of the manifest to the index. Called again when
+// the manifest is loaded after the index was built.
+void ttrek_IndexAddManifest(ttrek_state_t *state_ptr) {
+
+    cJSON *package_node;
+    cJSON_ArrayForEach(package_node, state_ptr->manifest_root) {
+        ttrek_index_package_t *package_ptr = ttrek_IndexGetOrCreatePackage(state_ptr, package_node->string);
+        package_ptr->manifest_node = package_node;
+        ttrek_IndexUpdateManifestFields(package_ptr);
+    }
+
+    DBG2(printf("indexed %d packages", state_ptr->index_ht.numEntries));
+
+}
+
+void ttrek_IndexFree(ttrek_state_t *state_ptr) {
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->index_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_Free((char *) Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&state_ptr->index_ht);
+}
+
+// Returns the package, or NULL if it is neither in the lock file
+// nor in the manifest.
+ttrek_index_package_t *ttrek_IndexGetPackage(ttrek_state_t *state_ptr, const char *package_name) {
+    ttrek_StateGetManifestRoot(state_ptr);
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&state_ptr->index_ht, package_name);
+    return entry == NULL ? NULL : (ttrek_index_package_t *) Tcl_GetHashValue(entry);
+}
+
+// Sets the package in "packages" of the lock file, or removes it if
+// lock_node is NULL. The lock_node is owned by the lock root after this call.
+void ttrek_IndexSetLockPackage(ttrek_state_t *state_ptr, const char *package_name, cJSON *lock_node) {
+
+    cJSON *packages = cJSON_GetObjectItem(state_ptr->lock_root, "packages");
+    if (packages == NULL) {
+        if (lock_node == NULL) {
+            return;
+        }
+        packages = cJSON_CreateObject();
+        cJSON_AddItemToObject(state_ptr->lock_root, "packages", packages);
+    }
+
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetOrCreatePackage(state_ptr, package_name);
+    ttrek_IndexReplaceItem(packages, package_ptr->lock_node, package_name, lock_node);
+    package_ptr->lock_node = lock_node;
+    ttrek_IndexUpdateLockFields(package_ptr);
+
+    ttrek_IndexDeleteIfEmpty(state_ptr, package_name);
+
+}
+
+// Sets the package in the manifest, or removes it if manifest_node is NULL.
+// The manifest_node is owned by the manifest root after this call. If the
+// manifest could not be loaded, the manifest_node is deleted, the command
+// fails later in ttrek_ManifestSave().
+void ttrek_IndexSetManifestPackage(ttrek_state_t *state_ptr, const char *package_name, cJSON *manifest_node) {
+
+    if (ttrek_StateGetManifestRoot(state_ptr) == NULL) {
+        cJSON_Delete(manifest_node);
+        return;
+    }
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetOrCreatePackage(state_ptr, package_name);
+    ttrek_IndexReplaceItem(state_ptr->manifest_root, package_ptr->manifest_node, package_name, manifest_node);
+    package_ptr->manifest_node = manifest_node;
+    ttrek_IndexUpdateManifestFields(package_ptr);
+
+    ttrek_IndexDeleteIfEmpty(state_ptr, package_name);
+
+}
@@ -0,0 +1,42 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_INDEX_H
+#define TTREK_INDEX_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An installed package as recorded in the lock file and in the manifest.
+// The fields point into the cJSON trees of the state, which are still
+// what is written back to the files.
+typedef struct {
+    // "packages" -> name in the lock file, or NULL
+    cJSON *lock_node;
+    const char *version;
+    cJSON *requires;
+    cJSON *iuse;
+    cJSON *use;
+    // name in the manifest, or NULL
+    cJSON *manifest_node;
+    cJSON *files;
+} ttrek_index_package_t;
+
+void ttrek_IndexInit(ttrek_state_t *state_ptr);
+void ttrek_IndexAddManifest(ttrek_state_t *state_ptr);
+void ttrek_IndexFree(ttrek_state_t *state_ptr);
+ttrek_index_package_t *ttrek_IndexGetPackage(ttrek_state_t *state_ptr, const char *package_name);
+void ttrek_IndexSetLockPackage(ttrek_state_t *state_ptr, const char *package_name, cJSON *lock_node);
+void ttrek_IndexSetManifestPackage(ttrek_state_t *state_ptr, const char *package_name, cJSON *manifest_node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_INDEX_H
@@ -0,0 +1,337 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "ttrek_jsonCache.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+// The binary cache of a parsed JSON file. The cache is valid as long as
+// the size, mtime and inode of the JSON file are the same as recorded
+// in the header. It is only read on the machine that wrote it, so
+// the numbers are stored in the native byte order.
+//
+// The header is followed by the root node. Each node is its cJSON type
+// (1 byte), its key if it is a member of an object, and its value:
+//   string, raw   - length (uint32_t) and the bytes with a terminating zero
+//   number        - double
+//   array, object - number of children (uint32_t) and the children
+//   true, false, null - nothing
+typedef struct {
+    char magic[8];
+    uint64_t json_size;
+    int64_t json_mtime_sec;
+    int64_t json_mtime_nsec;
+    uint64_t json_ino;
+    unsigned char json_hash[SHA256_DIGEST_LENGTH];
+    uint64_t data_len;
+} ttrek_json_cache_header_t;
+
+// The deepest nesting that is decoded, the same as the default of cJSON
+#define JSON_CACHE_NESTING_LIMIT 1000
+
+typedef struct {
+    const char *ptr;
+    const char *end;
+} ttrek_json_cache_reader_t;
+
+static void ttrek_JsonCacheEncodeString(Tcl_DString *ds, const char *str) {
+    uint32_t len = (uint32_t) strlen(str);
+    Tcl_DStringAppend(ds, (const char *) &len, sizeof(len));
+    // keep the terminating zero, so that the string can be used in place
+    Tcl_DStringAppend(ds, str, len + 1);
+}
+
+static void ttrek_JsonCacheEncode(Tcl_DString *ds, const cJSON *node, int with_key) {
+    unsigned char type = (unsigned char) (node->type & 0xFF);
+    Tcl_DStringAppend(ds, (const char *) &type, 1);
+    if (with_key) {
+        ttrek_JsonCacheEncodeString(ds, node->string == NULL ? "" : node->string);
+    }
+    switch (type) {
+        case cJSON_String:
+        case cJSON_Raw:
+            ttrek_JsonCacheEncodeString(ds, node->valuestring == NULL ? "" : node->valuestring);
+            break;
+        case cJSON_Number:
+            Tcl_DStringAppend(ds, (const char *) &node->valuedouble, sizeof(double));
+            break;
+        case cJSON_Array:
+        case cJSON_Object: {
+            uint32_t count = 0;
+            const cJSON *child;
+            cJSON_ArrayForEach(child, node) {
+                count++;
+            }
+            Tcl_DStringAppend(ds, (const char *) &count, sizeof(count));
+            cJSON_ArrayForEach(child, node) {
+                ttrek_JsonCacheEncode(ds, child, type == cJSON_Object);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static int ttrek_JsonCacheReadBytes(ttrek_json_cache_reader_t *reader, void *out, size_t len) {
+    if ((size_t) (reader->end - reader->ptr) < len) {
+        return 0;
+    }
+    memcpy(out, reader->ptr, len);
+    reader->ptr += len;
+    return 1;
+}
+
+static const char *ttrek_JsonCacheReadString(ttrek_json_cache_reader_t *reader) {
+    uint32_t len;
+    if (!ttrek_JsonCacheReadBytes(reader, &len, sizeof(len))) {
+        return NULL;
+    }
+    if ((size_t) (reader->end - reader->ptr) < (size_t) len + 1 || reader->ptr[len] != '\0') {
+        return NULL;
+    }
+    const char *str = reader->ptr;
+    reader->ptr += len + 1;
+    return str;
+}
+
+// Returns the decoded node, or NULL if the data is truncated or invalid
+static cJSON *ttrek_JsonCacheDecode(ttrek_json_cache_reader_t *reader, int depth, const char **key_ptr) {
+
+    if (depth > JSON_CACHE_NESTING_LIMIT) {
+        return NULL;
+    }
+
+    unsigned char type;
+    if (!ttrek_JsonCacheReadBytes(reader, &type, 1)) {
+        return NULL;
+    }
+
+    if (key_ptr != NULL && (*key_ptr = ttrek_JsonCacheReadString(reader)) == NULL) {
+        return NULL;
+    }
+
+    switch (type) {
+        case cJSON_False:
+            return cJSON_CreateFalse();
+        case cJSON_True:
+            return cJSON_CreateTrue();
+        case cJSON_NULL:
+            return cJSON_CreateNull();
+        case cJSON_Number: {
+            double number;
+            if (!ttrek_JsonCacheReadBytes(reader, &number, sizeof(number))) {
+                return NULL;
+            }
+            return cJSON_CreateNumber(number);
+        }
+        case cJSON_String:
+        case cJSON_Raw: {
+            const char *str = ttrek_JsonCacheReadString(reader);
+            if (str == NULL) {
+                return NULL;
+            }
+            return type == cJSON_String ? cJSON_CreateString(str) : cJSON_CreateRaw(str);
+        }
+        case cJSON_Array:
+        case cJSON_Object: {
+            uint32_t count;
+            if (!ttrek_JsonCacheReadBytes(reader, &count, sizeof(count))) {
+                return NULL;
+            }
+            cJSON *node = type == cJSON_Array ? cJSON_CreateArray() : cJSON_CreateObject();
+            for (uint32_t i = 0; i < count; i++) {
+                const char *key;
+                cJSON *child = ttrek_JsonCacheDecode(reader, depth + 1, type == cJSON_Object ? &key : NULL);
+                if (child == NULL) {
+                    cJSON_Delete(node);
+                    return NULL;
+                }
+                if (type == cJSON_Object) {
+                    cJSON_AddItemToObject(node, key, child);
+                } else {
+                    cJSON_AddItemToArray(node, child);
+                }
+            }
+            return node;
+        }
+        default:
+            return NULL;
+    }
+
+}
+
+static void ttrek_JsonCacheFillHeader(ttrek_json_cache_header_t *header, const struct stat *json_st) {
+    memset(header, 0, sizeof(ttrek_json_cache_header_t));
+    memcpy(header->magic, JSON_CACHE_MAGIC, sizeof(header->magic));
+    header->json_size = (uint64_t) json_st->st_size;
+    header->json_mtime_sec = (int64_t) ST_MTIM(*json_st).tv_sec;
+    header->json_mtime_nsec = (int64_t) ST_MTIM(*json_st).tv_nsec;
+    header->json_ino = (uint64_t) json_st->st_ino;
+}
+
+// Decodes the cache, if it exists and matches the JSON file
+static int ttrek_JsonCacheRead(Tcl_Obj *json_path_ptr, Tcl_Obj *cache_path_ptr, const struct stat *json_st,
+                               cJSON **root_ptr) {
+
+    int fd = open(Tcl_GetString(cache_path_ptr), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return TCL_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ttrek_json_cache_header_t)) {
+        close(fd);
+        return TCL_ERROR;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return TCL_ERROR;
+    }
+
+    ttrek_json_cache_header_t header, expected_header;
+    memcpy(&header, map, sizeof(header));
+    ttrek_JsonCacheFillHeader(&expected_header, json_st);
+
+    int rc = TCL_ERROR;
+    if (memcmp(header.magic, expected_header.magic, sizeof(header.magic)) != 0
+        || header.json_size != expected_header.json_size
+        || header.json_mtime_sec != expected_header.json_mtime_sec
+        || header.json_mtime_nsec != expected_header.json_mtime_nsec
+        || header.json_ino != expected_header.json_ino
+        || header.data_len != (uint64_t) st.st_size - sizeof(header)) {
+
+        DBG2(printf("stale cache %s", Tcl_GetString(cache_path_ptr)));
+        goto done;
+    }
+
+    ttrek_json_cache_reader_t reader;
+    reader.ptr = (const char *) map + sizeof(header);
+    reader.end = (const char *) map + st.st_size;
+    cJSON *root = ttrek_JsonCacheDecode(&reader, 0, NULL);
+    if (root == NULL || reader.ptr != reader.end) {
+        fprintf(stderr, "warning: ignoring invalid cache %s\n", Tcl_GetString(cache_path_ptr));
+        cJSON_Delete(root);
+        goto done;
+    }
+
+    // remember the hash, so that the JSON file is not written back if unchanged
+    ttrek_JsonHashSet(json_path_ptr, header.json_hash);
+
+    *root_ptr = root;
+    rc = TCL_OK;
+
+done:
+    munmap(map, st.st_size);
+    return rc;
+
+}
+
+static void ttrek_JsonCacheWrite(Tcl_Interp *interp, Tcl_Obj *cache_path_ptr, const struct stat *json_st,
+                                 const unsigned char *json_hash, cJSON *root) {
+
+    // The cache directory is created together with the rest of the venv,
+    // there is nothing to do until then.
+    const char *cache_path = Tcl_GetString(cache_path_ptr);
+    const char *slash = strrchr(cache_path, '/');
+    if (slash != NULL) {
+        Tcl_DString dir_ds;
+        Tcl_DStringInit(&dir_ds);
+        Tcl_DStringAppend(&dir_ds, cache_path, slash == cache_path ? 1 : slash - cache_path);
+        int is_writable = (access(Tcl_DStringValue(&dir_ds), W_OK) == 0);
+        Tcl_DStringFree(&dir_ds);
+        if (!is_writable) {
+            return;
+        }
+    }
+
+    ttrek_json_cache_header_t header;
+    ttrek_JsonCacheFillHeader(&header, json_st);
+    memcpy(header.json_hash, json_hash, SHA256_DIGEST_LENGTH);
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, (const char *) &header, sizeof(header));
+    ttrek_JsonCacheEncode(&ds, root, 0);
+
+    header.data_len = (uint64_t) Tcl_DStringLength(&ds) - sizeof(header);
+    memcpy(Tcl_DStringValue(&ds), &header, sizeof(header));
+
+    if (TCL_OK != ttrek_WriteFileAtomic(interp, cache_path_ptr, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), 0666)) {
+        fprintf(stderr, "warning: could not write cache %s\n", cache_path);
+    }
+
+    Tcl_DStringFree(&ds);
+
+}
+
+// Loads the JSON file from its binary cache, if the cache is up to date.
+// Otherwise, the JSON file is parsed and the cache is written for the next
+// time. As with ttrek_FileToJson(), *root_ptr is NULL if the JSON is invalid.
+int ttrek_JsonCacheLoad(Tcl_Interp *interp, Tcl_Obj *json_path_ptr, Tcl_Obj *cache_path_ptr, cJSON **root_ptr) {
+
+    const char *json_path = Tcl_GetString(json_path_ptr);
+    int fd = open(json_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open %s: %s\n", json_path, strerror(errno));
+        return TCL_ERROR;
+    }
+
+    struct stat json_st;
+    if (fstat(fd, &json_st) != 0) {
+        fprintf(stderr, "error: could not stat %s: %s\n", json_path, strerror(errno));
+        close(fd);
+        return TCL_ERROR;
+    }
+
+    if (ttrek_JsonCacheRead(json_path_ptr, cache_path_ptr, &json_st, root_ptr) == TCL_OK) {
+        DBG2(printf("loaded %s from cache", json_path));
+        close(fd);
+        return TCL_OK;
+    }
+
+    char *data = Tcl_Alloc(json_st.st_size + 1);
+    size_t data_len = 0;
+    while (data_len < (size_t) json_st.st_size) {
+        ssize_t n = read(fd, data + data_len, json_st.st_size - data_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        data_len += n;
+    }
+    close(fd);
+
+    if (data_len != (size_t) json_st.st_size) {
+        fprintf(stderr, "error: could not read %s\n", json_path);
+        Tcl_Free(data);
+        return TCL_ERROR;
+    }
+    data[data_len] = '\0';
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *) data, data_len, hash);
+    ttrek_JsonHashSet(json_path_ptr, hash);
+
+    *root_ptr = cJSON_Parse(data);
+    Tcl_Free(data);
+
+    if (*root_ptr != NULL) {
+        ttrek_JsonCacheWrite(interp, cache_path_ptr, &json_st, hash, *root_ptr);
+    }
+
+    return TCL_OK;
+
+}
@@ -0,0 +1,25 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_JSONCACHE_H
+#define TTREK_JSONCACHE_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bump the version when the layout of the cache changes
+#define JSON_CACHE_MAGIC "TTRKJC01"
+
+int ttrek_JsonCacheLoad(Tcl_Interp *interp, Tcl_Obj *json_path_ptr, Tcl_Obj *cache_path_ptr, cJSON **root_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_JSONCACHE_H
@@ -8,12 +8,17 @@
 #include <cassert>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include <sys/utsname.h>
 #include "PackageDatabase.h"
 #include "ttrek_resolvo.h"
 #include "installer.h"
+#include "ttrek_buildGraph.h"
+#include "ttrek_genInstall.h"
+#include "ttrek_buildHistory.h"
 #include "ttrek_telemetry.h"
 #include "ttrek_useflags.h"
+#include "ttrek_index.h"
 
 int ttrek_ParseRequirements(Tcl_Size objc, Tcl_Obj *const objv[], std::map<std::string, std::string> &requirements) {
     for (int i = 0; i < objc; i++) {
@@ -38,8 +43,8 @@ static void
 ttrek_ParseRequirementsFromSpecFile(ttrek_state_t *state_ptr, std::map<std::string, std::string> &requirements) {
     cJSON *dependencies = cJSON_GetObjectItem(state_ptr->spec_root, "dependencies");
     if (dependencies) {
-        for (int i = 0; i < cJSON_GetArraySize(dependencies); i++) {
-            cJSON *dep_item = cJSON_GetArrayItem(dependencies, i);
+        cJSON *dep_item;
+        cJSON_ArrayForEach(dep_item, dependencies) {
             std::string package_name = dep_item->string;
             std::string package_version_requirement = cJSON_GetStringValue(dep_item);
             DBG(std::cout << "(direct from spec) package_name: " << package_name << " package_version_requirement: "
@@ -53,8 +58,8 @@ static void
 ttrek_ParseRequirementsFromLockFile(ttrek_state_t *state_ptr, std::map<std::string, std::string> &requirements) {
     cJSON *packages = cJSON_GetObjectItem(state_ptr->lock_root, "packages");
     if (packages) {
-        for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-            cJSON *dep_item = cJSON_GetArrayItem(packages, i);
+        cJSON *dep_item;
+        cJSON_ArrayForEach(dep_item, packages) {
             std::string package_name = dep_item->string;
             requirements[package_name] = "";
             DBG(std::cout << "(direct from lock without version) package_name: " << package_name << std::endl);
@@ -65,8 +70,8 @@ ttrek_ParseRequirementsFromLockFile(ttrek_state_t *state_ptr, std::map<std::stri
 void ttrek_ParseLockedPackages(ttrek_state_t *state_ptr, PackageDatabase &db) {
     cJSON *packages = cJSON_GetObjectItem(state_ptr->lock_root, "packages");
     if (packages) {
-        for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-            cJSON *package = cJSON_GetArrayItem(packages, i);
+        cJSON *package;
+        cJSON_ArrayForEach(package, packages) {
             std::string package_name = package->string;
             std::string package_version = cJSON_GetStringValue(cJSON_GetObjectItem(package, "version"));
             db.alloc_locked_package(package_name, package_version);
@@ -82,16 +87,16 @@ static void ttrek_ParseReverseDependenciesFromLock(cJSON *lock_root,
         return;
     }
 
-    for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-        cJSON *package = cJSON_GetArrayItem(packages, i);
+    cJSON *package;
+    cJSON_ArrayForEach(package, packages) {
         std::string package_name = package->string;
         std::string package_version = cJSON_GetStringValue(cJSON_GetObjectItem(package, "version"));
         if (!cJSON_HasObjectItem(package, "requires")) {
             continue;
         }
         cJSON *dependencies = cJSON_GetObjectItem(package, "requires");
-        for (int j = 0; j < cJSON_GetArraySize(dependencies); j++) {
-            cJSON *dep_item = cJSON_GetArrayItem(dependencies, j);
+        cJSON *dep_item;
+        cJSON_ArrayForEach(dep_item, dependencies) {
             std::string dep_package_name = dep_item->string;
             if (reverse_dependencies_map.find(dep_package_name) == reverse_dependencies_map.end()) {
                 reverse_dependencies_map[dep_package_name] = std::unordered_set<std::string>();
@@ -109,16 +114,16 @@ static void ttrek_ParseDependenciesFromLock(cJSON *lock_root,
         return;
     }
 
-    for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-        cJSON *package = cJSON_GetArrayItem(packages, i);
+    cJSON *package;
+    cJSON_ArrayForEach(package, packages) {
         std::string package_name = package->string;
         std::string package_version = cJSON_GetStringValue(cJSON_GetObjectItem(package, "version"));
         if (!cJSON_HasObjectItem(package, "requires")) {
             continue;
         }
         cJSON *dependencies = cJSON_GetObjectItem(package, "requires");
-        for (int j = 0; j < cJSON_GetArraySize(dependencies); j++) {
-            cJSON *dep_item = cJSON_GetArrayItem(dependencies, j);
+        cJSON *dep_item;
+        cJSON_ArrayForEach(dep_item, dependencies) {
             std::string dep_package_name = dep_item->string;
             if (dependencies_map.find(package_name) == dependencies_map.end()) {
                 dependencies_map[package_name] = std::unordered_set<std::string>();
@@ -138,15 +143,15 @@ ttrek_ParseUseFlagsFromLockFile(cJSON *lock_root,
         return;
     }
 
-    for (int i = 0; i < cJSON_GetArraySize(packages); i++) {
-        cJSON *package = cJSON_GetArrayItem(packages, i);
+    cJSON *package;
+    cJSON_ArrayForEach(package, packages) {
         std::string package_name = package->string;
 
         std::set<UseFlag> iuse_flags;
         if (cJSON_HasObjectItem(package, "iuse")) {
             cJSON *iuse = cJSON_GetObjectItem(package, "iuse");
-            for (int j = 0; j < cJSON_GetArraySize(iuse); j++) {
-                cJSON *iuse_item = cJSON_GetArrayItem(iuse, j);
+            cJSON *iuse_item;
+            cJSON_ArrayForEach(iuse_item, iuse) {
                 std::string iuse_flag_str = iuse_item->valuestring;
                 UseFlag iuse_flag(iuse_flag_str);
                 iuse_flags.insert(iuse_flag);
@@ -157,8 +162,8 @@ ttrek_ParseUseFlagsFromLockFile(cJSON *lock_root,
         std::set<UseFlag> use_flags;
         if (cJSON_HasObjectItem(package, "use")) {
             cJSON *use = cJSON_GetObjectItem(package, "use");
-            for (int j = 0; j < cJSON_GetArraySize(use); j++) {
-                cJSON *use_item = cJSON_GetArrayItem(use, j);
+            cJSON *use_item;
+            cJSON_ArrayForEach(use_item, use) {
                 std::string use_flag_str = use_item->valuestring;
                 UseFlag use_flag(use_flag_str);
                 use_flags.insert(use_flag);
@@ -173,8 +178,8 @@ ttrek_ParseUseFlagsFromLockFile(cJSON *lock_root,
 static void ttrek_ParseUseFlagsFromSpecFile(ttrek_state_t *state_ptr, std::unordered_set<UseFlag> &use_flags) {
     cJSON *use = cJSON_GetObjectItem(state_ptr->spec_root, "useFlags");
     if (use) {
-        for (int i = 0; i < cJSON_GetArraySize(use); i++) {
-            cJSON *use_item = cJSON_GetArrayItem(use, i);
+        cJSON *use_item;
+        cJSON_ArrayForEach(use_item, use) {
             use_flags.insert(UseFlag(use_item->valuestring));
         }
     }
@@ -263,37 +268,31 @@ static int ttrek_UpdateLockFileAfterInstall(Tcl_Interp *interp, ttrek_state_t *s
 }
 
 static int ttrek_UpdateManifestFileAfterInstall(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
-    // write lock file
-    if (TCL_OK != ttrek_WriteJsonFile(interp, state_ptr->manifest_json_path_ptr, state_ptr->manifest_root)) {
+    // write manifest file, or keep the changes in the manifest journal
+    if (TCL_OK != ttrek_ManifestSave(interp, state_ptr)) {
         fprintf(stderr, "error: could not write %s\n", Tcl_GetString(state_ptr->manifest_json_path_ptr));
         return TCL_ERROR;
     }
     return TCL_OK;
 }
 
-static int ttrek_ExistsInLock(cJSON *lock_root, const char *package_name, const char *package_version,
+static int ttrek_ExistsInLock(ttrek_state_t *state_ptr, const char *package_name, const char *package_version,
                               int *package_name_exists_in_lock_p) {
 
     *package_name_exists_in_lock_p = 0;
 
-    cJSON *packages = cJSON_GetObjectItem(lock_root, "packages");
-    if (!packages) {
-        return 0;
-    }
-
-    cJSON *package = cJSON_GetObjectItem(packages, package_name);
-    if (!package) {
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    if (!package_ptr || !package_ptr->lock_node) {
         return 0;
     }
 
     *package_name_exists_in_lock_p = 1;
 
-    cJSON *version = cJSON_GetObjectItem(package, "version");
-    if (!version) {
+    if (!package_ptr->version) {
         return 0;
     }
 
-    if (strcmp(version->valuestring, package_version) != 0) {
+    if (strcmp(package_ptr->version, package_version) != 0) {
         return 0;
     }
 
@@ -378,7 +377,7 @@ static void ttrek_AddInstallToExecutionPlan(ttrek_state_t *state_ptr, const std:
     auto package_version = install.substr(index + 1);
 
     int package_name_exists_in_lock_p;
-    int exact_package_exists_in_lock_p = ttrek_ExistsInLock(state_ptr->lock_root, package_name.c_str(),
+    int exact_package_exists_in_lock_p = ttrek_ExistsInLock(state_ptr, package_name.c_str(),
                                                             package_version.c_str(),
                                                             &package_name_exists_in_lock_p);
 
@@ -553,7 +552,7 @@ ttrek_GenerateExecutionPlan(ttrek_state_t *state_ptr, const std::vector<std::str
 }
 
 static void
-ttrek_PrintExecutionPlan(const std::vector<InstallSpec> &execution_plan) {
+ttrek_PrintExecutionPlan(const std::vector<InstallSpec> &execution_plan, int estimated_duration) {
     for (const auto &install_spec: execution_plan) {
         if (install_spec.install_type == UNKNOWN_INSTALL) {
             DBG(std::cout << install_spec.package_name << "@" << install_spec.package_version << " (unknown install)"
@@ -580,6 +579,141 @@ ttrek_PrintExecutionPlan(const std::vector<InstallSpec> &execution_plan) {
 
         std::cout << std::endl;
     }
+
+    if (estimated_duration >= 0) {
+        Tcl_Obj *duration_ptr = Tcl_NewObj();
+        ttrek_BuildHistoryFormatDuration(duration_ptr, estimated_duration);
+        std::cout << std::endl << "Estimated build time: " << Tcl_GetString(duration_ptr) << std::endl;
+        Tcl_BounceRefCount(duration_ptr);
+    }
+}
+
+// Orders the packages to be installed so that the packages on the longest
+// remaining path through the dependency graph start first. The estimated
+// build time of a package includes the longest chain of packages that
+// depend on it. Building is simulated with the given number of jobs,
+// the order in which packages start is returned in schedule, and the
+// estimated total time is the result.
+static int ttrek_ScheduleExecutionPlan(const std::vector<InstallSpec> &execution_plan,
+                                       const std::map<std::string, std::unordered_set<std::string>> &dependencies_map,
+                                       const std::map<std::string, int> &estimates, int jobs,
+                                       std::vector<InstallSpec> &schedule) {
+
+    std::vector<InstallSpec> packages;
+    std::map<std::string, size_t> package_index_map;
+    for (const auto &install_spec: execution_plan) {
+        if (install_spec.install_type == ALREADY_INSTALLED) {
+            continue;
+        }
+        package_index_map[install_spec.package_name] = packages.size();
+        packages.push_back(install_spec);
+    }
+
+    size_t count = packages.size();
+    std::vector<std::vector<size_t>> dependents(count);
+    std::vector<int> deps_remaining(count, 0);
+    std::vector<int> duration(count, 0);
+    for (size_t i = 0; i < count; i++) {
+        auto estimate_it = estimates.find(packages[i].package_name);
+        duration[i] = (estimate_it == estimates.end() ? BUILD_HISTORY_DEFAULT_DURATION : estimate_it->second);
+        auto deps_it = dependencies_map.find(packages[i].package_name);
+        if (deps_it == dependencies_map.end()) {
+            continue;
+        }
+        for (const auto &dep_package_name: deps_it->second) {
+            auto index_it = package_index_map.find(dep_package_name);
+            if (index_it == package_index_map.end() || index_it->second == i) {
+                continue;
+            }
+            dependents[index_it->second].push_back(i);
+            deps_remaining[i]++;
+        }
+    }
+
+    // The execution plan is in dependency order, so the longest remaining
+    // path can be computed from the last package to the first one.
+    std::vector<int> priority(count, 0);
+    for (size_t i = count; i-- > 0;) {
+        int longest_dependent_path = 0;
+        for (auto dependent: dependents[i]) {
+            longest_dependent_path = std::max(longest_dependent_path, priority[dependent]);
+        }
+        priority[i] = duration[i] + longest_dependent_path;
+    }
+
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < count; i++) {
+        if (deps_remaining[i] == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    // finish time -> package index
+    std::multimap<int, size_t> running;
+    int now = 0;
+    schedule.clear();
+    while (schedule.size() < count) {
+        while (!ready.empty() && (int) running.size() < std::max(jobs, 1)) {
+            auto next_it = ready.begin();
+            for (auto it = ready.begin(); it != ready.end(); ++it) {
+                if (priority[*it] > priority[*next_it] || (priority[*it] == priority[*next_it] && *it < *next_it)) {
+                    next_it = it;
+                }
+            }
+            size_t next = *next_it;
+            ready.erase(next_it);
+            schedule.push_back(packages[next]);
+            running.emplace(now + duration[next], next);
+        }
+        if (running.empty()) {
+            // Should not happen with a valid dependency graph, but make sure
+            // that all packages are scheduled anyway.
+            for (size_t i = 0; i < count; i++) {
+                if (deps_remaining[i] > 0) {
+                    deps_remaining[i] = 0;
+                    schedule.push_back(packages[i]);
+                }
+            }
+            break;
+        }
+        auto finished_it = running.begin();
+        now = finished_it->first;
+        for (auto dependent: dependents[finished_it->second]) {
+            if (--deps_remaining[dependent] == 0) {
+                ready.push_back(dependent);
+            }
+        }
+        running.erase(finished_it);
+    }
+
+    for (const auto &item: running) {
+        now = std::max(now, item.first);
+    }
+
+    return now;
+}
+
+static void ttrek_EstimateExecutionPlan(Tcl_Interp *interp, ttrek_state_t *state_ptr,
+                                        const std::vector<InstallSpec> &execution_plan, const char *use_flags,
+                                        std::map<std::string, int> &estimates) {
+
+    cJSON *history_root;
+    if (TCL_OK != ttrek_BuildHistoryLoad(interp, state_ptr, &history_root)) {
+        history_root = NULL;
+    }
+
+    for (const auto &install_spec: execution_plan) {
+        if (install_spec.install_type == ALREADY_INSTALLED) {
+            continue;
+        }
+        estimates[install_spec.package_name] = ttrek_BuildHistoryEstimateDuration(
+            interp, state_ptr, history_root, install_spec.package_name.c_str(),
+            install_spec.package_version.c_str(), use_flags);
+        DBG(std::cout << "estimate: " << install_spec.package_name << "@" << install_spec.package_version
+                      << " " << estimates[install_spec.package_name] << "s" << std::endl);
+    }
+
+    cJSON_Delete(history_root);
 }
 
 
@@ -644,6 +778,244 @@ static const std::string &ttrek_RewriteUnsatMessage(const std::string &message)
     return result;
 }
 
+// Dependencies of the packages to be installed. Packages that are not
+// resolved in this run keep their dependencies from the lock file.
+static void ttrek_GetPlannedDependencies(ttrek_state_t *state_ptr, PackageDatabase &db,
+                                         std::map<std::string, std::unordered_set<std::string>> &dependencies_map) {
+    ttrek_ParseDependenciesFromLock(state_ptr->lock_root, dependencies_map);
+    for (const auto &item: db.get_dependencies_map()) {
+        dependencies_map[item.first] = item.second;
+    }
+}
+
+// In bootstrap mode, packages are output as shell functions. Output the job
+// runner that calls them in dependency order.
+static int ttrek_OutputBootstrapRunner(Tcl_Interp *interp, ttrek_state_t *state_ptr,
+                                       const std::vector<InstallSpec> &execution_plan,
+                                       const std::map<std::string, std::unordered_set<std::string>> &dependencies_map) {
+
+    std::map<std::string, int> package_num_map;
+    for (const auto &install_spec: execution_plan) {
+        if (install_spec.install_type == ALREADY_INSTALLED) {
+            continue;
+        }
+        auto package_num = (int) package_num_map.size() + 1;
+        package_num_map[install_spec.package_name] = package_num;
+    }
+
+    Tcl_Obj *deps_list_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(deps_list_ptr);
+    for (const auto &install_spec: execution_plan) {
+        if (install_spec.install_type == ALREADY_INSTALLED) {
+            continue;
+        }
+        Tcl_Obj *package_deps_ptr = Tcl_NewListObj(0, NULL);
+        auto deps_it = dependencies_map.find(install_spec.package_name);
+        if (deps_it != dependencies_map.end()) {
+            for (const auto &dep_package_name: deps_it->second) {
+                auto num_it = package_num_map.find(dep_package_name);
+                if (num_it == package_num_map.end()) {
+                    continue;
+                }
+                Tcl_ListObjAppendElement(interp, package_deps_ptr, Tcl_NewIntObj(num_it->second));
+            }
+        }
+        Tcl_ListObjAppendElement(interp, deps_list_ptr, package_deps_ptr);
+    }
+
+    Tcl_Obj *runner_ptr = ttrek_generateBootstrapRunner(interp, deps_list_ptr);
+    Tcl_DecrRefCount(deps_list_ptr);
+    if (runner_ptr == NULL) {
+        return TCL_ERROR;
+    }
+
+    ttrek_OutputBootstrap(state_ptr, Tcl_GetString(runner_ptr));
+    Tcl_BounceRefCount(runner_ptr);
+
+    return TCL_OK;
+}
+
+struct PreparedInstall {
+    InstallSpec install_spec;
+    cJSON *install_spec_root;
+    Tcl_Obj *path_to_install_file_ptr;
+    int package_num_current;
+    Tcl_Obj *files_diff;
+};
+
+static int ttrek_InstallExecutionPlanWithBuildGraph(Tcl_Interp *interp, ttrek_state_t *state_ptr,
+                                                    Tcl_HashTable *global_use_flags_ht_ptr,
+                                                    const std::vector<InstallSpec> &execution_plan,
+                                                    const std::map<std::string, std::unordered_set<std::string>> &dependencies_map,
+                                                    const struct utsname &sysinfo, int package_num_total,
+                                                    std::vector<InstallSpec> &installs_from_lock_file_sofar,
+                                                    cJSON *build_run_root) {
+
+    ttrek_build_graph_t *graph_ptr = ttrek_BuildGraphCreate(interp, state_ptr);
+    if (graph_ptr == NULL) {
+        fprintf(stderr, "error: could not create build graph\n");
+        return TCL_ERROR;
+    }
+
+    int package_num_current = 0;
+    int result = TCL_OK;
+    std::vector<PreparedInstall> prepared;
+    Tcl_Obj *staged_files_ptr = NULL;
+    Tcl_Obj *unstaged_files_ptr = NULL;
+    Tcl_Size unstaged_len = 0;
+
+    for (const auto &install_spec: execution_plan) {
+        if (install_spec.install_type == ALREADY_INSTALLED) {
+            continue;
+        }
+        auto package_name = install_spec.package_name;
+        auto package_version = install_spec.package_version;
+
+        cJSON *install_spec_root = NULL;
+        Tcl_Obj *path_to_install_file_ptr = NULL;
+        if (TCL_OK != ttrek_PrepareInstallPackage(interp, state_ptr, global_use_flags_ht_ptr, package_name.c_str(),
+                                                  package_version.c_str(), sysinfo.sysname, sysinfo.machine,
+                                                  install_spec.package_name_exists_in_lock_p,
+                                                  ++package_num_current, package_num_total,
+                                                  &install_spec_root, &path_to_install_file_ptr)) {
+            ttrek_TelemetryPackageInstallEvent(package_name.c_str(), package_version.c_str(),
+                                               sysinfo.sysname, sysinfo.machine, 0,
+                                               (install_spec.install_type == DIRECT_INSTALL ? 1 : 0));
+            result = TCL_ERROR;
+            goto done;
+        }
+
+        // The install script is kept, in case the packages have to be
+        // installed again one by one, see below.
+        prepared.push_back({install_spec, install_spec_root, path_to_install_file_ptr, package_num_current, NULL});
+
+        if (install_spec.package_name_exists_in_lock_p) {
+            installs_from_lock_file_sofar.push_back(install_spec);
+        }
+
+        Tcl_Obj *deps_list_ptr = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(deps_list_ptr);
+        auto deps_it = dependencies_map.find(package_name);
+        if (deps_it != dependencies_map.end()) {
+            for (const auto &dep_package_name: deps_it->second) {
+                Tcl_ListObjAppendElement(interp, deps_list_ptr, Tcl_NewStringObj(dep_package_name.c_str(), -1));
+            }
+        }
+
+        result = ttrek_BuildGraphAddPackage(interp, graph_ptr, package_name.c_str(), package_version.c_str(),
+                                            path_to_install_file_ptr, package_num_current, package_num_total,
+                                            deps_list_ptr);
+        Tcl_DecrRefCount(deps_list_ptr);
+
+        if (TCL_OK != result) {
+            fprintf(stderr, "error: could not add package %s to the build graph\n", package_name.c_str());
+            goto done;
+        }
+    }
+
+    // Packages that ignore DESTDIR write directly to the install directory,
+    // these files are not in any staging list.
+    if (TCL_OK != ttrek_WatchInstallDirectory(interp, state_ptr)) {
+        result = TCL_ERROR;
+        goto done;
+    }
+
+    result = ttrek_BuildGraphRun(interp, graph_ptr, state_ptr->jobs);
+
+    for (const auto &item: prepared) {
+        const InstallSpec &install_spec = item.install_spec;
+        int is_installed = ttrek_BuildGraphIsInstalled(graph_ptr, install_spec.package_name.c_str());
+        ttrek_TelemetryPackageInstallEvent(install_spec.package_name.c_str(), install_spec.package_version.c_str(),
+                                           sysinfo.sysname, sysinfo.machine, is_installed,
+                                           (install_spec.install_type == DIRECT_INSTALL ? 1 : 0));
+        ttrek_BuildHistoryAddPackage(interp, state_ptr, build_run_root, install_spec.package_name.c_str(),
+                                     install_spec.package_version.c_str(), is_installed);
+    }
+
+    if (TCL_OK != result) {
+        fprintf(stderr, "error: could not build packages\n");
+        // The install directory is in unknown state now
+        ttrek_UnwatchInstallDirectory(interp, state_ptr);
+        goto done;
+    }
+
+    staged_files_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(staged_files_ptr);
+    for (auto &item: prepared) {
+        const InstallSpec &install_spec = item.install_spec;
+        if (TCL_OK != ttrek_BuildGraphGetInstalledFiles(interp, graph_ptr, install_spec.package_name.c_str(),
+                                                        install_spec.package_version.c_str(), &item.files_diff)) {
+            fprintf(stderr, "error: could not get installed files for package %s\n",
+                    install_spec.package_name.c_str());
+            ttrek_UnwatchInstallDirectory(interp, state_ptr);
+            result = TCL_ERROR;
+            goto done;
+        }
+        Tcl_ListObjAppendList(interp, staged_files_ptr, item.files_diff);
+    }
+
+    if (TCL_OK != ttrek_ReadUnstagedFiles(interp, state_ptr, staged_files_ptr, &unstaged_files_ptr)) {
+        result = TCL_ERROR;
+        goto done;
+    }
+    Tcl_IncrRefCount(unstaged_files_ptr);
+
+    // The packages were installed at the same time, so it is not known which
+    // package installed these files. The build stages are cached, so running
+    // the install scripts again one by one only repeats the install stage,
+    // and tells the files of each package apart.
+    Tcl_ListObjLength(interp, unstaged_files_ptr, &unstaged_len);
+    if (unstaged_len > 0) {
+        fprintf(stderr, "warning: files were installed outside of the staging directory, "
+                        "installing the packages again one by one\n");
+
+        if (TCL_OK != ttrek_DeleteUnstagedFiles(interp, state_ptr, unstaged_files_ptr)) {
+            ttrek_UnwatchInstallDirectory(interp, state_ptr);
+            result = TCL_ERROR;
+            goto done;
+        }
+
+        for (auto &item: prepared) {
+            const InstallSpec &install_spec = item.install_spec;
+            Tcl_DecrRefCount(item.files_diff);
+            item.files_diff = NULL;
+            if (TCL_OK != ttrek_ExecuteInstallScript(interp, state_ptr, install_spec.package_name.c_str(),
+                                                     install_spec.package_version.c_str(),
+                                                     item.path_to_install_file_ptr, item.package_num_current,
+                                                     package_num_total, &item.files_diff)) {
+                result = TCL_ERROR;
+                goto done;
+            }
+        }
+    }
+
+    // Register the installed packages in the order of the execution plan
+    for (const auto &item: prepared) {
+        const InstallSpec &install_spec = item.install_spec;
+        ttrek_AddInstalledPackage(interp, state_ptr, global_use_flags_ht_ptr, install_spec.package_name.c_str(),
+                                  install_spec.package_version.c_str(),
+                                  install_spec.direct_version_requirement.c_str(), item.install_spec_root,
+                                  item.files_diff);
+    }
+
+done:
+    for (const auto &item: prepared) {
+        cJSON_Delete(item.install_spec_root);
+        Tcl_DecrRefCount(item.path_to_install_file_ptr);
+        if (item.files_diff != NULL) {
+            Tcl_DecrRefCount(item.files_diff);
+        }
+    }
+    if (staged_files_ptr != NULL) {
+        Tcl_DecrRefCount(staged_files_ptr);
+    }
+    if (unstaged_files_ptr != NULL) {
+        Tcl_DecrRefCount(unstaged_files_ptr);
+    }
+    ttrek_BuildGraphDestroy(graph_ptr);
+    return result;
+}
+
 int
 ttrek_InstallOrUpdate(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[], ttrek_state_t *state_ptr, int *abort) {
 
@@ -684,9 +1056,17 @@ ttrek_InstallOrUpdate(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[],
 
         // generate the execution plan
         std::vector<InstallSpec> execution_plan;
+        // the order in which packages are built, and their dependencies
+        std::vector<InstallSpec> schedule;
+        std::map<std::string, std::unordered_set<std::string>> dependencies_map;
         ttrek_GenerateExecutionPlan(state_ptr, installs, requirements, db.get_dependencies_map(), &global_use_flags_ht,
                                     execution_plan);
 
+        // the versions of the dependencies are part of the stage fingerprints
+        for (const auto &install_spec: execution_plan) {
+            ttrek_SetPlannedVersion(state_ptr, install_spec.package_name.c_str(), install_spec.package_version.c_str());
+        }
+
         // print the execution plan
 
         if (execution_plan.empty()) {
@@ -703,8 +1083,18 @@ ttrek_InstallOrUpdate(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[],
             goto skipConfirmation;
         }
 
-        std::cout << "The following packages will be installed:" << std::endl;
-        ttrek_PrintExecutionPlan(execution_plan);
+        {
+            std::map<std::string, int> estimates;
+            ttrek_EstimateExecutionPlan(interp, state_ptr, execution_plan, Tcl_GetString(use_flags_list_ptr),
+                                        estimates);
+
+            ttrek_GetPlannedDependencies(state_ptr, db, dependencies_map);
+            int estimated_duration = ttrek_ScheduleExecutionPlan(execution_plan, dependencies_map, estimates,
+                                                                 state_ptr->jobs, schedule);
+
+            std::cout << "The following packages will be installed:" << std::endl;
+            ttrek_PrintExecutionPlan(execution_plan, estimated_duration);
+        }
 
         if (!state_ptr->option_yes) {
             // get yes/no from user
@@ -731,6 +1121,14 @@ skipConfirmation:
             return TCL_ERROR;
         }
 
+        // put back the files of packages from an interrupted installation
+        if (state_ptr->mode != MODE_BOOTSTRAP && TCL_OK != ttrek_RestoreInterruptedInstalls(interp, state_ptr)) {
+            fprintf(stderr, "error: could not restore package files from interrupted installation\n");
+            Tcl_DecrRefCount(use_flags_list_ptr);
+            Tcl_DeleteHashTable(&global_use_flags_ht);
+            return TCL_ERROR;
+        }
+
         int package_num_total = 0;
         int package_num_current = 0;
 
@@ -750,71 +1148,142 @@ skipConfirmation:
             return TCL_ERROR;
         }
 
+        // timing of the installation is saved to the build history
+        cJSON *build_run_root = NULL;
+        if (state_ptr->mode != MODE_BOOTSTRAP) {
+            build_run_root = ttrek_BuildHistoryCreateRun(Tcl_GetString(use_flags_list_ptr));
+        }
+
         // perform the installation
         std::vector<InstallSpec> installs_from_lock_file_sofar;
-        for (const auto &install_spec: execution_plan) {
-            if (install_spec.install_type == ALREADY_INSTALLED) {
-                continue;
+        if (state_ptr->jobs > 1 && state_ptr->mode != MODE_BOOTSTRAP) {
+
+            if (TCL_OK != ttrek_InstallExecutionPlanWithBuildGraph(interp, state_ptr, &global_use_flags_ht,
+                                                                   schedule, dependencies_map, sysinfo,
+                                                                   package_num_total,
+                                                                   installs_from_lock_file_sofar,
+                                                                   build_run_root)) {
+
+                ttrek_BuildHistorySaveRun(interp, state_ptr, build_run_root);
+
+                for (const auto &spec: installs_from_lock_file_sofar) {
+                    fprintf(stderr, "restoring package files from old installation: %s\n",
+                            spec.package_name.c_str());
+                    if (TCL_OK != ttrek_RestoreTempFiles(interp, state_ptr, spec.package_name.c_str())) {
+                        fprintf(stderr, "error: could not restore package files from old installation\n");
+                    }
+                }
+
+                Tcl_DecrRefCount(use_flags_list_ptr);
+                Tcl_DeleteHashTable(&global_use_flags_ht);
+                return TCL_ERROR;
+
             }
-            auto package_name = install_spec.package_name;
-            auto package_version = install_spec.package_version;
-            auto direct_version_requirement = install_spec.direct_version_requirement;
-            auto package_name_exists_in_lock_p = install_spec.package_name_exists_in_lock_p;
 
-            // std::cout << "installing... " << package_name << "@" << package_version << std::endl;
+        } else {
+            for (const auto &install_spec: execution_plan) {
+                if (install_spec.install_type == ALREADY_INSTALLED) {
+                    continue;
+                }
+                auto package_name = install_spec.package_name;
+                auto package_version = install_spec.package_version;
+                auto direct_version_requirement = install_spec.direct_version_requirement;
+                auto package_name_exists_in_lock_p = install_spec.package_name_exists_in_lock_p;
+
+                // std::cout << "installing... " << package_name << "@" << package_version << std::endl;
 
-            auto outcome = ttrek_InstallPackage(interp, state_ptr, &global_use_flags_ht, package_name.c_str(),
-                                                package_version.c_str(), sysinfo.sysname, sysinfo.machine,
-                                                direct_version_requirement.c_str(), package_name_exists_in_lock_p,
-                                                ++package_num_current, package_num_total);
+                auto outcome = ttrek_InstallPackage(interp, state_ptr, &global_use_flags_ht, package_name.c_str(),
+                                                    package_version.c_str(), sysinfo.sysname, sysinfo.machine,
+                                                    direct_version_requirement.c_str(), package_name_exists_in_lock_p,
+                                                    ++package_num_current, package_num_total);
 
-            ttrek_TelemetryPackageInstallEvent(package_name.c_str(), package_version.c_str(),
-                                               sysinfo.sysname, sysinfo.machine, (outcome == TCL_OK ? 1 : 0),
-                                               (install_spec.install_type == DIRECT_INSTALL ? 1 : 0));
+                ttrek_TelemetryPackageInstallEvent(package_name.c_str(), package_version.c_str(),
+                                                   sysinfo.sysname, sysinfo.machine, (outcome == TCL_OK ? 1 : 0),
+                                                   (install_spec.install_type == DIRECT_INSTALL ? 1 : 0));
 
-            if (TCL_OK != outcome) {
+                if (build_run_root != NULL) {
+                    ttrek_BuildHistoryAddPackage(interp, state_ptr, build_run_root, package_name.c_str(),
+                                                 package_version.c_str(), (outcome == TCL_OK ? 1 : 0));
+                }
 
-                for (const auto &spec: installs_from_lock_file_sofar) {
+                if (TCL_OK != outcome) {
+
+                    if (build_run_root != NULL) {
+                        ttrek_BuildHistorySaveRun(interp, state_ptr, build_run_root);
+                    }
+
+                    // the failed package has its backup too
                     if (package_name_exists_in_lock_p) {
+                        installs_from_lock_file_sofar.push_back(install_spec);
+                    }
+
+                    for (const auto &spec: installs_from_lock_file_sofar) {
                         fprintf(stderr, "restoring package files from old installation: %s\n",
                                 spec.package_name.c_str());
                         if (TCL_OK != ttrek_RestoreTempFiles(interp, state_ptr, spec.package_name.c_str())) {
                             fprintf(stderr, "error: could not restore package files from old installation\n");
                         }
                     }
-                }
 
-                Tcl_DecrRefCount(use_flags_list_ptr);
-                Tcl_DeleteHashTable(&global_use_flags_ht);
-                return TCL_ERROR;
+                    Tcl_DecrRefCount(use_flags_list_ptr);
+                    Tcl_DeleteHashTable(&global_use_flags_ht);
+                    return TCL_ERROR;
 
-            }
+                }
 
-            if (package_name_exists_in_lock_p) {
-                installs_from_lock_file_sofar.push_back(install_spec);
+                if (package_name_exists_in_lock_p) {
+                    installs_from_lock_file_sofar.push_back(install_spec);
+                }
             }
         }
         Tcl_DecrRefCount(use_flags_list_ptr);
         Tcl_DeleteHashTable(&global_use_flags_ht);
 
-        if (state_ptr->mode != MODE_BOOTSTRAP) {
+        if (build_run_root != NULL && TCL_OK != ttrek_BuildHistorySaveRun(interp, state_ptr, build_run_root)) {
+            fprintf(stderr, "warning: could not save build history\n");
+        }
+
+        if (state_ptr->mode == MODE_BOOTSTRAP) {
+
+            ttrek_GetPlannedDependencies(state_ptr, db, dependencies_map);
+
+            if (TCL_OK != ttrek_OutputBootstrapRunner(interp, state_ptr, execution_plan, dependencies_map)) {
+                return TCL_ERROR;
+            }
+
+        } else {
 
             if (TCL_OK != ttrek_UpdateSpecFileAfterInstall(interp, state_ptr)) {
                 return TCL_ERROR;
             }
 
+            Tcl_Obj *installed_packages_ptr = Tcl_NewListObj(0, NULL);
+            Tcl_IncrRefCount(installed_packages_ptr);
+            for (const auto &install_spec: installs_from_lock_file_sofar) {
+                Tcl_ListObjAppendElement(interp, installed_packages_ptr,
+                                         Tcl_NewStringObj(install_spec.package_name.c_str(), -1));
+            }
+
+            // the backups are retired only once the lock file and the manifest are saved,
+            // the commit marker lets an interrupted commit be completed on the next run
+            if (TCL_OK != ttrek_BeginInstallCommit(interp, state_ptr, installed_packages_ptr)) {
+                Tcl_DecrRefCount(installed_packages_ptr);
+                return TCL_ERROR;
+            }
+
             if (TCL_OK != ttrek_UpdateLockFileAfterInstall(interp, state_ptr)) {
+                Tcl_DecrRefCount(installed_packages_ptr);
                 return TCL_ERROR;
             }
 
             if (TCL_OK != ttrek_UpdateManifestFileAfterInstall(interp, state_ptr)) {
                 fprintf(stderr, "error: could not update manifest file\n");
+                Tcl_DecrRefCount(installed_packages_ptr);
                 return TCL_ERROR;
             }
 
-            for (const auto &install_spec: installs_from_lock_file_sofar) {
-                ttrek_DeleteTempFiles(interp, state_ptr, install_spec.package_name.c_str());
-            }
+            ttrek_EndInstallCommit(interp, state_ptr, installed_packages_ptr);
+            Tcl_DecrRefCount(installed_packages_ptr);
 
         }
 
@@ -0,0 +1,113 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "ttrek_snapshot.h"
+#include "ttrek_git.h"
+#include "ttrek_store.h"
+
+int ttrek_SnapshotBackendFromString(const char *backend_str, ttrek_snapshot_backend_t *backend_ptr) {
+    if (strcmp(backend_str, "git") == 0) {
+        *backend_ptr = SNAPSHOT_GIT;
+    } else if (strcmp(backend_str, "store") == 0) {
+        *backend_ptr = SNAPSHOT_STORE;
+    } else {
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// Marks the installed file (relative to the install directory) as changed,
+// so that it is included in the next snapshot.
+void ttrek_SnapshotTrackInstalledFile(ttrek_state_t *state_ptr, const char *file_path) {
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, INSTALL_DIR "/", -1);
+    Tcl_DStringAppend(&ds, file_path, -1);
+    int is_new;
+    Tcl_CreateHashEntry(&state_ptr->snapshot_paths_ht, Tcl_DStringValue(&ds), &is_new);
+    Tcl_DStringFree(&ds);
+}
+
+int ttrek_SnapshotInit(Tcl_Interp *interp, ttrek_state_t *state_ptr, ttrek_snapshot_backend_t backend) {
+    state_ptr->snapshot_backend = backend;
+    switch (backend) {
+        case SNAPSHOT_GIT:
+            return ttrek_GitInit(state_ptr);
+        case SNAPSHOT_STORE:
+            return ttrek_StoreInit(interp, state_ptr);
+    }
+    return TCL_ERROR;
+}
+
+// Finds out which backend keeps the snapshots of the venv, and resets the
+// venv to the last snapshot if the last run was interrupted. A venv
+// without snapshots gets the backend from TTREK_SNAPSHOT_BACKEND, git by
+// default.
+int ttrek_SnapshotEnsureReady(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    Tcl_Obj *store_dir_ptr = ttrek_GetVenvSubDir(interp, state_ptr->project_venv_dir_ptr, SNAPSHOT_STORE_DIR);
+    int store_exists;
+    if (TCL_OK != ttrek_DirectoryExists(interp, store_dir_ptr, &store_exists)) {
+        fprintf(stderr, "error: could not check if %s exists\n", SNAPSHOT_STORE_DIR);
+        Tcl_DecrRefCount(store_dir_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(store_dir_ptr);
+
+    if (store_exists) {
+
+        state_ptr->snapshot_backend = SNAPSHOT_STORE;
+
+        int dirty_file_exists = 0;
+        if (TCL_OK != ttrek_FileExists(interp, state_ptr->dirty_file_path_ptr, &dirty_file_exists)) {
+            fprintf(stderr, "error: checking if .dirty exists failed\n");
+            return TCL_ERROR;
+        }
+
+        if (dirty_file_exists && TCL_OK != ttrek_StoreReset(interp, state_ptr)) {
+            fprintf(stderr, "error: resetting to the last snapshot failed\n");
+            return TCL_ERROR;
+        }
+
+        return TCL_OK;
+
+    }
+
+    Tcl_Obj *git_dir_ptr = ttrek_GetVenvSubDir(interp, state_ptr->project_venv_dir_ptr, ".git");
+    int git_exists;
+    if (TCL_OK != ttrek_DirectoryExists(interp, git_dir_ptr, &git_exists)) {
+        fprintf(stderr, "error: could not check if .git exists\n");
+        Tcl_DecrRefCount(git_dir_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(git_dir_ptr);
+
+    ttrek_snapshot_backend_t backend = SNAPSHOT_GIT;
+    const char *backend_env = getenv("TTREK_SNAPSHOT_BACKEND");
+    if (!git_exists && backend_env != NULL && TCL_OK != ttrek_SnapshotBackendFromString(backend_env, &backend)) {
+        fprintf(stderr, "warning: unknown snapshot backend \"%s\", using git\n", backend_env);
+    }
+
+    if (backend == SNAPSHOT_STORE) {
+        return ttrek_SnapshotInit(interp, state_ptr, SNAPSHOT_STORE);
+    }
+
+    state_ptr->snapshot_backend = SNAPSHOT_GIT;
+    return ttrek_EnsureGitReady(interp, state_ptr);
+
+}
+
+int ttrek_SnapshotSave(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+    switch (state_ptr->snapshot_backend) {
+        case SNAPSHOT_GIT:
+            return ttrek_GitAmend(state_ptr);
+        case SNAPSHOT_STORE:
+            return ttrek_StoreSave(interp, state_ptr);
+    }
+    return TCL_ERROR;
+}
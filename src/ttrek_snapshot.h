@@ -0,0 +1,26 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_SNAPSHOT_H
+#define TTREK_SNAPSHOT_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ttrek_SnapshotBackendFromString(const char *backend_str, ttrek_snapshot_backend_t *backend_ptr);
+void ttrek_SnapshotTrackInstalledFile(ttrek_state_t *state_ptr, const char *file_path);
+int ttrek_SnapshotInit(Tcl_Interp *interp, ttrek_state_t *state_ptr, ttrek_snapshot_backend_t backend);
+int ttrek_SnapshotEnsureReady(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+int ttrek_SnapshotSave(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_SNAPSHOT_H
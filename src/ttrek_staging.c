@@ -0,0 +1,235 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "ttrek_staging.h"
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static void ttrek_StagingAppendName(Tcl_DString *ds, const char *name) {
+    if (Tcl_DStringLength(ds) > 0) {
+        Tcl_DStringAppend(ds, "/", 1);
+    }
+    Tcl_DStringAppend(ds, name, -1);
+}
+
+// Appends all files in the directory to the list. The paths in the list
+// are relative to the install directory, rel_ds contains the path of
+// the directory itself.
+static int ttrek_StagingListFiles(Tcl_DString *path_ds, Tcl_DString *rel_ds, Tcl_Obj *files_list_ptr) {
+
+    DIR *dir = opendir(Tcl_DStringValue(path_ds));
+    if (dir == NULL) {
+        fprintf(stderr, "error: could not open directory %s: %s\n", Tcl_DStringValue(path_ds), strerror(errno));
+        return TCL_ERROR;
+    }
+
+    Tcl_Size path_len = Tcl_DStringLength(path_ds);
+    Tcl_Size rel_len = Tcl_DStringLength(rel_ds);
+
+    int rc = TCL_OK;
+    struct dirent *entry;
+    while (rc == TCL_OK && (entry = readdir(dir)) != NULL) {
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        ttrek_StagingAppendName(path_ds, entry->d_name);
+        ttrek_StagingAppendName(rel_ds, entry->d_name);
+
+        struct stat st;
+        if (lstat(Tcl_DStringValue(path_ds), &st) != 0) {
+            fprintf(stderr, "error: could not stat %s: %s\n", Tcl_DStringValue(path_ds), strerror(errno));
+            rc = TCL_ERROR;
+        } else if (S_ISDIR(st.st_mode)) {
+            rc = ttrek_StagingListFiles(path_ds, rel_ds, files_list_ptr);
+        } else {
+            Tcl_ListObjAppendElement(NULL, files_list_ptr,
+                                     Tcl_NewStringObj(Tcl_DStringValue(rel_ds), Tcl_DStringLength(rel_ds)));
+        }
+
+        Tcl_DStringSetLength(path_ds, path_len);
+        Tcl_DStringSetLength(rel_ds, rel_len);
+
+    }
+
+    closedir(dir);
+    return rc;
+
+}
+
+// Moves the contents of the staging directory to the install directory.
+// Directories that do not exist in the install directory are moved with
+// a single rename, the existing ones are merged file by file.
+static int ttrek_StagingMergeDirectory(Tcl_DString *src_ds, Tcl_DString *dst_ds, Tcl_DString *rel_ds,
+                                       Tcl_Obj *files_list_ptr) {
+
+    DIR *dir = opendir(Tcl_DStringValue(src_ds));
+    if (dir == NULL) {
+        fprintf(stderr, "error: could not open directory %s: %s\n", Tcl_DStringValue(src_ds), strerror(errno));
+        return TCL_ERROR;
+    }
+
+    Tcl_Size src_len = Tcl_DStringLength(src_ds);
+    Tcl_Size dst_len = Tcl_DStringLength(dst_ds);
+    Tcl_Size rel_len = Tcl_DStringLength(rel_ds);
+
+    int rc = TCL_OK;
+    struct dirent *entry;
+    while (rc == TCL_OK && (entry = readdir(dir)) != NULL) {
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        ttrek_StagingAppendName(src_ds, entry->d_name);
+        ttrek_StagingAppendName(dst_ds, entry->d_name);
+        ttrek_StagingAppendName(rel_ds, entry->d_name);
+
+        const char *src = Tcl_DStringValue(src_ds);
+        const char *dst = Tcl_DStringValue(dst_ds);
+
+        struct stat src_st, dst_st;
+        int dst_exists = (lstat(dst, &dst_st) == 0);
+
+        if (lstat(src, &src_st) != 0) {
+            fprintf(stderr, "error: could not stat %s: %s\n", src, strerror(errno));
+            rc = TCL_ERROR;
+        } else if (S_ISDIR(src_st.st_mode)) {
+
+            if (!dst_exists) {
+                if (rename(src, dst) == 0) {
+                    DBG2(printf("moved directory %s", Tcl_DStringValue(rel_ds)));
+                    rc = ttrek_StagingListFiles(dst_ds, rel_ds, files_list_ptr);
+                    goto next;
+                }
+                // The directory could be created by another package that
+                // is installed at the same time.
+                if ((errno != EEXIST && errno != ENOTEMPTY) || lstat(dst, &dst_st) != 0) {
+                    fprintf(stderr, "error: could not move %s to %s: %s\n", src, dst, strerror(errno));
+                    rc = TCL_ERROR;
+                    goto next;
+                }
+            }
+
+            if (S_ISDIR(dst_st.st_mode)) {
+                rc = ttrek_StagingMergeDirectory(src_ds, dst_ds, rel_ds, files_list_ptr);
+            } else {
+                fprintf(stderr, "error: could not replace %s with a directory\n", dst);
+                rc = TCL_ERROR;
+            }
+
+        } else if (rename(src, dst) != 0) {
+            fprintf(stderr, "error: could not move %s to %s: %s\n", src, dst, strerror(errno));
+            rc = TCL_ERROR;
+        } else if (!dst_exists) {
+            // Files that already existed belong to other packages
+            Tcl_ListObjAppendElement(NULL, files_list_ptr,
+                                     Tcl_NewStringObj(Tcl_DStringValue(rel_ds), Tcl_DStringLength(rel_ds)));
+        }
+
+next:
+        Tcl_DStringSetLength(src_ds, src_len);
+        Tcl_DStringSetLength(dst_ds, dst_len);
+        Tcl_DStringSetLength(rel_ds, rel_len);
+
+    }
+
+    closedir(dir);
+    return rc;
+
+}
+
+// Moves the files installed with DESTDIR=staging_dir_ptr to the install
+// directory, and appends the paths of the new files to files_list_ptr.
+int ttrek_StagingMerge(Tcl_Interp *interp, Tcl_Obj *staging_dir_ptr, Tcl_Obj *install_dir_ptr,
+                       Tcl_Obj *files_list_ptr) {
+
+    UNUSED(interp);
+
+    // With DESTDIR, the files are installed to $DESTDIR$PREFIX
+    Tcl_DString src_ds;
+    Tcl_DStringInit(&src_ds);
+    Tcl_DStringAppend(&src_ds, Tcl_GetString(staging_dir_ptr), -1);
+    const char *install_dir = Tcl_GetString(install_dir_ptr);
+    if (install_dir[0] != '/') {
+        Tcl_DStringAppend(&src_ds, "/", 1);
+    }
+    Tcl_DStringAppend(&src_ds, install_dir, -1);
+
+    struct stat st;
+    if (lstat(Tcl_DStringValue(&src_ds), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        DBG2(printf("nothing was installed to %s", Tcl_DStringValue(&src_ds)));
+        Tcl_DStringFree(&src_ds);
+        return TCL_OK;
+    }
+
+    Tcl_DString dst_ds;
+    Tcl_DStringInit(&dst_ds);
+    Tcl_DStringAppend(&dst_ds, install_dir, -1);
+
+    Tcl_DString rel_ds;
+    Tcl_DStringInit(&rel_ds);
+
+    int rc = ttrek_StagingMergeDirectory(&src_ds, &dst_ds, &rel_ds, files_list_ptr);
+
+    Tcl_DStringFree(&rel_ds);
+    Tcl_DStringFree(&dst_ds);
+    Tcl_DStringFree(&src_ds);
+    return rc;
+
+}
+
+int ttrek_StagingReadFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name,
+                           const char *package_version, Tcl_Obj **files_list_ptr) {
+
+    Tcl_Obj *staging_dir_ptr;
+    ttrek_ResolvePath(interp, state_ptr->project_build_dir_ptr, Tcl_NewStringObj(STAGING_DIR, -1), &staging_dir_ptr);
+    Tcl_Obj *files_path_ptr;
+    ttrek_ResolvePath(interp, staging_dir_ptr,
+                      Tcl_ObjPrintf("%s-%s%s", package_name, package_version, STAGING_FILES_EXT), &files_path_ptr);
+    Tcl_DecrRefCount(staging_dir_ptr);
+
+    if (ttrek_CheckFileExists(files_path_ptr) != TCL_OK) {
+        fprintf(stderr, "error: list of installed files %s does not exist\n", Tcl_GetString(files_path_ptr));
+        Tcl_DecrRefCount(files_path_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *contents_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(contents_ptr);
+    if (TCL_OK != ttrek_ReadChars(interp, files_path_ptr, &contents_ptr)) {
+        Tcl_DecrRefCount(contents_ptr);
+        Tcl_DecrRefCount(files_path_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(files_path_ptr);
+
+    Tcl_Obj *files_list = Tcl_NewListObj(0, NULL);
+
+    Tcl_Size len;
+    const char *str = Tcl_GetStringFromObj(contents_ptr, &len);
+    const char *end = str + len;
+    while (str < end) {
+        const char *eol = memchr(str, '\n', end - str);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (eol > str) {
+            Tcl_ListObjAppendElement(interp, files_list, Tcl_NewStringObj(str, eol - str));
+        }
+        str = eol + 1;
+    }
+
+    Tcl_DecrRefCount(contents_ptr);
+
+    Tcl_IncrRefCount(files_list);
+    *files_list_ptr = files_list;
+    return TCL_OK;
+
+}
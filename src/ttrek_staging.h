@@ -0,0 +1,31 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_STAGING_H
+#define TTREK_STAGING_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Packages are installed with DESTDIR pointing to the staging directory
+// build/staging/<package>-<version>, and then moved to the install directory.
+// The list of moved files is saved to build/staging/<package>-<version>.files
+#define STAGING_DIR       "staging"
+#define STAGING_FILES_EXT ".files"
+
+int ttrek_StagingMerge(Tcl_Interp *interp, Tcl_Obj *staging_dir_ptr, Tcl_Obj *install_dir_ptr,
+                       Tcl_Obj *files_list_ptr);
+int ttrek_StagingReadFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name,
+                           const char *package_version, Tcl_Obj **files_list_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_STAGING_H
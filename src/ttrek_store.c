@@ -0,0 +1,1011 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "ttrek_store.h"
+#include "ttrek_verify.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+// Bump the version when the format of the snapshot file changes
+#define STORE_SNAPSHOT_HEADER "ttrek-snapshot 1\n"
+
+// A file of the snapshot, keyed by its path relative to the venv
+typedef struct {
+    mode_t mode;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    ino_t ino;
+    char hash[VERIFY_HASH_HEX_SIZE];
+    // Set by ttrek_StoreReset() for the files found in the venv
+    int is_seen;
+} ttrek_store_entry_t;
+
+typedef struct {
+    ttrek_state_t *state_ptr;
+    Tcl_DString store_ds;
+    Tcl_HashTable entries_ht;
+    int is_changed;
+} ttrek_store_t;
+
+static void ttrek_StoreOpen(ttrek_state_t *state_ptr, ttrek_store_t *store) {
+    store->state_ptr = state_ptr;
+    store->is_changed = 0;
+    Tcl_DStringInit(&store->store_ds);
+    Tcl_DStringAppend(&store->store_ds, Tcl_GetString(state_ptr->project_venv_dir_ptr), -1);
+    Tcl_DStringAppend(&store->store_ds, "/" SNAPSHOT_STORE_DIR, -1);
+    Tcl_InitHashTable(&store->entries_ht, TCL_STRING_KEYS);
+}
+
+static void ttrek_StoreClose(ttrek_store_t *store) {
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&store->entries_ht, &search); entry != NULL;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_Free((char *) Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&store->entries_ht);
+    Tcl_DStringFree(&store->store_ds);
+}
+
+static void ttrek_StoreVenvPath(ttrek_store_t *store, const char *rel_path, Tcl_DString *ds) {
+    Tcl_DStringInit(ds);
+    Tcl_DStringAppend(ds, Tcl_GetString(store->state_ptr->project_venv_dir_ptr), -1);
+    Tcl_DStringAppend(ds, "/", 1);
+    Tcl_DStringAppend(ds, rel_path, -1);
+}
+
+// Objects are stored as objects/ab/cdef... like in git
+static void ttrek_StoreObjectPath(ttrek_store_t *store, const char *hash, Tcl_DString *ds) {
+    Tcl_DStringInit(ds);
+    Tcl_DStringAppend(ds, Tcl_DStringValue(&store->store_ds), Tcl_DStringLength(&store->store_ds));
+    Tcl_DStringAppend(ds, "/" STORE_OBJECTS_DIR "/", -1);
+    Tcl_DStringAppend(ds, hash, 2);
+    Tcl_DStringAppend(ds, "/", 1);
+    Tcl_DStringAppend(ds, hash + 2, -1);
+}
+
+static int ttrek_StoreIsEntryUpToDate(const ttrek_store_entry_t *entry, const struct stat *st) {
+    return entry->mode == st->st_mode
+           && entry->size == st->st_size
+           && entry->ino == st->st_ino
+           && entry->mtime_sec == ST_MTIM(*st).tv_sec
+           && entry->mtime_nsec == ST_MTIM(*st).tv_nsec;
+}
+
+static void ttrek_StoreSetEntryStat(ttrek_store_entry_t *entry, const struct stat *st) {
+    entry->mode = st->st_mode;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->mtime_sec = ST_MTIM(*st).tv_sec;
+    entry->mtime_nsec = ST_MTIM(*st).tv_nsec;
+}
+
+static int ttrek_StoreLoad(Tcl_Interp *interp, ttrek_store_t *store, int *exists_ptr) {
+
+    Tcl_Obj *snapshot_path_ptr = Tcl_ObjPrintf("%s/%s", Tcl_DStringValue(&store->store_ds), STORE_SNAPSHOT_FILE);
+    Tcl_IncrRefCount(snapshot_path_ptr);
+
+    *exists_ptr = 0;
+    if (TCL_OK != ttrek_CheckFileExists(snapshot_path_ptr)) {
+        Tcl_DecrRefCount(snapshot_path_ptr);
+        return TCL_OK;
+    }
+
+    Tcl_Obj *contents_ptr = Tcl_NewObj();
+    Tcl_IncrRefCount(contents_ptr);
+    if (TCL_OK != ttrek_ReadChars(interp, snapshot_path_ptr, &contents_ptr)) {
+        Tcl_DecrRefCount(contents_ptr);
+        Tcl_DecrRefCount(snapshot_path_ptr);
+        return TCL_ERROR;
+    }
+
+    int rc = TCL_OK;
+    const char *p = Tcl_GetString(contents_ptr);
+    if (strncmp(p, STORE_SNAPSHOT_HEADER, strlen(STORE_SNAPSHOT_HEADER)) != 0) {
+        fprintf(stderr, "error: unknown snapshot format in %s\n", Tcl_GetString(snapshot_path_ptr));
+        rc = TCL_ERROR;
+        goto done;
+    }
+    p += strlen(STORE_SNAPSHOT_HEADER);
+
+    // mode size mtime mtime_nsec ino hash path
+    while (*p != '\0') {
+
+        const char *eol = strchr(p, '\n');
+        if (eol == NULL) {
+            eol = p + strlen(p);
+        }
+
+        unsigned int mode;
+        long long size, mtime_sec;
+        long mtime_nsec;
+        unsigned long long ino;
+        char hash[VERIFY_HASH_HEX_SIZE];
+        int path_offset = 0;
+        if (sscanf(p, "%o %lld %lld %ld %llu %64s %n", &mode, &size, &mtime_sec, &mtime_nsec, &ino, hash,
+                   &path_offset) != 6 || path_offset == 0 || p + path_offset >= eol) {
+            fprintf(stderr, "error: invalid entry in %s\n", Tcl_GetString(snapshot_path_ptr));
+            rc = TCL_ERROR;
+            goto done;
+        }
+
+        ttrek_store_entry_t *entry = (ttrek_store_entry_t *) Tcl_Alloc(sizeof(ttrek_store_entry_t));
+        entry->mode = mode;
+        entry->size = size;
+        entry->mtime_sec = mtime_sec;
+        entry->mtime_nsec = mtime_nsec;
+        entry->ino = ino;
+        entry->is_seen = 0;
+        memcpy(entry->hash, hash, VERIFY_HASH_HEX_SIZE);
+
+        Tcl_DString path_ds;
+        Tcl_DStringInit(&path_ds);
+        Tcl_DStringAppend(&path_ds, p + path_offset, eol - (p + path_offset));
+        int is_new;
+        Tcl_HashEntry *hash_entry = Tcl_CreateHashEntry(&store->entries_ht, Tcl_DStringValue(&path_ds), &is_new);
+        if (!is_new) {
+            Tcl_Free((char *) Tcl_GetHashValue(hash_entry));
+        }
+        Tcl_SetHashValue(hash_entry, entry);
+        Tcl_DStringFree(&path_ds);
+
+        p = *eol == '\0' ? eol : eol + 1;
+
+    }
+
+    *exists_ptr = 1;
+
+done:
+    Tcl_DecrRefCount(contents_ptr);
+    Tcl_DecrRefCount(snapshot_path_ptr);
+    return rc;
+
+}
+
+static int ttrek_StoreWrite(Tcl_Interp *interp, ttrek_store_t *store) {
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, STORE_SNAPSHOT_HEADER, -1);
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *hash_entry = Tcl_FirstHashEntry(&store->entries_ht, &search); hash_entry != NULL;
+         hash_entry = Tcl_NextHashEntry(&search)) {
+        const char *path = Tcl_GetHashKey(&store->entries_ht, hash_entry);
+        ttrek_store_entry_t *entry = Tcl_GetHashValue(hash_entry);
+        char line[256];
+        int len = snprintf(line, sizeof(line), "%o %lld %lld %ld %llu %s ", (unsigned int) entry->mode,
+                           (long long) entry->size, (long long) entry->mtime_sec, entry->mtime_nsec,
+                           (unsigned long long) entry->ino, entry->hash);
+        Tcl_DStringAppend(&ds, line, len);
+        Tcl_DStringAppend(&ds, path, -1);
+        Tcl_DStringAppend(&ds, "\n", 1);
+    }
+
+    Tcl_Obj *snapshot_path_ptr = Tcl_ObjPrintf("%s/%s", Tcl_DStringValue(&store->store_ds), STORE_SNAPSHOT_FILE);
+    Tcl_IncrRefCount(snapshot_path_ptr);
+    int rc = ttrek_WriteFileAtomic(interp, snapshot_path_ptr, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), 0644);
+    Tcl_DecrRefCount(snapshot_path_ptr);
+    Tcl_DStringFree(&ds);
+
+    if (rc == TCL_OK) {
+        store->is_changed = 0;
+    }
+    return rc;
+
+}
+
+// Creates dst as a copy-on-write clone of src. Returns 0 on success or
+// errno on failure, e.g. when the file system does not support it.
+static int ttrek_StoreReflink(const char *src, const char *dst, mode_t mode) {
+#ifdef FICLONE
+    int src_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        return errno;
+    }
+    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (dst_fd < 0) {
+        int error = errno;
+        close(src_fd);
+        return error;
+    }
+    int error = ioctl(dst_fd, FICLONE, src_fd) == 0 ? 0 : errno;
+    close(dst_fd);
+    close(src_fd);
+    if (error) {
+        unlink(dst);
+    }
+    return error;
+#else
+    UNUSED(src);
+    UNUSED(dst);
+    UNUSED(mode);
+    return ENOTSUP;
+#endif
+}
+
+static int ttrek_StoreCopy(const char *src, const char *dst, mode_t mode) {
+
+    int src_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        return errno;
+    }
+    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (dst_fd < 0) {
+        int error = errno;
+        close(src_fd);
+        return error;
+    }
+
+    int error = 0;
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(src_fd, buf, sizeof(buf));
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            break;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t m = write(dst_fd, buf + written, n - written);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error = errno;
+                break;
+            }
+            written += m;
+        }
+        if (error) {
+            break;
+        }
+    }
+
+    close(dst_fd);
+    close(src_fd);
+    if (error) {
+        unlink(dst);
+    }
+    return error;
+
+}
+
+// Creates the directories of the path, except the last component
+static void ttrek_StoreMakeParents(const char *path) {
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, path, -1);
+    char *p = Tcl_DStringValue(&ds);
+    for (char *slash = strchr(p + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(p, 0755);
+        *slash = '/';
+    }
+    Tcl_DStringFree(&ds);
+}
+
+// Only installed files are hardlinked to the objects. These are moved in
+// place from the staging directory, so a new install replaces the file
+// instead of writing to the shared data. The manifest journal is appended
+// to, so it is always copied.
+static int ttrek_StoreCanLink(const char *rel_path) {
+    return strncmp(rel_path, INSTALL_DIR "/", strlen(INSTALL_DIR "/")) == 0;
+}
+
+// Adds the file to the objects, unless an object with the same hash is
+// there already. The data is shared with the installed file by reflink,
+// or by hardlink if the file system does not support reflinks.
+static int ttrek_StoreAddObject(ttrek_store_t *store, const char *path, const struct stat *st, const char *hash,
+                                int can_link) {
+
+    Tcl_DString object_ds;
+    ttrek_StoreObjectPath(store, hash, &object_ds);
+    const char *object_path = Tcl_DStringValue(&object_ds);
+
+    struct stat object_st;
+    if (lstat(object_path, &object_st) == 0) {
+        Tcl_DStringFree(&object_ds);
+        return TCL_OK;
+    }
+
+    ttrek_StoreMakeParents(object_path);
+
+    // Write to a temp file first, so that there are no partial objects
+    // after a crash
+    Tcl_Obj *temp_path_ptr = Tcl_ObjPrintf("%s.tmp.%d", object_path, (int) getpid());
+    Tcl_IncrRefCount(temp_path_ptr);
+    const char *temp_path = Tcl_GetString(temp_path_ptr);
+
+    int error;
+    if (S_ISLNK(st->st_mode)) {
+        // Symbolic links are stored as files with the target as contents
+        char target[4096];
+        ssize_t len = readlink(path, target, sizeof(target));
+        int fd = len < 0 ? -1 : open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            error = errno;
+        } else {
+            error = write(fd, target, len) == len ? 0 : (errno ? errno : EIO);
+            close(fd);
+        }
+    } else {
+        error = ttrek_StoreReflink(path, temp_path, st->st_mode & 07777);
+        if (error && can_link && link(path, object_path) == 0) {
+            error = 0;
+            goto done;
+        }
+        if (error) {
+            error = ttrek_StoreCopy(path, temp_path, st->st_mode & 07777);
+        }
+    }
+
+    if (!error && rename(temp_path, object_path) != 0) {
+        error = errno;
+        unlink(temp_path);
+    }
+
+done:
+    Tcl_DecrRefCount(temp_path_ptr);
+
+    if (error) {
+        fprintf(stderr, "error: could not store %s: %s\n", path, strerror(error));
+        Tcl_DStringFree(&object_ds);
+        return TCL_ERROR;
+    }
+
+    Tcl_DStringFree(&object_ds);
+    return TCL_OK;
+
+}
+
+// Records the current state of the path in the snapshot. The hash of the
+// file is taken from the manifest when its stat data matches, otherwise
+// the file is hashed. The hashes of the replaced entries are appended to
+// old_hashes_ptr, so that their objects can be removed.
+static int ttrek_StoreUpdatePath(ttrek_store_t *store, const char *rel_path, Tcl_HashTable *file_info_ht,
+                                 Tcl_Obj *old_hashes_ptr) {
+
+    Tcl_DString path_ds;
+    ttrek_StoreVenvPath(store, rel_path, &path_ds);
+    const char *path = Tcl_DStringValue(&path_ds);
+
+    Tcl_HashEntry *hash_entry = Tcl_FindHashEntry(&store->entries_ht, rel_path);
+    ttrek_store_entry_t *entry = hash_entry != NULL ? Tcl_GetHashValue(hash_entry) : NULL;
+
+    struct stat st;
+    if (lstat(path, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) {
+        if (entry != NULL) {
+            DBG2(printf("remove: %s", rel_path));
+            Tcl_ListObjAppendElement(NULL, old_hashes_ptr, Tcl_NewStringObj(entry->hash, -1));
+            Tcl_Free((char *) entry);
+            Tcl_DeleteHashEntry(hash_entry);
+            store->is_changed = 1;
+        }
+        Tcl_DStringFree(&path_ds);
+        return TCL_OK;
+    }
+
+    if (entry != NULL && ttrek_StoreIsEntryUpToDate(entry, &st)) {
+        Tcl_DStringFree(&path_ds);
+        return TCL_OK;
+    }
+
+    char hash[VERIFY_HASH_HEX_SIZE] = "";
+    Tcl_HashEntry *info_entry = Tcl_FindHashEntry(file_info_ht, rel_path);
+    if (info_entry != NULL) {
+        cJSON *info_node = Tcl_GetHashValue(info_entry);
+        const char *info_hash = cJSON_GetStringValue(cJSON_GetObjectItem(info_node, "sha256"));
+        if (info_hash != NULL && strlen(info_hash) == VERIFY_HASH_HEX_SIZE - 1
+            && (off_t) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "size")) == st.st_size
+            && (mode_t) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "mode")) == st.st_mode
+            && (time_t) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "mtime")) == ST_MTIM(st).tv_sec
+            && (long) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "mtime_nsec")) == ST_MTIM(st).tv_nsec) {
+            memcpy(hash, info_hash, VERIFY_HASH_HEX_SIZE);
+        }
+    }
+
+    if (hash[0] == '\0') {
+        int error = ttrek_VerifyHashFile(AT_FDCWD, path, st.st_mode, st.st_size, hash);
+        if (error) {
+            fprintf(stderr, "error: could not hash %s: %s\n", path, strerror(error));
+            Tcl_DStringFree(&path_ds);
+            return TCL_ERROR;
+        }
+    }
+
+    if (TCL_OK != ttrek_StoreAddObject(store, path, &st, hash, ttrek_StoreCanLink(rel_path))) {
+        Tcl_DStringFree(&path_ds);
+        return TCL_ERROR;
+    }
+    Tcl_DStringFree(&path_ds);
+
+    DBG2(printf("add: %s", rel_path));
+
+    if (entry == NULL) {
+        entry = (ttrek_store_entry_t *) Tcl_Alloc(sizeof(ttrek_store_entry_t));
+        entry->is_seen = 0;
+        int is_new;
+        hash_entry = Tcl_CreateHashEntry(&store->entries_ht, rel_path, &is_new);
+        Tcl_SetHashValue(hash_entry, entry);
+    } else if (strcmp(entry->hash, hash) != 0) {
+        Tcl_ListObjAppendElement(NULL, old_hashes_ptr, Tcl_NewStringObj(entry->hash, -1));
+    }
+
+    ttrek_StoreSetEntryStat(entry, &st);
+    memcpy(entry->hash, hash, VERIFY_HASH_HEX_SIZE);
+    store->is_changed = 1;
+    return TCL_OK;
+
+}
+
+// Removes the objects of the given hashes that are not in the snapshot anymore
+static void ttrek_StoreRemoveObjects(ttrek_store_t *store, Tcl_Obj *hashes_ptr) {
+
+    Tcl_Size hashes_len;
+    Tcl_Obj **hashes_ptrs;
+    Tcl_ListObjGetElements(NULL, hashes_ptr, &hashes_len, &hashes_ptrs);
+    if (hashes_len == 0) {
+        return;
+    }
+
+    Tcl_HashTable used_ht;
+    Tcl_InitHashTable(&used_ht, TCL_STRING_KEYS);
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *hash_entry = Tcl_FirstHashEntry(&store->entries_ht, &search); hash_entry != NULL;
+         hash_entry = Tcl_NextHashEntry(&search)) {
+        ttrek_store_entry_t *entry = Tcl_GetHashValue(hash_entry);
+        int is_new;
+        Tcl_CreateHashEntry(&used_ht, entry->hash, &is_new);
+    }
+
+    for (Tcl_Size i = 0; i < hashes_len; i++) {
+        const char *hash = Tcl_GetString(hashes_ptrs[i]);
+        if (Tcl_FindHashEntry(&used_ht, hash) != NULL) {
+            continue;
+        }
+        Tcl_DString object_ds;
+        ttrek_StoreObjectPath(store, hash, &object_ds);
+        DBG2(printf("remove object: %s", Tcl_DStringValue(&object_ds)));
+        if (unlink(Tcl_DStringValue(&object_ds)) == 0) {
+            // Also remove the directory of the object, if it is empty now
+            Tcl_DStringSetLength(&object_ds, Tcl_DStringLength(&object_ds) - (VERIFY_HASH_HEX_SIZE - 1 - 2) - 1);
+            rmdir(Tcl_DStringValue(&object_ds));
+        }
+        Tcl_DStringFree(&object_ds);
+    }
+
+    Tcl_DeleteHashTable(&used_ht);
+
+}
+
+// Maps the installed files (relative to the venv) to their file info in
+// the manifest, see ttrek_VerifyGetFileInfo().
+static int ttrek_StoreGetFileInfo(ttrek_state_t *state_ptr, Tcl_HashTable *file_info_ht) {
+    cJSON *manifest_root = ttrek_StateGetManifestRoot(state_ptr);
+    if (manifest_root == NULL) {
+        fprintf(stderr, "error: could not load %s\n", MANIFEST_JSON_FILE);
+        return TCL_ERROR;
+    }
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    cJSON *package_node;
+    cJSON_ArrayForEach(package_node, manifest_root) {
+        cJSON *info_node;
+        cJSON_ArrayForEach(info_node, cJSON_GetObjectItem(package_node, VERIFY_FILE_INFO)) {
+            Tcl_DStringSetLength(&ds, 0);
+            Tcl_DStringAppend(&ds, INSTALL_DIR "/", -1);
+            Tcl_DStringAppend(&ds, info_node->string, -1);
+            int is_new;
+            Tcl_HashEntry *entry = Tcl_CreateHashEntry(file_info_ht, Tcl_DStringValue(&ds), &is_new);
+            Tcl_SetHashValue(entry, info_node);
+        }
+    }
+    Tcl_DStringFree(&ds);
+    return TCL_OK;
+}
+
+// Takes a new snapshot from the last one, updating only the paths that
+// were changed by the command (see ttrek_SnapshotTrackInstalledFile())
+// and the manifest.
+int ttrek_StoreSave(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    ttrek_store_t store;
+    ttrek_StoreOpen(state_ptr, &store);
+
+    int exists;
+    if (TCL_OK != ttrek_StoreLoad(interp, &store, &exists)) {
+        ttrek_StoreClose(&store);
+        return TCL_ERROR;
+    }
+
+    Tcl_HashTable file_info_ht;
+    Tcl_InitHashTable(&file_info_ht, TCL_STRING_KEYS);
+    if (state_ptr->snapshot_paths_ht.numEntries > 0
+        && TCL_OK != ttrek_StoreGetFileInfo(state_ptr, &file_info_ht)) {
+        Tcl_DeleteHashTable(&file_info_ht);
+        ttrek_StoreClose(&store);
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *old_hashes_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(old_hashes_ptr);
+
+    int rc = TCL_OK;
+
+    const char *top_level_files[] = {MANIFEST_JSON_FILE, MANIFEST_JOURNAL_FILE, NULL};
+    for (int i = 0; rc == TCL_OK && top_level_files[i] != NULL; i++) {
+        rc = ttrek_StoreUpdatePath(&store, top_level_files[i], &file_info_ht, old_hashes_ptr);
+    }
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&state_ptr->snapshot_paths_ht, &search);
+         rc == TCL_OK && entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+        rc = ttrek_StoreUpdatePath(&store, Tcl_GetHashKey(&state_ptr->snapshot_paths_ht, entry), &file_info_ht,
+                                   old_hashes_ptr);
+    }
+
+    DBG2(printf("updated %d changed paths, %d files in snapshot", state_ptr->snapshot_paths_ht.numEntries,
+                store.entries_ht.numEntries));
+
+    // The old objects are only removed once the new snapshot is in place
+    if (rc == TCL_OK && (store.is_changed || !exists)) {
+        rc = ttrek_StoreWrite(interp, &store);
+        if (rc == TCL_OK) {
+            ttrek_StoreRemoveObjects(&store, old_hashes_ptr);
+        }
+    }
+
+    if (rc == TCL_OK) {
+        Tcl_DeleteHashTable(&state_ptr->snapshot_paths_ht);
+        Tcl_InitHashTable(&state_ptr->snapshot_paths_ht, TCL_STRING_KEYS);
+    }
+
+    Tcl_DecrRefCount(old_hashes_ptr);
+    Tcl_DeleteHashTable(&file_info_ht);
+    ttrek_StoreClose(&store);
+    return rc;
+
+}
+
+// Adds all files under the directory to the changed paths
+static void ttrek_StoreTrackDir(ttrek_state_t *state_ptr, Tcl_DString *path_ds, Tcl_DString *rel_ds) {
+
+    DIR *dir = opendir(Tcl_DStringValue(path_ds));
+    if (dir == NULL) {
+        return;
+    }
+
+    Tcl_Size path_len = Tcl_DStringLength(path_ds);
+    Tcl_Size rel_len = Tcl_DStringLength(rel_ds);
+
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+
+        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        Tcl_DStringAppend(path_ds, "/", 1);
+        Tcl_DStringAppend(path_ds, dir_entry->d_name, -1);
+        Tcl_DStringAppend(rel_ds, "/", 1);
+        Tcl_DStringAppend(rel_ds, dir_entry->d_name, -1);
+
+        struct stat st;
+        if (lstat(Tcl_DStringValue(path_ds), &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                ttrek_StoreTrackDir(state_ptr, path_ds, rel_ds);
+            } else {
+                int is_new;
+                Tcl_CreateHashEntry(&state_ptr->snapshot_paths_ht, Tcl_DStringValue(rel_ds), &is_new);
+            }
+        }
+
+        Tcl_DStringSetLength(path_ds, path_len);
+        Tcl_DStringSetLength(rel_ds, rel_len);
+
+    }
+    closedir(dir);
+
+}
+
+// Creates the store and takes the first snapshot of the venv
+int ttrek_StoreInit(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    ttrek_store_t store;
+    ttrek_StoreOpen(state_ptr, &store);
+
+    Tcl_DString path_ds;
+    Tcl_DStringInit(&path_ds);
+    Tcl_DStringAppend(&path_ds, Tcl_DStringValue(&store.store_ds), Tcl_DStringLength(&store.store_ds));
+    Tcl_DStringAppend(&path_ds, "/" STORE_OBJECTS_DIR, -1);
+    ttrek_StoreMakeParents(Tcl_DStringValue(&path_ds));
+    if (mkdir(Tcl_DStringValue(&path_ds), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "error: could not create directory %s: %s\n", Tcl_DStringValue(&path_ds), strerror(errno));
+        Tcl_DStringFree(&path_ds);
+        ttrek_StoreClose(&store);
+        return TCL_ERROR;
+    }
+    Tcl_DStringFree(&path_ds);
+
+    // Everything that is installed already goes into the first snapshot
+    Tcl_DString rel_ds;
+    Tcl_DStringInit(&rel_ds);
+    Tcl_DStringAppend(&rel_ds, INSTALL_DIR, -1);
+    ttrek_StoreVenvPath(&store, INSTALL_DIR, &path_ds);
+    ttrek_StoreTrackDir(state_ptr, &path_ds, &rel_ds);
+    Tcl_DStringFree(&path_ds);
+    Tcl_DStringFree(&rel_ds);
+
+    fprintf(stdout, "initialized snapshot store in %s\n", Tcl_DStringValue(&store.store_ds));
+    ttrek_StoreClose(&store);
+
+    return ttrek_StoreSave(interp, state_ptr);
+
+}
+
+// Puts the file of the snapshot back in place, from its object
+static int ttrek_StoreRestoreEntry(ttrek_store_t *store, const char *rel_path, ttrek_store_entry_t *entry) {
+
+    Tcl_DString path_ds;
+    ttrek_StoreVenvPath(store, rel_path, &path_ds);
+    const char *path = Tcl_DStringValue(&path_ds);
+
+    Tcl_DString object_ds;
+    ttrek_StoreObjectPath(store, entry->hash, &object_ds);
+    const char *object_path = Tcl_DStringValue(&object_ds);
+
+    int rc = TCL_ERROR;
+    int error = 0;
+
+    struct stat object_st;
+    if (lstat(object_path, &object_st) != 0) {
+        fprintf(stderr, "error: the snapshot of %s is missing from the store\n", rel_path);
+        goto done;
+    }
+
+    struct stat st;
+    int exists = (lstat(path, &st) == 0);
+    if (exists && st.st_ino == object_st.st_ino && st.st_dev == object_st.st_dev) {
+        // The file is hardlinked to the object. If only its mode was
+        // changed, the content is still the same.
+        if (object_st.st_size != entry->size || ST_MTIM(object_st).tv_sec != entry->mtime_sec
+            || ST_MTIM(object_st).tv_nsec != entry->mtime_nsec) {
+            fprintf(stderr, "error: the snapshot of %s was modified in place and cannot be restored\n", rel_path);
+            goto done;
+        }
+        if (chmod(path, entry->mode & 07777) != 0 || lstat(path, &st) != 0) {
+            error = errno;
+            goto done;
+        }
+        ttrek_StoreSetEntryStat(entry, &st);
+        store->is_changed = 1;
+        rc = TCL_OK;
+        goto done;
+    }
+
+    if (object_st.st_size != entry->size) {
+        fprintf(stderr, "error: the snapshot of %s is damaged in the store\n", rel_path);
+        goto done;
+    }
+
+    if (exists) {
+        if (S_ISDIR(st.st_mode)) {
+            Tcl_Obj *dir_path_ptr = Tcl_NewStringObj(path, -1);
+            Tcl_IncrRefCount(dir_path_ptr);
+            Tcl_Obj *error_ptr = NULL;
+            if (TCL_OK != Tcl_FSRemoveDirectory(dir_path_ptr, 1, &error_ptr)) {
+                error = errno;
+            }
+            if (error_ptr != NULL) {
+                Tcl_BounceRefCount(error_ptr);
+            }
+            Tcl_DecrRefCount(dir_path_ptr);
+        } else if (unlink(path) != 0) {
+            error = errno;
+        }
+        if (error) {
+            goto done;
+        }
+    } else {
+        ttrek_StoreMakeParents(path);
+    }
+
+    if (S_ISLNK(entry->mode)) {
+        char target[4096];
+        int fd = open(object_path, O_RDONLY | O_CLOEXEC);
+        ssize_t len = fd < 0 ? -1 : read(fd, target, sizeof(target) - 1);
+        if (len < 0) {
+            error = errno;
+        } else {
+            target[len] = '\0';
+            if (symlink(target, path) != 0) {
+                error = errno;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    } else {
+        error = ttrek_StoreReflink(object_path, path, entry->mode & 07777);
+        // The object and the file share the mode when hardlinked
+        if (error && ttrek_StoreCanLink(rel_path) && (object_st.st_mode & 07777) == (entry->mode & 07777)
+            && link(object_path, path) == 0) {
+            error = 0;
+        } else if (error) {
+            error = ttrek_StoreCopy(object_path, path, entry->mode & 07777);
+        }
+        if (!error && chmod(path, entry->mode & 07777) != 0) {
+            error = errno;
+        }
+    }
+
+    if (!error && lstat(path, &st) != 0) {
+        error = errno;
+    }
+
+    if (!error) {
+        ttrek_StoreSetEntryStat(entry, &st);
+        store->is_changed = 1;
+        rc = TCL_OK;
+    }
+
+done:
+    if (error) {
+        fprintf(stderr, "error: could not restore %s: %s\n", rel_path, strerror(error));
+    }
+    Tcl_DStringFree(&object_ds);
+    Tcl_DStringFree(&path_ds);
+    return rc;
+
+}
+
+// Compares the venv path with the snapshot: files that are not in the
+// snapshot are removed, changed files are restored. The stat data is
+// compared, so unchanged files are not read at all.
+static int ttrek_StoreResetPath(ttrek_store_t *store, Tcl_DString *rel_ds, int *num_restored_ptr,
+                                int *num_removed_ptr) {
+
+    const char *rel_path = Tcl_DStringValue(rel_ds);
+    int is_top_level = strchr(rel_path, '/') == NULL;
+
+    Tcl_DString path_ds;
+    ttrek_StoreVenvPath(store, rel_path, &path_ds);
+
+    struct stat st;
+    if (lstat(Tcl_DStringValue(&path_ds), &st) != 0) {
+        Tcl_DStringFree(&path_ds);
+        return TCL_OK;
+    }
+
+    Tcl_HashEntry *hash_entry = Tcl_FindHashEntry(&store->entries_ht, rel_path);
+    ttrek_store_entry_t *entry = hash_entry != NULL ? Tcl_GetHashValue(hash_entry) : NULL;
+
+    int rc = TCL_OK;
+
+    if (S_ISDIR(st.st_mode) && entry == NULL) {
+
+        DIR *dir = opendir(Tcl_DStringValue(&path_ds));
+        if (dir == NULL) {
+            fprintf(stderr, "error: could not open directory %s: %s\n", Tcl_DStringValue(&path_ds), strerror(errno));
+            Tcl_DStringFree(&path_ds);
+            return TCL_ERROR;
+        }
+
+        int num_removed = *num_removed_ptr;
+        Tcl_Size rel_len = Tcl_DStringLength(rel_ds);
+        struct dirent *dir_entry;
+        while (rc == TCL_OK && (dir_entry = readdir(dir)) != NULL) {
+            if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+                continue;
+            }
+            Tcl_DStringAppend(rel_ds, "/", 1);
+            Tcl_DStringAppend(rel_ds, dir_entry->d_name, -1);
+            rc = ttrek_StoreResetPath(store, rel_ds, num_restored_ptr, num_removed_ptr);
+            Tcl_DStringSetLength(rel_ds, rel_len);
+        }
+        closedir(dir);
+
+        // Remove the directories that were emptied, but not the ones that
+        // were empty already
+        if (!is_top_level && *num_removed_ptr > num_removed) {
+            rmdir(Tcl_DStringValue(&path_ds));
+        }
+
+    } else if (entry == NULL) {
+
+        DBG2(printf("remove: %s", rel_path));
+        if (unlink(Tcl_DStringValue(&path_ds)) != 0) {
+            fprintf(stderr, "error: could not remove %s: %s\n", Tcl_DStringValue(&path_ds), strerror(errno));
+            rc = TCL_ERROR;
+        } else {
+            (*num_removed_ptr)++;
+        }
+
+    } else {
+
+        entry->is_seen = 1;
+        if (!ttrek_StoreIsEntryUpToDate(entry, &st)) {
+            DBG2(printf("restore: %s", rel_path));
+            rc = ttrek_StoreRestoreEntry(store, rel_path, entry);
+            (*num_restored_ptr)++;
+        }
+
+    }
+
+    Tcl_DStringFree(&path_ds);
+    return rc;
+
+}
+
+// Brings the venv back to the last snapshot, after an interrupted command.
+// Only the paths that differ from the snapshot are touched.
+int ttrek_StoreReset(Tcl_Interp *interp, ttrek_state_t *state_ptr) {
+
+    ttrek_store_t store;
+    ttrek_StoreOpen(state_ptr, &store);
+
+    int exists;
+    if (TCL_OK != ttrek_StoreLoad(interp, &store, &exists)) {
+        ttrek_StoreClose(&store);
+        return TCL_ERROR;
+    }
+
+    if (!exists) {
+        fprintf(stderr, "error: there is no snapshot to restore in %s\n", Tcl_DStringValue(&store.store_ds));
+        ttrek_StoreClose(&store);
+        return TCL_ERROR;
+    }
+
+    int rc = TCL_OK;
+    int num_restored = 0;
+    int num_removed = 0;
+
+    Tcl_DString rel_ds;
+    Tcl_DStringInit(&rel_ds);
+    const char *top_level_paths[] = {MANIFEST_JSON_FILE, MANIFEST_JOURNAL_FILE, INSTALL_DIR, NULL};
+    for (int i = 0; rc == TCL_OK && top_level_paths[i] != NULL; i++) {
+        Tcl_DStringSetLength(&rel_ds, 0);
+        Tcl_DStringAppend(&rel_ds, top_level_paths[i], -1);
+        rc = ttrek_StoreResetPath(&store, &rel_ds, &num_restored, &num_removed);
+    }
+    Tcl_DStringFree(&rel_ds);
+
+    // The files that were removed by the command
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *hash_entry = Tcl_FirstHashEntry(&store.entries_ht, &search);
+         rc == TCL_OK && hash_entry != NULL; hash_entry = Tcl_NextHashEntry(&search)) {
+        ttrek_store_entry_t *entry = Tcl_GetHashValue(hash_entry);
+        if (!entry->is_seen) {
+            rc = ttrek_StoreRestoreEntry(&store, Tcl_GetHashKey(&store.entries_ht, hash_entry), entry);
+            num_restored++;
+        }
+    }
+
+    // The restored files have new stat data
+    if (store.is_changed && TCL_OK != ttrek_StoreWrite(interp, &store)) {
+        rc = TCL_ERROR;
+    }
+
+    if (rc == TCL_OK) {
+        fprintf(stdout, "Reset to the last snapshot: %d restored, %d removed.\n", num_restored, num_removed);
+    }
+
+    ttrek_StoreClose(&store);
+    return rc;
+
+}
+
+// Removes the objects that are not in the snapshot, e.g. the ones left
+// behind by an interrupted save
+int ttrek_StoreGc(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_WideInt *num_removed_ptr,
+                  Tcl_WideInt *removed_size_ptr) {
+
+    ttrek_store_t store;
+    ttrek_StoreOpen(state_ptr, &store);
+
+    *num_removed_ptr = 0;
+    *removed_size_ptr = 0;
+
+    int exists;
+    if (TCL_OK != ttrek_StoreLoad(interp, &store, &exists)) {
+        ttrek_StoreClose(&store);
+        return TCL_ERROR;
+    }
+
+    // Without a snapshot, every object would look unused
+    if (!exists) {
+        ttrek_StoreClose(&store);
+        return TCL_OK;
+    }
+
+    Tcl_HashTable used_ht;
+    Tcl_InitHashTable(&used_ht, TCL_STRING_KEYS);
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *hash_entry = Tcl_FirstHashEntry(&store.entries_ht, &search); hash_entry != NULL;
+         hash_entry = Tcl_NextHashEntry(&search)) {
+        ttrek_store_entry_t *entry = Tcl_GetHashValue(hash_entry);
+        int is_new;
+        Tcl_CreateHashEntry(&used_ht, entry->hash, &is_new);
+    }
+
+    Tcl_DString path_ds;
+    Tcl_DStringInit(&path_ds);
+    Tcl_DStringAppend(&path_ds, Tcl_DStringValue(&store.store_ds), Tcl_DStringLength(&store.store_ds));
+    Tcl_DStringAppend(&path_ds, "/" STORE_OBJECTS_DIR, -1);
+    Tcl_Size objects_len = Tcl_DStringLength(&path_ds);
+
+    DIR *objects_dir = opendir(Tcl_DStringValue(&path_ds));
+    if (objects_dir != NULL) {
+        struct dirent *dir_entry;
+        while ((dir_entry = readdir(objects_dir)) != NULL) {
+
+            if (strlen(dir_entry->d_name) != 2 || dir_entry->d_name[0] == '.') {
+                continue;
+            }
+
+            Tcl_DStringSetLength(&path_ds, objects_len);
+            Tcl_DStringAppend(&path_ds, "/", 1);
+            Tcl_DStringAppend(&path_ds, dir_entry->d_name, -1);
+            Tcl_Size dir_len = Tcl_DStringLength(&path_ds);
+
+            DIR *dir = opendir(Tcl_DStringValue(&path_ds));
+            if (dir == NULL) {
+                continue;
+            }
+
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.') {
+                    continue;
+                }
+                char hash[VERIFY_HASH_HEX_SIZE];
+                snprintf(hash, sizeof(hash), "%s%s", dir_entry->d_name, entry->d_name);
+                // Temp files have a suffix, so they are never in use
+                if (strlen(entry->d_name) == VERIFY_HASH_HEX_SIZE - 1 - 2
+                    && Tcl_FindHashEntry(&used_ht, hash) != NULL) {
+                    continue;
+                }
+                Tcl_DStringSetLength(&path_ds, dir_len);
+                Tcl_DStringAppend(&path_ds, "/", 1);
+                Tcl_DStringAppend(&path_ds, entry->d_name, -1);
+                struct stat st;
+                if (lstat(Tcl_DStringValue(&path_ds), &st) == 0 && unlink(Tcl_DStringValue(&path_ds)) == 0) {
+                    (*num_removed_ptr)++;
+                    // Hardlinked objects share their space with the venv
+                    if (st.st_nlink == 1) {
+                        *removed_size_ptr += st.st_size;
+                    }
+                }
+            }
+            closedir(dir);
+
+            Tcl_DStringSetLength(&path_ds, dir_len);
+            rmdir(Tcl_DStringValue(&path_ds));
+
+        }
+        closedir(objects_dir);
+    }
+
+    Tcl_DStringFree(&path_ds);
+    Tcl_DeleteHashTable(&used_ht);
+    ttrek_StoreClose(&store);
+    return TCL_OK;
+
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_STORE_H
+#define TTREK_STORE_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The content-addressed snapshot store of the venv, an alternative to the
+// git repository. The snapshot is a list of (path, mode, SHA-256) entries
+// with the stat data of the files when they were recorded, and the file
+// contents are kept in objects/ by hash, shared with the installed files
+// by reflink or hardlink when possible.
+#define STORE_SNAPSHOT_FILE "snapshot"
+#define STORE_OBJECTS_DIR   "objects"
+
+int ttrek_StoreInit(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+int ttrek_StoreSave(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+int ttrek_StoreReset(Tcl_Interp *interp, ttrek_state_t *state_ptr);
+int ttrek_StoreGc(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_WideInt *num_removed_ptr,
+                  Tcl_WideInt *removed_size_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_STORE_H
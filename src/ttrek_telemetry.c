@@ -24,8 +24,8 @@ static int isEnvironmentRegistered = 0;
 static char *machineIdBaseFile = "machine-id";
 
 // While gathering environment information by function ttrek_TelemetryCollectEnvironmentInfo(),
-// we call ttrek_ExecuteCommand(), which uses Tcl_OpenCommandChannel(),
-// which requires a live Tcl interpreter.
+// we call ttrek_ExecuteCommand(), which reports errors in the result of
+// a live Tcl interpreter.
 //
 // However, ttrek_TelemetryGetCompilerVersion() is called from ttrek_TelemetryRegisterEnvironment(),
 // which is called from ttrek_RegistryGet(). The last function does not have
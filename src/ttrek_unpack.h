@@ -0,0 +1,25 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_UNPACK_H
+#define TTREK_UNPACK_H
+
+#include "common.h"
+#include <archive.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+Tcl_Obj *ttrek_UnpackGetOutputName(Tcl_Obj *basePath, const char *entryPath);
+int ttrek_UnpackArchive(Tcl_Interp *interp, struct archive *a, Tcl_Obj *archive_name_ptr,
+                        Tcl_Obj *output_dir_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_UNPACK_H
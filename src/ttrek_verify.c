@@ -0,0 +1,366 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "ttrek_verify.h"
+#include "ttrek_index.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <openssl/sha.h>
+
+// How many files a thread takes from the list at once
+#define VERIFY_BATCH_SIZE 16
+
+typedef struct {
+    const char *path;
+    // Expected values from the manifest, used when has_expected is set
+    int has_expected;
+    off_t expected_size;
+    mode_t expected_mode;
+    time_t expected_mtime_sec;
+    long expected_mtime_nsec;
+    const char *expected_hash;
+    // When set, the file is not hashed if its size, mode and mtime are as expected
+    int use_fast_path;
+    // Results
+    int error;
+    int is_hashed;
+    off_t size;
+    mode_t mode;
+    time_t mtime_sec;
+    long mtime_nsec;
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+} ttrek_verify_job_t;
+
+typedef struct {
+    int dir_fd;
+    ttrek_verify_job_t *jobs;
+    Tcl_Size jobs_len;
+    Tcl_Size next_job;
+    Tcl_Mutex mutex;
+} ttrek_verify_shared_t;
+
+static void ttrek_VerifyHexHash(const unsigned char *hash_bin, char *hash_hex) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        hash_hex[i * 2] = hex[hash_bin[i] >> 4];
+        hash_hex[i * 2 + 1] = hex[hash_bin[i] & 0x0f];
+    }
+    hash_hex[SHA256_DIGEST_LENGTH * 2] = '\0';
+}
+
+// Hashes the content of a regular file, or the target of a symbolic link.
+// Returns 0 on success or errno on failure.
+int ttrek_VerifyHashFile(int dir_fd, const char *path, mode_t mode, off_t size, char *hash_hex) {
+
+    unsigned char hash_bin[SHA256_DIGEST_LENGTH];
+
+    if (S_ISLNK(mode)) {
+        char target[4096];
+        ssize_t len = readlinkat(dir_fd, path, target, sizeof(target));
+        if (len < 0) {
+            return errno;
+        }
+        SHA256((const unsigned char *) target, len, hash_bin);
+        goto done;
+    }
+
+    if (!S_ISREG(mode) || size == 0) {
+        SHA256((const unsigned char *) "", 0, hash_bin);
+        goto done;
+    }
+
+    int fd = openat(dir_fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    close(fd);
+
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+    SHA256((const unsigned char *) data, size, hash_bin);
+    munmap(data, size);
+
+done:
+    ttrek_VerifyHexHash(hash_bin, hash_hex);
+    return 0;
+
+}
+
+static void ttrek_VerifyRunJob(int dir_fd, ttrek_verify_job_t *job) {
+
+    struct stat st;
+    if (fstatat(dir_fd, job->path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        job->error = errno;
+        return;
+    }
+
+    job->size = st.st_size;
+    job->mode = st.st_mode;
+    job->mtime_sec = ST_MTIM(st).tv_sec;
+    job->mtime_nsec = ST_MTIM(st).tv_nsec;
+
+    // Without the expected values, there is nothing to compare the hash with
+    if (job->use_fast_path && (!job->has_expected || (job->size == job->expected_size
+        && job->mode == job->expected_mode && job->mtime_sec == job->expected_mtime_sec
+        && job->mtime_nsec == job->expected_mtime_nsec))) {
+        return;
+    }
+
+    job->error = ttrek_VerifyHashFile(dir_fd, job->path, job->mode, job->size, job->hash);
+    job->is_hashed = !job->error;
+
+}
+
+static void ttrek_VerifyRun(ttrek_verify_shared_t *shared) {
+    for (;;) {
+        Tcl_MutexLock(&shared->mutex);
+        Tcl_Size first = shared->next_job;
+        Tcl_Size last = first + VERIFY_BATCH_SIZE;
+        if (last > shared->jobs_len) {
+            last = shared->jobs_len;
+        }
+        shared->next_job = last;
+        Tcl_MutexUnlock(&shared->mutex);
+
+        if (first >= last) {
+            break;
+        }
+        for (Tcl_Size i = first; i < last; i++) {
+            ttrek_VerifyRunJob(shared->dir_fd, &shared->jobs[i]);
+        }
+    }
+}
+
+static Tcl_ThreadCreateType ttrek_VerifyThreadProc(void *clientData) {
+    ttrek_VerifyRun((ttrek_verify_shared_t *) clientData);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+// Runs the jobs on num_threads threads, the current thread included
+static int ttrek_VerifyRunJobs(Tcl_Obj *install_dir_ptr, ttrek_verify_job_t *jobs, Tcl_Size jobs_len,
+                               int num_threads) {
+
+    ttrek_verify_shared_t shared;
+    memset(&shared, 0, sizeof(shared));
+    shared.jobs = jobs;
+    shared.jobs_len = jobs_len;
+    shared.dir_fd = open(Tcl_GetString(install_dir_ptr), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (shared.dir_fd < 0) {
+        fprintf(stderr, "error: could not open directory %s: %s\n", Tcl_GetString(install_dir_ptr),
+                strerror(errno));
+        return TCL_ERROR;
+    }
+
+    if (num_threads > (jobs_len + VERIFY_BATCH_SIZE - 1) / VERIFY_BATCH_SIZE) {
+        num_threads = (int) ((jobs_len + VERIFY_BATCH_SIZE - 1) / VERIFY_BATCH_SIZE);
+    }
+
+    Tcl_ThreadId *thread_ids = NULL;
+    int num_started = 1;
+    if (num_threads > 1) {
+        thread_ids = (Tcl_ThreadId *) Tcl_Alloc(num_threads * sizeof(Tcl_ThreadId));
+        for (int i = 1; i < num_threads; i++) {
+            if (TCL_OK != Tcl_CreateThread(&thread_ids[num_started], ttrek_VerifyThreadProc, &shared,
+                                           TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE)) {
+                DBG2(printf("could not create verify thread, continue with %d threads", num_started));
+                break;
+            }
+            num_started++;
+        }
+    }
+
+    ttrek_VerifyRun(&shared);
+
+    for (int i = 1; i < num_started; i++) {
+        int result;
+        Tcl_JoinThread(thread_ids[i], &result);
+    }
+
+    if (thread_ids != NULL) {
+        Tcl_Free((char *) thread_ids);
+    }
+    Tcl_MutexFinalize(&shared.mutex);
+    close(shared.dir_fd);
+    return TCL_OK;
+
+}
+
+int ttrek_VerifyDefaultThreads(void) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (int) num_cpus : 1;
+}
+
+// Computes size, mode, mtime and SHA-256 hash of the installed files.
+// The result is an object with the file paths as keys, to be stored
+// in the manifest.
+int ttrek_VerifyGetFileInfo(Tcl_Interp *interp, Tcl_Obj *install_dir_ptr, Tcl_Obj *files_list_ptr, int num_threads,
+                            cJSON **file_info_ptr) {
+
+    Tcl_Size files_len;
+    Tcl_Obj **files_ptrs;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, files_list_ptr, &files_len, &files_ptrs)) {
+        return TCL_ERROR;
+    }
+
+    ttrek_verify_job_t *jobs = (ttrek_verify_job_t *) Tcl_Alloc((files_len + 1) * sizeof(ttrek_verify_job_t));
+    memset(jobs, 0, (files_len + 1) * sizeof(ttrek_verify_job_t));
+    for (Tcl_Size i = 0; i < files_len; i++) {
+        jobs[i].path = Tcl_GetString(files_ptrs[i]);
+    }
+
+    if (TCL_OK != ttrek_VerifyRunJobs(install_dir_ptr, jobs, files_len, num_threads)) {
+        Tcl_Free((char *) jobs);
+        return TCL_ERROR;
+    }
+
+    cJSON *file_info = cJSON_CreateObject();
+    for (Tcl_Size i = 0; i < files_len; i++) {
+        ttrek_verify_job_t *job = &jobs[i];
+        if (job->error) {
+            fprintf(stderr, "warning: could not compute checksum of %s: %s\n", job->path, strerror(job->error));
+            continue;
+        }
+        cJSON *info_node = cJSON_CreateObject();
+        cJSON_AddNumberToObject(info_node, "size", (double) job->size);
+        cJSON_AddNumberToObject(info_node, "mode", job->mode);
+        cJSON_AddNumberToObject(info_node, "mtime", (double) job->mtime_sec);
+        cJSON_AddNumberToObject(info_node, "mtime_nsec", job->mtime_nsec);
+        cJSON_AddStringToObject(info_node, "sha256", job->hash);
+        cJSON_AddItemToObject(file_info, job->path, info_node);
+    }
+
+    Tcl_Free((char *) jobs);
+    *file_info_ptr = file_info;
+    return TCL_OK;
+
+}
+
+const char *ttrek_VerifyStatusToString(ttrek_verify_status_t status) {
+    switch (status) {
+        case VERIFY_FILE_OK:
+            return "ok";
+        case VERIFY_FILE_TOUCHED:
+            return "touched";
+        case VERIFY_FILE_MISSING:
+            return "missing";
+        case VERIFY_FILE_MODIFIED:
+            return "modified";
+        case VERIFY_FILE_MODE_CHANGED:
+            return "mode changed";
+        case VERIFY_FILE_UNKNOWN:
+            return "unknown";
+    }
+    return "unknown";
+}
+
+static ttrek_verify_status_t ttrek_VerifyJobStatus(const ttrek_verify_job_t *job) {
+    if (job->error == ENOENT || job->error == ENOTDIR) {
+        return VERIFY_FILE_MISSING;
+    }
+    if (job->error) {
+        fprintf(stderr, "warning: could not check %s: %s\n", job->path, strerror(job->error));
+        return VERIFY_FILE_MODIFIED;
+    }
+    if (!job->has_expected) {
+        return VERIFY_FILE_UNKNOWN;
+    }
+    if (!job->is_hashed) {
+        // The size and mtime are the same
+        return VERIFY_FILE_OK;
+    }
+    if (job->expected_hash == NULL || strcmp(job->hash, job->expected_hash) != 0) {
+        return VERIFY_FILE_MODIFIED;
+    }
+    if (job->mode != job->expected_mode) {
+        return VERIFY_FILE_MODE_CHANGED;
+    }
+    if (job->size == job->expected_size && job->mtime_sec == job->expected_mtime_sec
+        && job->mtime_nsec == job->expected_mtime_nsec) {
+        return VERIFY_FILE_OK;
+    }
+    return VERIFY_FILE_TOUCHED;
+}
+
+// Checks the installed files of the package against the manifest. The files
+// that do not match are added to drift_dict_ptr with their status. Unless
+// full_check is set, files with the recorded size and mtime are not hashed.
+int ttrek_VerifyPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name, int full_check,
+                        int num_threads, Tcl_Obj *drift_dict_ptr, Tcl_Size *num_files_ptr) {
+
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    cJSON *package_node = package_ptr == NULL ? NULL : package_ptr->manifest_node;
+    cJSON *files_node = package_ptr == NULL ? NULL : package_ptr->files;
+    cJSON *file_info_node = cJSON_GetObjectItem(package_node, VERIFY_FILE_INFO);
+
+    // cJSON_GetObjectItem() is a linear search, so index the file info
+    // by path first
+    Tcl_HashTable file_info_ht;
+    Tcl_InitHashTable(&file_info_ht, TCL_STRING_KEYS);
+    cJSON *info_node;
+    cJSON_ArrayForEach(info_node, file_info_node) {
+        int is_new;
+        Tcl_HashEntry *entry = Tcl_CreateHashEntry(&file_info_ht, info_node->string, &is_new);
+        Tcl_SetHashValue(entry, info_node);
+    }
+
+    Tcl_Size files_len = cJSON_GetArraySize(files_node);
+    ttrek_verify_job_t *jobs = (ttrek_verify_job_t *) Tcl_Alloc((files_len + 1) * sizeof(ttrek_verify_job_t));
+    memset(jobs, 0, (files_len + 1) * sizeof(ttrek_verify_job_t));
+
+    Tcl_Size i = 0;
+    cJSON *file_node;
+    cJSON_ArrayForEach(file_node, files_node) {
+        ttrek_verify_job_t *job = &jobs[i++];
+        job->path = cJSON_GetStringValue(file_node);
+        Tcl_HashEntry *entry = job->path == NULL ? NULL : Tcl_FindHashEntry(&file_info_ht, job->path);
+        info_node = entry == NULL ? NULL : (cJSON *) Tcl_GetHashValue(entry);
+        if (info_node == NULL) {
+            // Only check that the file exists
+            job->use_fast_path = 1;
+            continue;
+        }
+        job->has_expected = 1;
+        job->use_fast_path = !full_check;
+        job->expected_size = (off_t) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "size"));
+        job->expected_mode = (mode_t) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "mode"));
+        job->expected_mtime_sec = (time_t) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "mtime"));
+        job->expected_mtime_nsec = (long) cJSON_GetNumberValue(cJSON_GetObjectItem(info_node, "mtime_nsec"));
+        job->expected_hash = cJSON_GetStringValue(cJSON_GetObjectItem(info_node, "sha256"));
+    }
+
+    Tcl_DeleteHashTable(&file_info_ht);
+
+    if (TCL_OK != ttrek_VerifyRunJobs(state_ptr->project_install_dir_ptr, jobs, files_len, num_threads)) {
+        Tcl_Free((char *) jobs);
+        return TCL_ERROR;
+    }
+
+    for (i = 0; i < files_len; i++) {
+        ttrek_verify_status_t status = ttrek_VerifyJobStatus(&jobs[i]);
+        if (status == VERIFY_FILE_OK || status == VERIFY_FILE_TOUCHED) {
+            continue;
+        }
+        Tcl_DictObjPut(interp, drift_dict_ptr, Tcl_NewStringObj(jobs[i].path, -1),
+                       Tcl_NewStringObj(ttrek_VerifyStatusToString(status), -1));
+    }
+
+    Tcl_Free((char *) jobs);
+    *num_files_ptr = files_len;
+    return TCL_OK;
+
+}
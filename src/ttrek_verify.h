@@ -0,0 +1,47 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef TTREK_VERIFY_H
+#define TTREK_VERIFY_H
+
+#include "common.h"
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The key in the manifest with the size, mode, mtime and SHA-256 hash
+// of each installed file of the package.
+#define VERIFY_FILE_INFO "file_info"
+
+typedef enum {
+    VERIFY_FILE_OK,
+    // The file was touched, but its content and mode are the same
+    VERIFY_FILE_TOUCHED,
+    VERIFY_FILE_MISSING,
+    VERIFY_FILE_MODIFIED,
+    VERIFY_FILE_MODE_CHANGED,
+    // The file was installed by an older version of ttrek
+    VERIFY_FILE_UNKNOWN
+} ttrek_verify_status_t;
+
+// The size of the buffer for the hex SHA-256 hash of a file
+#define VERIFY_HASH_HEX_SIZE 65
+
+int ttrek_VerifyDefaultThreads(void);
+int ttrek_VerifyHashFile(int dir_fd, const char *path, mode_t mode, off_t size, char *hash_hex);
+int ttrek_VerifyGetFileInfo(Tcl_Interp *interp, Tcl_Obj *install_dir_ptr, Tcl_Obj *files_list_ptr, int num_threads,
+                            cJSON **file_info_ptr);
+int ttrek_VerifyPackage(Tcl_Interp *interp, ttrek_state_t *state_ptr, const char *package_name, int full_check,
+                        int num_threads, Tcl_Obj *drift_dict_ptr, Tcl_Size *num_files_ptr);
+const char *ttrek_VerifyStatusToString(ttrek_verify_status_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTREK_VERIFY_H
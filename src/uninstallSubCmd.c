@@ -7,7 +7,7 @@
 #include "subCmdDecls.h"
 #include "common.h"
 #include "ttrek_resolvo.h"
-#include "ttrek_git.h"
+#include "ttrek_snapshot.h"
 
 int ttrek_UninstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
     int option_user = 0;
@@ -47,8 +47,17 @@ int ttrek_UninstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv
         return TCL_ERROR;
     }
 
-    if (TCL_OK != ttrek_EnsureGitReady(interp, state_ptr)) {
-        fprintf(stderr, "error: ensuring git repository is ready failed\n");
+    // Commands that change the manifest fail before touching the venv
+    // if the manifest could not be loaded
+    if (ttrek_StateGetManifestRoot(state_ptr) == NULL) {
+        fprintf(stderr, "error: could not load %s\n", MANIFEST_JSON_FILE);
+        ttrek_DestroyState(state_ptr);
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
+    if (TCL_OK != ttrek_SnapshotEnsureReady(interp, state_ptr)) {
+        fprintf(stderr, "error: ensuring snapshot of the venv is ready failed\n");
         ttrek_DestroyState(state_ptr);
         ckfree(remObjv);
         return TCL_ERROR;
@@ -77,7 +86,7 @@ int ttrek_UninstallSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv
     ckfree(remObjv);
 
     if (!abort) {
-        if (TCL_OK != ttrek_GitAmend(state_ptr)) {
+        if (TCL_OK != ttrek_SnapshotSave(interp, state_ptr)) {
             fprintf(stderr, "error: committing changes failed\n");
             ttrek_DestroyState(state_ptr);
             return TCL_ERROR;
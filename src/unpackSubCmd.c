@@ -5,6 +5,7 @@
  */
 
 #include "subCmdDecls.h"
+#include "ttrek_unpack.h"
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -88,14 +89,11 @@ Tcl_Obj *ttrek_UnpackGetOutputName(Tcl_Obj *basePath, const char *entryPath) {
 
 }
 
-int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+// Extracts all entries of an archive that is already open for reading
+// into output_dir. The caller owns the archive and frees it.
+int ttrek_UnpackArchive(Tcl_Interp *interp, struct archive *a, Tcl_Obj *archive_name_ptr,
+                        Tcl_Obj *output_dir_ptr) {
 
-    if (objc != 3) {
-        SetResult("not enough arguments");
-        return TCL_ERROR;
-    }
-
-    struct archive *a = NULL;
     struct archive *ext = NULL;
     struct archive_entry *entry;
     int r;
@@ -106,18 +104,6 @@ int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
     flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
     flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
 
-    a = archive_read_new();
-    archive_read_support_filter_all(a);
-    archive_read_support_format_all(a);
-
-    r = archive_read_open_filename(a, Tcl_GetString(objv[1]), 10240);
-
-    if (r != ARCHIVE_OK) {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to open archive \"%s\":"
-            " %s", Tcl_GetString(objv[1]), archive_error_string(a)));
-        goto error;
-    }
-
     ext = archive_write_disk_new();
     archive_write_disk_set_options(ext, flags);
     archive_write_disk_set_standard_lookup(ext);
@@ -133,7 +119,7 @@ int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
         if (r < ARCHIVE_OK) {
             if (r < ARCHIVE_WARN) {
                 Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to read the"
-                    " archive \"%s\": %s", Tcl_GetString(objv[1]),
+                    " archive \"%s\": %s", Tcl_GetString(archive_name_ptr),
                     archive_error_string(a)));
                 goto error;
             } else {
@@ -143,7 +129,7 @@ int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
 
         const char *entryPath = archive_entry_pathname(entry);
 
-        outputFileName = ttrek_UnpackGetOutputName(objv[2], entryPath);
+        outputFileName = ttrek_UnpackGetOutputName(output_dir_ptr, entryPath);
         Tcl_IncrRefCount(outputFileName);
 
         printf("Extracting entry: '%s' -> '%s'\n",
@@ -179,6 +165,47 @@ int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
 
     }
 
+    archive_write_free(ext);
+
+    return TCL_OK;
+
+error:
+    if (ext != NULL) {
+        archive_write_free(ext);
+    }
+    if (outputFileName != NULL) {
+        Tcl_DecrRefCount(outputFileName);
+    }
+    return TCL_ERROR;
+
+}
+
+int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+
+    if (objc != 3) {
+        SetResult("not enough arguments");
+        return TCL_ERROR;
+    }
+
+    struct archive *a = NULL;
+    int r;
+
+    a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+
+    r = archive_read_open_filename(a, Tcl_GetString(objv[1]), 10240);
+
+    if (r != ARCHIVE_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to open archive \"%s\":"
+            " %s", Tcl_GetString(objv[1]), archive_error_string(a)));
+        goto error;
+    }
+
+    if (ttrek_UnpackArchive(interp, a, objv[1], objv[2]) != TCL_OK) {
+        goto error;
+    }
+
     r = archive_read_free(a);
     if (r != ARCHIVE_OK) {
         Tcl_SetObjResult(interp, Tcl_ObjPrintf("error while closing archive"
@@ -186,20 +213,12 @@ int ttrek_UnpackSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
         return TCL_ERROR;
     }
 
-    archive_write_free(ext);
-
     return TCL_OK;
 
 error:
     if (a != NULL) {
         archive_read_free(a);
     }
-    if (ext != NULL) {
-        archive_write_free(ext);
-    }
-    if (outputFileName != NULL) {
-        Tcl_DecrRefCount(outputFileName);
-    }
     return TCL_ERROR;
 
 }
@@ -6,7 +6,7 @@
 
 #include "subCmdDecls.h"
 #include "ttrek_resolvo.h"
-#include "ttrek_git.h"
+#include "ttrek_snapshot.h"
 
 int ttrek_UpdateSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
 
@@ -15,6 +15,7 @@ int ttrek_UpdateSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
     int option_global = 0;
     int option_yes = 0;
     int option_force = 0;
+    int option_jobs = 1;
     const char *option_strategy = NULL;
     Tcl_ArgvInfo ArgTable[] = {
 //            {TCL_ARGV_CONSTANT, "-save-dev", INT2PTR(1), &option_save_dev, "Save the package to the local repository as a dev dependency"},
@@ -23,6 +24,7 @@ int ttrek_UpdateSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
             {TCL_ARGV_CONSTANT, "-g",        INT2PTR(1), &option_global,   "update global directory tree",                                       NULL},
             {TCL_ARGV_CONSTANT, "-force",    INT2PTR(1), &option_force,    "force installation of already installed packages",                   NULL},
             {TCL_ARGV_STRING,   "-strategy", NULL,       &option_strategy, "strategy used for resolving dependencies (latest, favored, locked)", NULL},
+            {TCL_ARGV_INT,      "-jobs",     NULL,       &option_jobs,     "number of packages to build at the same time",                       NULL},
             {TCL_ARGV_END,      NULL,        NULL,       NULL,             NULL,                                                                 NULL}
 //            TCL_ARGV_AUTO_REST, TCL_ARGV_AUTO_HELP, TCL_ARGV_TABLE_END
     };
@@ -32,6 +34,12 @@ int ttrek_UpdateSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
 
     DBG(fprintf(stderr, "strategy: %s\n", (option_strategy == NULL ? "<NULL>" : option_strategy)));
 
+    if (option_jobs < 1) {
+        fprintf(stderr, "error: the number of jobs must be a positive integer\n");
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
     if (option_user && option_global) {
         fprintf(stderr, "error: conflicting options -u and -g\n");
         ckfree(remObjv);
@@ -48,8 +56,19 @@ int ttrek_UpdateSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
         return TCL_ERROR;
     }
 
-    if (TCL_OK != ttrek_EnsureGitReady(interp, state_ptr)) {
-        fprintf(stderr, "error: ensuring git repository is ready failed\n");
+    state_ptr->jobs = option_jobs;
+
+    // Commands that change the manifest fail before touching the venv
+    // if the manifest could not be loaded
+    if (ttrek_StateGetManifestRoot(state_ptr) == NULL) {
+        fprintf(stderr, "error: could not load %s\n", MANIFEST_JSON_FILE);
+        ttrek_DestroyState(state_ptr);
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
+    if (TCL_OK != ttrek_SnapshotEnsureReady(interp, state_ptr)) {
+        fprintf(stderr, "error: ensuring snapshot of the venv is ready failed\n");
         ttrek_DestroyState(state_ptr);
         ckfree(remObjv);
         return TCL_ERROR;
@@ -100,7 +119,7 @@ int ttrek_UpdateSubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[])
     ckfree(remObjv);
 
     if (!abort) {
-        if (TCL_OK != ttrek_GitAmend(state_ptr)) {
+        if (TCL_OK != ttrek_SnapshotSave(interp, state_ptr)) {
             fprintf(stderr, "error: committing changes failed\n");
             ttrek_DestroyState(state_ptr);
             return TCL_ERROR;
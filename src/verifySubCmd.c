@@ -0,0 +1,245 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <string.h>
+#include "subCmdDecls.h"
+#include "ttrek_verify.h"
+#include "ttrek_index.h"
+#include "fsmonitor/walk.h"
+
+static const char *ttrek_VerifyPackageVersion(ttrek_state_t *state_ptr, const char *package_name) {
+    ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+    return package_ptr == NULL || package_ptr->version == NULL ? "?" : package_ptr->version;
+}
+
+// Prints the files in the install directory that do not belong to any
+// of the installed packages.
+static int ttrek_VerifyUntrackedFiles(Tcl_Interp *interp, ttrek_state_t *state_ptr, Tcl_Obj *packages_ptr,
+                                      int num_threads) {
+
+    Tcl_HashTable files_ht;
+    Tcl_InitHashTable(&files_ht, TCL_STRING_KEYS);
+
+    Tcl_Size packages_len;
+    Tcl_Obj **packages_ptrs;
+    Tcl_ListObjGetElements(interp, packages_ptr, &packages_len, &packages_ptrs);
+    for (Tcl_Size i = 0; i < packages_len; i++) {
+        ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, Tcl_GetString(packages_ptrs[i]));
+        if (package_ptr == NULL) {
+            continue;
+        }
+        cJSON *file_node;
+        cJSON_ArrayForEach(file_node, package_ptr->files) {
+            if (cJSON_IsString(file_node)) {
+                int is_new;
+                Tcl_CreateHashEntry(&files_ht, file_node->valuestring, &is_new);
+            }
+        }
+    }
+
+    ttrek_walk_t *walk;
+    if (TCL_OK != ttrek_Walk(interp, Tcl_GetString(state_ptr->project_install_dir_ptr), 0, num_threads, &walk)) {
+        Tcl_DeleteHashTable(&files_ht);
+        return TCL_ERROR;
+    }
+
+    Tcl_Size num_untracked = 0;
+    for (Tcl_Size i = 0; i < walk->entries_len; i++) {
+        ttrek_walk_entry_t *entry = &walk->entries[i];
+        if (entry->type == TTREK_WALK_TYPE_DIR || Tcl_FindHashEntry(&files_ht, entry->path) != NULL) {
+            continue;
+        }
+        if (num_untracked++ == 0) {
+            fprintf(stdout, "\nFiles that do not belong to any package:\n");
+        }
+        fprintf(stdout, "    %-12s %s\n", "untracked", entry->path);
+    }
+
+    ttrek_WalkFree(walk);
+    Tcl_DeleteHashTable(&files_ht);
+    return TCL_OK;
+
+}
+
+int ttrek_VerifySubCmd(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+
+    int option_user = 0;
+    int option_global = 0;
+    int option_full = 0;
+    int option_jobs = 0;
+    Tcl_ArgvInfo ArgTable[] = {
+            {TCL_ARGV_CONSTANT, "-u",        INT2PTR(1), &option_user,     "run in user mode",                                          NULL},
+            {TCL_ARGV_CONSTANT, "-g",        INT2PTR(1), &option_global,   "run in global mode",                                        NULL},
+            {TCL_ARGV_CONSTANT, "-full",     INT2PTR(1), &option_full,     "hash all files, even if their size and mtime are the same", NULL},
+            {TCL_ARGV_INT,      "-jobs",     NULL,       &option_jobs,     "number of files to hash at the same time",                  NULL},
+            {TCL_ARGV_END,      NULL,        NULL,       NULL,             NULL,                                                        NULL}
+    };
+
+    Tcl_Obj **remObjv;
+    if (TCL_OK != Tcl_ParseArgsObjv(interp, ArgTable, &objc, objv, &remObjv)) {
+        return TCL_ERROR;
+    }
+
+    if (option_user && option_global) {
+        ckfree(remObjv);
+        fprintf(stderr, "error: conflicting options -u and -g\n");
+        return TCL_ERROR;
+    }
+
+    if (option_jobs < 0) {
+        ckfree(remObjv);
+        fprintf(stderr, "error: the number of jobs must be a positive integer\n");
+        return TCL_ERROR;
+    }
+
+    if (option_jobs == 0) {
+        option_jobs = ttrek_VerifyDefaultThreads();
+    }
+
+    ttrek_mode_t mode = option_user ? MODE_USER : (option_global ? MODE_GLOBAL : MODE_LOCAL);
+    ttrek_state_t *state_ptr = ttrek_CreateState(interp, 0, 0, 0, mode, STRATEGY_LATEST);
+
+    if (!state_ptr) {
+        ckfree(remObjv);
+        fprintf(stderr, "error: initializing ttrek state failed\n");
+        return TCL_ERROR;
+    }
+
+    cJSON *manifest_root = ttrek_StateGetManifestRoot(state_ptr);
+    if (manifest_root == NULL) {
+        fprintf(stderr, "error: could not load %s\n", MANIFEST_JSON_FILE);
+        ttrek_DestroyState(state_ptr);
+        ckfree(remObjv);
+        return TCL_ERROR;
+    }
+
+    // Verify the packages given as arguments, or all installed packages
+    Tcl_Obj *packages_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(packages_ptr);
+    if (objc > 1) {
+        for (Tcl_Size i = 1; i < objc; i++) {
+            Tcl_ListObjAppendElement(interp, packages_ptr, remObjv[i]);
+        }
+    } else {
+        cJSON *package_node;
+        cJSON_ArrayForEach(package_node, manifest_root) {
+            Tcl_ListObjAppendElement(interp, packages_ptr, Tcl_NewStringObj(package_node->string, -1));
+        }
+    }
+    ckfree(remObjv);
+
+    int rc = TCL_OK;
+
+    Tcl_Size packages_len;
+    Tcl_Obj **packages_ptrs;
+    Tcl_ListObjGetElements(interp, packages_ptr, &packages_len, &packages_ptrs);
+
+    if (packages_len == 0) {
+        fprintf(stdout, "No packages installed.\n");
+        goto done;
+    }
+
+    Tcl_Obj *drifted_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(drifted_ptr);
+    int num_unknown = 0;
+
+    for (Tcl_Size i = 0; i < packages_len; i++) {
+
+        const char *package_name = Tcl_GetString(packages_ptrs[i]);
+        ttrek_index_package_t *package_ptr = ttrek_IndexGetPackage(state_ptr, package_name);
+        if (package_ptr == NULL || package_ptr->manifest_node == NULL) {
+            fprintf(stderr, "error: package %s is not installed\n", package_name);
+            rc = TCL_ERROR;
+            continue;
+        }
+
+        Tcl_Obj *drift_dict_ptr = Tcl_NewDictObj();
+        Tcl_IncrRefCount(drift_dict_ptr);
+
+        Tcl_Size num_files;
+        if (TCL_OK != ttrek_VerifyPackage(interp, state_ptr, package_name, option_full, option_jobs,
+                                          drift_dict_ptr, &num_files)) {
+            fprintf(stderr, "error: could not verify package %s\n", package_name);
+            Tcl_DecrRefCount(drift_dict_ptr);
+            rc = TCL_ERROR;
+            continue;
+        }
+
+        Tcl_Obj *name_ptr = Tcl_ObjPrintf("%s@%s", package_name,
+                                          ttrek_VerifyPackageVersion(state_ptr, package_name));
+        Tcl_IncrRefCount(name_ptr);
+
+        int counts[VERIFY_FILE_UNKNOWN + 1] = {0};
+        Tcl_DictSearch search;
+        Tcl_Obj *path_ptr, *status_ptr;
+        int is_done;
+        Tcl_DictObjFirst(interp, drift_dict_ptr, &search, &path_ptr, &status_ptr, &is_done);
+        for (; !is_done; Tcl_DictObjNext(&search, &path_ptr, &status_ptr, &is_done)) {
+            for (int status = 0; status <= VERIFY_FILE_UNKNOWN; status++) {
+                if (strcmp(Tcl_GetString(status_ptr), ttrek_VerifyStatusToString(status)) == 0) {
+                    counts[status]++;
+                    break;
+                }
+            }
+        }
+        Tcl_DictObjDone(&search);
+
+        int num_drifted = counts[VERIFY_FILE_MISSING] + counts[VERIFY_FILE_MODIFIED] + counts[VERIFY_FILE_MODE_CHANGED];
+
+        if (counts[VERIFY_FILE_UNKNOWN]) {
+            num_unknown++;
+        }
+
+        if (num_drifted == 0) {
+            fprintf(stdout, "%s: ok (%" TCL_SIZE_MODIFIER "d files)%s\n", Tcl_GetString(name_ptr), num_files,
+                    counts[VERIFY_FILE_UNKNOWN] ? ", no checksums recorded" : "");
+        } else {
+            fprintf(stdout, "%s: %d modified, %d missing, %d mode changed (%" TCL_SIZE_MODIFIER "d files)\n",
+                    Tcl_GetString(name_ptr), counts[VERIFY_FILE_MODIFIED], counts[VERIFY_FILE_MISSING],
+                    counts[VERIFY_FILE_MODE_CHANGED], num_files);
+            Tcl_DictObjFirst(interp, drift_dict_ptr, &search, &path_ptr, &status_ptr, &is_done);
+            for (; !is_done; Tcl_DictObjNext(&search, &path_ptr, &status_ptr, &is_done)) {
+                if (strcmp(Tcl_GetString(status_ptr), ttrek_VerifyStatusToString(VERIFY_FILE_UNKNOWN)) != 0) {
+                    fprintf(stdout, "    %-12s %s\n", Tcl_GetString(status_ptr), Tcl_GetString(path_ptr));
+                }
+            }
+            Tcl_DictObjDone(&search);
+            Tcl_ListObjAppendElement(interp, drifted_ptr, name_ptr);
+        }
+
+        Tcl_DecrRefCount(name_ptr);
+        Tcl_DecrRefCount(drift_dict_ptr);
+
+    }
+
+    // The untracked files are only known when all packages are verified
+    if (objc <= 1 && TCL_OK != ttrek_VerifyUntrackedFiles(interp, state_ptr, packages_ptr, option_jobs)) {
+        fprintf(stderr, "warning: could not list files in %s\n", Tcl_GetString(state_ptr->project_install_dir_ptr));
+    }
+
+    if (num_unknown) {
+        fprintf(stdout, "\n%d package(s) were installed without checksums, only missing files were checked.\n"
+                        "Reinstall them to record the checksums.\n", num_unknown);
+    }
+
+    Tcl_Size drifted_len;
+    Tcl_ListObjLength(interp, drifted_ptr, &drifted_len);
+    if (drifted_len > 0) {
+        fprintf(stdout, "\n%" TCL_SIZE_MODIFIER "d of %" TCL_SIZE_MODIFIER "d packages have changed: %s\n"
+                        "Reinstall these packages to repair them.\n",
+                drifted_len, packages_len, Tcl_GetString(drifted_ptr));
+        SetResult("installed files do not match the manifest");
+        rc = TCL_ERROR;
+    }
+
+    Tcl_DecrRefCount(drifted_ptr);
+
+done:
+    Tcl_DecrRefCount(packages_ptr);
+    ttrek_DestroyState(state_ptr);
+    return rc;
+
+}